@@ -3,11 +3,16 @@
 #include "bfbdb.hh"
 #include "bftimeprof.hh"
 #include "bfcfgparser.hh"
+#include "bfversionindex.hh"
+#include "bfhashfilter.hh"
 #include <db_cxx.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 
 #include <set>
 
@@ -17,9 +22,44 @@ using std::vector;
 using std::set;
 using std::map;
 
+#undef major
+#undef minor
+
 namespace BFSync
 {
 
+static const BDBTableInfo table_info_init[] =
+{
+  /* table                          database name              page size  flags */
+  { BDB_TABLE_INODES,               "db_inodes",               16384,     DB_DUP },
+  { BDB_TABLE_LINKS,                "db_links",                16384,     DB_DUP },
+  { BDB_TABLE_LOCAL_ID2INO,         "db_local_id2ino",         0,         DB_DUP },
+  { BDB_TABLE_LOCAL_INO2ID,         "db_local_ino2id",         0,         0 },
+  { BDB_TABLE_HISTORY,              "db_history",              4096,      DB_DUP },
+  { BDB_TABLE_CHANGED_INODES,       "db_changed_inodes",       4096,      DB_DUP | DB_DUPSORT },
+  { BDB_TABLE_CHANGED_INODES_REV,   "db_changed_inodes_rev",   4096,      0 },
+  { BDB_TABLE_DELETED_FILES,        "db_deleted_files",        4096,      DB_DUP },
+  { BDB_TABLE_TEMP_FILES,           "db_temp_files",           4096,      DB_DUP },
+  { BDB_TABLE_JOURNAL,              "db_journal",              4096,      DB_DUP },
+  { BDB_TABLE_TAGS,                 "db_tags",                 4096,      DB_DUP },
+  { BDB_TABLE_VARIABLES,            "db_variables",            4096,      DB_DUP },
+};
+
+const vector<BDBTableInfo>&
+bdb_table_info()
+{
+  static vector<BDBTableInfo> info (table_info_init,
+                                    table_info_init + sizeof (table_info_init) / sizeof (table_info_init[0]));
+  return info;
+}
+
+/* history changes of the current transaction (m_history_txn_changes) */
+enum
+{
+  HISTORY_CHANGE_APPEND     = 1 << 0,   // new entries
+  HISTORY_CHANGE_RELOAD     = 1 << 1    // existing entries or "deleted" tags changed
+};
+
 BDB*
 bdb_open (const string& path, int cache_size_mb, bool recover)
 {
@@ -34,6 +74,13 @@ bdb_open (const string& path, int cache_size_mb, bool recover)
 
       return bdb;
     }
+  else if (bdb->open_needs_upgrade())
+    {
+      // recovery doesn't help here, the repository needs to be upgraded
+      delete bdb;
+
+      return NULL;
+    }
   else
     {
       // recovery might help if database open fails, so we write a file indicating
@@ -59,9 +106,40 @@ bdb_need_recover (const string& path)
   return result;
 }
 
+bool
+bdb_upgrade_tables (const string& path, int cache_size_mb)
+{
+  BDB *bdb = new BDB();
+
+  bool result = bdb->upgrade_tables (path, cache_size_mb);
+
+  delete bdb;
+
+  return result;
+}
+
 BDB::BDB() :
   transaction (NULL),
+  db_env (NULL),
+  db_legacy (NULL),
+  db_hash2file (NULL),
+  db_seq (NULL),
+  db_sql_export (NULL),
+  new_file_number_seq (NULL),
+  m_upgrade_mode (false),
+  m_open_needs_upgrade (false),
+  m_record_format (BDB_RECORD_FORMAT_FIXED),
+  m_txn_deadlock (false),
+  m_txn_journal (false),
+  m_commit_mode (BDB_COMMIT_SYNC),
+  m_deadlock_count (0),
+  m_retry_count (0),
   m_history (this),
+  m_h2f_filter (NULL),
+  m_h2f_gen (0),
+  m_h2f_misses (0),
+  m_h2f_txn_modified (false),
+  m_history_txn_changes (0),
   m_multi_data_buffer (64 * 1024)
 {
 }
@@ -131,6 +209,14 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
 
       repo_path = path;
 
+      /* without generation files, other processes would not notice our changes */
+      if (!m_h2f_gen_file.open (path + "/hash2file.gen", 1) ||
+          !m_history_gen_file.open (path + "/history.gen", 2))
+        {
+          printf ("can't open generation files in '%s'.\n", path.c_str());
+          return false;
+        }
+
       /* load repo id */
       CfgParser repo_info_parser;
       if (!repo_info_parser.parse (path + "/info"))
@@ -158,6 +244,7 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
       db_env->set_cachesize (cache_size_gb, cache_size_mb * 1024 * 1024, 0); // set cache size
       db_env->set_lk_max_locks (100000);
       db_env->set_lk_max_objects (100000);
+      db_env->set_lk_detect (DB_LOCK_DEFAULT);         // run deadlock detector whenever a lock request blocks
       db_env->log_set_config (DB_LOG_AUTO_REMOVE, 1);     // automatically remove old log files
       db_env->set_paniccall (panic_call);
 
@@ -172,23 +259,59 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
         0);
       if (ret == 0)
         {
-          // DB: main database
-          db = new Db (db_env, 0);
-          db->set_flags (DB_DUP);       // allow duplicate keys
-
-          // Open the database
-          u_int32_t oFlags = DB_CREATE | DB_AUTO_COMMIT; // Open flags;
-
-          ret = db->open (NULL,               // Transaction pointer
-                          "db",               // Database name
-                          NULL,               // Optional logical database name
-                          DB_BTREE,           // Database access method
-                          oFlags,             // Open flags
-                          0);                 // File mode (using defaults)
-          if (ret != 0)
+          // Open flags; DB_MULTIVERSION allows snapshot reads (see DbcPtr::SNAPSHOT)
+          u_int32_t oFlags = DB_CREATE | DB_AUTO_COMMIT | DB_MULTIVERSION;
+
+          // DB: one database for each table
+          const vector<BDBTableInfo>& table_info = bdb_table_info();
+
+          table_dbs.assign (BDB_TABLE_VARIABLES + 1, NULL);
+          for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
             {
-              db->err (ret, "open database 'db' failed");
-              result = false;
+              Db *table_db = new Db (db_env, 0);
+
+              if (ti->flags)
+                table_db->set_flags (ti->flags);
+              if (ti->page_size)
+                table_db->set_pagesize (ti->page_size);   // only used if the database is created
+
+              ret = table_db->open (NULL,             // Transaction pointer
+                                    ti->db_name,      // Database name
+                                    NULL,             // Optional logical database name
+                                    DB_BTREE,         // Database access method
+                                    oFlags,           // Open flags
+                                    0);               // File mode (using defaults)
+              if (ret != 0)
+                {
+                  table_db->err (ret, "open database '%s' failed", ti->db_name);
+                  result = false;
+                }
+              table_dbs[ti->table] = table_db;
+            }
+
+          // DB: old single database for all tables (bfsync <= 0.3.7), only opened if it exists
+          db_legacy = new Db (db_env, 0);
+          db_legacy->set_flags (DB_DUP);
+
+          ret = db_legacy->open (NULL, "db", NULL, DB_BTREE, DB_AUTO_COMMIT, 0);
+          if (ret == 0)
+            {
+              if (!m_upgrade_mode)
+                {
+                  printf ("============================================================================\n");
+                  printf ("%s: repository database uses old single table layout\n", path.c_str());
+                  printf (" - use bfsync upgrade %s to fix this\n", path.c_str());
+                  printf ("============================================================================\n");
+
+                  m_open_needs_upgrade = true;
+                  result = false;
+                }
+            }
+          else
+            {
+              db_legacy->close (0);
+              delete db_legacy;
+              db_legacy = NULL;
             }
 
           // DB: hash2file
@@ -250,6 +373,10 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
               db_sql_export->err (ret, "open database 'db_sql_export' failed");
               result = false;
             }
+
+          // legacy databases get the record format during upgrade
+          if (result && !db_legacy)
+            result = init_record_format();
         }
       else
         {
@@ -284,7 +411,8 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
               shm_init_fail[db_env] = false; // in case we try again later
             }
           db_env->err (ret, "open database env failed");
-          db = NULL;
+          table_dbs.clear();
+          db_legacy = NULL;
           db_hash2file = NULL;
           db_seq = NULL;
           db_sql_export = NULL;
@@ -293,11 +421,20 @@ BDB::open (const string& path, int cache_size_mb, bool recover)
 
       if (!result)
         {
-          if (db)
+          for (size_t t = 0; t < table_dbs.size(); t++)
+            {
+              if (table_dbs[t])
+                {
+                  table_dbs[t]->close (0);
+                  delete table_dbs[t];
+                }
+            }
+          table_dbs.clear();
+          if (db_legacy)
             {
-              db->close (0);
-              delete db;
-              db = NULL;
+              db_legacy->close (0);
+              delete db_legacy;
+              db_legacy = NULL;
             }
           if (db_hash2file)
             {
@@ -336,26 +473,64 @@ bool
 BDB::close (CloseFlags flags)
 {
   assert (db_env != 0);
-  assert (db != 0);
+  assert (!table_dbs.empty());
   assert (db_hash2file != 0);
 
-  int ret = db->close (0);
-  delete db;
-  db = NULL;
+  int ret;
 
-  assert (ret == 0);
+  if (m_commit_mode != BDB_COMMIT_SYNC)
+    {
+      // make transactions durable that were committed without flushing the log
+      BDBError err = checkpoint();
+      assert (err == BDB_ERROR_NONE);
+    }
 
-  if (flags == CLOSE_TRUNCATE)
+  for (map<unsigned int, VersionIndex *>::iterator vi = m_version_indexes.begin(); vi != m_version_indexes.end(); vi++)
+    delete vi->second;
+  m_version_indexes.clear();
+
+  delete m_h2f_filter;
+  m_h2f_filter = NULL;
+
+  m_h2f_gen_file.close();
+  m_history_gen_file.close();
+
+  for (size_t t = 0; t < table_dbs.size(); t++)
     {
-      db = new Db (db_env, 0);
-      ret = db->remove ("db", NULL, 0);
+      if (table_dbs[t])
+        {
+          ret = table_dbs[t]->close (0);
+          delete table_dbs[t];
+
+          assert (ret == 0);
+        }
+    }
+  table_dbs.clear();
 
-      delete db;
-      db = NULL;
+  if (db_legacy)
+    {
+      ret = db_legacy->close (0);
+      delete db_legacy;
+      db_legacy = NULL;
 
       assert (ret == 0);
     }
 
+  if (flags == CLOSE_TRUNCATE)
+    {
+      const vector<BDBTableInfo>& table_info = bdb_table_info();
+
+      for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
+        {
+          Db *rm_db = new Db (db_env, 0);
+          ret = rm_db->remove (ti->db_name, NULL, 0);
+
+          delete rm_db;
+
+          assert (ret == 0);
+        }
+    }
+
   ret = db_hash2file->close (0);
   delete db_hash2file;
   db_hash2file = NULL;
@@ -389,6 +564,204 @@ BDB::close (CloseFlags flags)
   return (ret == 0);
 }
 
+bool
+BDB::open_needs_upgrade()
+{
+  return m_open_needs_upgrade;
+}
+
+/*
+ * determine format of inode and link records; this is stored in the database as
+ * "record-format" variable, new databases use the compact format
+ */
+bool
+BDB::init_record_format()
+{
+  DataOutBuffer kbuf;
+  kbuf.write_string ("record-format");
+  kbuf.write_table (BDB_TABLE_VARIABLES);
+
+  Dbt key (kbuf.begin(), kbuf.size());
+  Dbt data;
+
+  int ret = get_db (BDB_TABLE_VARIABLES)->get (NULL, &key, &data, 0);
+  if (ret == 0)
+    {
+      DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+
+      int format = atoi (dbuffer.read_string().c_str());
+      if (format != BDB_RECORD_FORMAT_FIXED && format != BDB_RECORD_FORMAT_COMPACT)
+        {
+          printf ("%s: unsupported record format %d\n", repo_path.c_str(), format);
+          return false;
+        }
+      m_record_format = BDBRecordFormat (format);
+      return true;
+    }
+
+  /* no variable: databases that already contain inodes were created with the fixed
+   * record format, empty databases are new and use the compact format
+   */
+  Dbc *dbc;
+  ret = get_db (BDB_TABLE_INODES)->cursor (NULL, &dbc, 0);
+  g_assert (ret == 0);
+
+  Dbt ikey, idata;
+  ret = dbc->get (&ikey, &idata, DB_FIRST);
+  dbc->close();
+
+  m_record_format = (ret == DB_NOTFOUND) ? BDB_RECORD_FORMAT_COMPACT : BDB_RECORD_FORMAT_FIXED;
+
+  // store format, so that restoring a dump (bfdefrag) will use the same format as the dumped records
+  DataOutBuffer dbuf;
+  dbuf.write_string (string_printf ("%d", m_record_format));
+
+  Dbt fdata (dbuf.begin(), dbuf.size());
+
+  ret = get_db (BDB_TABLE_VARIABLES)->put (NULL, &key, &fdata, DB_AUTO_COMMIT);
+  if (ret != 0)
+    {
+      get_db (BDB_TABLE_VARIABLES)->err (ret, "storing record format failed");
+      return false;
+    }
+  return true;
+}
+
+static void
+upgrade_update_status (size_t n_records)
+{
+  printf ("\rUpgrade: splitting database tables: %zd records ... ", n_records);
+  fflush (stdout);
+}
+
+/* move all records from the old single database to the per table databases */
+bool
+BDB::upgrade_tables (const string& path, int cache_size_mb)
+{
+  m_upgrade_mode = true;
+
+  if (!open (path, cache_size_mb, false))
+    return false;
+
+  if (!db_legacy)     // nothing to do
+    return close();
+
+  int ret;
+
+  // remove records from a previous interrupted upgrade
+  for (size_t t = 0; t < table_dbs.size(); t++)
+    {
+      if (table_dbs[t])
+        {
+          u_int32_t count;
+
+          ret = table_dbs[t]->truncate (NULL, &count, DB_AUTO_COMMIT);
+          g_assert (ret == 0);
+        }
+    }
+
+  Dbc *dbc;
+  ret = db_legacy->cursor (NULL, &dbc, 0);
+  g_assert (ret == 0);
+
+  size_t n_records = 0;
+  size_t n_ops = 0;
+  bool   result = true;
+
+  upgrade_update_status (0);
+  begin_transaction();
+
+  AllRecordsIterator ari (dbc);
+
+  Dbt key, data;
+  while (ari.next (key, data))
+    {
+      BDBTables table = bdb_key_table (key);
+      if (table <= 0 || size_t (table) >= table_dbs.size() || !table_dbs[table])
+        {
+          printf ("\nUpgrade: unknown record type %d\n", table);
+          result = false;
+          break;
+        }
+
+      /* convert inode and link records to compact format */
+      DataOutBuffer dbuf;
+      Dbt           compact_data;
+
+      if (table == BDB_TABLE_INODES || table == BDB_TABLE_LINKS)
+        {
+          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+          DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+
+          if (table == BDB_TABLE_INODES)
+            {
+              INodeRecord ir;
+              ir.read (dbuffer, BDB_RECORD_FORMAT_FIXED);
+              ir.write (dbuf, BDB_RECORD_FORMAT_COMPACT);
+            }
+          else
+            {
+              ID dir_id (kbuffer);
+
+              LinkRecord lr;
+              lr.read (dbuffer, dir_id, BDB_RECORD_FORMAT_FIXED);
+              lr.write (dbuf, dir_id, BDB_RECORD_FORMAT_COMPACT);
+            }
+          compact_data = Dbt (dbuf.begin(), dbuf.size());
+        }
+
+      Dbt *put_data = compact_data.get_data() ? &compact_data : &data;
+
+      ret = table_dbs[table]->put (transaction, &key, put_data, 0);
+      if (ret != 0 && ret != DB_KEYEXIST)  /* DB_KEYEXIST: duplicate record in sorted duplicate table */
+        {
+          table_dbs[table]->err (ret, "Upgrade: put failed");
+          result = false;
+          break;
+        }
+
+      n_records++;
+      if (++n_ops >= 20000)
+        {
+          /* keep number of locks limited by splitting transactions every once in a while */
+          commit_transaction();
+          begin_transaction();
+          n_ops = 0;
+
+          upgrade_update_status (n_records);
+        }
+    }
+  dbc->close();
+
+  if (result)
+    {
+      vector<string> format;
+      format.push_back (string_printf ("%d", BDB_RECORD_FORMAT_COMPACT));
+
+      result = (set_variable ("record-format", format) == BDB_ERROR_NONE);
+    }
+  if (!result)
+    {
+      abort_transaction();
+      close();
+      return false;
+    }
+  commit_transaction();
+  upgrade_update_status (n_records);
+
+  // old database is no longer needed
+  ret = db_legacy->close (0);
+  delete db_legacy;
+  db_legacy = NULL;
+
+  if (ret == 0)
+    ret = db_env->dbremove (NULL, "db", NULL, DB_AUTO_COMMIT);
+
+  printf ("%s.\n", ret == 0 ? "done" : "failed");
+
+  return close() && ret == 0;
+}
+
 BDBError
 BDB::begin_transaction()
 {
@@ -402,6 +775,10 @@ BDB::begin_transaction()
     return ret2error (ret);
 
   g_assert (transaction);
+  m_txn_deadlock = false;
+  m_txn_journal = false;
+  m_h2f_txn_modified = false;
+  m_history_txn_changes = 0;
 
   return BDB_ERROR_NONE;
 }
@@ -418,11 +795,84 @@ BDB::commit_transaction()
   if (!transaction)
     return BDB_ERROR_NO_TRANS;
 
-  int ret = transaction->commit (0);
+  if (m_txn_deadlock)
+    {
+      /* an operation of this transaction was chosen as deadlock victim: abort, caller may retry */
+      int ret = transaction->abort();
+      transaction = NULL;
+      m_txn_deadlock = false;
+      m_h2f_txn_modified = false;
+      m_history_txn_changes = 0;
+      m_deadlock_count++;
+
+      if (ret)
+        return ret2error (ret);
+
+      return BDB_ERROR_DEADLOCK;
+    }
+
+  u_int32_t commit_flags = 0;
+  if (m_commit_mode == BDB_COMMIT_WRITE_NOSYNC)
+    commit_flags = DB_TXN_WRITE_NOSYNC;
+  else if (m_commit_mode == BDB_COMMIT_NOSYNC)
+    commit_flags = DB_TXN_NOSYNC;
+
+  /* other processes need to rebuild their hash2file filter and update their History:
+   * the generations are incremented before the changes become visible, otherwise a
+   * filter/History of the old generation would be used while they are; if other
+   * processes can't be notified, the transaction is not committed
+   */
+  if ((m_h2f_txn_modified && !h2f_generation_bump()) ||
+      (m_history_txn_changes && !history_generation_bump()))
+    {
+      transaction->abort();
+      transaction = NULL;
+      m_h2f_txn_modified = false;
+      m_history_txn_changes = 0;
+
+      return BDB_ERROR_IO;
+    }
+
+  int ret = transaction->commit (commit_flags);
   transaction = NULL;
 
   if (ret)
-    return ret2error (ret);
+    {
+      m_h2f_txn_modified = false;
+      m_history_txn_changes = 0;
+      return ret2error (ret);
+    }
+
+  /* filters/History read between the first increment and the commit miss the changes;
+   * the generation files have their full size, so this only fails on I/O errors */
+  bool gen_ok = true;
+  if (m_h2f_txn_modified)
+    {
+      gen_ok = h2f_generation_bump() && gen_ok;
+      m_h2f_txn_modified = false;
+    }
+  if (m_history_txn_changes)
+    {
+      gen_ok = history_generation_bump() && gen_ok;
+      m_history_txn_changes = 0;
+    }
+  if (!gen_ok)
+    return BDB_ERROR_IO;
+
+  if (m_txn_journal && m_commit_mode != BDB_COMMIT_SYNC)
+    {
+      /* journal boundary: make everything up to here durable */
+      ret = db_env->log_flush (NULL);
+      if (ret)
+        return ret2error (ret);
+
+      /* checkpoint if 16 Mb log were written or a minute has passed, to keep recovery fast */
+      ret = db_env->txn_checkpoint (16 * 1024, 1, 0);
+      if (ret)
+        return ret2error (ret);
+
+      return BDB_ERROR_NONE;
+    }
 
   /* checkpoint database every minute (min = 1) */
   ret = db_env->txn_checkpoint (0, 1, 0);
@@ -432,6 +882,28 @@ BDB::commit_transaction()
   return BDB_ERROR_NONE;
 }
 
+void
+BDB::set_commit_mode (BDBCommitMode mode)
+{
+  Lock lock (mutex);
+
+  m_commit_mode = mode;
+}
+
+/* flush log and write checkpoint: all transactions committed so far become durable */
+BDBError
+BDB::checkpoint()
+{
+  Lock lock (mutex);
+
+  int ret = db_env->log_flush (NULL);
+  if (ret)
+    return ret2error (ret);
+
+  ret = db_env->txn_checkpoint (0, 0, DB_FORCE);
+  return ret2error (ret);
+}
+
 BDBError
 BDB::abort_transaction()
 {
@@ -442,6 +914,14 @@ BDB::abort_transaction()
 
   int ret = transaction->abort();
   transaction = NULL;
+  m_h2f_txn_modified = false;
+  m_history_txn_changes = 0;
+
+  if (m_txn_deadlock)
+    {
+      m_txn_deadlock = false;
+      m_deadlock_count++;
+    }
 
   if (ret)
     return ret2error (ret);
@@ -449,6 +929,87 @@ BDB::abort_transaction()
   return BDB_ERROR_NONE;
 }
 
+/*
+ * check the result of a database operation within the current transaction
+ *
+ * deadlocks are not fatal: the transaction is marked as failed, and commit_transaction()
+ * will abort it and return BDB_ERROR_DEADLOCK, so that the caller can retry it; once a
+ * transaction is marked, the errors of subsequent operations are ignored
+ */
+void
+BDB::txn_check (int ret)
+{
+  if (ret == 0)
+    return;
+
+  if (ret == DB_LOCK_DEADLOCK || ret == DB_LOCK_NOTGRANTED || m_txn_deadlock)
+    {
+      m_txn_deadlock = true;
+      return;
+    }
+  assert (ret == 0);    // any other error is fatal
+}
+
+/* check the final result of a read loop (DB_NOTFOUND just means that there are no more records) */
+void
+BDB::txn_check_read (int ret)
+{
+  if (transaction && ret != DB_NOTFOUND)
+    txn_check (ret);
+}
+
+/*
+ * read a single record; returns the result of Db::get
+ *
+ * reads without transaction (txn == NULL) are retried on deadlock; any error other
+ * than DB_NOTFOUND is passed to txn_check_read(), so if a transaction is active, it
+ * will fail on commit instead of being committed with a wrong "not found" result
+ */
+int
+BDB::get_record (Db *db, DbTxn *txn, Dbt *key, Dbt *data)
+{
+  int ret = db->get (txn, key, data, 0);
+
+  for (int attempt = 0; !txn && (ret == DB_LOCK_DEADLOCK || ret == DB_LOCK_NOTGRANTED); attempt++)
+    {
+      if (!retry_backoff (attempt))
+        break;
+
+      ret = db->get (txn, key, data, 0);
+    }
+  if (ret != 0)
+    txn_check_read (ret);
+
+  return ret;
+}
+
+bool
+BDB::txn_deadlock()
+{
+  return m_txn_deadlock;
+}
+
+/*
+ * wait before retrying a transaction that failed with BDB_ERROR_DEADLOCK
+ *
+ * the delay grows exponentially (10ms, 20ms, ... up to 1s) with random jitter, so that
+ * the processes involved in the deadlock don't collide again; returns false if the
+ * transaction failed too often and the caller should give up
+ */
+bool
+BDB::retry_backoff (int attempt)
+{
+  if (attempt >= BDB_MAX_TXN_RETRIES)
+    return false;
+
+  m_retry_count++;
+
+  double delay = std::min (0.01 * (1 << std::min (attempt, 7)), 1.0);
+  g_usleep (delay * g_random_double_range (0.5, 1.5) * 1000000);
+
+  return true;
+}
+
 DbTxn*
 BDB::get_transaction()
 {
@@ -517,43 +1078,147 @@ DataOutBuffer::write_uint32_be (guint32 i)
 }
 
 void
-DataOutBuffer::write_table (char table)
+DataOutBuffer::write_varint (guint64 i)
 {
-  out.push_back (table);
+  // 7 bits per byte, least significant bits first; high bit set: more bytes follow
+  while (i >= 0x80)
+    {
+      out.push_back ((i & 0x7f) | 0x80);
+      i >>= 7;
+    }
+  out.push_back (i);
 }
 
 void
-write_link_data (DataOutBuffer& db_out, const LinkPtr& lp)
+DataOutBuffer::write_bytes (const char *bytes, size_t n)
 {
-  db_out.write_uint32 (lp->vmin);
-  db_out.write_uint32 (lp->vmax);
-  lp->inode_id.store (db_out);
-  db_out.write_string (lp->name);
+  out.insert (out.end(), bytes, bytes + n);
 }
 
-TimeProfSection tp_store_link ("BDB::store_link");
-
 void
-BDB::store_link (const LinkPtr& lp)
+DataOutBuffer::write_table (char table)
 {
-  Lock lock (mutex);
+  out.push_back (table);
+}
 
-  TimeProfHandle h (tp_store_link);
+void
+LinkRecord::write (DataOutBuffer& dbuf, const ID& dir_id, BDBRecordFormat format) const
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      dbuf.write_uint32 (vmin);
+      dbuf.write_uint32 (vmax);
+      inode_id.store (dbuf);
+      dbuf.write_string (name);
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
 
-  g_assert (transaction != NULL);
+  dbuf.write_varint (vmin);
+  dbuf.write_varint (guint32 (vmax + 1));   // VERSION_INF -> 0
+
+  /* the path prefix of the inode id usually starts with the path prefix of the
+   * directory, so we only store the length of the common part and the rest */
+  const vector<char>& dir_prefix = dir_id.path_prefix;
+  const vector<char>& prefix = inode_id.path_prefix;
+
+  size_t common = 0;
+  while (common < prefix.size() && common < dir_prefix.size() && prefix[common] == dir_prefix[common])
+    common++;
+
+  dbuf.write_varint (common);
+  dbuf.write_varint (prefix.size() - common);
+  if (common < prefix.size())
+    dbuf.write_bytes (&prefix[common], prefix.size() - common);
+
+  dbuf.write_uint32 (inode_id.a);
+  dbuf.write_uint32 (inode_id.b);
+  dbuf.write_uint32 (inode_id.c);
+  dbuf.write_uint32 (inode_id.d);
+  dbuf.write_uint32 (inode_id.e);
+  dbuf.write_string (name);
+}
+
+void
+LinkRecord::read (DataBuffer& dbuf, const ID& dir_id, BDBRecordFormat format)
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      vmin = dbuf.read_uint32();
+      vmax = dbuf.read_uint32();
+      inode_id = ID (dbuf);
+      name = dbuf.read_string();
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
+
+  vmin = dbuf.read_varint();
+  vmax = dbuf.read_varint() - 1;
+
+  size_t common = dbuf.read_varint();
+  size_t suffix_len = dbuf.read_varint();
+  assert (common <= dir_id.path_prefix.size());
+
+  inode_id.path_prefix.assign (dir_id.path_prefix.begin(), dir_id.path_prefix.begin() + common);
+  dbuf.read_bytes (inode_id.path_prefix, suffix_len);
+
+  inode_id.a = dbuf.read_uint32();
+  inode_id.b = dbuf.read_uint32();
+  inode_id.c = dbuf.read_uint32();
+  inode_id.d = dbuf.read_uint32();
+  inode_id.e = dbuf.read_uint32();
+  name = dbuf.read_string();
+}
+
+void
+LinkRecord::read_versions (DataBuffer dbuf, BDBRecordFormat format, guint32& vmin, guint32& vmax)
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      vmin = dbuf.read_uint32();
+      vmax = dbuf.read_uint32();
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
+
+  vmin = dbuf.read_varint();
+  vmax = dbuf.read_varint() - 1;
+}
+
+TimeProfSection tp_store_link ("BDB::store_link");
+
+void
+BDB::store_link (const LinkPtr& lp, BDBBulkWriter *writer)
+{
+  TimeProfHandle h (tp_store_link);
 
   DataOutBuffer kbuf, dbuf;
 
   lp->dir_id.store (kbuf);
   kbuf.write_table (BDB_TABLE_LINKS);
 
-  write_link_data (dbuf, lp);
+  LinkRecord lr;
+  lr.vmin = lp->vmin;
+  lr.vmax = lp->vmax;
+  lr.inode_id = lp->inode_id;
+  lr.name = lp->name;
+  lr.write (dbuf, lp->dir_id, m_record_format);
+
+  if (writer)
+    {
+      writer->put (kbuf, dbuf);
+      return;
+    }
+
+  Lock lock (mutex);
+
+  g_assert (transaction != NULL);
 
   Dbt lkey (kbuf.begin(), kbuf.size());
   Dbt ldata (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &lkey, &ldata, 0);
-  assert (ret == 0);
+  int ret = get_db (BDB_TABLE_LINKS)->put (transaction, &lkey, &ldata, 0);
+  txn_check (ret);
 }
 
 TimeProfSection tp_delete_links ("BDB::delete_links");
@@ -573,7 +1238,7 @@ BDB::delete_links (const ID& dir_id, const map<string, LinkVersionList>& link_ma
   Dbt lkey (kbuf.begin(), kbuf.size());
   Dbt ldata;
 
-  DbcPtr dbc (this, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_LINKS, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // iterate over key elements and delete records which are in LinkVersionList
   int ret = dbc->get (&lkey, &ldata, DB_SET);
@@ -581,20 +1246,18 @@ BDB::delete_links (const ID& dir_id, const map<string, LinkVersionList>& link_ma
     {
       DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
 
-      guint32 vmin = dbuffer.read_uint32();
-      guint32 vmax = dbuffer.read_uint32();
-      ID inode_id (dbuffer);
-      string name = dbuffer.read_string();
+      LinkRecord lr;
+      lr.read (dbuffer, dir_id, m_record_format);
 
       bool del = false;
 
-      map<string, LinkVersionList>::const_iterator mapi = link_map.find (name);
+      map<string, LinkVersionList>::const_iterator mapi = link_map.find (lr.name);
       if (mapi != link_map.end())
         {
           const LinkVersionList& links = mapi->second;
           for (size_t i = 0; i < links.size(); i++)
             {
-              if (links[i]->inode_id == inode_id && (links[i]->vmin == vmin || links[i]->vmax == vmax))
+              if (links[i]->inode_id == lr.inode_id && (links[i]->vmin == lr.vmin || links[i]->vmax == lr.vmax))
                 del = true;
             }
         }
@@ -602,10 +1265,27 @@ BDB::delete_links (const ID& dir_id, const map<string, LinkVersionList>& link_ma
       if (del)
         {
           ret = dbc->del (0);
-          assert (ret == 0);
+          txn_check (ret);
         }
       ret = dbc->get (&lkey, &ldata, DB_NEXT_DUP);
     }
+  if (ret != DB_NOTFOUND)
+    txn_check (ret);
+}
+
+static Link *
+link_from_record (const ID& dir_id, const LinkRecord& lr)
+{
+  Link *l = new Link;
+
+  l->vmin = lr.vmin;
+  l->vmax = lr.vmax;
+  l->dir_id = dir_id;
+  l->inode_id = lr.inode_id;
+  l->name = lr.name;
+  l->updated = false;
+
+  return l;
 }
 
 TimeProfSection tp_load_links ("BDB::load_links");
@@ -630,7 +1310,7 @@ BDB::load_links (std::vector<Link*>& links, const ID& id, guint32 version)
   lmulti_data.set_data (&m_multi_data_buffer[0]);
   lmulti_data.set_ulen (m_multi_data_buffer.size());
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_LINKS); /* Acquire a cursor for the database. */
 
   // iterate over key elements and delete records which are in LinkVersionList
   int ret = dbc->get (&lkey, &lmulti_data, DB_SET | DB_MULTIPLE);
@@ -641,28 +1321,17 @@ BDB::load_links (std::vector<Link*>& links, const ID& id, guint32 version)
         {
           DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
 
-          guint32 vmin = dbuffer.read_uint32();
-          guint32 vmax = dbuffer.read_uint32();
-          ID inode_id (dbuffer);
-          string name = dbuffer.read_string();
+          LinkRecord lr;
+          lr.read (dbuffer, id, m_record_format);
 
-          if (version >= vmin && version <= vmax)
-            {
-              Link *l = new Link;
-
-              l->vmin = vmin;
-              l->vmax = vmax;
-              l->dir_id = id;
-              l->inode_id = inode_id;
-              l->name = name;
-              l->updated = false;
+          if (version >= lr.vmin && version <= lr.vmax)
+            links.push_back (link_from_record (id, lr));
 
-              links.push_back (l);
-            }
           assert (dbuffer.remaining() == 0);
         }
       ret = dbc->get (&lkey, &lmulti_data, DB_NEXT_DUP | DB_MULTIPLE);
     }
+  txn_check_read (ret);
 }
 
 DbEnv*
@@ -672,9 +1341,11 @@ BDB::get_db_env()
 }
 
 Db*
-BDB::get_db()
+BDB::get_db (BDBTables table)
 {
-  return db;
+  g_assert (table > 0 && size_t (table) < table_dbs.size() && table_dbs[table]);
+
+  return table_dbs[table];
 }
 
 Db*
@@ -701,6 +1372,12 @@ BDB::repo_id()
   return m_repo_id;
 }
 
+BDBRecordFormat
+BDB::record_format()
+{
+  return m_record_format;
+}
+
 DataBuffer::DataBuffer (const char *ptr, size_t size) :
   m_ptr (ptr),
   m_remaining (size)
@@ -786,45 +1463,291 @@ DataBuffer::read_hash()
   return str;
 }
 
-TimeProfSection tp_store_inode ("BDB::store_inode");
+guint64
+DataBuffer::read_varint()
+{
+  guint64 result = 0;
+
+  for (int shift = 0; ; shift += 7)
+    {
+      assert (m_remaining >= 1 && shift < 64);
+
+      unsigned char c = *m_ptr++;
+      m_remaining--;
+
+      result |= guint64 (c & 0x7f) << shift;
+      if (c < 0x80)
+        return result;
+    }
+}
 
 void
-BDB::store_inode (const INode *inode)
+DataBuffer::read_bytes (vector<char>& vec, size_t n)
+{
+  assert (m_remaining >= n);
+
+  vec.insert (vec.end(), m_ptr, m_ptr + n);
+  m_remaining -= n;
+  m_ptr += n;
+}
+
+/* fields of compact inode records: the flags say which optional fields are present */
+enum
+{
+  INODE_HAS_UID             = 1 << 0,
+  INODE_HAS_GID             = 1 << 1,
+  INODE_HAS_SIZE            = 1 << 2,
+  INODE_HAS_MAJOR           = 1 << 3,
+  INODE_HAS_MINOR           = 1 << 4,
+  INODE_HAS_NLINK           = 1 << 5,   // otherwise nlink = 1
+  INODE_HAS_CTIME_NS        = 1 << 6,
+  INODE_HAS_MTIME           = 1 << 7,   // otherwise mtime = ctime
+  INODE_HAS_MTIME_NS        = 1 << 8,   // otherwise mtime_ns = ctime_ns
+  INODE_HAS_NEW_FILE_NUMBER = 1 << 9,
+  INODE_HAS_LINK            = 1 << 10,
+  INODE_HASH_BINARY         = 1 << 11,  // 20 byte SHA-1
+  INODE_HASH_NEW            = 1 << 12,  // hash == "new"
+  INODE_HASH_STRING         = 1 << 13   // any other non-empty hash
+};
+
+static bool
+is_binary_hash (const string& hash)
+{
+  if (hash.size() != 40)
+    return false;
+
+  // only lower case hex digits, otherwise read_hash() would not restore the same string
+  for (size_t i = 0; i < hash.size(); i++)
+    {
+      const char c = hash[i];
+      if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+        return false;
+    }
+  return true;
+}
+
+INodeRecord::INodeRecord() :
+  vmin (0), vmax (0),
+  uid (0), gid (0),
+  mode (0), type (0),
+  size (0),
+  major (0), minor (0),
+  nlink (0),
+  ctime (0), ctime_ns (0),
+  mtime (0), mtime_ns (0),
+  new_file_number (0)
 {
-  Lock lock (mutex);
+}
 
-  TimeProfHandle h (tp_store_inode);
+INodeRecord::INodeRecord (const INode& inode) :
+  vmin (inode.vmin), vmax (inode.vmax),
+  uid (inode.uid), gid (inode.gid),
+  mode (inode.mode), type (inode.type),
+  hash (inode.hash),
+  link (inode.link),
+  size (inode.size),
+  major (inode.major), minor (inode.minor),
+  nlink (inode.nlink),
+  ctime (inode.ctime), ctime_ns (inode.ctime_ns),
+  mtime (inode.mtime), mtime_ns (inode.mtime_ns),
+  new_file_number (inode.new_file_number)
+{
+}
 
-  g_assert (transaction != NULL);
+void
+INodeRecord::to_inode (INode& inode) const
+{
+  inode.vmin = vmin;
+  inode.vmax = vmax;
+  inode.uid = uid;
+  inode.gid = gid;
+  inode.mode = mode;
+  inode.type = FileType (type);
+  inode.hash = hash;
+  inode.link = link;
+  inode.size = size;
+  inode.major = major;
+  inode.minor = minor;
+  inode.nlink = nlink;
+  inode.ctime = ctime;
+  inode.ctime_ns = ctime_ns;
+  inode.mtime = mtime;
+  inode.mtime_ns = mtime_ns;
+  inode.new_file_number = new_file_number;
+}
+
+void
+INodeRecord::write (DataOutBuffer& dbuf, BDBRecordFormat format) const
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      dbuf.write_uint32 (vmin);
+      dbuf.write_uint32 (vmax);
+      dbuf.write_uint32 (uid);
+      dbuf.write_uint32 (gid);
+      dbuf.write_uint32 (mode);
+      dbuf.write_uint32 (type);
+      dbuf.write_string (hash);
+      dbuf.write_string (link);
+      dbuf.write_uint64 (size);
+      dbuf.write_uint32 (major);
+      dbuf.write_uint32 (minor);
+      dbuf.write_uint32 (nlink);
+      dbuf.write_uint32 (ctime);
+      dbuf.write_uint32 (ctime_ns);
+      dbuf.write_uint32 (mtime);
+      dbuf.write_uint32 (mtime_ns);
+      dbuf.write_uint32 (new_file_number);
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
+
+  guint32 flags = 0;
+
+  if (uid)                  flags |= INODE_HAS_UID;
+  if (gid)                  flags |= INODE_HAS_GID;
+  if (size)                 flags |= INODE_HAS_SIZE;
+  if (major)                flags |= INODE_HAS_MAJOR;
+  if (minor)                flags |= INODE_HAS_MINOR;
+  if (nlink != 1)           flags |= INODE_HAS_NLINK;
+  if (ctime_ns)             flags |= INODE_HAS_CTIME_NS;
+  if (mtime != ctime)       flags |= INODE_HAS_MTIME;
+  if (mtime_ns != ctime_ns) flags |= INODE_HAS_MTIME_NS;
+  if (new_file_number)      flags |= INODE_HAS_NEW_FILE_NUMBER;
+  if (!link.empty())        flags |= INODE_HAS_LINK;
+
+  if (is_binary_hash (hash))
+    flags |= INODE_HASH_BINARY;
+  else if (hash == "new")
+    flags |= INODE_HASH_NEW;
+  else if (!hash.empty())
+    flags |= INODE_HASH_STRING;
+
+  dbuf.write_varint (flags);
+  dbuf.write_varint (vmin);
+  dbuf.write_varint (guint32 (vmax + 1));   // VERSION_INF -> 0
+  dbuf.write_varint (mode);
+  dbuf.write_varint (type);
+  dbuf.write_varint (ctime);
+
+  if (flags & INODE_HAS_UID)             dbuf.write_varint (uid);
+  if (flags & INODE_HAS_GID)             dbuf.write_varint (gid);
+  if (flags & INODE_HAS_SIZE)            dbuf.write_varint (size);
+  if (flags & INODE_HAS_MAJOR)           dbuf.write_varint (major);
+  if (flags & INODE_HAS_MINOR)           dbuf.write_varint (minor);
+  if (flags & INODE_HAS_NLINK)           dbuf.write_varint (nlink);
+  if (flags & INODE_HAS_CTIME_NS)        dbuf.write_varint (ctime_ns);
+  if (flags & INODE_HAS_MTIME)           dbuf.write_varint (mtime);
+  if (flags & INODE_HAS_MTIME_NS)        dbuf.write_varint (mtime_ns);
+  if (flags & INODE_HAS_NEW_FILE_NUMBER) dbuf.write_varint (new_file_number);
+  if (flags & INODE_HAS_LINK)            dbuf.write_string (link);
+  if (flags & INODE_HASH_BINARY)         dbuf.write_hash (hash);
+  if (flags & INODE_HASH_STRING)         dbuf.write_string (hash);
+}
+
+void
+INodeRecord::read (DataBuffer& dbuf, BDBRecordFormat format)
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      vmin = dbuf.read_uint32();
+      vmax = dbuf.read_uint32();
+      uid = dbuf.read_uint32();
+      gid = dbuf.read_uint32();
+      mode = dbuf.read_uint32();
+      type = dbuf.read_uint32();
+      hash = dbuf.read_string();
+      link = dbuf.read_string();
+      size = dbuf.read_uint64();
+      major = dbuf.read_uint32();
+      minor = dbuf.read_uint32();
+      nlink = dbuf.read_uint32();
+      ctime = dbuf.read_uint32();
+      ctime_ns = dbuf.read_uint32();
+      mtime = dbuf.read_uint32();
+      mtime_ns = dbuf.read_uint32();
+      new_file_number = dbuf.read_uint32();
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
+
+  guint32 flags = dbuf.read_varint();
+
+  vmin  = dbuf.read_varint();
+  vmax  = dbuf.read_varint() - 1;
+  mode  = dbuf.read_varint();
+  type  = dbuf.read_varint();
+  ctime = dbuf.read_varint();
+
+  uid             = (flags & INODE_HAS_UID)             ? dbuf.read_varint() : 0;
+  gid             = (flags & INODE_HAS_GID)             ? dbuf.read_varint() : 0;
+  size            = (flags & INODE_HAS_SIZE)            ? dbuf.read_varint() : 0;
+  major           = (flags & INODE_HAS_MAJOR)           ? dbuf.read_varint() : 0;
+  minor           = (flags & INODE_HAS_MINOR)           ? dbuf.read_varint() : 0;
+  nlink           = (flags & INODE_HAS_NLINK)           ? dbuf.read_varint() : 1;
+  ctime_ns        = (flags & INODE_HAS_CTIME_NS)        ? dbuf.read_varint() : 0;
+  mtime           = (flags & INODE_HAS_MTIME)           ? dbuf.read_varint() : ctime;
+  mtime_ns        = (flags & INODE_HAS_MTIME_NS)        ? dbuf.read_varint() : ctime_ns;
+  new_file_number = (flags & INODE_HAS_NEW_FILE_NUMBER) ? dbuf.read_varint() : 0;
+
+  link = (flags & INODE_HAS_LINK) ? dbuf.read_string() : "";
+
+  if (flags & INODE_HASH_BINARY)
+    hash = dbuf.read_hash();
+  else if (flags & INODE_HASH_NEW)
+    hash = "new";
+  else if (flags & INODE_HASH_STRING)
+    hash = dbuf.read_string();
+  else
+    hash = "";
+}
+
+void
+INodeRecord::read_versions (DataBuffer dbuf, BDBRecordFormat format, guint32& vmin, guint32& vmax)
+{
+  if (format == BDB_RECORD_FORMAT_FIXED)
+    {
+      vmin = dbuf.read_uint32();
+      vmax = dbuf.read_uint32();
+      return;
+    }
+  assert (format == BDB_RECORD_FORMAT_COMPACT);
+
+  dbuf.read_varint(); // flags
+
+  vmin = dbuf.read_varint();
+  vmax = dbuf.read_varint() - 1;
+}
+
+TimeProfSection tp_store_inode ("BDB::store_inode");
+
+void
+BDB::store_inode (const INode *inode, BDBBulkWriter *writer)
+{
+  TimeProfHandle h (tp_store_inode);
 
   DataOutBuffer kbuf, dbuf;
 
   inode->id.store (kbuf);
   kbuf.write_table (BDB_TABLE_INODES);
 
-  dbuf.write_uint32 (inode->vmin);
-  dbuf.write_uint32 (inode->vmax);
-  dbuf.write_uint32 (inode->uid);
-  dbuf.write_uint32 (inode->gid);
-  dbuf.write_uint32 (inode->mode);
-  dbuf.write_uint32 (inode->type);
-  dbuf.write_string (inode->hash);
-  dbuf.write_string (inode->link);
-  dbuf.write_uint64 (inode->size);
-  dbuf.write_uint32 (inode->major);
-  dbuf.write_uint32 (inode->minor);
-  dbuf.write_uint32 (inode->nlink);
-  dbuf.write_uint32 (inode->ctime);
-  dbuf.write_uint32 (inode->ctime_ns);
-  dbuf.write_uint32 (inode->mtime);
-  dbuf.write_uint32 (inode->mtime_ns);
-  dbuf.write_uint32 (inode->new_file_number);
+  INodeRecord (*inode).write (dbuf, m_record_format);
+
+  if (writer)
+    {
+      writer->put (kbuf, dbuf);
+      return;
+    }
+
+  Lock lock (mutex);
+
+  g_assert (transaction != NULL);
 
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &ikey, &idata, 0);
-  assert (ret == 0);
+  int ret = get_db (BDB_TABLE_INODES)->put (transaction, &ikey, &idata, 0);
+  txn_check (ret);
 }
 
 TimeProfSection tp_delete_inodes ("BDB::delete_inodes");
@@ -870,7 +1793,7 @@ BDB::delete_inodes (const INodeVersionList& inodes)
   Dbt idata;
 
 
-  DbcPtr dbc (this, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_INODES, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // iterate over key elements and delete records which are in INodeVersionList
   int ret = dbc->get (&ikey, &idata, DB_SET);
@@ -878,21 +1801,26 @@ BDB::delete_inodes (const INodeVersionList& inodes)
     {
       DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
 
-      int vmin = dbuffer.read_uint32();
-      int vmax = dbuffer.read_uint32();
+      INodeRecord ir;
+      ir.read (dbuffer, m_record_format);
+
+      int vmin = ir.vmin;
+      int vmax = ir.vmax;
 
       if (vmin_del.find (vmin) != vmin_del.end())
         {
           ret = dbc->del (0);
-          assert (ret == 0);
+          txn_check (ret);
         }
       else if (vmax_del.find (vmax) != vmax_del.end())
         {
           ret = dbc->del (0);
-          assert (ret == 0);
+          txn_check (ret);
         }
       ret = dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  if (ret != DB_NOTFOUND)
+    txn_check (ret);
 }
 
 TimeProfSection tp_load_inode ("BDB::load_inode");
@@ -912,38 +1840,25 @@ BDB::load_inode (const ID& id, unsigned int version, INode *inode)
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_INODES); /* Acquire a cursor for the database. */
 
   int ret = dbc->get (&ikey, &idata, DB_SET);
   while (ret == 0)
     {
       DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
 
-      inode->vmin = dbuffer.read_uint32();
-      inode->vmax = dbuffer.read_uint32();
+      INodeRecord ir;
+      ir.read (dbuffer, m_record_format);
 
-      if (version >= inode->vmin && version <= inode->vmax)
+      if (version >= ir.vmin && version <= ir.vmax)
         {
-          inode->id   = id;
-          inode->uid  = dbuffer.read_uint32();
-          inode->gid  = dbuffer.read_uint32();
-          inode->mode = dbuffer.read_uint32();
-          inode->type = BFSync::FileType (dbuffer.read_uint32());
-          inode->hash = dbuffer.read_string();
-          inode->link = dbuffer.read_string();
-          inode->size = dbuffer.read_uint64();
-          inode->major = dbuffer.read_uint32();
-          inode->minor = dbuffer.read_uint32();
-          inode->nlink = dbuffer.read_uint32();
-          inode->ctime = dbuffer.read_uint32();
-          inode->ctime_ns = dbuffer.read_uint32();
-          inode->mtime = dbuffer.read_uint32();
-          inode->mtime_ns = dbuffer.read_uint32();
-          inode->new_file_number = dbuffer.read_uint32();
+          ir.to_inode (*inode);
+          inode->id = id;
           return true;
         }
       ret = dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  txn_check_read (ret);
   return false;
 }
 
@@ -969,8 +1884,8 @@ BDB::try_store_id2ino (const ID& id, int ino)
   Dbt rev_ikey (kbuf.begin(), kbuf.size());
   Dbt rev_lookup;
 
-  int ret = db->get (NULL, &rev_ikey, &rev_lookup, 0);
-  if (ret == 0)
+  int ret = get_record (get_db (BDB_TABLE_LOCAL_INO2ID), NULL, &rev_ikey, &rev_lookup);
+  if (ret != DB_NOTFOUND)   // used (or error: don't risk using the ino twice)
     return false;
 
   new_id2ino_entries[ino] = id;
@@ -1003,8 +1918,8 @@ BDB::store_new_id2ino_entries()
       Dbt rev_idata (dbuf.begin(), dbuf.size());
       Dbt rev_ikey (kbuf.begin(), kbuf.size());
 
-      int ret = db->put (transaction, &rev_ikey, &rev_idata, 0);
-      assert (ret == 0);
+      int ret = get_db (BDB_TABLE_LOCAL_INO2ID)->put (transaction, &rev_ikey, &rev_idata, 0);
+      txn_check (ret);
 
       kbuf.clear();
       dbuf.clear();
@@ -1018,11 +1933,12 @@ BDB::store_new_id2ino_entries()
       Dbt ikey (kbuf.begin(), kbuf.size());
       Dbt idata (dbuf.begin(), dbuf.size());
 
-      ret = db->put (transaction, &ikey, &idata, 0);
-      assert (ret == 0);
+      ret = get_db (BDB_TABLE_LOCAL_ID2INO)->put (transaction, &ikey, &idata, 0);
+      txn_check (ret);
     }
-  // clear new entries
-  new_id2ino_entries.clear();
+  // clear new entries (unless the transaction will be retried)
+  if (!m_txn_deadlock)
+    new_id2ino_entries.clear();
 }
 
 TimeProfSection tp_load_ino ("BDB::load_ino");
@@ -1042,7 +1958,7 @@ BDB::load_ino (const ID& id, ino_t& ino)
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata;
 
-  if (db->get (NULL, &ikey, &idata, 0) != 0)
+  if (get_record (get_db (BDB_TABLE_LOCAL_ID2INO), NULL, &ikey, &idata) != 0)
     return false;
 
   DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
@@ -1075,8 +1991,10 @@ BDB::store_history_entry (int version, const HistoryEntry& he)
   Dbt hkey (kbuf.begin(), kbuf.size());
   Dbt hdata (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &hkey, &hdata, 0);
-  assert (ret == 0);
+  int ret = get_db (BDB_TABLE_HISTORY)->put (transaction, &hkey, &hdata, 0);
+  txn_check (ret);
+
+  m_history_txn_changes |= HISTORY_CHANGE_APPEND;
 }
 
 bool
@@ -1092,7 +2010,7 @@ BDB::load_history_entry (int version, HistoryEntry& he)
   Dbt hkey (kbuf.begin(), kbuf.size());
   Dbt hdata;
 
-  if (db->get (transaction, &hkey, &hdata, 0) != 0)
+  if (get_record (get_db (BDB_TABLE_HISTORY), transaction, &hkey, &hdata) != 0)
     return false;
 
   DataBuffer dbuffer ((char *) hdata.get_data(), hdata.get_size());
@@ -1119,17 +2037,180 @@ BDB::delete_history_entry (int version)
   Dbt hkey (kbuf.begin(), kbuf.size());
   Dbt hdata;
 
-  DbcPtr dbc (this, DbcPtr::WRITE);
+  DbcPtr dbc (this, BDB_TABLE_HISTORY, DbcPtr::WRITE);
 
   // iterate over key elements and delete records which are in LinkVersionList
   int ret = dbc->get (&hkey, &hdata, DB_SET);
   while (ret == 0)
     {
       ret = dbc->del (0);
-      assert (ret == 0);
+      txn_check (ret);
+
+      /* existing entry changed: can't be handled by reading new entries only */
+      m_history_txn_changes |= HISTORY_CHANGE_RELOAD;
 
       ret = dbc->get (&hkey, &hdata, DB_NEXT_DUP);
     }
+  if (ret != DB_NOTFOUND)
+    txn_check (ret);
+}
+
+/* versions >= first_version that have a history entry, in ascending order */
+void
+BDB::list_history_versions (unsigned int first_version, vector<unsigned int>& versions)
+{
+  Lock lock (mutex);
+
+  DataOutBuffer kbuf;
+
+  kbuf.write_uint32_be (first_version);  /* use big endian storage to make Berkeley DB sort entries properly */
+  kbuf.write_table (BDB_TABLE_HISTORY);
+
+  Dbt hkey (kbuf.begin(), kbuf.size());
+  Dbt hdata;
+
+  DbcPtr dbc (this, BDB_TABLE_HISTORY);
+
+  int ret = dbc->get (&hkey, &hdata, DB_SET_RANGE);
+  while (ret == 0)
+    {
+      DataBuffer kbuffer ((char *) hkey.get_data(), hkey.get_size());
+      versions.push_back (kbuffer.read_uint32_be());
+
+      ret = dbc->get (&hkey, &hdata, DB_NEXT_NODUP);
+    }
+}
+
+GenerationFile::GenerationFile() :
+  fd (-1),
+  n_counters (0)
+{
+}
+
+GenerationFile::~GenerationFile()
+{
+  close();
+}
+
+/*
+ * the file always has its full size (missing counters are written as 0 when it is
+ * opened), so later updates don't need to allocate disk space
+ */
+bool
+GenerationFile::open (const string& filename, size_t n)
+{
+  close();
+
+  fd = ::open (filename.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+
+  n_counters = n;
+
+  vector<guint64> counters (n_counters);
+  const ssize_t size = n_counters * sizeof (guint64);
+
+  flock (fd, LOCK_EX);
+
+  ssize_t bytes = pread (fd, &counters[0], size, 0);
+  bool ok = bytes == size ||
+            (bytes >= 0 && pwrite (fd, &counters[0], size, 0) == size && fdatasync (fd) == 0);
+
+  flock (fd, LOCK_UN);
+
+  if (!ok)
+    close();
+  return ok;
+}
+
+void
+GenerationFile::close()
+{
+  if (fd >= 0)
+    {
+      ::close (fd);
+      fd = -1;
+    }
+}
+
+bool
+GenerationFile::read (vector<guint64>& counters)
+{
+  if (fd < 0)
+    return false;
+
+  counters.resize (n_counters);
+  const ssize_t size = n_counters * sizeof (guint64);
+
+  flock (fd, LOCK_SH);
+  ssize_t bytes = pread (fd, &counters[0], size, 0);
+  flock (fd, LOCK_UN);
+
+  return bytes == size;
+}
+
+/* add increments to the counters (atomically for all processes), old_counters are the values before */
+bool
+GenerationFile::bump (const vector<guint64>& increments, vector<guint64>& old_counters)
+{
+  if (fd < 0)
+    return false;
+
+  g_return_val_if_fail (increments.size() == n_counters, false);
+
+  old_counters.resize (n_counters);
+  const ssize_t size = n_counters * sizeof (guint64);
+
+  flock (fd, LOCK_EX);
+
+  bool ok = pread (fd, &old_counters[0], size, 0) == size;
+  if (ok)
+    {
+      vector<guint64> counters (old_counters);
+      for (size_t i = 0; i < n_counters; i++)
+        counters[i] += increments[i];
+
+      ok = pwrite (fd, &counters[0], size, 0) == size;
+    }
+
+  flock (fd, LOCK_UN);
+  return ok;
+}
+
+/*
+ * <repo>/history.gen contains two counters: the generation, which is incremented
+ * by each commit of a transaction that modified the history, and the reload generation,
+ * which is only incremented if existing history entries or "deleted" tags changed
+ *
+ * if only the generation changed, History only needs to read the new entries
+ */
+bool
+BDB::history_generation (guint64& gen, guint64& reload_gen)
+{
+  Lock lock (mutex);
+
+  /* uncommitted history changes of this process are not covered by the generation */
+  if (m_history_txn_changes)
+    return false;
+
+  vector<guint64> gens;
+  if (!m_history_gen_file.read (gens))
+    return false;
+
+  gen = gens[0];
+  reload_gen = gens[1];
+  return true;
+}
+
+bool
+BDB::history_generation_bump()
+{
+  vector<guint64> inc (2), old_gens;
+
+  inc[0] = 1;
+  inc[1] = (m_history_txn_changes & HISTORY_CHANGE_RELOAD) ? 1 : 0;
+
+  return m_history_gen_file.bump (inc, old_gens);
 }
 
 TimeProfSection tp_add_changed_inode ("BDB::add_changed_inode");
@@ -1153,13 +2234,18 @@ BDB::add_changed_inode (const ID& id)
   Dbt rev_cikey (kbuf.begin(), kbuf.size());
   Dbt rev_cidata;
 
-  ret = db->get (transaction, &rev_cikey, &rev_cidata, 0);
+  ret = get_db (BDB_TABLE_CHANGED_INODES_REV)->get (transaction, &rev_cikey, &rev_cidata, 0);
   if (ret == 0)
     return;       // => inode already in changed set
+  if (ret != DB_NOTFOUND)
+    {
+      txn_check (ret);
+      return;
+    }
 
   // add reverse entry
-  ret = db->put (transaction, &rev_cikey, &rev_cidata, 0);
-  assert (ret == 0);
+  ret = get_db (BDB_TABLE_CHANGED_INODES_REV)->put (transaction, &rev_cikey, &rev_cidata, 0);
+  txn_check (ret);
 
   // add to changed inodes table
   kbuf.clear();
@@ -1171,8 +2257,8 @@ BDB::add_changed_inode (const ID& id)
   Dbt cikey (kbuf.begin(), kbuf.size());
   Dbt cidata (dbuf.begin(), dbuf.size());
 
-  ret = db->put (transaction, &cikey, &cidata, 0);
-  assert (ret == 0);
+  ret = get_db (BDB_TABLE_CHANGED_INODES)->put (transaction, &cikey, &cidata, 0);
+  txn_check (ret);
 }
 
 BDBError
@@ -1191,7 +2277,7 @@ BDB::clear_changed_inodes (unsigned int max_inodes, unsigned int& result)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this, DbcPtr::WRITE);  /* get write cursor */
+  DbcPtr dbc (this, BDB_TABLE_CHANGED_INODES, DbcPtr::WRITE);  /* get write cursor */
 
   int ret = dbc->get (&key, &data, DB_SET);
   while (ret == 0)
@@ -1211,7 +2297,7 @@ BDB::clear_changed_inodes (unsigned int max_inodes, unsigned int& result)
       rev_kbuf.write_table (BDB_TABLE_CHANGED_INODES_REV);
 
       Dbt rev_key (rev_kbuf.begin(), rev_kbuf.size());
-      ret = db->del (transaction, &rev_key, 0);
+      ret = get_db (BDB_TABLE_CHANGED_INODES_REV)->del (transaction, &rev_key, 0);
       if (ret)
         return ret2error (ret);
 
@@ -1258,16 +2344,30 @@ BDB::load_hash2file (const string& hash)
   DataOutBuffer kbuf;
   kbuf.write_hash (hash);
 
+  m_h2f_stats.lookups++;
+  if (h2f_filter_update() && !m_h2f_filter->may_contain (kbuf.begin()))
+    {
+      m_h2f_stats.filter_negatives++;
+      return 0; // not found
+    }
+
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  int ret = db_hash2file->get (transaction, &key, &data, 0);
+  int ret = get_record (db_hash2file, transaction, &key, &data);
   if (ret == 0)
     {
       DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
       unsigned int file_number = dbuffer.read_uint32();
       return file_number;
     }
+  if (ret != DB_NOTFOUND)
+    return 0;   // error: the transaction fails on commit (see get_record)
+
+  if (m_h2f_filter)
+    m_h2f_stats.false_positives++;
+  else
+    m_h2f_misses++;
 
   return 0; // not found
 }
@@ -1291,7 +2391,12 @@ BDB::store_hash2file (const string& hash, unsigned int file_number)
   Dbt data (dbuf.begin(), dbuf.size());
 
   int ret = db_hash2file->put (transaction, &key, &data, 0);
-  assert (ret == 0);
+  txn_check (ret);
+
+  /* if the transaction is aborted, the filter contains an extra hash, which is harmless */
+  if (m_h2f_filter)
+    m_h2f_filter->add (kbuf.begin());
+  m_h2f_txn_modified = true;
 }
 
 TimeProfSection tp_delete_hash2file ("BDB::delete_hash2file");
@@ -1311,41 +2416,186 @@ BDB::delete_hash2file (const string& hash)
   Dbt key (kbuf.begin(), kbuf.size());
 
   int ret = db_hash2file->del (transaction, &key, 0);
-  assert (ret == 0);
+  txn_check (ret);
+
+  m_h2f_txn_modified = true;
 }
 
+/* like delete_hash2file, but the hash is already in binary form (20 bytes), as stored in the database */
 void
-BDB::add_deleted_file (unsigned int file_number)
+BDB::delete_hash2file_bin (const string& bin_hash)
 {
   Lock lock (mutex);
 
+  TimeProfHandle h (tp_delete_hash2file);
+
   g_assert (transaction);
+  g_assert (bin_hash.size() == 20);
 
-  DataOutBuffer kbuf, dbuf;
-  kbuf.write_table (BDB_TABLE_DELETED_FILES);
-  dbuf.write_uint32 (file_number);
+  Dbt key ((void *) bin_hash.data(), bin_hash.size());
 
-  Dbt key (kbuf.begin(), kbuf.size());
-  Dbt data (dbuf.begin(), dbuf.size());
+  int ret = db_hash2file->del (transaction, &key, 0);
+  txn_check (ret);
+
+  m_h2f_txn_modified = true;
+}
+
+/*
+ * hash2file filter
+ *
+ * most lookups during commit, clone or put are for hashes that are not in the
+ * hash2file database; once a process had H2F_FILTER_MIN_MISSES misses, a Bloom
+ * filter of all hashes in the database is built, and hashes the filter doesn't
+ * contain are not looked up in the database
+ *
+ * hash2file is modified by other processes, so each commit of a transaction that
+ * modified hash2file increments the generation stored in <repo>/hash2file.gen;
+ * a process that finds a different generation than the one its filter was built
+ * for discards the filter
+ */
+static const guint64 H2F_FILTER_MIN_MISSES = 256;
 
-  int ret = db->put (transaction, &key, &data, 0);
-  assert (ret == 0);
+bool
+BDB::h2f_generation_bump()
+{
+  vector<guint64> inc (1, 1), old_gen;
+
+  if (!m_h2f_gen_file.bump (inc, old_gen))
+    {
+      /* can't tell anymore whether the filter is up-to-date */
+      delete m_h2f_filter;
+      m_h2f_filter = NULL;
+      m_h2f_misses = 0;
+      return false;
+    }
+  if (m_h2f_filter && old_gen[0] != m_h2f_gen)
+    {
+      /* another process modified hash2file since the filter was built */
+      delete m_h2f_filter;
+      m_h2f_filter = NULL;
+      m_h2f_misses = 0;
+    }
+  m_h2f_gen = old_gen[0] + 1;
+  return true;
 }
 
-vector<unsigned int>
-BDB::load_deleted_files()
+/* returns true if a filter that is up-to-date can be used */
+bool
+BDB::h2f_filter_update()
 {
-  Lock lock (mutex);
+  if (m_h2f_filter)
+    {
+      vector<guint64> gen;
+      if (m_h2f_gen_file.read (gen) && gen[0] == m_h2f_gen && m_h2f_filter->size() <= m_h2f_filter->capacity())
+        return true;
 
-  vector<unsigned int> files;
+      delete m_h2f_filter;
+      m_h2f_filter = NULL;
 
-  DataOutBuffer kbuf;
-  kbuf.write_table (BDB_TABLE_DELETED_FILES);
+      /* only rebuild if we still get misses */
+      m_h2f_misses = 0;
+    }
+  if (m_h2f_misses < H2F_FILTER_MIN_MISSES)
+    return false;
 
-  Dbt key (kbuf.begin(), kbuf.size());
+  return h2f_filter_build();
+}
+
+TimeProfSection tp_h2f_filter_build ("BDB::h2f_filter_build");
+
+bool
+BDB::h2f_filter_build()
+{
+  TimeProfHandle h (tp_h2f_filter_build);
+
+  double start_t = gettime();
+
+  /* read generation first: modifications after this point will change it */
+  vector<guint64> gen;
+  if (!m_h2f_gen_file.read (gen))
+    return false;
+
+  /* uses the current transaction (if any), so hashes stored by it are included */
+  DbcPtr dbc (this, db_hash2file, DbcPtr::SNAPSHOT);
+
+  vector<char> hashes;
+  vector<char> multi_data_buffer (256 * 1024);
+
+  Dbt key;
+  Dbt multi_data;
+  multi_data.set_flags (DB_DBT_USERMEM);
+  multi_data.set_data (&multi_data_buffer[0]);
+  multi_data.set_ulen (multi_data_buffer.size());
+
+  int ret = dbc->get (&key, &multi_data, DB_FIRST | DB_MULTIPLE_KEY);
+  while (ret == 0)
+    {
+      DbMultipleKeyDataIterator data_iterator (multi_data);
+
+      Dbt hkey, hdata;
+      while (data_iterator.next (hkey, hdata))
+        {
+          g_assert (hkey.get_size() == 20);
+
+          const char *bin_hash = (const char *) hkey.get_data();
+          hashes.insert (hashes.end(), bin_hash, bin_hash + 20);
+        }
+      ret = dbc->get (&key, &multi_data, DB_NEXT | DB_MULTIPLE_KEY);
+    }
+  if (ret != DB_NOTFOUND)
+    {
+      /* incomplete scan (deadlock): no filter */
+      txn_check_read (ret);
+      m_h2f_misses = 0;
+      return false;
+    }
+
+  /* leave room for hashes added later */
+  size_t n_hashes = hashes.size() / 20;
+  m_h2f_filter = new HashFilter (n_hashes * 2 + 64 * 1024);
+  for (size_t i = 0; i < n_hashes; i++)
+    m_h2f_filter->add (&hashes[i * 20]);
+
+  m_h2f_gen = gen[0];
+
+  m_h2f_stats.filter_builds++;
+  m_h2f_stats.filter_build_time += gettime() - start_t;
+
+  return true;
+}
+
+void
+BDB::add_deleted_file (unsigned int file_number)
+{
+  Lock lock (mutex);
+
+  g_assert (transaction);
+
+  DataOutBuffer kbuf, dbuf;
+  kbuf.write_table (BDB_TABLE_DELETED_FILES);
+  dbuf.write_uint32 (file_number);
+
+  Dbt key (kbuf.begin(), kbuf.size());
+  Dbt data (dbuf.begin(), dbuf.size());
+
+  int ret = get_db (BDB_TABLE_DELETED_FILES)->put (transaction, &key, &data, 0);
+  txn_check (ret);
+}
+
+vector<unsigned int>
+BDB::load_deleted_files()
+{
+  Lock lock (mutex);
+
+  vector<unsigned int> files;
+
+  DataOutBuffer kbuf;
+  kbuf.write_table (BDB_TABLE_DELETED_FILES);
+
+  Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_DELETED_FILES); /* Acquire a cursor for the database. */
 
   // iterate over all deleted files
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1377,7 +2627,7 @@ BDB::clear_deleted_files (unsigned int max_files, unsigned int& result)
 
   result = 0;
 
-  DbcPtr dbc (this, DbcPtr::WRITE);  /* get write cursor */
+  DbcPtr dbc (this, BDB_TABLE_DELETED_FILES, DbcPtr::WRITE);  /* get write cursor */
 
   int ret = dbc->get (&key, &data, DB_SET);
   while (ret == 0)
@@ -1413,7 +2663,7 @@ BDB::add_temp_file (const TempFile& temp_file)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &key, &data, 0);
+  int ret = get_db (BDB_TABLE_TEMP_FILES)->put (transaction, &key, &data, 0);
   if (ret)
     return ret2error (ret);
 
@@ -1433,7 +2683,7 @@ BDB::load_temp_files()
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_TEMP_FILES); /* Acquire a cursor for the database. */
 
   // iterate over all temp files
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1466,7 +2716,7 @@ BDB::delete_temp_file (const string& name)
   Dbt tkey (kbuf.begin(), kbuf.size());
   Dbt tdata;
 
-  DbcPtr dbc (this, DbcPtr::WRITE);
+  DbcPtr dbc (this, BDB_TABLE_TEMP_FILES, DbcPtr::WRITE);
 
   // iterate over all temp files
   int ret = dbc->get (&tkey, &tdata, DB_SET);
@@ -1476,11 +2726,13 @@ BDB::delete_temp_file (const string& name)
       if (dbuffer.read_string() == name)
         {
           ret = dbc->del (0);
-          assert (ret == 0);
+          txn_check (ret);
         }
 
       ret = dbc->get (&tkey, &tdata, DB_NEXT_DUP);
     }
+  if (ret != DB_NOTFOUND)
+    txn_check (ret);
 }
 
 string
@@ -1502,7 +2754,7 @@ BDB::load_journal_entries (std::vector<JournalEntry>& entries)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_JOURNAL); /* Acquire a cursor for the database. */
 
   // iterate over all journal entries
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1537,7 +2789,9 @@ BDB::store_journal_entry (const JournalEntry& journal_entry)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &key, &data, 0);
+  m_txn_journal = true;
+
+  int ret = get_db (BDB_TABLE_JOURNAL)->put (transaction, &key, &data, 0);
   return ret2error (ret);
 }
 
@@ -1554,7 +2808,9 @@ BDB::clear_journal_entries()
 
   Dbt key (kbuf.begin(), kbuf.size());
 
-  int ret = db->del (transaction, &key, 0);
+  m_txn_journal = true;
+
+  int ret = get_db (BDB_TABLE_JOURNAL)->del (transaction, &key, 0);
 
   if (ret == 0 || ret == DB_NOTFOUND)
     return BDB_ERROR_NONE;
@@ -1576,7 +2832,7 @@ BDB::list_tags (unsigned int version)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_TAGS); /* Acquire a cursor for the database. */
 
   map<string, bool> have_tag;
 
@@ -1612,7 +2868,7 @@ BDB::load_tag  (unsigned int version, const string& tag)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_TAGS); /* Acquire a cursor for the database. */
 
   // iterate over all tag values
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1663,7 +2919,10 @@ BDB::add_tag (unsigned int version, const string& tag, const string& value)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data (dbuf.begin(), dbuf.size());
 
-  int ret = db->put (transaction, &key, &data, 0);
+  int ret = get_db (BDB_TABLE_TAGS)->put (transaction, &key, &data, 0);
+  if (ret == 0 && tag == "deleted")
+    m_history_txn_changes |= HISTORY_CHANGE_RELOAD;
+
   return ret2error (ret);
 }
 
@@ -1687,7 +2946,7 @@ BDB::del_tag (unsigned int version, const string& tag, const string& value)
   Dbt tkey (kbuf.begin(), kbuf.size());
   Dbt tdata;
 
-  DbcPtr dbc (this, DbcPtr::WRITE);
+  DbcPtr dbc (this, BDB_TABLE_TAGS, DbcPtr::WRITE);
 
   // iterate over all tags for that version
   bool found = false;
@@ -1709,9 +2968,36 @@ BDB::del_tag (unsigned int version, const string& tag, const string& value)
 
       ret = dbc->get (&tkey, &tdata, DB_NEXT_DUP);
     }
+  if (found && tag == "deleted")
+    m_history_txn_changes |= HISTORY_CHANGE_RELOAD;
+
   return found ? BDB_ERROR_NONE : BDB_ERROR_NOT_FOUND;
 }
 
+/* all versions that have a tag, using one pass over the tags table */
+void
+BDB::list_tagged_versions (const string& tag, vector<unsigned int>& versions)
+{
+  Lock lock (mutex);
+
+  Dbt key, data;
+
+  DbcPtr dbc (this, BDB_TABLE_TAGS);
+
+  int ret = dbc->get (&key, &data, DB_FIRST);
+  while (ret == 0)
+    {
+      DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+      DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+
+      unsigned int version = kbuffer.read_uint32_be();
+      if (dbuffer.read_string() == tag && (versions.empty() || versions.back() != version))
+        versions.push_back (version);
+
+      ret = dbc->get (&key, &data, DB_NEXT);
+    }
+}
+
 vector<string>
 BDB::get_variable (const string& variable)
 {
@@ -1726,7 +3012,7 @@ BDB::get_variable (const string& variable)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_VARIABLES); /* Acquire a cursor for the database. */
 
   // iterate over all values
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1756,7 +3042,7 @@ BDB::set_variable (const string& variable, const vector<string>& value)
   Dbt key (kbuf.begin(), kbuf.size());
   Dbt data;
 
-  DbcPtr dbc (this, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (this, BDB_TABLE_VARIABLES, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // delete old variable values
   int ret = dbc->get (&key, &data, DB_SET);
@@ -1777,7 +3063,7 @@ BDB::set_variable (const string& variable, const vector<string>& value)
 
       Dbt data (dbuf.begin(), dbuf.size());
 
-      int ret = db->put (transaction, &key, &data, 0);
+      int ret = get_db (BDB_TABLE_VARIABLES)->put (transaction, &key, &data, 0);
       if (ret != 0)
         return ret2error (ret);
     }
@@ -1931,6 +3217,43 @@ BDB::multi_data_buffer()
   return m_multi_data_buffer;
 }
 
+TimeProfSection tp_put_multiple ("BDB::put_multiple");
+
+BDBError
+BDB::put_multiple (BDBTables table, Dbt& multi_key_data)
+{
+  Lock lock (mutex);
+
+  TimeProfHandle h (tp_put_multiple);
+
+  if (!transaction)
+    return BDB_ERROR_NO_TRANS;
+
+  Dbt unused_data;  /* with DB_MULTIPLE_KEY, keys and data are both stored in multi_key_data */
+
+  int ret = get_db (table)->put (transaction, &multi_key_data, &unused_data, DB_MULTIPLE_KEY);
+  txn_check (ret);
+
+  return ret2error (ret);
+}
+
+BDBError
+BDB::put_record (BDBTables table, const void *key, size_t key_size, const void *data, size_t data_size)
+{
+  Lock lock (mutex);
+
+  if (!transaction)
+    return BDB_ERROR_NO_TRANS;
+
+  Dbt rkey ((void *) key, key_size);
+  Dbt rdata ((void *) data, data_size);
+
+  int ret = get_db (table)->put (transaction, &rkey, &rdata, 0);
+  txn_check (ret);
+
+  return ret2error (ret);
+}
+
 BDBError
 BDB::ret2error (int ret)
 {
@@ -1938,10 +3261,623 @@ BDB::ret2error (int ret)
     {
       case 0:           return BDB_ERROR_NONE;
       case DB_NOTFOUND: return BDB_ERROR_NOT_FOUND;
+      case DB_LOCK_DEADLOCK:
+      case DB_LOCK_NOTGRANTED:
+                        return BDB_ERROR_DEADLOCK;
     }
   return BDB_ERROR_UNKNOWN;
 }
 
+//----- BDBBulkWriter helper class: write records using bulk puts -------
+
+BDBBulkWriter::BDBBulkWriter (BDB *bdb, BDBTables table) :
+  bdb (bdb),
+  table (table),
+  buffer (1024 * 1024),
+  builder (NULL),
+  n_buffered (0),
+  n_written (0)
+{
+  multi_key_data.set_flags (DB_DBT_USERMEM);
+  multi_key_data.set_data (&buffer[0]);
+  multi_key_data.set_ulen (buffer.size());
+
+  reset();
+}
+
+BDBBulkWriter::~BDBBulkWriter()
+{
+  g_assert (n_buffered == 0);   // flush() must be called before the writer is destroyed
+
+  delete builder;
+}
+
+void
+BDBBulkWriter::reset()
+{
+  delete builder;
+
+  builder = new DbMultipleKeyDataBuilder (multi_key_data);
+  n_buffered = 0;
+}
+
+void
+BDBBulkWriter::put (DataOutBuffer& kbuf, DataOutBuffer& dbuf)
+{
+  put (kbuf.begin(), kbuf.size(), dbuf.begin(), dbuf.size());
+}
+
+void
+BDBBulkWriter::put (const void *key, size_t key_size, const void *data, size_t data_size)
+{
+  if (builder->append ((void *) key, key_size, (void *) data, data_size))
+    {
+      n_buffered++;
+      return;
+    }
+
+  // buffer full => write buffered records and try again
+  flush();
+
+  if (builder->append ((void *) key, key_size, (void *) data, data_size))
+    {
+      n_buffered++;
+      return;
+    }
+
+  // record doesn't fit into an empty buffer => write it with a single put
+  BDBError err = bdb->put_record (table, key, key_size, data, data_size);
+  g_assert (err == BDB_ERROR_NONE || err == BDB_ERROR_DEADLOCK);   // deadlock => commit will fail, retry
+
+  n_written++;
+}
+
+void
+BDBBulkWriter::flush()
+{
+  if (n_buffered == 0)
+    return;
+
+  BDBError err = bdb->put_multiple (table, multi_key_data);
+  g_assert (err == BDB_ERROR_NONE || err == BDB_ERROR_DEADLOCK);   // deadlock => commit will fail, retry
+
+  n_written += n_buffered;
+  reset();
+}
+
+size_t
+BDBBulkWriter::records_written() const
+{
+  return n_written;
+}
+
+//----- BDBCompactor: online compaction -------
+
+/* records per compaction transaction: keeps transactions (and lock counts) small */
+static const int COMPACT_RANGE_RECORDS = 2000;
+
+BDBCompactor::BDBCompactor (BDB *bdb, bool measure_fill) :
+  bdb (bdb),
+  measure_fill (measure_fill),
+  db_index (0),
+  db_started (false),
+  m_conflicts (0)
+{
+  dbs = bdb->all_dbs();
+  m_stats.time = 0;
+}
+
+/* full statistics: reads all pages of the database */
+void
+BDBCompactor::db_stat (Db *db, guint32& page_size, guint64& pages, double& fill)
+{
+  page_size = 0;
+  pages = 0;
+  fill = -1;
+
+  DB_BTREE_STAT *bsp;
+  if (db->stat (NULL, &bsp, measure_fill ? 0 : DB_FAST_STAT) == 0)
+    {
+      page_size = bsp->bt_pagesize;
+      pages = bsp->bt_pagecnt;
+
+      if (measure_fill && pages)
+        {
+          guint64 used = guint64 (bsp->bt_leaf_pg + bsp->bt_int_pg + bsp->bt_dup_pg + bsp->bt_over_pg) * page_size;
+          used -= bsp->bt_leaf_pgfree + bsp->bt_int_pgfree + bsp->bt_dup_pgfree + bsp->bt_over_pgfree;
+
+          fill = double (used) / (pages * page_size);
+        }
+      free (bsp);
+    }
+}
+
+/* conflict: set if the range needs to be retried because other users of the database hold locks */
+BDBError
+BDBCompactor::compact_range (bool& conflict)
+{
+  conflict = false;
+
+  Db *db = dbs[db_index].second;
+
+  BDBCompactStats::DbStats& db_stats = m_stats.dbs.back();
+
+  DbTxn *txn;
+  int ret = bdb->get_db_env()->txn_begin (NULL, &txn, 0);
+  if (ret != 0)
+    return BDB_ERROR_UNKNOWN;
+
+  /* find the end of the range */
+  Dbc *dbc;
+  ret = db->cursor (txn, &dbc, 0);
+  g_assert (ret == 0);
+
+  Dbt key, data;
+  data.set_flags (DB_DBT_PARTIAL);     // only keys are needed
+  data.set_dlen (0);
+
+  if (next_key.empty())
+    {
+      ret = dbc->get (&key, &data, DB_FIRST);
+    }
+  else
+    {
+      key = Dbt (&next_key[0], next_key.size());
+      ret = dbc->get (&key, &data, DB_SET_RANGE);
+    }
+  for (int i = 0; i < COMPACT_RANGE_RECORDS && ret == 0; i++)
+    ret = dbc->get (&key, &data, DB_NEXT);
+
+  vector<char> stop_key;
+  if (ret == 0)
+    {
+      const char *key_data = (const char *) key.get_data();
+      stop_key.assign (key_data, key_data + key.get_size());
+    }
+  dbc->close();
+
+  if (ret == 0 || ret == DB_NOTFOUND)
+    {
+      Dbt start_dbt, stop_dbt;
+      if (!next_key.empty())
+        start_dbt = Dbt (&next_key[0], next_key.size());
+      if (!stop_key.empty())
+        stop_dbt = Dbt (&stop_key[0], stop_key.size());
+
+      DB_COMPACT c_data;
+      memset (&c_data, 0, sizeof (c_data));
+
+      ret = db->compact (txn, next_key.empty() ? NULL : &start_dbt, stop_key.empty() ? NULL : &stop_dbt,
+                         &c_data, DB_FREE_SPACE, NULL);
+      if (ret == 0)
+        {
+          db_stats.pages_examined  += c_data.compact_pages_examine;
+          db_stats.pages_freed     += c_data.compact_pages_free;
+          db_stats.pages_truncated += c_data.compact_pages_truncated;
+          db_stats.levels_removed  += c_data.compact_levels;
+        }
+    }
+  if (ret == DB_LOCK_DEADLOCK || ret == DB_LOCK_NOTGRANTED)
+    {
+      /* conflict with other users of the database: retry this range in the next step */
+      txn->abort();
+      db_stats.deadlocks++;
+      conflict = true;
+      return BDB_ERROR_NONE;
+    }
+  if (ret != 0)
+    {
+      txn->abort();
+      return BDB_ERROR_UNKNOWN;
+    }
+
+  /* compaction doesn't change the contents, so it doesn't need to be durable immediately */
+  ret = txn->commit (DB_TXN_WRITE_NOSYNC);
+  if (ret != 0)
+    return BDB_ERROR_UNKNOWN;
+
+  if (stop_key.empty())
+    {
+      /* database done */
+      db_stat (db, db_stats.page_size, db_stats.pages_after, db_stats.fill_after);
+
+      db_index++;
+      db_started = false;
+      next_key.clear();
+    }
+  else
+    {
+      next_key = stop_key;
+    }
+  return BDB_ERROR_NONE;
+}
+
+/*
+ * compact until all databases are done or max_seconds have passed; must not be called
+ * while the BDB has an active transaction (the compaction transactions could wait for it)
+ *
+ * after a conflict with other users of the database, step returns early, so that these
+ * can proceed; the range is retried by the next call (see conflicts())
+ */
+BDBError
+BDBCompactor::step (double max_seconds)
+{
+  if (bdb->get_transaction())
+    return BDB_ERROR_TRANS_ACTIVE;
+
+  double start_t = gettime();
+  while (!done() && gettime() - start_t < max_seconds)
+    {
+      if (!db_started)
+        {
+          BDBCompactStats::DbStats db_stats;
+
+          db_stats.name = dbs[db_index].first;
+          db_stat (dbs[db_index].second, db_stats.page_size, db_stats.pages_before, db_stats.fill_before);
+          db_stats.pages_after     = db_stats.pages_before;
+          db_stats.fill_after      = db_stats.fill_before;
+          db_stats.pages_examined  = 0;
+          db_stats.pages_freed     = 0;
+          db_stats.pages_truncated = 0;
+          db_stats.levels_removed  = 0;
+          db_stats.deadlocks       = 0;
+
+          m_stats.dbs.push_back (db_stats);
+          db_started = true;
+        }
+      bool conflict;
+      BDBError err = compact_range (conflict);
+      if (err)
+        {
+          m_stats.time += gettime() - start_t;
+          return err;
+        }
+      if (conflict)
+        {
+          m_conflicts++;
+          break;
+        }
+      m_conflicts = 0;
+    }
+  m_stats.time += gettime() - start_t;
+  return BDB_ERROR_NONE;
+}
+
+bool
+BDBCompactor::done() const
+{
+  return db_index == dbs.size();
+}
+
+/* number of conflicts since the last range that could be compacted */
+int
+BDBCompactor::conflicts() const
+{
+  return m_conflicts;
+}
+
+const BDBCompactStats&
+BDBCompactor::stats() const
+{
+  return m_stats;
+}
+
+string
+BDBCompactStats::to_string() const
+{
+  string s;
+
+  for (vector<DbStats>::const_iterator di = dbs.begin(); di != dbs.end(); di++)
+    {
+      s += string_printf ("db \"%s\" page-size %u pages-before %" G_GUINT64_FORMAT " pages-after %" G_GUINT64_FORMAT
+                          " fill-before %.4f fill-after %.4f examined %" G_GUINT64_FORMAT " freed %" G_GUINT64_FORMAT
+                          " truncated %" G_GUINT64_FORMAT " levels %" G_GUINT64_FORMAT " deadlocks %" G_GUINT64_FORMAT ";\n",
+                          di->name.c_str(), di->page_size, di->pages_before, di->pages_after,
+                          di->fill_before, di->fill_after, di->pages_examined, di->pages_freed,
+                          di->pages_truncated, di->levels_removed, di->deadlocks);
+    }
+  s += string_printf ("compact-time %.2f;\n", time);
+
+  return s;
+}
+
+/*
+ * version index of a historical version (see bfversionindex.hh), NULL if there is
+ * no index file; the current version changes, so it never uses an index
+ *
+ * index records are not the exact database records, so only read-only code may use
+ * them: load_inode/load_links never do, since their results are cached (INodeRepo)
+ * and may be deleted or stored again
+ */
+VersionIndex*
+BDB::find_version_index (unsigned int version)
+{
+  if (version >= m_history.current_version() || !m_history.have_version (version))
+    return NULL;
+
+  map<unsigned int, VersionIndex *>::iterator vi = m_version_indexes.find (version);
+  if (vi != m_version_indexes.end())
+    return vi->second;
+
+  VersionIndex *index = new VersionIndex();
+  if (!index->open (BFSync::version_index_filename (repo_path, version)) || index->version() != version)
+    {
+      delete index;
+      index = NULL;
+    }
+  m_version_indexes[version] = index;
+  return index;
+}
+
+VersionIndex*
+BDB::version_index (unsigned int version)
+{
+  Lock lock (mutex);
+
+  return find_version_index (version);
+}
+
+string
+BDB::version_index_filename (unsigned int version)
+{
+  Lock lock (mutex);
+
+  return BFSync::version_index_filename (repo_path, version);
+}
+
+/*
+ * open index files again: they may have been built or removed by now, and
+ * after a revert, a new commit may reuse the number of a reverted version
+ */
+void
+BDB::version_index_refresh()
+{
+  Lock lock (mutex);
+
+  for (map<unsigned int, VersionIndex *>::iterator vi = m_version_indexes.begin(); vi != m_version_indexes.end(); vi++)
+    delete vi->second;
+  m_version_indexes.clear();
+}
+
+/* all databases of the environment */
+vector< std::pair<string, Db*> >
+BDB::all_dbs()
+{
+  vector< std::pair<string, Db*> > dbs;
+
+  const vector<BDBTableInfo>& table_info = bdb_table_info();
+  for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
+    dbs.push_back (std::make_pair (ti->db_name, get_db (ti->table)));
+  dbs.push_back (std::make_pair ("db_hash2file", db_hash2file));
+  dbs.push_back (std::make_pair ("db_seq", db_seq));
+  dbs.push_back (std::make_pair ("db_sql_export", db_sql_export));
+
+  return dbs;
+}
+
+TimeProfSection tp_cache_stats ("BDB::cache_stats");
+
+BDBError
+BDB::cache_stats (BDBCacheStats& stats)
+{
+  Lock lock (mutex);
+
+  TimeProfHandle h (tp_cache_stats);
+
+  DB_MPOOL_STAT   *gsp;
+  DB_MPOOL_FSTAT **fsp;
+
+  int ret = db_env->memp_stat (&gsp, &fsp, 0);
+  if (ret != 0)
+    return ret2error (ret);
+
+  stats.cache_bytes = guint64 (gsp->st_gbytes) * 1024 * 1024 * 1024 + gsp->st_bytes;
+  stats.cache_hit   = gsp->st_cache_hit;
+  stats.cache_miss  = gsp->st_cache_miss;
+  stats.pages       = gsp->st_pages;
+  stats.clean_pages = gsp->st_page_clean;
+  stats.dirty_pages = gsp->st_page_dirty;
+  stats.evictions   = gsp->st_ro_evict + gsp->st_rw_evict;
+  stats.page_in     = gsp->st_page_in;
+  stats.page_out    = gsp->st_page_out;
+
+  vector< std::pair<string, Db*> > dbs = all_dbs();
+
+  stats.dbs.clear();
+  for (size_t i = 0; i < dbs.size(); i++)
+    {
+      BDBCacheStats::DbStats db_stats;
+
+      db_stats.name        = dbs[i].first;
+      db_stats.page_size   = 0;
+      db_stats.db_pages    = 0;
+      db_stats.cache_hit   = 0;
+      db_stats.cache_miss  = 0;
+      db_stats.page_in     = 0;
+      db_stats.page_create = 0;
+
+      DB_BTREE_STAT *bsp;
+      if (dbs[i].second->stat (NULL, &bsp, DB_FAST_STAT) == 0)
+        {
+          db_stats.page_size = bsp->bt_pagesize;
+          db_stats.db_pages  = bsp->bt_pagecnt;
+          free (bsp);
+        }
+
+      for (DB_MPOOL_FSTAT **f = fsp; f && *f; f++)
+        {
+          if ((*f)->file_name && db_stats.name == (*f)->file_name)
+            {
+              db_stats.cache_hit   += (*f)->st_cache_hit;
+              db_stats.cache_miss  += (*f)->st_cache_miss;
+              db_stats.page_in     += (*f)->st_page_in;
+              db_stats.page_create += (*f)->st_page_create;
+            }
+        }
+      stats.dbs.push_back (db_stats);
+    }
+  free (gsp);
+  free (fsp);
+
+  return BDB_ERROR_NONE;
+}
+
+double
+BDBCacheStats::hit_ratio() const
+{
+  const guint64 total = cache_hit + cache_miss;
+
+  return total ? double (cache_hit) / total : 1.0;
+}
+
+/* pages that have been loaded into the cache (at most the whole database) */
+guint64
+BDBCacheStats::working_set_bytes() const
+{
+  guint64 bytes = 0;
+
+  for (vector<DbStats>::const_iterator di = dbs.begin(); di != dbs.end(); di++)
+    bytes += std::min (di->page_in + di->page_create, di->db_pages) * di->page_size;
+
+  return bytes;
+}
+
+guint64
+BDBCacheStats::db_bytes() const
+{
+  guint64 bytes = 0;
+
+  for (vector<DbStats>::const_iterator di = dbs.begin(); di != dbs.end(); di++)
+    bytes += di->db_pages * di->page_size;
+
+  return bytes;
+}
+
+/* cache size that holds the working set with some headroom, but never less than the bfsync default */
+int
+BDBCacheStats::recommended_cache_mb() const
+{
+  const guint64 mb = 1024 * 1024;
+
+  return std::max<guint64> (16, (working_set_bytes() * 5 / 4 + mb - 1) / mb);
+}
+
+string
+BDBCacheStats::to_string() const
+{
+  const double mb = 1024 * 1024;
+
+  string s;
+
+  s += string_printf ("cache-size-mb %.2f;\n", cache_bytes / mb);
+  s += string_printf ("cache-hit %" G_GUINT64_FORMAT ";\n", cache_hit);
+  s += string_printf ("cache-miss %" G_GUINT64_FORMAT ";\n", cache_miss);
+  s += string_printf ("cache-hit-ratio %.4f;\n", hit_ratio());
+  s += string_printf ("cache-pages %" G_GUINT64_FORMAT ";\n", pages);
+  s += string_printf ("cache-clean-pages %" G_GUINT64_FORMAT ";\n", clean_pages);
+  s += string_printf ("cache-dirty-pages %" G_GUINT64_FORMAT ";\n", dirty_pages);
+  s += string_printf ("cache-evictions %" G_GUINT64_FORMAT ";\n", evictions);
+  s += string_printf ("cache-page-in %" G_GUINT64_FORMAT ";\n", page_in);
+  s += string_printf ("cache-page-out %" G_GUINT64_FORMAT ";\n", page_out);
+  for (vector<DbStats>::const_iterator di = dbs.begin(); di != dbs.end(); di++)
+    {
+      s += string_printf ("db \"%s\" page-size %u db-pages %" G_GUINT64_FORMAT " page-in %" G_GUINT64_FORMAT
+                          " page-create %" G_GUINT64_FORMAT " hit %" G_GUINT64_FORMAT " miss %" G_GUINT64_FORMAT ";\n",
+                          di->name.c_str(), di->page_size, di->db_pages, di->page_in, di->page_create,
+                          di->cache_hit, di->cache_miss);
+    }
+  s += string_printf ("db-size-mb %.2f;\n", db_bytes() / mb);
+  s += string_printf ("working-set-mb %.2f;\n", working_set_bytes() / mb);
+  s += string_printf ("recommended-cache-size %d;\n", recommended_cache_mb());
+
+  return s;
+}
+
+TimeProfSection tp_lock_stats ("BDB::lock_stats");
+
+BDBError
+BDB::lock_stats (BDBLockStats& stats)
+{
+  TimeProfHandle h (tp_lock_stats);
+
+  DB_LOCK_STAT *lsp = NULL;
+
+  int ret = db_env->lock_stat (&lsp, 0);
+  if (ret != 0)
+    return ret2error (ret);
+
+  stats.deadlocks        = m_deadlock_count;
+  stats.retries          = m_retry_count;
+  stats.env_deadlocks    = lsp->st_ndeadlocks;
+  stats.env_lock_waits   = lsp->st_lock_wait;
+  stats.env_lock_nowaits = lsp->st_lock_nowait;
+
+  free (lsp);
+
+  return BDB_ERROR_NONE;
+}
+
+string
+BDBLockStats::to_string() const
+{
+  string s;
+
+  s += string_printf ("deadlocks %" G_GUINT64_FORMAT ";\n", deadlocks);
+  s += string_printf ("deadlock-retries %" G_GUINT64_FORMAT ";\n", retries);
+  s += string_printf ("env-deadlocks %" G_GUINT64_FORMAT ";\n", env_deadlocks);
+  s += string_printf ("env-lock-waits %" G_GUINT64_FORMAT ";\n", env_lock_waits);
+  s += string_printf ("env-lock-nowaits %" G_GUINT64_FORMAT ";\n", env_lock_nowaits);
+
+  return s;
+}
+
+BDBHash2FileStats::BDBHash2FileStats() :
+  lookups (0),
+  filter_negatives (0),
+  false_positives (0),
+  filter_builds (0),
+  filter_build_time (0),
+  filter_hashes (0),
+  filter_bytes (0)
+{
+}
+
+/* fraction of the lookups of absent hashes that were not answered by the filter */
+double
+BDBHash2FileStats::false_positive_rate() const
+{
+  guint64 negatives = filter_negatives + false_positives;
+
+  return negatives ? double (false_positives) / negatives : 0;
+}
+
+string
+BDBHash2FileStats::to_string() const
+{
+  string s;
+
+  s += string_printf ("lookups %" G_GUINT64_FORMAT ";\n", lookups);
+  s += string_printf ("filter-negatives %" G_GUINT64_FORMAT ";\n", filter_negatives);
+  s += string_printf ("false-positives %" G_GUINT64_FORMAT ";\n", false_positives);
+  s += string_printf ("false-positive-rate %.5f;\n", false_positive_rate());
+  s += string_printf ("filter-builds %" G_GUINT64_FORMAT ";\n", filter_builds);
+  s += string_printf ("filter-build-time %.3f;\n", filter_build_time);
+  s += string_printf ("filter-hashes %" G_GUINT64_FORMAT ";\n", filter_hashes);
+  s += string_printf ("filter-bytes %" G_GUINT64_FORMAT ";\n", filter_bytes);
+
+  return s;
+}
+
+void
+BDB::hash2file_stats (BDBHash2FileStats& stats)
+{
+  Lock lock (mutex);
+
+  stats = m_h2f_stats;
+  stats.filter_hashes = m_h2f_filter ? m_h2f_filter->size() : 0;
+  stats.filter_bytes = m_h2f_filter ? m_h2f_filter->bytes() : 0;
+}
+
 //----- AllRecordsIterator helper class: iterate over all database records -------
 
 AllRecordsIterator::AllRecordsIterator (Dbc* dbc) :
@@ -30,6 +30,25 @@ enum BDBTables
   BDB_TABLE_VARIABLES           = 13,
 };
 
+/* each table is stored in its own database within the environment; the
+ * trailing table byte is still part of each key, so records can be
+ * dumped/restored without knowing which database they came from */
+struct BDBTableInfo
+{
+  BDBTables     table;
+  const char   *db_name;
+  u_int32_t     page_size;      // 0: use Berkeley DB default page size
+  u_int32_t     flags;          // duplicate handling: DB_DUP, DB_DUPSORT
+};
+
+const std::vector<BDBTableInfo>& bdb_table_info();
+
+inline BDBTables
+bdb_key_table (const Dbt& key)
+{
+  return BDBTables (((char *) key.get_data()) [key.get_size() - 1]);
+}
+
 enum BDBError
 {
   BDB_ERROR_NONE = 0,
@@ -38,11 +57,29 @@ enum BDBError
   BDB_ERROR_NO_TRANS,
   BDB_ERROR_NOT_FOUND,
   BDB_ERROR_INTR,
-  BDB_ERROR_IO
+  BDB_ERROR_IO,
+  BDB_ERROR_DEADLOCK
+};
+
+/*
+ * durability of commits: BDB_COMMIT_SYNC flushes the log to disk on every commit; the
+ * bulk modes don't, so an OS crash can lose the last committed transactions - to
+ * allow bfsync recover to continue from a consistent state, the log is flushed after
+ * each transaction that modifies the journal
+ */
+enum BDBCommitMode
+{
+  BDB_COMMIT_SYNC,
+  BDB_COMMIT_WRITE_NOSYNC,    // write log on commit, but don't flush it to disk
+  BDB_COMMIT_NOSYNC           // keep log in memory on commit
 };
 
+/* how often a transaction that failed because of a deadlock is retried */
+const int BDB_MAX_TXN_RETRIES = 50;
+
 BDB *bdb_open (const std::string& path, int cache_size_mb, bool recover);
 bool bdb_need_recover (const std::string& path);
+bool bdb_upgrade_tables (const std::string& path, int cache_size_mb);
 
 class DataBuffer
 {
@@ -55,7 +92,9 @@ public:
   guint64     read_uint64();
   guint32     read_uint32();
   guint32     read_uint32_be();
+  guint64     read_varint();
   std::string read_string();
+  void        read_bytes (std::vector<char>& vec, size_t n);
   void        read_vec_zero (std::vector<char>& vec);
   std::string read_hash();
   size_t      remaining() const
@@ -77,6 +116,8 @@ public:
   void write_uint64 (guint64 i);
   void write_uint32 (guint32 i);
   void write_uint32_be (guint32 i);
+  void write_varint (guint64 i);
+  void write_bytes (const char *bytes, size_t n);
   void write_table (char table);
 
   char*
@@ -101,6 +142,54 @@ public:
   }
 };
 
+/*
+ * format of the data of inode and link records, stored as "record-format" variable
+ */
+enum BDBRecordFormat
+{
+  BDB_RECORD_FORMAT_FIXED   = 0,  // fixed size integers, hash as string (bfsync <= 0.3.7)
+  BDB_RECORD_FORMAT_COMPACT = 1   // varints, binary hash, fields with default values omitted
+};
+
+struct INodeRecord
+{
+  guint32       vmin, vmax;
+  guint32       uid, gid;
+  guint32       mode, type;
+  std::string   hash;
+  std::string   link;
+  guint64       size;
+  guint32       major, minor;
+  guint32       nlink;
+  guint32       ctime, ctime_ns;
+  guint32       mtime, mtime_ns;
+  guint32       new_file_number;
+
+  INodeRecord();
+  explicit INodeRecord (const INode& inode);
+
+  void  to_inode (INode& inode) const;
+
+  void  write (DataOutBuffer& dbuf, BDBRecordFormat format) const;
+  void  read (DataBuffer& dbuf, BDBRecordFormat format);
+
+  /* only decode vmin/vmax (dbuf is passed by value, so it is not advanced) */
+  static void read_versions (DataBuffer dbuf, BDBRecordFormat format, guint32& vmin, guint32& vmax);
+};
+
+struct LinkRecord
+{
+  guint32       vmin, vmax;
+  ID            inode_id;
+  std::string   name;
+
+  /* dir_id is the key of the link record: inode_id path prefix is stored relative to it */
+  void  write (DataOutBuffer& dbuf, const ID& dir_id, BDBRecordFormat format) const;
+  void  read (DataBuffer& dbuf, const ID& dir_id, BDBRecordFormat format);
+
+  static void read_versions (DataBuffer dbuf, BDBRecordFormat format, guint32& vmin, guint32& vmax);
+};
+
 struct HistoryEntry
 {
   int         version;
@@ -122,19 +211,164 @@ struct JournalEntry
   std::string   state;
 };
 
+/*
+ * BDBCacheStats: memory pool statistics of the environment (shared by all processes
+ * using the repository) and page counts per database
+ */
+struct BDBCacheStats
+{
+  struct DbStats
+  {
+    std::string name;
+    guint32     page_size;
+    guint64     db_pages;       // pages in database file
+    guint64     cache_hit;
+    guint64     cache_miss;
+    guint64     page_in;        // pages read into cache
+    guint64     page_create;    // pages created in cache
+  };
+
+  guint64     cache_bytes;
+  guint64     cache_hit;
+  guint64     cache_miss;
+  guint64     pages;
+  guint64     clean_pages;
+  guint64     dirty_pages;
+  guint64     evictions;
+  guint64     page_in;
+  guint64     page_out;
+
+  std::vector<DbStats> dbs;
+
+  double      hit_ratio() const;
+  guint64     working_set_bytes() const;
+  guint64     db_bytes() const;
+  int         recommended_cache_mb() const;
+  std::string to_string() const;
+};
+
+/*
+ * BDBLockStats: deadlock/retry counters of this process and lock statistics of the
+ * environment (shared by all processes using the repository)
+ */
+struct BDBLockStats
+{
+  guint64     deadlocks;          // transactions of this process aborted due to deadlock
+  guint64     retries;            // transactions of this process retried after deadlock
+  guint64     env_deadlocks;      // deadlocks resolved by the deadlock detector
+  guint64     env_lock_waits;     // lock requests that had to wait
+  guint64     env_lock_nowaits;   // lock requests granted without waiting
+
+  std::string to_string() const;
+};
+
+/*
+ * GenerationFile: counters in a file that is shared by all processes using the
+ * repository; a process that changes shared state increments them, the others
+ * compare them to the values they have seen to find out whether their cached
+ * state (hash2file filter, History) is still valid
+ */
+class GenerationFile
+{
+  int     fd;
+  size_t  n_counters;
+
+public:
+  GenerationFile();
+  ~GenerationFile();
+
+  bool    open (const std::string& filename, size_t n_counters);
+  void    close();
+  bool    read (std::vector<guint64>& counters);
+  bool    bump (const std::vector<guint64>& increments, std::vector<guint64>& old_counters);
+};
+
+/*
+ * BDBHash2FileStats: lookups of this process and the Bloom filter in front of the
+ * hash2file database (see BDB::load_hash2file)
+ */
+struct BDBHash2FileStats
+{
+  guint64     lookups;
+  guint64     filter_negatives;   // lookups answered by the filter, without db access
+  guint64     false_positives;    // filter: maybe present, db: not found
+  guint64     filter_builds;
+  double      filter_build_time;  // seconds, all builds
+  guint64     filter_hashes;      // hashes in current filter
+  guint64     filter_bytes;       // memory used by current filter
+
+  BDBHash2FileStats();
+
+  double      false_positive_rate() const;
+  std::string to_string() const;
+};
+
+/*
+ * BDBCompactStats: result of an online compaction (see BDBCompactor); fill is the
+ * fraction of the database file used by records (-1: not measured)
+ */
+struct BDBCompactStats
+{
+  struct DbStats
+  {
+    std::string name;
+    guint32     page_size;
+    guint64     pages_before;
+    guint64     pages_after;
+    double      fill_before;
+    double      fill_after;
+    guint64     pages_examined;
+    guint64     pages_freed;
+    guint64     pages_truncated;     // returned to the filesystem
+    guint64     levels_removed;
+    guint64     deadlocks;
+  };
+
+  std::vector<DbStats> dbs;
+  double               time;
+
+  std::string to_string() const;
+};
+
+class BDBBulkWriter;
+class VersionIndex;
+class HashFilter;
+
 class BDB
 {
   DbTxn   *transaction;
   DbEnv   *db_env;
-  Db      *db;
+  Db      *db_legacy;
   Db      *db_hash2file;
   Db      *db_seq;
   Db      *db_sql_export;
   DbSequence *new_file_number_seq;
 
+  std::vector<Db*> table_dbs;
+  bool     m_upgrade_mode;
+  bool     m_open_needs_upgrade;
+  BDBRecordFormat m_record_format;
+  bool     m_txn_deadlock;
+  bool     m_txn_journal;
+  BDBCommitMode m_commit_mode;
+  guint64  m_deadlock_count;
+  guint64  m_retry_count;
+
   std::map<ino_t, ID> new_id2ino_entries;
   History  m_history;
 
+  std::map<unsigned int, VersionIndex *> m_version_indexes;   // NULL: no index file
+
+  HashFilter *m_h2f_filter;         // NULL: not built (yet)
+  GenerationFile m_h2f_gen_file;    // <repo>/hash2file.gen
+  guint64     m_h2f_gen;            // generation the filter was built for
+  guint64     m_h2f_misses;         // misses without filter
+  bool        m_h2f_txn_modified;
+  BDBHash2FileStats m_h2f_stats;
+
+  GenerationFile m_history_gen_file;  // <repo>/history.gen
+  int         m_history_txn_changes;
+
   int      shm_id (const std::string& path);
 
   std::string  pid_filename;
@@ -149,14 +383,24 @@ class BDB
   int  del_pid();
 
   BDBError ret2error (int ret);
+  bool     init_record_format();
+
+  VersionIndex *find_version_index (unsigned int version);
+
+  bool     h2f_generation_bump();
+  bool     h2f_filter_update();
+  bool     h2f_filter_build();
+
+  bool     history_generation_bump();
 
 public:
-  Db*         get_db();
+  Db*         get_db (BDBTables table);
   Db*         get_db_hash2file();
   Db*         get_db_sql_export();
   DbEnv*      get_db_env();
   History*    history();
   std::string repo_id();
+  BDBRecordFormat record_format();
 
   BDB();
 
@@ -178,16 +422,29 @@ public:
   void  sync();
   bool  close (CloseFlags flags = CLOSE_NORMAL);
 
+  bool  open_needs_upgrade();
+  bool  upgrade_tables (const std::string& path, int cache_size_mb);
+
   BDBError  begin_transaction();
   BDBError  commit_transaction();
   BDBError  abort_transaction();
   DbTxn*    get_transaction();
 
-  void  store_link (const LinkPtr& link);
+  void      txn_check (int ret);
+  void      txn_check_read (int ret);
+  int       get_record (Db *db, DbTxn *txn, Dbt *key, Dbt *data);
+  bool      txn_deadlock();
+  bool      retry_backoff (int attempt);
+  BDBError  lock_stats (BDBLockStats& stats);
+
+  void      set_commit_mode (BDBCommitMode mode);
+  BDBError  checkpoint();
+
+  void  store_link (const LinkPtr& link, BDBBulkWriter *writer = NULL);
   void  delete_links (const ID& dir_id, const std::map<std::string, LinkVersionList>& links);
   void  load_links (std::vector<Link*>& links, const ID& id, guint32 version);
 
-  void  store_inode (const INode *inode);
+  void  store_inode (const INode *inode, BDBBulkWriter *writer = NULL);
   void  delete_inodes (const INodeVersionList& inodes);
   bool  load_inode (const ID& id, unsigned int version, INode *inode);
   void  add_changed_inode (const ID& id);
@@ -202,10 +459,13 @@ public:
   bool  load_history_entry (int version, HistoryEntry& entry);
   void  store_history_entry (int version, const HistoryEntry& entry);
   void  delete_history_entry (int version);
+  void  list_history_versions (unsigned int first_version, std::vector<unsigned int>& versions);
+  bool  history_generation (guint64& gen, guint64& reload_gen);
 
   unsigned int load_hash2file (const std::string& hash);
   void  store_hash2file (const std::string& hash, unsigned int file_number);
   void  delete_hash2file (const std::string& hash);
+  void  delete_hash2file_bin (const std::string& bin_hash);
 
   void  add_deleted_file (unsigned int file_number);
   std::vector<unsigned int>  load_deleted_files();
@@ -221,6 +481,7 @@ public:
   BDBError  clear_journal_entries();
 
   std::vector<std::string>  list_tags (unsigned int version);
+  void                      list_tagged_versions (const std::string& tag, std::vector<unsigned int>& versions);
   std::vector<std::string>  load_tag  (unsigned int version, const std::string& tag);
   BDBError                  add_tag (unsigned int version, const std::string& tag, const std::string& value);
   BDBError                  del_tag (unsigned int version, const std::string& tag, const std::string& value);
@@ -229,30 +490,138 @@ public:
   BDBError                  set_variable (const std::string& variable, const std::vector<std::string>& value);
 
   std::vector<char>& multi_data_buffer();
+
+  BDBError  put_multiple (BDBTables table, Dbt& multi_key_data);
+  BDBError  put_record (BDBTables table, const void *key, size_t key_size, const void *data, size_t data_size);
+
+  BDBError  cache_stats (BDBCacheStats& stats);
+  std::vector< std::pair<std::string, Db*> > all_dbs();
+  void      hash2file_stats (BDBHash2FileStats& stats);
+
+  VersionIndex *version_index (unsigned int version);
+  void          version_index_refresh();
+  std::string   version_index_filename (unsigned int version);
+};
+
+/*
+ * BDBBulkWriter: collects records for one table and writes them with a few bulk puts
+ * (DB_MULTIPLE_KEY) instead of one put per record; buffered records are not visible
+ * for reads before flush() was called; a record larger than the buffer is written
+ * with a single put
+ */
+class BDBBulkWriter
+{
+  BDB                      *bdb;
+  BDBTables                 table;
+  std::vector<char>         buffer;
+  Dbt                       multi_key_data;
+  DbMultipleKeyDataBuilder *builder;
+  size_t                    n_buffered;
+  size_t                    n_written;
+
+  void  reset();
+
+public:
+  BDBBulkWriter (BDB *bdb, BDBTables table);
+  ~BDBBulkWriter();
+
+  void    put (DataOutBuffer& kbuf, DataOutBuffer& dbuf);
+  void    put (const void *key, size_t key_size, const void *data, size_t data_size);
+  void    flush();
+  size_t  records_written() const;
+};
+
+/*
+ * BDBCompactor: online compaction of all databases with Db::compact
+ *
+ * each step() compacts a few thousand records at a time, each range in its own
+ * short transaction, until the time limit is reached; so compaction can run while
+ * the repository is in use, and continues where it stopped with the next step()
+ */
+class BDBCompactor
+{
+  BDB                  *bdb;
+  bool                  measure_fill;
+  std::vector< std::pair<std::string, Db*> > dbs;
+  size_t                db_index;
+  bool                  db_started;
+  std::vector<char>     next_key;     // start of the next range (empty: first key)
+  int                   m_conflicts;  // consecutive conflicts for next_key
+  BDBCompactStats       m_stats;
+
+  void      db_stat (Db *db, guint32& page_size, guint64& pages, double& fill);
+  BDBError  compact_range (bool& conflict);
+
+public:
+  BDBCompactor (BDB *bdb, bool measure_fill);
+
+  BDBError  step (double max_seconds);
+  bool      done() const;
+  int       conflicts() const;
+
+  const BDBCompactStats& stats() const;
 };
 
 class DbcPtr // cursor smart-wrapper: automatically closes cursor in destructor
 {
 public:
   Dbc *dbc;
-  enum Mode { READ, WRITE };
 
-  DbcPtr (BDB *bdb, Mode mode = READ)
+  /*
+   * READ      - read cursor, uses the current transaction (if any)
+   * WRITE     - write cursor, requires a transaction
+   * SNAPSHOT  - read cursor for long scans; without current transaction, it reads
+   *             from a snapshot (MVCC) transaction which neither blocks writers
+   *             nor is blocked by them
+   */
+  enum Mode { READ, WRITE, SNAPSHOT };
+
+private:
+  DbTxn *snapshot_txn;
+
+  void
+  init (BDB *bdb, Db *db, Mode mode)
   {
-    assert (bdb);
+    assert (bdb && db);
 
     DbTxn *txn = bdb->get_transaction();
     if (mode == WRITE)
       {
         g_assert (txn != NULL); // writing without transaction is a bad idea
       }
+    if (mode == SNAPSHOT && !txn)
+      {
+        int ret = bdb->get_db_env()->txn_begin (NULL, &snapshot_txn, DB_TXN_SNAPSHOT);
+        g_assert (ret == 0);
 
-    int ret = bdb->get_db()->cursor (txn, &dbc, 0);
+        txn = snapshot_txn;
+      }
+
+    int ret = db->cursor (txn, &dbc, 0);
     g_assert (ret == 0);
   }
+public:
+  DbcPtr (BDB *bdb, BDBTables table, Mode mode = READ) :
+    snapshot_txn (NULL)
+  {
+    assert (bdb);
+
+    init (bdb, bdb->get_db (table), mode);
+  }
+  DbcPtr (BDB *bdb, Db *db, Mode mode = READ) :
+    snapshot_txn (NULL)
+  {
+    init (bdb, db, mode);
+  }
   ~DbcPtr()
   {
     dbc->close();
+
+    if (snapshot_txn)
+      {
+        int ret = snapshot_txn->commit (0);   // read only: nothing to write
+        g_assert (ret == 0);
+      }
   }
   Dbc*
   operator->()
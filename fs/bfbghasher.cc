@@ -0,0 +1,335 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bfbghasher.hh"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+
+using std::string;
+using std::map;
+
+namespace BFSync
+{
+
+BackgroundHasher::Entry::Entry() :
+  writers (0),
+  generation (0),
+  queued (false),
+  have_hash (false),
+  size (0),
+  mtime (0),
+  mtime_ns (0)
+{
+}
+
+BackgroundHasher::BackgroundHasher() :
+  thread_running (false),
+  quit (false)
+{
+}
+
+static BackgroundHasher *instance = NULL;
+
+BackgroundHasher *
+BackgroundHasher::the()
+{
+  if (!instance)
+    instance = new BackgroundHasher();
+
+  return instance;
+}
+
+/*
+ * a writable handle for the file was opened: the file may change from now on
+ *
+ * returns the generation of the file if this is the only writer, 0 otherwise; a
+ * stream hash is only accepted by file_closed() if the generation didn't change
+ */
+unsigned int
+BackgroundHasher::file_opened (unsigned int file_number, const string& filename)
+{
+  Lock lock (mutex);
+
+  Entry& entry = entries[file_number];
+  entry.filename = filename;
+  entry.writers++;
+  entry.generation++;
+  entry.have_hash = false;
+
+  return entry.writers == 1 ? entry.generation : 0;
+}
+
+/*
+ * the last writable handle was closed: use the stream hash computed during the
+ * writes if it is valid, or queue file for hashing
+ */
+void
+BackgroundHasher::file_closed (unsigned int file_number, unsigned int generation,
+                               const string& stream_hash, guint64 stream_size)
+{
+  Lock lock (mutex);
+
+  map<unsigned int, Entry>::iterator ei = entries.find (file_number);
+  if (ei == entries.end() || ei->second.writers == 0)
+    return;
+
+  Entry& entry = ei->second;
+  entry.writers--;
+  if (entry.writers != 0)
+    return;
+
+  struct stat st;
+  if (generation && generation == entry.generation && !stream_hash.empty() &&
+      stat (entry.filename.c_str(), &st) == 0 && guint64 (st.st_size) == stream_size)
+    {
+      entry.have_hash = true;
+      entry.hash      = stream_hash;
+      entry.size      = st.st_size;
+      entry.mtime     = st.st_mtime;
+      entry.mtime_ns  = st.st_mtim.tv_nsec;
+
+      m_stream_hashes.add (1);
+    }
+  else
+    {
+      enqueue (file_number, entry);
+    }
+}
+
+/* the file was changed without a file handle (truncate) */
+void
+BackgroundHasher::file_changed (unsigned int file_number, const string& filename)
+{
+  Lock lock (mutex);
+
+  Entry& entry = entries[file_number];
+  entry.filename = filename;
+  entry.generation++;
+  entry.have_hash = false;
+  if (entry.writers == 0)
+    enqueue (file_number, entry);
+}
+
+void
+BackgroundHasher::enqueue (unsigned int file_number, Entry& entry)
+{
+  if (!entry.queued)
+    {
+      entry.queued = true;
+      queue.push_back (file_number);
+    }
+  if (!thread_running)
+    {
+      thread_running = true;
+      pthread_create (&thread, NULL, thread_start, this);
+    }
+  cond.broadcast();
+}
+
+/*
+ * returns the hash of the file if it is still valid (and forgets it, since the
+ * commit that asks for it turns the file into an object), or "" otherwise
+ */
+string
+BackgroundHasher::take_hash (unsigned int file_number)
+{
+  Lock lock (mutex);
+
+  map<unsigned int, Entry>::iterator ei = entries.find (file_number);
+  if (ei == entries.end())
+    return "";
+
+  Entry& entry = ei->second;
+  if (!entry.have_hash || entry.writers)
+    return "";
+
+  // check that the file is still the one that was hashed
+  struct stat st;
+  if (stat (entry.filename.c_str(), &st) != 0 || guint64 (st.st_size) != entry.size ||
+      st.st_mtime != entry.mtime || st.st_mtim.tv_nsec != entry.mtime_ns)
+    return "";
+
+  string hash = entry.hash;
+  if (!entry.queued)
+    entries.erase (ei);
+
+  m_hashes_used.add (1);
+  return hash;
+}
+
+/*
+ * forgets entries whose data file no longer exists (the file was deleted, or
+ * was turned into an object by a commit that didn't take the hash)
+ *
+ * returns the number of entries removed
+ */
+size_t
+BackgroundHasher::prune()
+{
+  Lock lock (mutex);
+
+  size_t removed = 0;
+  map<unsigned int, Entry>::iterator ei = entries.begin();
+  while (ei != entries.end())
+    {
+      const Entry& entry = ei->second;
+
+      struct stat st;
+      if (!entry.writers && !entry.queued && stat (entry.filename.c_str(), &st) != 0 && errno == ENOENT)
+        {
+          entries.erase (ei++);
+          removed++;
+        }
+      else
+        {
+          ei++;
+        }
+    }
+  return removed;
+}
+
+void
+BackgroundHasher::stop()
+{
+  {
+    Lock lock (mutex);
+    if (!thread_running)
+      return;
+
+    quit = true;
+    cond.broadcast();
+  }
+  pthread_join (thread, NULL);
+
+  Lock lock (mutex);
+  thread_running = false;
+}
+
+void *
+BackgroundHasher::thread_start (void *arg)
+{
+  BackgroundHasher *hasher = static_cast<BackgroundHasher *> (arg);
+  hasher->thread_run();
+  return NULL;
+}
+
+void
+BackgroundHasher::thread_run()
+{
+  // hashing must not slow down filesystem operations
+  setpriority (PRIO_PROCESS, syscall (SYS_gettid), 19);
+
+  Lock lock (mutex);
+
+  while (!quit)
+    {
+      if (queue.empty())
+        {
+          cond.wait (mutex);
+          continue;
+        }
+      unsigned int file_number = queue.front();
+      queue.pop_front();
+
+      map<unsigned int, Entry>::iterator ei = entries.find (file_number);
+      if (ei == entries.end())
+        continue;
+
+      ei->second.queued = false;
+      if (ei->second.writers || ei->second.have_hash)   // opened again, or stream hash available
+        continue;
+
+      const string       filename   = ei->second.filename;
+      const unsigned int generation = ei->second.generation;
+
+      mutex.unlock();
+
+      // the file must not change while we hash it: compare stat before and after
+      struct stat st_before, st_after;
+      FileHashResult result;
+
+      guint64 start_ns = stats_time_ns();
+      bool ok = stat (filename.c_str(), &st_before) == 0 &&
+                FileHasher::hash_file (filename, result) &&
+                stat (filename.c_str(), &st_after) == 0 &&
+                st_before.st_size == st_after.st_size &&
+                st_before.st_mtime == st_after.st_mtime &&
+                st_before.st_mtim.tv_nsec == st_after.st_mtim.tv_nsec &&
+                guint64 (st_after.st_size) == result.size;
+
+      m_files_hashed.add (1);
+      m_bytes_hashed.add (result.size);
+      m_hash_time_ns.add (stats_time_ns() - start_ns);
+
+      mutex.lock();
+
+      // entry may have been erased or changed meanwhile
+      ei = entries.find (file_number);
+      if (ok && ei != entries.end() && ei->second.generation == generation && ei->second.writers == 0)
+        {
+          Entry& entry = ei->second;
+
+          entry.have_hash = true;
+          entry.hash      = result.hash;
+          entry.size      = st_after.st_size;
+          entry.mtime     = st_after.st_mtime;
+          entry.mtime_ns  = st_after.st_mtim.tv_nsec;
+        }
+    }
+}
+
+size_t
+BackgroundHasher::queue_size()
+{
+  Lock lock (mutex);
+  return queue.size();
+}
+
+size_t
+BackgroundHasher::hash_count()
+{
+  Lock lock (mutex);
+
+  size_t count = 0;
+  for (map<unsigned int, Entry>::const_iterator ei = entries.begin(); ei != entries.end(); ei++)
+    {
+      if (ei->second.have_hash)
+        count++;
+    }
+  return count;
+}
+
+guint64
+BackgroundHasher::files_hashed() const
+{
+  return m_files_hashed.value();
+}
+
+guint64
+BackgroundHasher::bytes_hashed() const
+{
+  return m_bytes_hashed.value();
+}
+
+guint64
+BackgroundHasher::hash_time_ns() const
+{
+  return m_hash_time_ns.value();
+}
+
+guint64
+BackgroundHasher::hashes_used() const
+{
+  return m_hashes_used.value();
+}
+
+guint64
+BackgroundHasher::stream_hashes() const
+{
+  return m_stream_hashes.value();
+}
+
+}
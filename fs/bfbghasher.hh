@@ -0,0 +1,86 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_BG_HASHER_HH
+#define BFSYNC_BG_HASHER_HH
+
+#include "bffilehasher.hh"
+
+#include <map>
+
+namespace BFSync
+{
+
+/*
+ * BackgroundHasher: hashes new files in bfsyncfs after they are closed
+ *
+ * when the last writable handle of a new file is released, the file is queued
+ * and hashed by a low priority thread; the hash is recorded together with size
+ * and mtime of the file. Opening the file for writing (or truncating it) again
+ * invalidates the hash. If a file was written sequentially by a single handle,
+ * the hash computed during the writes (StreamHasher) is used and the file is
+ * not read again. bfsync commit asks for the hashes via the "bg-hashes"
+ * server command, and only hashes files for which no valid hash is known.
+ * Entries of files that were deleted or committed without using the hash are
+ * removed by prune() once the data file is gone.
+ */
+class BackgroundHasher
+{
+  struct Entry
+  {
+    std::string   filename;
+    unsigned int  writers;      // number of open writable handles
+    unsigned int  generation;   // incremented on each change, to detect changes while hashing
+    bool          queued;
+
+    bool          have_hash;
+    std::string   hash;
+    guint64       size;
+    time_t        mtime;
+    long          mtime_ns;
+
+    Entry();
+  };
+
+  Mutex                             mutex;
+  Cond                              cond;
+  std::map<unsigned int, Entry>     entries;      // new_file_number -> entry
+  std::deque<unsigned int>          queue;
+  bool                              thread_running;
+  bool                              quit;
+  pthread_t                         thread;
+
+  StatsCounter                      m_files_hashed;
+  StatsCounter                      m_bytes_hashed;
+  StatsCounter                      m_hash_time_ns;
+  StatsCounter                      m_hashes_used;
+  StatsCounter                      m_stream_hashes;
+
+  static void *thread_start (void *arg);
+  void         thread_run();
+  void         enqueue (unsigned int file_number, Entry& entry);
+
+public:
+  BackgroundHasher();
+
+  static BackgroundHasher *the();
+
+  unsigned int  file_opened (unsigned int file_number, const std::string& filename);
+  void          file_closed (unsigned int file_number, unsigned int generation = 0,
+                             const std::string& stream_hash = "", guint64 stream_size = 0);
+  void          file_changed (unsigned int file_number, const std::string& filename);
+  std::string   take_hash (unsigned int file_number);
+  size_t        prune();
+  void          stop();
+
+  size_t        queue_size();
+  size_t        hash_count();
+  guint64       files_hashed() const;
+  guint64       bytes_hashed() const;
+  guint64       hash_time_ns() const;
+  guint64       hashes_used() const;
+  guint64       stream_hashes() const;
+};
+
+}
+
+#endif /* BFSYNC_BG_HASHER_HH */
@@ -69,16 +69,8 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  Db *db = bdb->get_db();
   Dbc *dbcp;
-
-  /* Acquire a cursor for the database. */
   int ret;
-  if ((ret = db->cursor (NULL, &dbcp, 0)) != 0)
-    {
-      db->err (ret, "DB->cursor");
-      return 1;
-    }
 
   vector<string> links, inodes, id2ino, ino2id, history, changed_inodes, changed_inodes_rev,
                  new_file_number, deleted_files, temp_files, journal, variables;
@@ -89,143 +81,156 @@ main (int argc, char **argv)
   size_t inode_total = 0;
   size_t inode_total_keysize = 0;
   size_t inode_total_datasize = 0;
+  size_t inode_fixed_datasize = 0;
+  size_t inode_compact_datasize = 0;
 
   size_t link_total = 0;
   size_t link_total_keysize = 0;
   size_t link_total_datasize = 0;
+  size_t link_fixed_datasize = 0;
+  size_t link_compact_datasize = 0;
 
-  AllRecordsIterator ari (dbcp);
-
-  while (ari.next (key, data))
+  const vector<BDBTableInfo>& table_info = bdb_table_info();
+  for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
     {
-      DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-      DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
-
-      char table = ((char *) key.get_data()) [key.get_size() - 1];
-      if (table == BDB_TABLE_INODES)
-        {
-          ID  id (kbuffer);
-
-          unsigned int vmin = dbuffer.read_uint32();
-          unsigned int vmax = dbuffer.read_uint32();
-          int uid = dbuffer.read_uint32();
-          int gid = dbuffer.read_uint32();
-          int mode = dbuffer.read_uint32();
-          int type = dbuffer.read_uint32();
-          string hash = dbuffer.read_string();
-          string link = dbuffer.read_string();
-          guint64 size = dbuffer.read_uint64();
-          int major = dbuffer.read_uint32();
-          int minor = dbuffer.read_uint32();
-          int nlink = dbuffer.read_uint32();
-          int ctime = dbuffer.read_uint32();
-          int ctime_ns = dbuffer.read_uint32();
-          int mtime = dbuffer.read_uint32();
-          int mtime_ns = dbuffer.read_uint32();
-          unsigned int new_file_number = dbuffer.read_uint32();
-
-          inode_total_keysize += key.get_size();
-          inode_total_datasize += data.get_size();
-          inode_total++;
-
-          add ("inode", inodes, string_printf ("%s=%u|%s|%d|%d|%o|%d|%s|%s|%" G_GUINT64_FORMAT "|%d|%d|%d|%d|%d|%d|%d|%u",
-                 id.pretty_str().c_str(), vmin, VMSTR (vmax), uid, gid, mode, type, hash.c_str(), link.c_str(),
-                 size, major, minor, nlink, ctime, ctime_ns, mtime, mtime_ns, new_file_number));
-        }
-      else if (table == BDB_TABLE_LINKS)
-        {
-          ID  id (kbuffer);
-
-          unsigned int vmin = dbuffer.read_uint32();
-          unsigned int vmax = dbuffer.read_uint32();
-          ID  inode_id (dbuffer);
-          string name = dbuffer.read_string();
-
-          link_total_keysize += key.get_size();
-          link_total_datasize += data.get_size();
-          link_total++;
-
-          add ("link", links, string_printf ("%s=%u|%s|%s|%s",
-                 id.pretty_str().c_str(), vmin, VMSTR (vmax), inode_id.pretty_str().c_str(), name.c_str()));
-        }
-      else if (table == BDB_TABLE_LOCAL_ID2INO)
-        {
-          ID  id (kbuffer);
-          int ino = dbuffer.read_uint32();
-
-          add ("id2ino", id2ino, string_printf ("%s=%d", id.pretty_str().c_str(), ino));
-        }
-      else if (table == BDB_TABLE_LOCAL_INO2ID)
-        {
-          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-
-          int ino = kbuffer.read_uint32_be();
-          ID  id (dbuffer);
+      Db *db = bdb->get_db (ti->table);
 
-          add ("ino2id", ino2id, string_printf ("%d=%s", ino, id.pretty_str().c_str()));
-        }
-      else if (table == BDB_TABLE_HISTORY)
+      /* Acquire a cursor for the table database. */
+      if ((ret = db->cursor (NULL, &dbcp, 0)) != 0)
         {
-          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-          int version = kbuffer.read_uint32_be();
-          HistoryEntry he;
-          bdb->load_history_entry (version, he);
-          add ("history", history, string_printf ("%d=%s|%s|%s|%d", version,
-                 he.hash.c_str(), he.author.c_str(), he.message.c_str(), he.time));
+          db->err (ret, "DB->cursor");
+          return 1;
         }
-      else if (table == BDB_TABLE_CHANGED_INODES)
-        {
-          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
 
-          ID  id (dbuffer);
+      AllRecordsIterator ari (dbcp);
 
-          add ("changed_inode", changed_inodes, string_printf ("%s", id.pretty_str().c_str()));
-         }
-      else if (table == BDB_TABLE_CHANGED_INODES_REV)
+      while (ari.next (key, data))
         {
           DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-
-          ID  id (kbuffer);
-
-          add ("changed_inode_rev", changed_inodes_rev, string_printf ("%s", id.pretty_str().c_str()));
-         }
-      else if (table == BDB_TABLE_NEW_FILE_NUMBER)
-        {
-          unsigned int n = dbuffer.read_uint32();
-
-          add ("new_file_number", new_file_number, string_printf ("%u", n));
-         }
-      else if (table == BDB_TABLE_DELETED_FILES)
-        {
-          unsigned int n = dbuffer.read_uint32();
-
-          add ("deleted_files", deleted_files, string_printf ("%u", n));
-         }
-      else if (table == BDB_TABLE_TEMP_FILES)
-        {
-          string name = dbuffer.read_string();
-          unsigned int pid = dbuffer.read_uint32();
-
-          add ("temp_files", temp_files, string_printf ("%s|%u", name.c_str(), pid));
-        }
-      else if (table == BDB_TABLE_JOURNAL)
-        {
-          string operation = dbuffer.read_string();
-          string state = dbuffer.read_string();
-
-          add ("journal", journal, string_printf ("%s|%s", operation.c_str(), state.c_str()));
-        }
-      else if (table == BDB_TABLE_VARIABLES)
-        {
-          string variable = kbuffer.read_string();
-          string value = dbuffer.read_string();
-
-          add ("variables", variables, string_printf ("%s=%s", variable.c_str(), value.c_str()));
-        }
-      else
-        {
-          printf ("unknown record type %d\n", table);
+          DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+
+          char table = ((char *) key.get_data()) [key.get_size() - 1];
+          if (table == BDB_TABLE_INODES)
+            {
+              ID  id (kbuffer);
+
+              INodeRecord ir;
+              ir.read (dbuffer, bdb->record_format());
+
+              inode_total_keysize += key.get_size();
+              inode_total_datasize += data.get_size();
+              inode_total++;
+
+              DataOutBuffer fixed_buf, compact_buf;
+              ir.write (fixed_buf, BDB_RECORD_FORMAT_FIXED);
+              ir.write (compact_buf, BDB_RECORD_FORMAT_COMPACT);
+              inode_fixed_datasize += fixed_buf.size();
+              inode_compact_datasize += compact_buf.size();
+
+              add ("inode", inodes, string_printf ("%s=%u|%s|%d|%d|%o|%d|%s|%s|%" G_GUINT64_FORMAT "|%d|%d|%d|%d|%d|%d|%d|%u",
+                     id.pretty_str().c_str(), ir.vmin, VMSTR (ir.vmax), ir.uid, ir.gid, ir.mode, ir.type, ir.hash.c_str(), ir.link.c_str(),
+                     ir.size, ir.major, ir.minor, ir.nlink, ir.ctime, ir.ctime_ns, ir.mtime, ir.mtime_ns, ir.new_file_number));
+            }
+          else if (table == BDB_TABLE_LINKS)
+            {
+              ID  id (kbuffer);
+
+              LinkRecord lr;
+              lr.read (dbuffer, id, bdb->record_format());
+
+              link_total_keysize += key.get_size();
+              link_total_datasize += data.get_size();
+              link_total++;
+
+              DataOutBuffer fixed_buf, compact_buf;
+              lr.write (fixed_buf, id, BDB_RECORD_FORMAT_FIXED);
+              lr.write (compact_buf, id, BDB_RECORD_FORMAT_COMPACT);
+              link_fixed_datasize += fixed_buf.size();
+              link_compact_datasize += compact_buf.size();
+
+              add ("link", links, string_printf ("%s=%u|%s|%s|%s",
+                     id.pretty_str().c_str(), lr.vmin, VMSTR (lr.vmax), lr.inode_id.pretty_str().c_str(), lr.name.c_str()));
+            }
+          else if (table == BDB_TABLE_LOCAL_ID2INO)
+            {
+              ID  id (kbuffer);
+              int ino = dbuffer.read_uint32();
+
+              add ("id2ino", id2ino, string_printf ("%s=%d", id.pretty_str().c_str(), ino));
+            }
+          else if (table == BDB_TABLE_LOCAL_INO2ID)
+            {
+              DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+
+              int ino = kbuffer.read_uint32_be();
+              ID  id (dbuffer);
+
+              add ("ino2id", ino2id, string_printf ("%d=%s", ino, id.pretty_str().c_str()));
+            }
+          else if (table == BDB_TABLE_HISTORY)
+            {
+              DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+              int version = kbuffer.read_uint32_be();
+              HistoryEntry he;
+              bdb->load_history_entry (version, he);
+              add ("history", history, string_printf ("%d=%s|%s|%s|%d", version,
+                     he.hash.c_str(), he.author.c_str(), he.message.c_str(), he.time));
+            }
+          else if (table == BDB_TABLE_CHANGED_INODES)
+            {
+              DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+
+              ID  id (dbuffer);
+
+              add ("changed_inode", changed_inodes, string_printf ("%s", id.pretty_str().c_str()));
+             }
+          else if (table == BDB_TABLE_CHANGED_INODES_REV)
+            {
+              DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+
+              ID  id (kbuffer);
+
+              add ("changed_inode_rev", changed_inodes_rev, string_printf ("%s", id.pretty_str().c_str()));
+             }
+          else if (table == BDB_TABLE_NEW_FILE_NUMBER)
+            {
+              unsigned int n = dbuffer.read_uint32();
+
+              add ("new_file_number", new_file_number, string_printf ("%u", n));
+             }
+          else if (table == BDB_TABLE_DELETED_FILES)
+            {
+              unsigned int n = dbuffer.read_uint32();
+
+              add ("deleted_files", deleted_files, string_printf ("%u", n));
+             }
+          else if (table == BDB_TABLE_TEMP_FILES)
+            {
+              string name = dbuffer.read_string();
+              unsigned int pid = dbuffer.read_uint32();
+
+              add ("temp_files", temp_files, string_printf ("%s|%u", name.c_str(), pid));
+            }
+          else if (table == BDB_TABLE_JOURNAL)
+            {
+              string operation = dbuffer.read_string();
+              string state = dbuffer.read_string();
+
+              add ("journal", journal, string_printf ("%s|%s", operation.c_str(), state.c_str()));
+            }
+          else if (table == BDB_TABLE_VARIABLES)
+            {
+              string variable = kbuffer.read_string();
+              string value = dbuffer.read_string();
+
+              add ("variables", variables, string_printf ("%s=%s", variable.c_str(), value.c_str()));
+            }
+          else
+            {
+              printf ("unknown record type %d\n", table);
+            }
         }
+      dbcp->close();
     }
 
   print ("INodes", inodes);
@@ -271,11 +276,15 @@ main (int argc, char **argv)
   printf ("\n\n");
   printf ("INode Count:    %zd\n", inode_total);
   printf ("Avg INode Key:  %.2f\n", inode_total_keysize / double (inode_total));
-  printf ("Avg INode Data: %.2f\n", inode_total_datasize / double (inode_total));
+  printf ("Avg INode Data: %.2f (fixed format: %.2f, compact format: %.2f)\n", inode_total_datasize / double (inode_total),
+          inode_fixed_datasize / double (inode_total), inode_compact_datasize / double (inode_total));
   printf ("\n\n");
   printf ("Link Count:     %zd\n", link_total);
   printf ("Avg Link Key:   %.2f\n", link_total_keysize / double (link_total));
-  printf ("Avg Link Data:  %.2f\n", link_total_datasize / double (link_total));
+  printf ("Avg Link Data:  %.2f (fixed format: %.2f, compact format: %.2f)\n", link_total_datasize / double (link_total),
+          link_fixed_datasize / double (link_total), link_compact_datasize / double (link_total));
+  printf ("\n\n");
+  printf ("Record Format:  %s\n", bdb->record_format() == BDB_RECORD_FORMAT_COMPACT ? "compact" : "fixed");
 
   if (!bdb->close())
     {
@@ -2,9 +2,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "bfbdb.hh"
 
+#include <deque>
+#include <algorithm>
+
 using namespace BFSync;
 using std::string;
 using std::vector;
@@ -62,8 +67,6 @@ dump_db (BDB *bdb, const string& dump_filename)
       return 1;
     }
 
-  DbcPtr dbc (bdb);
-
   Dbt key;
   Dbt data;
   DataOutBuffer out;
@@ -73,39 +76,47 @@ dump_db (BDB *bdb, const string& dump_filename)
 
   dump_update_status (0);
 
-  int ret = dbc->get (&key, &data, DB_FIRST);
-  while (ret == 0)
+  /* dump all tables; the table is stored as last byte of each key, so restore can put the
+   * records into the right table database */
+  const vector<BDBTableInfo>& table_info = bdb_table_info();
+  for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
     {
-      out.clear();
-      out.write_uint32 (key.get_size());
-      out.write_uint32 (data.get_size());
+      DbcPtr dbc (bdb, ti->table);
 
-      if (!dump_write (out.begin(), out.size(), dump_file))
-        return 1;
+      int ret = dbc->get (&key, &data, DB_FIRST);
+      while (ret == 0)
+        {
+          out.clear();
+          out.write_uint32 (key.get_size());
+          out.write_uint32 (data.get_size());
 
-      g_checksum_update (sum, (guchar *) out.begin(), out.size());
+          if (!dump_write (out.begin(), out.size(), dump_file))
+            return 1;
 
-      if (!dump_write (key.get_data(), key.get_size(), dump_file))
-        return 1;
+          g_checksum_update (sum, (guchar *) out.begin(), out.size());
 
-      g_checksum_update (sum, (guchar *) key.get_data(), key.get_size());
+          if (!dump_write (key.get_data(), key.get_size(), dump_file))
+            return 1;
 
-      if (!dump_write (data.get_data(), data.get_size(), dump_file))
-        return 1;
+          g_checksum_update (sum, (guchar *) key.get_data(), key.get_size());
 
-      g_checksum_update (sum, (guchar *) data.get_data(), data.get_size());
+          if (!dump_write (data.get_data(), data.get_size(), dump_file))
+            return 1;
 
-      n_records++;
+          g_checksum_update (sum, (guchar *) data.get_data(), data.get_size());
 
-      if (output_needs_update())
-        dump_update_status (n_records);
+          n_records++;
 
-      if (signal_received)
-        {
-          printf ("\nTerminated during dump.\n");
-          return 1;
+          if (output_needs_update())
+            dump_update_status (n_records);
+
+          if (signal_received)
+            {
+              printf ("\nTerminated during dump.\n");
+              return 1;
+            }
+          ret = dbc->get (&key, &data, DB_NEXT);
         }
-      ret = dbc->get (&key, &data, DB_NEXT);
     }
   dump_update_status (n_records);
 
@@ -151,32 +162,221 @@ verify_update_status (int n_records)
   fflush (stdout);
 }
 
+void
+restore_update_status (int n_records)
+{
+  printf ("\rRestoring dump:   %d records ... ", n_records);
+  fflush (stdout);
+}
+
+/*
+ * DumpReader: reads the dump file in large blocks on a separate thread, which also
+ * computes the checksum, so the restore thread only decodes and inserts records
+ */
+static const size_t DUMP_BLOCK_SIZE = 4 * 1024 * 1024;
+static const size_t DUMP_MAX_BLOCKS = 4;       // read ahead
+
+class DumpReader
+{
+  FILE                      *file;
+  guint64                    file_size;
+  pthread_t                  thread;
+  bool                       thread_running;
+
+  Mutex                      mutex;
+  Cond                       cond;
+  std::deque<vector<char> *> blocks;
+  bool                       eof;
+  bool                       error;
+  bool                       stop;
+
+  vector<guint8>             sha1;          // computed by reader thread
+  vector<guint8>             dump_sha1;     // stored at the end of the dump
+
+  vector<char>              *block;         // used by restore thread
+  size_t                     block_pos;
+
+  static void *thread_start (void *arg);
+  void         run();
+
+public:
+  DumpReader();
+  ~DumpReader();
+
+  bool open (const string& dump_filename);
+  bool read (void *ptr, size_t size);
+  bool checksum_ok();
+};
+
+DumpReader::DumpReader() :
+  file (NULL),
+  file_size (0),
+  thread_running (false),
+  eof (false),
+  error (false),
+  stop (false),
+  block (NULL),
+  block_pos (0)
+{
+}
+
+DumpReader::~DumpReader()
+{
+  if (thread_running)
+    {
+      mutex.lock();
+      stop = true;
+      cond.broadcast();
+      mutex.unlock();
+
+      pthread_join (thread, NULL);
+    }
+  for (std::deque<vector<char> *>::iterator bi = blocks.begin(); bi != blocks.end(); bi++)
+    delete *bi;
+  delete block;
+
+  if (file)
+    fclose (file);
+}
+
 bool
-verify_read (void *ptr, size_t size, FILE *file)
+DumpReader::open (const string& dump_filename)
 {
-  size_t result = fread (ptr, size, 1, file);
-  if (result == 1)
+  file = fopen (dump_filename.c_str(), "r");
+  if (!file)
     {
-      return true;
+      printf ("Dump: can't open file '%s' for reading.\n", dump_filename.c_str());
+      return false;
     }
-  else
+
+  struct stat st;
+  if (fstat (fileno (file), &st) != 0 || st.st_size < 20)
     {
-      printf ("\nVerify: error reading data from dump file.\n");
+      printf ("Dump: file '%s' is too short.\n", dump_filename.c_str());
       return false;
     }
+  file_size = st.st_size;
+
+  pthread_create (&thread, NULL, thread_start, this);
+  thread_running = true;
+  return true;
 }
 
-int
-verify_dump (const string& dump_filename)
+void*
+DumpReader::thread_start (void *arg)
 {
-  FILE *file = fopen (dump_filename.c_str(), "r");
-  if (!file)
+  DumpReader *instance = static_cast<DumpReader *> (arg);
+  instance->run();
+  return NULL;
+}
+
+/* reader thread: everything before the trailing sha1 sum is passed to the restore thread */
+void
+DumpReader::run()
+{
+  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+
+  guint64 data_size = file_size - 20;
+  guint64 pos = 0;
+  bool    read_error = false;
+
+  while (pos < data_size)
     {
-      printf ("Verify: can't open file '%s' for reading.\n", dump_filename.c_str());
-      return 1;
+      vector<char> *new_block = new vector<char> (std::min<guint64> (DUMP_BLOCK_SIZE, data_size - pos));
+      if (fread (&(*new_block)[0], new_block->size(), 1, file) != 1)
+        {
+          delete new_block;
+          read_error = true;
+          break;
+        }
+      g_checksum_update (sum, (guchar *) &(*new_block)[0], new_block->size());
+      pos += new_block->size();
+
+      Lock lock (mutex);
+      while (blocks.size() >= DUMP_MAX_BLOCKS && !stop)
+        cond.wait (mutex);
+
+      if (stop)
+        {
+          delete new_block;
+          break;
+        }
+      blocks.push_back (new_block);
+      cond.broadcast();
     }
 
-  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+  vector<guint8> file_sha1 (20);
+  if (!read_error && pos == data_size && fread (&file_sha1[0], file_sha1.size(), 1, file) != 1)
+    read_error = true;
+
+  vector<guint8> computed_sha1 (g_checksum_type_get_length (G_CHECKSUM_SHA1));
+  gsize digest_len = computed_sha1.size();
+  g_checksum_get_digest (sum, &computed_sha1[0], &digest_len);
+  g_checksum_free (sum);
+
+  Lock lock (mutex);
+  sha1 = computed_sha1;
+  dump_sha1 = file_sha1;
+  error = read_error;
+  eof = true;
+  cond.broadcast();
+}
+
+/* restore thread: read size bytes from the dump */
+bool
+DumpReader::read (void *ptr, size_t size)
+{
+  char *out = (char *) ptr;
+
+  while (size)
+    {
+      if (!block || block_pos == block->size())
+        {
+          delete block;
+          block = NULL;
+          block_pos = 0;
+
+          Lock lock (mutex);
+          while (blocks.empty() && !eof)
+            cond.wait (mutex);
+
+          if (blocks.empty())
+            {
+              printf ("\nDump: error reading data from dump file.\n");
+              return false;
+            }
+          block = blocks.front();
+          blocks.pop_front();
+          cond.broadcast();
+        }
+      size_t n = std::min (size, block->size() - block_pos);
+      memcpy (out, &(*block)[block_pos], n);
+
+      out += n;
+      block_pos += n;
+      size -= n;
+    }
+  return true;
+}
+
+/* waits for the reader thread: the whole file must have been read, and the sum must match */
+bool
+DumpReader::checksum_ok()
+{
+  Lock lock (mutex);
+  while (!eof)
+    cond.wait (mutex);
+
+  return !error && blocks.empty() && (!block || block_pos == block->size()) && sha1 == dump_sha1;
+}
+
+int
+verify_dump (const string& dump_filename)
+{
+  DumpReader reader;
+
+  if (!reader.open (dump_filename))
+    return 1;
 
   int n_records = 0;
 
@@ -184,13 +384,12 @@ verify_dump (const string& dump_filename)
 
   const int HEADER_SIZE = 8;
   char header[HEADER_SIZE];
-  while (!feof (file))
+  vector<char> data;
+  while (1)
     {
-      if (!verify_read (header, HEADER_SIZE, file))
+      if (!reader.read (header, HEADER_SIZE))
         return 1;
 
-      g_checksum_update (sum, (guchar *) header, HEADER_SIZE);
-
       DataBuffer hbuf (header, HEADER_SIZE);
       size_t klen = hbuf.read_uint32();
       size_t dlen = hbuf.read_uint32();
@@ -205,13 +404,10 @@ verify_dump (const string& dump_filename)
       if (output_needs_update())
         verify_update_status (n_records);
 
-      guchar data[klen + dlen];
-
-      if (!verify_read (&data, klen + dlen, file))
+      data.resize (klen + dlen);
+      if (!reader.read (&data[0], klen + dlen))
         return 1;
 
-      g_checksum_update (sum, data, klen + dlen);
-
       if (signal_received)
         {
           printf ("\nTerminated during verify.\n");
@@ -221,20 +417,7 @@ verify_dump (const string& dump_filename)
 
   verify_update_status (n_records);
 
-  vector<guint8> dump_sha1 (g_checksum_type_get_length (G_CHECKSUM_SHA1));
-  vector<guint8> sha1 (g_checksum_type_get_length (G_CHECKSUM_SHA1));
-
-  gsize digest_len = dump_sha1.size();
-  g_checksum_get_digest (sum, &sha1[0], &digest_len);
-
-  if (!verify_read (&dump_sha1[0], dump_sha1.size(), file))
-    return 1;
-
-  fclose (file);
-
-  assert (sha1.size() == dump_sha1.size());
-
-  if (sha1 == dump_sha1)
+  if (reader.checksum_ok())
     {
       printf ("ok.\n");
       return 0;
@@ -246,53 +429,39 @@ verify_dump (const string& dump_filename)
     }
 }
 
-void
-restore_update_status (int n_records)
-{
-  printf ("\rRestoring dump:   %d records ... ", n_records);
-  fflush (stdout);
-}
-
-bool
-restore_read (void *ptr, size_t size, FILE *file)
-{
-  size_t result = fread (ptr, size, 1, file);
-  if (result == 1)
-    {
-      return true;
-    }
-  else
-    {
-      printf ("\nRestore: error reading data from dump file.\n");
-      return false;
-    }
-}
-
-
+/*
+ * the dump contains the records of each table in key order (dump_db uses a cursor
+ * for each table), so the records can be written with bulk puts (DB_MULTIPLE_KEY),
+ * which fill the btree pages sequentially
+ */
 int
 restore_db (BDB *bdb, const string& dump_filename)
 {
-  FILE *file = fopen (dump_filename.c_str(), "r");
-  if (!file)
-    {
-      printf ("Restore: can't open file '%s' for reading.\n", dump_filename.c_str());
-      return 1;
-    }
+  DumpReader reader;
 
-  Db *db = bdb->get_db();
+  if (!reader.open (dump_filename))
+    return 1;
 
   int n_records = 0;
   int OPS = 0;
 
   restore_update_status (0);
 
+  /* the dump file can be restored again if the restore fails, so log records don't need to be synced */
+  bdb->set_commit_mode (BDB_COMMIT_NOSYNC);
   bdb->begin_transaction();
 
+  // the new database got a default record format on open; the dump contains the right one
+  bdb->set_variable ("record-format", vector<string>());
+
+  vector<BDBBulkWriter *> writers (BDB_TABLE_VARIABLES + 1);
+  vector<char> dump_data;
+
   const int HEADER_SIZE = 8;
   char header[HEADER_SIZE];
-  while (!feof (file))
+  while (1)
     {
-      if (!restore_read (header, HEADER_SIZE, file))
+      if (!reader.read (header, HEADER_SIZE))
         return 1;
 
       DataBuffer hbuf (header, HEADER_SIZE);
@@ -304,22 +473,42 @@ restore_db (BDB *bdb, const string& dump_filename)
           break;
         }
 
-      guchar dump_data[klen + dlen];
-      if (!restore_read (&dump_data, klen + dlen, file))
+      dump_data.resize (klen + dlen);
+      if (!reader.read (&dump_data[0], klen + dlen))
         return 1;
 
-      Dbt key (dump_data, klen);
-      Dbt data (dump_data + klen, dlen);
+      Dbt key (&dump_data[0], klen);
+      BDBTables table = bdb_key_table (key);
+
+      if (klen + dlen < 64 * 1024)
+        {
+          if (!writers[table])
+            writers[table] = new BDBBulkWriter (bdb, table);
+
+          writers[table]->put (&dump_data[0], klen, &dump_data[klen], dlen);
+        }
+      else
+        {
+          /* large record: keep the order of records with the same key */
+          if (writers[table])
+            writers[table]->flush();
 
-      int ret = db->put (bdb->get_transaction(), &key, &data, 0);
-      assert (ret == 0);
+          Dbt data (&dump_data[klen], dlen);
+
+          int ret = bdb->get_db (table)->put (bdb->get_transaction(), &key, &data, 0);
+          assert (ret == 0);
+        }
 
       n_records++;
       OPS++;
 
-      if (OPS >= 20000)
+      if (OPS >= 100000)
         {
           /* keep number of locks limited by splitting transactions every once in a while */
+          for (size_t t = 0; t < writers.size(); t++)
+            if (writers[t])
+              writers[t]->flush();
+
           bdb->commit_transaction();
           bdb->begin_transaction();
           OPS = 0;
@@ -334,11 +523,32 @@ restore_db (BDB *bdb, const string& dump_filename)
           return 1;
         }
     }
-  fclose (file);
+  for (size_t t = 0; t < writers.size(); t++)
+    {
+      if (writers[t])
+        {
+          writers[t]->flush();
+          delete writers[t];
+        }
+    }
   bdb->commit_transaction();
 
   restore_update_status (n_records);
 
+  if (!reader.checksum_ok())
+    {
+      printf ("\nRestore: checksum of dump file is wrong.\n");
+      return 1;
+    }
+
+  /* make everything durable before the dump file is removed */
+  if (bdb->checkpoint() != BDB_ERROR_NONE)
+    {
+      printf ("\nRestore: checkpoint failed.\n");
+      return 1;
+    }
+  bdb->set_commit_mode (BDB_COMMIT_SYNC);
+
   unlink (dump_filename.c_str());
 
   printf ("done.\n");
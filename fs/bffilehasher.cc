@@ -0,0 +1,246 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bffilehasher.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+
+using std::string;
+using std::vector;
+
+namespace BFSync
+{
+
+static const size_t HASH_READ_SIZE = 1024 * 1024;
+
+FileHashResult::FileHashResult() :
+  ok (false),
+  size (0)
+{
+}
+
+FileHasher::FileHasher (unsigned int n_threads) :
+  quit (false)
+{
+  if (n_threads == 0)
+    {
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n_threads = n_cpus > 0 ? n_cpus : 1;
+    }
+  threads.resize (n_threads);
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_create (&threads[i], NULL, thread_start, this);
+}
+
+FileHasher::~FileHasher()
+{
+  {
+    Lock lock (mutex);
+    quit = true;
+    cond.broadcast();
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+    pthread_join (threads[i], NULL);
+
+  // jobs that were not started or whose result was not returned
+  for (size_t i = 0; i < jobs.size(); i++)
+    delete jobs[i];
+}
+
+void *
+FileHasher::thread_start (void *arg)
+{
+  FileHasher *hasher = static_cast<FileHasher *> (arg);
+  hasher->thread_run();
+  return NULL;
+}
+
+void
+FileHasher::thread_run()
+{
+  Lock lock (mutex);
+
+  while (!quit)
+    {
+      if (todo_jobs.empty())
+        {
+          cond.wait (mutex);
+          continue;
+        }
+      Job *job = todo_jobs.front();
+      todo_jobs.pop_front();
+
+      mutex.unlock();
+      hash_file (job->result.filename, job->result, &m_bytes_done);
+      mutex.lock();
+
+      job->done = true;
+      cond.broadcast();
+    }
+}
+
+void
+FileHasher::add_file (const string& filename)
+{
+  Job *job = new Job();
+  job->result.filename = filename;
+  job->done = false;
+
+  Lock lock (mutex);
+  jobs.push_back (job);
+  todo_jobs.push_back (job);
+  cond.broadcast();
+}
+
+/* wait (at most timeout seconds) until next_result() can return without blocking */
+bool
+FileHasher::wait_result (double timeout)
+{
+  Lock lock (mutex);
+
+  if (!jobs.empty() && !jobs.front()->done)
+    cond.timed_wait (mutex, timeout);
+
+  return !jobs.empty() && jobs.front()->done;
+}
+
+FileHashResult
+FileHasher::next_result()
+{
+  Lock lock (mutex);
+
+  assert (!jobs.empty());
+  while (!jobs.front()->done)
+    cond.wait (mutex);
+
+  Job *job = jobs.front();
+  jobs.pop_front();
+
+  FileHashResult result = job->result;
+  delete job;
+
+  return result;
+}
+
+guint64
+FileHasher::bytes_done() const
+{
+  return m_bytes_done.value();
+}
+
+unsigned int
+FileHasher::n_threads() const
+{
+  return threads.size();
+}
+
+bool
+FileHasher::hash_file (const string& filename, FileHashResult& result, StatsCounter *bytes_done)
+{
+  result.filename = filename;
+  result.ok = false;
+  result.size = 0;
+
+  int fd = open (filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      result.error = string_printf ("can't open file '%s': %s", filename.c_str(), strerror (errno));
+      return false;
+    }
+  // we read the whole file once: let the kernel read ahead as much as possible
+  posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+  vector<guchar> buffer (HASH_READ_SIZE);
+
+  ssize_t bytes;
+  while ((bytes = read (fd, &buffer[0], buffer.size())) != 0)
+    {
+      if (bytes < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          result.error = string_printf ("read error on file '%s': %s", filename.c_str(), strerror (errno));
+          break;
+        }
+      g_checksum_update (sum, &buffer[0], bytes);
+      result.size += bytes;
+      if (bytes_done)
+        bytes_done->add (bytes);
+    }
+  close (fd);
+
+  if (bytes == 0)
+    {
+      result.hash = g_checksum_get_string (sum);
+      result.ok = true;
+    }
+  g_checksum_free (sum);
+
+  return result.ok;
+}
+
+StreamHasher::StreamHasher() :
+  sum (g_checksum_new (G_CHECKSUM_SHA1)),
+  pos (0)
+{
+}
+
+StreamHasher::~StreamHasher()
+{
+  invalidate();
+}
+
+void
+StreamHasher::update (guint64 offset, const char *data, size_t size)
+{
+  Lock lock (mutex);
+
+  if (!sum)
+    return;
+
+  if (offset == pos)
+    {
+      g_checksum_update (sum, (const guchar *) data, size);
+      pos += size;
+    }
+  else
+    {
+      g_checksum_free (sum);
+      sum = NULL;
+    }
+}
+
+void
+StreamHasher::invalidate()
+{
+  Lock lock (mutex);
+
+  if (sum)
+    {
+      g_checksum_free (sum);
+      sum = NULL;
+    }
+}
+
+string
+StreamHasher::finish (guint64& size)
+{
+  Lock lock (mutex);
+
+  if (!sum)
+    return "";
+
+  string hash = g_checksum_get_string (sum);
+  g_checksum_free (sum);
+  sum = NULL;
+
+  size = pos;
+  return hash;
+}
+
+}
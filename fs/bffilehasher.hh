@@ -0,0 +1,90 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_FILE_HASHER_HH
+#define BFSYNC_FILE_HASHER_HH
+
+#include "bfsyncfs.hh"
+#include "bfstats.hh"
+
+#include <string>
+#include <vector>
+#include <deque>
+
+namespace BFSync
+{
+
+struct FileHashResult
+{
+  std::string filename;
+  bool        ok;
+  std::string hash;     // SHA-1, hex
+  guint64     size;
+  std::string error;    // if !ok
+
+  FileHashResult();
+};
+
+/*
+ * FileHasher: computes SHA-1 hashes of files with a pool of threads
+ *
+ * files are started in the order they were added (so passing them sorted by
+ * file number reads the disk mostly sequentially), and results are returned in
+ * the same order; while the next result is not ready, bytes_done() can be used
+ * to show progress
+ */
+class FileHasher
+{
+  struct Job
+  {
+    FileHashResult result;
+    bool           done;
+  };
+
+  Mutex                   mutex;
+  Cond                    cond;
+  std::vector<pthread_t>  threads;
+  std::deque<Job *>       todo_jobs;      // not started yet
+  std::deque<Job *>       jobs;           // all jobs whose result was not returned, in order
+  bool                    quit;
+  StatsCounter            m_bytes_done;
+
+  static void *thread_start (void *arg);
+  void         thread_run();
+
+public:
+  FileHasher (unsigned int n_threads = 0);  // 0: one thread per cpu
+  ~FileHasher();
+
+  void            add_file (const std::string& filename);
+  bool            wait_result (double timeout);
+  FileHashResult  next_result();
+  guint64         bytes_done() const;
+  unsigned int    n_threads() const;
+
+  static bool     hash_file (const std::string& filename, FileHashResult& result, StatsCounter *bytes_done = NULL);
+};
+
+/*
+ * StreamHasher: SHA-1 of data that is written sequentially, starting at offset 0
+ *
+ * the first write that doesn't continue at the end of the previous one makes
+ * the hash invalid
+ */
+class StreamHasher
+{
+  Mutex       mutex;
+  GChecksum  *sum;
+  guint64     pos;
+
+public:
+  StreamHasher();
+  ~StreamHasher();
+
+  void          update (guint64 offset, const char *data, size_t size);
+  void          invalidate();
+  std::string   finish (guint64& size);    // "" if invalid
+};
+
+}
+
+#endif /* BFSYNC_FILE_HASHER_HH */
@@ -0,0 +1,87 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+/*
+ * measure FileHasher throughput for 1, 2, 4, ... threads
+ *
+ * before each run, the files are dropped from the page cache (works for clean
+ * pages without root privileges), unless --cached is given
+ */
+
+#include "bffilehasher.hh"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace BFSync;
+
+using std::string;
+using std::vector;
+
+static void
+drop_cache (const vector<string>& files)
+{
+  for (size_t i = 0; i < files.size(); i++)
+    {
+      int fd = open (files[i].c_str(), O_RDONLY);
+      if (fd >= 0)
+        {
+          fdatasync (fd);
+          posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+          close (fd);
+        }
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  bool cached = false;
+  if (argc > 1 && strcmp (argv[1], "--cached") == 0)
+    {
+      cached = true;
+      argc--;
+      argv++;
+    }
+  if (argc < 3)
+    {
+      printf ("usage: bfhashbench [--cached] <max_threads> <file>...\n");
+      return 1;
+    }
+  unsigned int max_threads = atoi (argv[1]);
+
+  vector<string> files;
+  for (int i = 2; i < argc; i++)
+    files.push_back (argv[i]);
+
+  for (unsigned int n_threads = 1; n_threads <= max_threads; n_threads *= 2)
+    {
+      if (!cached)
+        drop_cache (files);
+
+      double start_t = gettime();
+
+      FileHasher hasher (n_threads);
+      for (size_t i = 0; i < files.size(); i++)
+        hasher.add_file (files[i]);
+
+      guint64 bytes = 0;
+      for (size_t i = 0; i < files.size(); i++)
+        {
+          FileHashResult result = hasher.next_result();
+          if (!result.ok)
+            {
+              fprintf (stderr, "bfhashbench: %s\n", result.error.c_str());
+              return 1;
+            }
+          bytes += result.size;
+        }
+      double t = gettime() - start_t;
+
+      printf ("%3d threads: %8.2f MB/s  (%.2f MB in %.3f s)\n", n_threads,
+              bytes / t / 1024 / 1024, bytes / 1024. / 1024, t);
+    }
+  return 0;
+}
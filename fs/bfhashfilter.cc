@@ -0,0 +1,81 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bfhashfilter.hh"
+#include <string.h>
+
+namespace BFSync
+{
+
+/* 10..20 bits per hash and 7 probes: false positive rate <= 1% up to capacity */
+static const size_t HF_MIN_BITS_PER_HASH = 10;
+static const size_t HF_PROBES = 7;
+
+HashFilter::HashFilter (size_t capacity) :
+  m_capacity (capacity),
+  m_size (0)
+{
+  guint64 n_bits = 64 * 1024;
+  while (n_bits < capacity * HF_MIN_BITS_PER_HASH)
+    n_bits *= 2;
+
+  bits.resize (n_bits / 64);
+  mask = n_bits - 1;
+}
+
+/* double hashing: probe i uses h1 + i * h2 */
+static inline void
+hash_probes (const char *bin_hash, guint64& h1, guint64& h2)
+{
+  memcpy (&h1, bin_hash, 8);
+  memcpy (&h2, bin_hash + 8, 8);
+  h2 |= 1;
+}
+
+void
+HashFilter::add (const char *bin_hash)
+{
+  guint64 h1, h2;
+  hash_probes (bin_hash, h1, h2);
+
+  for (size_t i = 0; i < HF_PROBES; i++)
+    {
+      guint64 b = (h1 + i * h2) & mask;
+      bits[b / 64] |= guint64 (1) << (b % 64);
+    }
+  m_size++;
+}
+
+bool
+HashFilter::may_contain (const char *bin_hash) const
+{
+  guint64 h1, h2;
+  hash_probes (bin_hash, h1, h2);
+
+  for (size_t i = 0; i < HF_PROBES; i++)
+    {
+      guint64 b = (h1 + i * h2) & mask;
+      if (!(bits[b / 64] & (guint64 (1) << (b % 64))))
+        return false;
+    }
+  return true;
+}
+
+size_t
+HashFilter::size() const
+{
+  return m_size;
+}
+
+size_t
+HashFilter::capacity() const
+{
+  return m_capacity;
+}
+
+size_t
+HashFilter::bytes() const
+{
+  return bits.size() * 8;
+}
+
+}
@@ -0,0 +1,39 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_HASH_FILTER_HH
+#define BFSYNC_HASH_FILTER_HH
+
+#include <glib.h>
+#include <vector>
+
+namespace BFSync
+{
+
+/*
+ * HashFilter: Bloom filter for binary SHA-1 hashes (20 bytes)
+ *
+ * the hashes are uniformly distributed already, so the bit positions are derived
+ * from the hash bytes directly; may_contain() never returns false for a hash that
+ * has been added, but may return true for hashes that have not been added
+ */
+class HashFilter
+{
+  std::vector<guint64> bits;
+  guint64              mask;
+  size_t               m_capacity;
+  size_t               m_size;
+
+public:
+  HashFilter (size_t capacity);
+
+  void    add (const char *bin_hash);
+  bool    may_contain (const char *bin_hash) const;
+
+  size_t  size() const;       // number of hashes added
+  size_t  capacity() const;   // false positive rate gets worse above capacity
+  size_t  bytes() const;
+};
+
+}
+
+#endif
@@ -15,10 +15,20 @@ namespace BFSync
 {
 
 History::History (BDB *bdb) :
-  bdb (bdb)
+  bdb (bdb),
+  m_loaded (false),
+  m_db_gen (0),
+  m_db_reload_gen (0),
+  m_generation (0)
 {
 }
 
+guint64
+History::generation() const
+{
+  return m_generation;
+}
+
 unsigned int
 History::current_version() const
 {
@@ -50,32 +60,105 @@ History::have_version (unsigned int version) const
     }
 }
 
+/*
+ * returns true if at least one version vmin <= v <= vmax exists (vmax may be VERSION_INF)
+ *
+ * this is O(1), using the number of existing versions below each version
+ */
+bool
+History::have_version_in_range (unsigned int vmin, unsigned int vmax) const
+{
+  if (m_version_exists.empty())
+    return false;
+
+  vmin = max (vmin, 1U);
+  vmax = std::min<unsigned int> (vmax, m_version_exists.size() - 1);
+  if (vmin > vmax)
+    return false;
+
+  return m_live_prefix[vmax + 1] > m_live_prefix[vmin];
+}
+
+void
+History::update_live_prefix()
+{
+  m_live_prefix.resize (m_version_exists.size() + 1);
+  m_live_prefix[0] = 0;
+
+  for (size_t v = 0; v < m_version_exists.size(); v++)
+    m_live_prefix[v + 1] = m_live_prefix[v] + (m_version_exists[v] ? 1 : 0);
+}
+
 void
 History::read()
+{
+  guint64 db_gen, db_reload_gen;
+
+  /* the generation needs to be read before the history entries: a commit that
+   * happens in between will then cause another update next time */
+  if (!bdb->history_generation (db_gen, db_reload_gen))
+    {
+      load_all();
+      m_loaded = false;   // no generation: can't tell if it's up-to-date later
+    }
+  else if (!m_loaded || db_reload_gen != m_db_reload_gen)
+    {
+      load_all();
+      m_loaded = true;
+    }
+  else if (db_gen != m_db_gen)
+    {
+      load_new_entries();
+    }
+  else
+    {
+      return;
+    }
+  update_live_prefix();
+
+  m_db_gen = db_gen;
+  m_db_reload_gen = db_reload_gen;
+  m_generation++;
+
+  debug ("current version is %d\n", current_version());
+}
+
+void
+History::load_all()
 {
   m_version_exists.clear();
   m_version_exists.push_back (false);   // version 0 never exists
 
-  HistoryEntry history_entry;
+  vector<unsigned int> versions;
+  bdb->list_history_versions (1, versions);
 
-  for (unsigned int version = 1; bdb->load_history_entry (version, history_entry); version++)
+  for (size_t i = 0; i < versions.size() && versions[i] == m_version_exists.size(); i++)
+    m_version_exists.push_back (true);
+
+  vector<unsigned int> deleted_versions;
+  bdb->list_tagged_versions ("deleted", deleted_versions);
+
+  for (size_t i = 0; i < deleted_versions.size(); i++)
     {
-      bool version_exists = true;
-
-      vector<string> tags = bdb->list_tags (version);
-      for (vector<string>::iterator ti = tags.begin(); ti != tags.end(); ti++)
-        {
-          if (*ti == "deleted")
-            {
-              version_exists = false;
-              break;
-            }
-        }
-      m_version_exists.push_back (version_exists);
+      if (deleted_versions[i] > 0 && deleted_versions[i] < m_version_exists.size())
+        m_version_exists[deleted_versions[i]] = false;
     }
   m_version_exists.push_back (true);    // current_version always exists
+}
 
-  debug ("current version is %d\n", current_version());
+/* new versions can't be tagged "deleted" without a reload generation change */
+void
+History::load_new_entries()
+{
+  m_version_exists.pop_back();          // old current_version
+
+  vector<unsigned int> versions;
+  bdb->list_history_versions (m_version_exists.size(), versions);
+
+  for (size_t i = 0; i < versions.size() && versions[i] == m_version_exists.size(); i++)
+    m_version_exists.push_back (true);
+
+  m_version_exists.push_back (true);    // current_version always exists
 }
 
 }
@@ -3,6 +3,7 @@
 #ifndef BFSYNC_HISTORY_HH
 #define BFSYNC_HISTORY_HH
 
+#include <glib.h>
 #include <vector>
 #include <set>
 
@@ -10,18 +11,36 @@ namespace BFSync {
 
 class BDB;
 
+/*
+ * History: the versions that exist
+ *
+ * read() only loads everything the first time it is called; later calls check the
+ * history generation (see BDB::history_generation) and do nothing if the history
+ * didn't change, or read only the new entries after a commit
+ */
 class History
 {
   std::vector<bool>           m_version_exists;
+  std::vector<unsigned int>   m_live_prefix;    // number of existing versions < v
   BDB                        *bdb;
 
+  bool                        m_loaded;
+  guint64                     m_db_gen;
+  guint64                     m_db_reload_gen;
+  guint64                     m_generation;
+
+  void          load_all();
+  void          load_new_entries();
+  void          update_live_prefix();
 public:
   History (BDB *bdb);
 
   void          read();
+  guint64       generation() const;   // changes whenever read() changed the history
 
   unsigned int  current_version() const;
   bool          have_version (unsigned int version) const;
+  bool          have_version_in_range (unsigned int vmin, unsigned int vmax) const;
 
   // for iterating over each history entry
   unsigned int  vbegin() const;
@@ -11,6 +11,7 @@
 #include "bfbdb.hh"
 #include "bfhistory.hh"
 #include "bfgroup.hh"
+#include "bfstats.hh"
 
 #include <set>
 
@@ -51,23 +52,32 @@ INodeRepo::instance_created()
   return inode_repo != NULL;
 }
 
-void
+bool
 INodeRepo::clear_cache()
 {
-  save_changes (SC_CLEAR_CACHE);
+  return save_changes (SC_CLEAR_CACHE);
 }
 
-void
-INodeRepo::save_changes (SaveChangesMode sc)
+static INodeLinksPtr
+inode_version_list_links (const INodeVersionList& ivlist)
 {
-  Lock lock (mutex);
-
-  if (sc != SC_NO_TXN)
+  // all versions of an inode share the same links
+  for (size_t i = 0; i < ivlist.size(); i++)
     {
-      bdb->begin_transaction();
+      if (ivlist[i])
+        return ivlist[i]->links;
     }
+  return INodeLinksPtr::null();
+}
 
-  int inodes_saved = 0;
+void
+INodeRepo::write_changes (vector<boost::unordered_map<ID, INodeVersionList>::iterator>& save_list)
+{
+  /* pass 1: delete old inode and link records of all modified inodes
+   *
+   * since deleting needs to see the records in the database, all deletes are done before
+   * the new records are written, so that the new records can be written with bulk puts
+   */
   for (boost::unordered_map<ID, INodeVersionList>::iterator ci = cache.begin(); ci != cache.end(); ci++)
     {
       INodeVersionList& ivlist = ci->second;
@@ -93,41 +103,100 @@ INodeRepo::save_changes (SaveChangesMode sc)
           // build changed inode list
           bdb->add_changed_inode (ci->first);
 
-          INodeLinksPtr links = INodeLinksPtr::null();
-          for (size_t i = 0; i < ivlist.size(); i++)
-            {
-              INodePtr inode_ptr = ivlist[i];
-
-              if (inode_ptr)
-                {
-                  inodes_saved++;
-
-                  INode *inode = inode_ptr.get_ptr_without_update();
-                  inode->save();
-                  inode->updated = false;
-                  if (!links)
-                    links = inode->links;
-                }
-            }
+          INodeLinksPtr links = inode_version_list_links (ivlist);
           if (links)
-            {
-              INodeLinks *inode_links = links.get_ptr_without_update();
-              inode_links->save (ci->first);
-            }
+            links.get_ptr_without_update()->delete_old (ci->first);
+
+          save_list.push_back (ci);
         }
     }
-  if (sc == SC_CLEAR_CACHE)
+
+  /* pass 2: write new inode and link records */
+  BDBBulkWriter inode_writer (bdb, BDB_TABLE_INODES);
+  BDBBulkWriter link_writer (bdb, BDB_TABLE_LINKS);
+
+  for (size_t s = 0; s < save_list.size(); s++)
     {
-      cache.clear();
-      links_cache.clear();
+      INodeVersionList& ivlist = save_list[s]->second;
+
+      for (size_t i = 0; i < ivlist.size(); i++)
+        {
+          INodePtr inode_ptr = ivlist[i];
+
+          if (inode_ptr)
+            inode_ptr.get_ptr_without_update()->save (&inode_writer);
+        }
+
+      INodeLinksPtr links = inode_version_list_links (ivlist);
+      if (links)
+        links.get_ptr_without_update()->save (save_list[s]->first, &link_writer);
     }
+  inode_writer.flush();
+  link_writer.flush();
+
   bdb->store_new_id2ino_entries();
+}
 
-  if (sc != SC_NO_TXN)
+/*
+ * write all changes in the cache to the database
+ *
+ * returns false if the transaction can't be committed; then the changes stay in the
+ * cache, so a later save_changes() writes them again
+ */
+bool
+INodeRepo::save_changes (SaveChangesMode sc)
+{
+  Lock lock (mutex);
+
+  vector<boost::unordered_map<ID, INodeVersionList>::iterator> save_list;
+
+  if (sc == SC_NO_TXN)
     {
-      bdb->commit_transaction();
+      // the caller commits the transaction (and needs to handle deadlocks)
+      write_changes (save_list);
+    }
+  else
+    {
+      /* if the transaction fails due to a deadlock, all changes are still in the cache,
+       * so we can simply write them again in a new transaction
+       */
+      for (int attempt = 0; ; attempt++)
+        {
+          bdb->begin_transaction();
+
+          save_list.clear();
+          write_changes (save_list);
+
+          BDBError err = bdb->commit_transaction();
+          if (err == BDB_ERROR_NONE)
+            break;
+
+          // retry on deadlock, up to BDB_MAX_TXN_RETRIES attempts
+          if (err != BDB_ERROR_DEADLOCK || !bdb->retry_backoff (attempt))
+            return false;
+        }
+    }
+
+  for (size_t s = 0; s < save_list.size(); s++)
+    {
+      INodeVersionList& ivlist = save_list[s]->second;
+
+      for (size_t i = 0; i < ivlist.size(); i++)
+        {
+          INodePtr inode_ptr = ivlist[i];
+
+          if (inode_ptr)
+            inode_ptr.get_ptr_without_update()->updated = false;
+        }
+    }
+
+  if (sc == SC_CLEAR_CACHE)
+    {
+      cache.clear();
+      links_cache.clear();
     }
   // bdb->sync();
+  return true;
 }
 
 void
@@ -186,6 +255,8 @@ INodeRepo::delete_unused_inodes (DeleteMode dmode)
 
               cache.quick_erase (ci);
               // do not access id after this point (deleted)
+
+              FSStats::the()->inode_cache_evictions.add (1);
             }
         }
       ci = nexti;
@@ -219,10 +290,12 @@ INodePtr::INodePtr (const Context& ctx, const ID& id) :
       if (ctx.version >= ip->vmin && ctx.version <= ip->vmax)
         {
           *this = ip;   // yes, in cache
+          FSStats::the()->inode_cache_hits.add (1);
           return;
         }
     }
   // not in cache, load and add to cache
+  FSStats::the()->inode_cache_misses.add (1);
   ptr = new INode;
   if (!ptr->load (ctx, id))
     {
@@ -400,10 +473,10 @@ INode::set_ctime (const INodeTime& time)
 }
 
 bool
-INode::save()
+INode::save (BDBBulkWriter *writer)
 {
   if (nlink != 0) // nlink == 0 means that the inode is not referenced anymore and can be deleted
-    INodeRepo::the()->bdb->store_inode (this);
+    INodeRepo::the()->bdb->store_inode (this, writer);
 
   return true;
 }
@@ -540,10 +613,13 @@ INode::copy_on_write()
       while ((read_bytes = read (old_fd, &buffer[0], buffer.size())) > 0)
         {
           write (new_fd, &buffer[0], read_bytes);
+          FSStats::the()->cow_bytes.add (read_bytes);
         }
       close (old_fd);
       close (new_fd);
 
+      FSStats::the()->cow_files.add (1);
+
       hash = "new";
     }
 }
@@ -741,13 +817,17 @@ INodeLinks::~INodeLinks()
   inode_links_leak_debugger.del (this);
 }
 
-bool
-INodeLinks::save (const ID& dir_id)
+void
+INodeLinks::delete_old (const ID& dir_id)
 {
   // delete links that were (possibly) modified
   INodeRepo::the()->bdb->delete_links (dir_id, link_map);
+}
 
-  // re-write links
+bool
+INodeLinks::save (const ID& dir_id, BDBBulkWriter *writer)
+{
+  // re-write links (old links must have been deleted using delete_old() before)
   for (map<string, LinkVersionList>::const_iterator li = link_map.begin(); li != link_map.end(); li++)
     {
       const LinkVersionList& lvlist = li->second;
@@ -756,7 +836,7 @@ INodeLinks::save (const ID& dir_id)
           const LinkPtr& lp = lvlist[i];
 
           if (!lp->deleted)
-            INodeRepo::the()->bdb->store_link (lp);
+            INodeRepo::the()->bdb->store_link (lp, writer);
 
           Link *link = lp.get_ptr_without_update();
           link->updated = false;
@@ -17,6 +17,7 @@ namespace BFSync
 {
 
 class BDB;
+class BDBBulkWriter;
 
 enum FileType {
   FILE_NONE,
@@ -157,7 +158,7 @@ public:
 
   enum LinkMode { LM_UPDATE_NLINK, LM_NO_UPDATE_NLINK };
 
-  bool          save();
+  bool          save (BDBBulkWriter *writer = NULL);
   bool          load (const Context& ctx, const ID& id);
 
   void          set_mtime_ctime (const INodeTime& time);
@@ -241,7 +242,8 @@ public:
   INodeLinks();
   ~INodeLinks();
 
-  bool save (const ID& id);
+  void delete_old (const ID& id);
+  bool save (const ID& id, BDBBulkWriter *writer = NULL);
 
   void
   ref()
@@ -267,6 +269,8 @@ public:
 class INodeRepo
 {
   boost::rand48                               random_gen;
+
+  void write_changes (std::vector<boost::unordered_map<ID, INodeVersionList>::iterator>& save_list);
 public:
   boost::unordered_map<ID, INodeVersionList>  cache;
   std::map<ino_t, ID>                         new_inodes;
@@ -276,8 +280,8 @@ public:
 
   enum SaveChangesMode { SC_NORMAL, SC_CLEAR_CACHE, SC_NO_TXN };
 
-  void save_changes (SaveChangesMode sc = SC_NORMAL);
-  void clear_cache();
+  bool save_changes (SaveChangesMode sc = SC_NORMAL);
+  bool clear_cache();
 
   enum DeleteMode { DM_ALL, DM_SOME };
   void delete_unused_inodes (DeleteMode dmode);
@@ -85,7 +85,7 @@ ids_update_status (size_t n_ids)
 void
 IntegrityCheck::read_all_ids()
 {
-  DbcPtr              dbc (bdb_ptr.get_bdb());   // Acquire a cursor for the database.
+  DbcPtr              dbc (bdb_ptr.get_bdb(), BDB_TABLE_INODES, DbcPtr::SNAPSHOT);   // Acquire a cursor for the inode table.
   AllRecordsIterator  ari (dbc.dbc);
 
   ids_update_status (0);
@@ -93,21 +93,17 @@ IntegrityCheck::read_all_ids()
   Dbt key, data;
   while (ari.next (key, data))
     {
-      char table = ((char *) key.get_data()) [key.get_size() - 1];
-      if (table == BDB_TABLE_INODES)
-        {
-          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+      DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
 
-          BFSync::ID id (kbuffer);
-          id_map[id] = 0;
+      BFSync::ID id (kbuffer);
+      id_map[id] = 0;
 
-          if (output_needs_update())
-            {
-              ids_update_status (id_map.size());
+      if (output_needs_update())
+        {
+          ids_update_status (id_map.size());
 
-              if (check_interrupted())
-                return;
-            }
+          if (check_interrupted())
+            return;
         }
     }
   ids_update_status (id_map.size());
@@ -142,7 +138,7 @@ link_err2str (LinkErr err)
 void
 IntegrityCheck::check_links()
 {
-  DbcPtr              dbc (bdb_ptr.get_bdb());   // Acquire a cursor for the database.
+  DbcPtr              dbc (bdb_ptr.get_bdb(), BDB_TABLE_LINKS, DbcPtr::SNAPSHOT);    // Acquire a cursor for the link table.
   AllRecordsIterator  ari (dbc.dbc);
 
 
@@ -152,53 +148,52 @@ IntegrityCheck::check_links()
   Dbt key, data;
   while (ari.next (key, data))
     {
-      char table = ((char *) key.get_data()) [key.get_size() - 1];
-      if (table == BDB_TABLE_LINKS)
+      DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+      BFSync::ID id (kbuffer);
+
+      DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+
+      BFSync::LinkRecord lr;
+      lr.read (dbuffer, id, bdb_ptr.get_bdb()->record_format());
+
+      const unsigned int vmin = lr.vmin;
+      const unsigned int vmax = lr.vmax;
+      const BFSync::ID&  inode_id = lr.inode_id;
+      const string&      name = lr.name;
+
+      LinkErr err = ERR_NONE;
+
+      IDMap::iterator id_it;
+
+      id_it = id_map.find (id);
+      if (id_it == id_map.end())
+        {
+          err = LinkErr (ERR_DIR_ID | err);
+        }
+
+      id_it = id_map.find (inode_id);
+      if (id_it == id_map.end())
+        {
+          err = LinkErr (ERR_INODE_ID | err);
+        }
+      else
+        {
+          // ID is reachable
+          int& flags = id_it->second;
+          flags |= 1;
+        }
+
+      n_links++;
+      if (output_needs_update())
+        {
+          links_update_status (n_links);
+          if (check_interrupted())
+            return;
+        }
+      if (err)
         {
-          DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-          BFSync::ID id (kbuffer);
-
-          DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
-
-          unsigned int vmin = dbuffer.read_uint32();
-          unsigned int vmax = dbuffer.read_uint32();
-          BFSync::ID inode_id (dbuffer);
-          string name = dbuffer.read_string();
-
-          LinkErr err = ERR_NONE;
-
-          IDMap::iterator id_it;
-
-          id_it = id_map.find (id);
-          if (id_it == id_map.end())
-            {
-              err = LinkErr (ERR_DIR_ID | err);
-            }
-
-          id_it = id_map.find (inode_id);
-          if (id_it == id_map.end())
-            {
-              err = LinkErr (ERR_INODE_ID | err);
-            }
-          else
-            {
-              // ID is reachable
-              int& flags = id_it->second;
-              flags |= 1;
-            }
-
-          n_links++;
-          if (output_needs_update())
-            {
-              links_update_status (n_links);
-              if (check_interrupted())
-                return;
-            }
-          if (err)
-            {
-              errors.push_back (string_printf ("LINK ERROR: %s {\n  %s=%u|%s|%s|%s\n}", link_err2str (err),
-                 id.pretty_str().c_str(), vmin, VMSTR (vmax), inode_id.pretty_str().c_str(), name.c_str()));
-            }
+          errors.push_back (string_printf ("LINK ERROR: %s {\n  %s=%u|%s|%s|%s\n}", link_err2str (err),
+             id.pretty_str().c_str(), vmin, VMSTR (vmax), inode_id.pretty_str().c_str(), name.c_str()));
         }
     }
   links_update_status (n_links);
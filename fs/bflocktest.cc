@@ -26,7 +26,7 @@ main (int argc, char **argv)
       exit (1);
     }
 
-  Db *db = bdb->get_db();
+  Db *db = bdb->get_db (BDB_TABLE_INODES);
   Dbc *dbcp;
 
   /* Acquire a cursor for the database. */
@@ -62,7 +62,7 @@ main (int argc, char **argv)
           Dbt xkey (&key_raw[0], key_raw.size());
           Dbt xdata;
 
-          ret = bdb->get_db()->get (txn, &xkey, &xdata, DB_RMW);
+          ret = db->get (txn, &xkey, &xdata, DB_RMW);
           g_assert (ret == 0);
           key_raw.clear();
         }
@@ -22,29 +22,34 @@ vector<Record> records;
 void
 load (BDB *bdb)
 {
-  DbcPtr dbc (bdb);
   Dbt key;
   Dbt data;
 
   unsigned char *p;
 
-  int ret = dbc->get (&key, &data, DB_FIRST);
-  while (ret == 0)
+  const vector<BDBTableInfo>& table_info = bdb_table_info();
+  for (vector<BDBTableInfo>::const_iterator ti = table_info.begin(); ti != table_info.end(); ti++)
     {
-      Record r;
+      DbcPtr dbc (bdb, ti->table);
 
-      p = (unsigned char *) key.get_data();
-      r.key.insert (r.key.end(), p, p + key.get_size());
+      int ret = dbc->get (&key, &data, DB_FIRST);
+      while (ret == 0)
+        {
+          Record r;
+
+          p = (unsigned char *) key.get_data();
+          r.key.insert (r.key.end(), p, p + key.get_size());
 
-      p = (unsigned char *) data.get_data();
-      r.data.insert (r.data.end(), p, p + data.get_size());
+          p = (unsigned char *) data.get_data();
+          r.data.insert (r.data.end(), p, p + data.get_size());
 
-      records.push_back (r);
+          records.push_back (r);
 
-      printf ("%zd\r", records.size());
-      fflush (stdout);
+          printf ("%zd\r", records.size());
+          fflush (stdout);
 
-      ret = dbc->get (&key, &data, DB_NEXT);
+          ret = dbc->get (&key, &data, DB_NEXT);
+        }
     }
   printf ("%zd\n", records.size());
 }
@@ -52,16 +57,18 @@ load (BDB *bdb)
 void
 restore (BDB *bdb)
 {
-  Db *db = bdb->get_db();
   int OPS = 0;
 
   bdb->begin_transaction();
+
+  // the new database got a default record format on open; the records contain the right one
+  bdb->set_variable ("record-format", vector<std::string>());
   for (vector<Record>::iterator ri = records.begin(); ri != records.end(); ri++)
     {
       Dbt key (&ri->key[0], ri->key.size());
       Dbt data (&ri->data[0], ri->data.size());
 
-      int ret = db->put (bdb->get_transaction(), &key, &data, 0);
+      int ret = bdb->get_db (bdb_key_table (key))->put (bdb->get_transaction(), &key, &data, 0);
       assert (ret == 0);
 
       OPS++;
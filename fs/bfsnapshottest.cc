@@ -0,0 +1,219 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+/*
+ * test that full database scans using snapshot cursors don't block writers
+ *
+ * a writer process keeps rewriting inode records in small transactions while
+ * this process scans the inode table with a DbcPtr::SNAPSHOT cursor; the test
+ * fails if the scan doesn't see a consistent record count or if the writer
+ * could not commit while the scan was running
+ *
+ * the test runs on a scratch copy of the repository database (the repository
+ * itself is not modified); the repository must not be in use
+ */
+
+#include "bfbdb.hh"
+#include "bfsyncfs.hh"
+#include "bftestrepo.hh"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+using namespace BFSync;
+
+using std::string;
+using std::vector;
+
+static void
+writer (const string& repo, int commit_fd, int stop_fd)
+{
+  BDB *bdb = bdb_open (repo, 16, false);
+  if (!bdb)
+    {
+      printf ("writer: error opening db %s\n", repo.c_str());
+      exit (1);
+    }
+
+  vector< vector<char> > all_keys;
+  {
+    DbcPtr dbc (bdb, BDB_TABLE_INODES);
+
+    Dbt key, data;
+    int ret = dbc->get (&key, &data, DB_FIRST);
+    while (ret == 0)
+      {
+        all_keys.push_back (vector<char> ((char *) key.get_data(), (char *) key.get_data() + key.get_size()));
+        ret = dbc->get (&key, &data, DB_NEXT);
+      }
+  }
+  if (all_keys.empty())
+    {
+      printf ("writer: no inode records in db %s\n", repo.c_str());
+      exit (1);
+    }
+
+  char c;
+  while (read (stop_fd, &c, 1) < 0)     // stop_fd is non-blocking; EOF => stop
+    {
+      bdb->begin_transaction();
+      {
+        DbcPtr dbc (bdb, BDB_TABLE_INODES, DbcPtr::WRITE);
+
+        for (size_t i = 0; i < 1000; i++)
+          {
+            vector<char>& key_raw = all_keys [g_random_int_range (0, all_keys.size())];
+
+            Dbt key (&key_raw[0], key_raw.size());
+            Dbt data;
+
+            /* rewrite record unchanged: this write locks (and copies) the page
+             *
+             * the inode table has duplicates, so the record must be replaced in place
+             * (DB_CURRENT), a plain put would add another duplicate
+             */
+            int ret = dbc->get (&key, &data, DB_SET | DB_RMW);
+            g_assert (ret == 0);
+
+            vector<char> data_raw ((char *) data.get_data(), (char *) data.get_data() + data.get_size());
+            Dbt new_data (&data_raw[0], data_raw.size());
+
+            ret = dbc->put (&key, &new_data, DB_CURRENT);
+            g_assert (ret == 0);
+          }
+      }
+      BDBError err = bdb->commit_transaction();
+      g_assert (err == BDB_ERROR_NONE);
+
+      ssize_t w = write (commit_fd, "c", 1);
+      g_assert (w == 1);
+    }
+  if (!bdb->close())
+    {
+      printf ("writer: error closing db %s\n", repo.c_str());
+      exit (1);
+    }
+  exit (0);
+}
+
+static size_t
+read_commits (int commit_fd)
+{
+  size_t commits = 0;
+  char buffer[1024];
+  ssize_t len;
+
+  while ((len = read (commit_fd, buffer, sizeof (buffer))) > 0)
+    commits += len;
+
+  return commits;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      printf ("usage: bfsnapshottest <repo>\n");
+      exit (1);
+    }
+
+  string scratch_repo;
+  if (!scratch_repo_create (argv[1], "snapshottest", scratch_repo))
+    exit (1);
+
+  int commit_pipe[2], stop_pipe[2];
+  if (pipe (commit_pipe) != 0 || pipe (stop_pipe) != 0)
+    {
+      perror ("pipe");
+      exit (1);
+    }
+
+  /* fork before opening the database: BDB handles must not be shared between processes */
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+      close (commit_pipe[0]);
+      close (stop_pipe[1]);
+      fcntl (stop_pipe[0], F_SETFL, O_NONBLOCK);
+
+      writer (scratch_repo, commit_pipe[1], stop_pipe[0]);
+    }
+  close (commit_pipe[1]);
+  close (stop_pipe[0]);
+
+  /* wait until the writer is busy */
+  char c;
+  if (read (commit_pipe[0], &c, 1) != 1)
+    {
+      printf ("writer failed\n");
+      scratch_repo_remove (scratch_repo);
+      exit (1);
+    }
+  fcntl (commit_pipe[0], F_SETFL, O_NONBLOCK);
+
+  BDB *bdb = bdb_open (scratch_repo, 16, false);
+  if (!bdb)
+    {
+      printf ("error opening db %s\n", scratch_repo.c_str());
+      exit (1);
+    }
+
+  bool ok = true;
+  size_t first_count = 0;
+
+  for (int pass = 0; pass < 3; pass++)
+    {
+      read_commits (commit_pipe[0]);
+
+      double start_t = gettime();
+      size_t count = 0;
+      {
+        DbcPtr dbc (bdb, BDB_TABLE_INODES, DbcPtr::SNAPSHOT);
+        AllRecordsIterator ari (dbc.dbc);
+
+        Dbt key, data;
+        while (ari.next (key, data))
+          count++;
+      }
+      double end_t = gettime();
+
+      size_t commits = read_commits (commit_pipe[0]);
+      printf ("pass %d: %zd records, %.2f seconds, writer committed %zd transactions during scan\n",
+              pass + 1, count, end_t - start_t, commits);
+
+      if (pass == 0)
+        first_count = count;
+      else if (count != first_count)
+        {
+          printf ("FAIL: record count changed (%zd != %zd)\n", count, first_count);
+          ok = false;
+        }
+      if (commits == 0 && end_t - start_t > 1)
+        {
+          printf ("FAIL: writer was blocked during scan\n");
+          ok = false;
+        }
+    }
+  if (!bdb->close())
+    {
+      printf ("error closing db %s\n", scratch_repo.c_str());
+      exit (1);
+    }
+
+  /* stop writer */
+  close (stop_pipe[1]);
+
+  int status;
+  if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    {
+      printf ("FAIL: writer failed\n");
+      ok = false;
+    }
+  scratch_repo_remove (scratch_repo);
+
+  printf ("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
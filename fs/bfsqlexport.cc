@@ -5,6 +5,7 @@
 #include "bfsyncdb.hh"
 #include "bfsyncfs.hh"
 #include "bfleakdebugger.hh"
+#include "bfversionindex.hh"
 
 #include <inttypes.h>
 
@@ -24,6 +25,10 @@ using BFSync::string_printf;
 using BFSync::DataBuffer;
 using BFSync::DataOutBuffer;
 using BFSync::BDBError;
+using BFSync::INodeRecord;
+using BFSync::LinkRecord;
+using BFSync::BDB_TABLE_INODES;
+using BFSync::BDB_TABLE_LINKS;
 
 struct SQLExportData
 {
@@ -309,7 +314,10 @@ SQLExportIterator::gen_files (unsigned int version, const string& insert_filenam
 //##############################################################################
 
 SQLExport::SQLExport (BDBPtr bdb_ptr) :
-  bdb_ptr (bdb_ptr)
+  bdb_ptr (bdb_ptr),
+  version_index (NULL),
+  inode_dbc (NULL),
+  link_dbc (NULL)
 {
   scan_ops = 0;
   start_time = gettime();
@@ -334,20 +342,106 @@ SQLExport::~SQLExport()
     }
 }
 
+static bool
+cmp_link_name (const LinkRecord& l1, const LinkRecord& l2)
+{
+  return l1.name < l2.name;
+}
+
 bool
-cmp_link_name (Link *l1, Link *l2)
+SQLExport::load_inode (const BFSync::ID& id, INodeRecord& ir)
+{
+  if (version_index)
+    return version_index->load_inode (id, ir);
+
+  BFSync::BDB *bdb = bdb_ptr.get_bdb();
+
+  DataOutBuffer kbuf;
+
+  id.store (kbuf);
+  kbuf.write_table (BDB_TABLE_INODES);
+
+  Dbt ikey (kbuf.begin(), kbuf.size());
+  Dbt idata;
+
+  int ret = (*inode_dbc)->get (&ikey, &idata, DB_SET);
+  while (ret == 0)
+    {
+      DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
+
+      guint32 vmin, vmax;
+      INodeRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+
+      if (version >= vmin && version <= vmax)
+        {
+          ir.read (dbuffer, bdb->record_format());
+          return true;
+        }
+      ret = (*inode_dbc)->get (&ikey, &idata, DB_NEXT_DUP);
+    }
+  bdb->txn_check_read (ret);
+  return false;
+}
+
+void
+SQLExport::load_links (const BFSync::ID& id, vector<LinkRecord>& links)
 {
-  return l1->name < l2->name;
+  if (version_index)
+    {
+      version_index->load_links (id, links);
+      return;
+    }
+
+  BFSync::BDB *bdb = bdb_ptr.get_bdb();
+
+  DataOutBuffer kbuf;
+
+  id.store (kbuf);
+  kbuf.write_table (BDB_TABLE_LINKS);
+
+  Dbt lkey (kbuf.begin(), kbuf.size());
+  Dbt ldata;
+
+  vector<char>& multi_data_buffer = bdb->multi_data_buffer();
+
+  Dbt lmulti_data;
+  lmulti_data.set_flags (DB_DBT_USERMEM);
+  lmulti_data.set_data (&multi_data_buffer[0]);
+  lmulti_data.set_ulen (multi_data_buffer.size());
+
+  int ret = (*link_dbc)->get (&lkey, &lmulti_data, DB_SET | DB_MULTIPLE);
+  while (ret == 0)
+    {
+      DbMultipleDataIterator data_iterator (lmulti_data);
+      while (data_iterator.next (ldata))
+        {
+          DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
+
+          guint32 vmin, vmax;
+          LinkRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+
+          if (version >= vmin && version <= vmax)
+            {
+              LinkRecord lr;
+              lr.read (dbuffer, id, bdb->record_format());
+              assert (dbuffer.remaining() == 0);
+
+              links.push_back (lr);
+            }
+        }
+      ret = (*link_dbc)->get (&lkey, &lmulti_data, DB_NEXT_DUP | DB_MULTIPLE);
+    }
+  bdb->txn_check_read (ret);
 }
 
 BDBError
-SQLExport::walk (const ID& id, const ID& parent_id, const string& prefix, FILE *out_file)
+SQLExport::walk (const BFSync::ID& id, const BFSync::ID& parent_id, const string& prefix, FILE *out_file)
 {
   if (sig_interrupted)
     return BFSync::BDB_ERROR_INTR;
 
-  INode inode = bdb_ptr.load_inode (id, version);
-  if (inode.valid)
+  INodeRecord inode;
+  if (load_inode (id, inode))
     {
       size_t written;
       string filename = prefix.size() ? prefix : "/";
@@ -355,8 +449,8 @@ SQLExport::walk (const ID& id, const ID& parent_id, const string& prefix, FILE *
       // write data
       out_buffer.clear();
       out_buffer.write_string (filename);
-      inode.id.id.store (out_buffer);
-      parent_id.id.store (out_buffer);
+      id.store (out_buffer);
+      parent_id.store (out_buffer);
       out_buffer.write_uint32 (inode.uid);
       out_buffer.write_uint32 (inode.gid);
       out_buffer.write_uint32 (inode.mode);
@@ -384,26 +478,22 @@ SQLExport::walk (const ID& id, const ID& parent_id, const string& prefix, FILE *
       if (written != 1)
         return BFSync::BDB_ERROR_IO;
 
-      maybe_split_transaction();
       scan_ops++;
       update_status ("scanning", false);
 
       if (inode.type == BFSync::FILE_DIR)
         {
-          vector<Link> links = bdb_ptr.load_links (id, version);
+          vector<LinkRecord> links;
+          load_links (id, links);
 
           // sort links before recursion
-          vector<Link*> sorted_links (links.size());
-          for (size_t l = 0; l < links.size(); l++)
-            sorted_links[l] = &links[l];
-          std::sort (sorted_links.begin(), sorted_links.end(), cmp_link_name);
+          std::sort (links.begin(), links.end(), cmp_link_name);
 
-          for (vector<Link*>::const_iterator li = sorted_links.begin(); li != sorted_links.end(); li++)
+          for (vector<LinkRecord>::const_iterator li = links.begin(); li != links.end(); li++)
             {
-              const Link* link = *li;
-              const string& inode_name = prefix + "/" + link->name;
+              const string& inode_name = prefix + "/" + li->name;
 
-              BDBError err = walk (link->inode_id, id, inode_name, out_file);
+              BDBError err = walk (li->inode_id, id, inode_name, out_file);
               if (err)
                 return err;
             }
@@ -412,19 +502,6 @@ SQLExport::walk (const ID& id, const ID& parent_id, const string& prefix, FILE *
   return BFSync::BDB_ERROR_NONE;
 }
 
-void
-SQLExport::maybe_split_transaction()
-{
-  transaction_ops++;
-  if (transaction_ops >= 20000)
-    {
-      transaction_ops = 0;
-
-      bdb_ptr.commit_transaction();
-      bdb_ptr.begin_transaction();
-    }
-}
-
 void
 SQLExport::update_status (const string& op_name, bool force_update)
 {
@@ -467,7 +544,6 @@ SQLExport::build_filelist (unsigned int version, string& filename)
   filelist_map[version] = filelist_name;
 
   this->version = version;
-  transaction_ops = 0;
   last_status_time = 0;
 
   FILE *file = fopen (filelist_name.c_str(), "w");
@@ -476,12 +552,27 @@ SQLExport::build_filelist (unsigned int version, string& filename)
       return BFSync::BDB_ERROR_IO;
     }
 
+  /* the scan reads from the version index (if any) or from snapshot transactions, so
+   * it neither blocks writers (bfsyncfs) nor is blocked by them, and it can't fail due
+   * to deadlocks
+   */
+  BFSync::DbcPtr snapshot_inode_dbc (bdb_ptr.get_bdb(), BDB_TABLE_INODES, BFSync::DbcPtr::SNAPSHOT);
+  BFSync::DbcPtr snapshot_link_dbc (bdb_ptr.get_bdb(), BDB_TABLE_LINKS, BFSync::DbcPtr::SNAPSHOT);
+
+  version_index = bdb_ptr.get_bdb()->version_index (version);
+  inode_dbc = &snapshot_inode_dbc;
+  link_dbc = &snapshot_link_dbc;
+
   // const double version_start_time = gettime();
-  bdb_ptr.begin_transaction();
-  BDBError err = walk (id_root(), id_root(), "", file);
-  bdb_ptr.commit_transaction();
+  BDBError err = walk (id_root().id, id_root().id, "", file);
   // const double version_end_time = gettime();
-  fclose (file);
+
+  version_index = NULL;
+  inode_dbc = NULL;
+  link_dbc = NULL;
+
+  if (fclose (file) != 0 && !err)
+    err = BFSync::BDB_ERROR_IO;
 
   // printf ("### filelist time: %.2f\n", (version_end_time - version_start_time));
   // fflush (stdout);
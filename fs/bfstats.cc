@@ -0,0 +1,71 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bfstats.hh"
+#include <assert.h>
+#include <time.h>
+
+using std::vector;
+using std::string;
+
+namespace BFSync
+{
+
+guint64
+stats_time_ns()
+{
+  timespec time_now;
+
+  int r = clock_gettime (CLOCK_MONOTONIC, &time_now);
+  assert (r == 0);
+
+  return guint64 (time_now.tv_sec) * 1000 * 1000 * 1000 + time_now.tv_nsec;
+}
+
+static FSStats *instance = NULL;
+
+FSStats*
+FSStats::the()
+{
+  if (!instance)
+    instance = new FSStats();
+
+  return instance;
+}
+
+void
+FSStats::add_op (FSOpStats *op)
+{
+  m_ops.push_back (op);
+}
+
+const vector<FSOpStats *>&
+FSStats::ops() const
+{
+  return m_ops;
+}
+
+FSOpStats::FSOpStats (const string& name) :
+  m_name (name)
+{
+  FSStats::the()->add_op (this);
+}
+
+const string&
+FSOpStats::name() const
+{
+  return m_name;
+}
+
+FSOpStatsHandle::FSOpStatsHandle (FSOpStats& stats) :
+  m_stats (&stats),
+  m_start_ns (stats_time_ns())
+{
+}
+
+FSOpStatsHandle::~FSOpStatsHandle()
+{
+  m_stats->calls.add (1);
+  m_stats->time_ns.add (stats_time_ns() - m_start_ns);
+}
+
+}
@@ -0,0 +1,96 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_STATS_HH
+#define BFSYNC_STATS_HH
+
+#include <glib.h>
+#include <string>
+#include <vector>
+
+namespace BFSync
+{
+
+/* counter that can be updated by many threads without locking */
+class StatsCounter
+{
+  volatile guint64 m_value;
+
+public:
+  StatsCounter() :
+    m_value (0)
+  {
+  }
+  void
+  add (guint64 n)
+  {
+    __sync_fetch_and_add (&m_value, n);
+  }
+  guint64
+  value() const
+  {
+    return m_value;
+  }
+};
+
+guint64 stats_time_ns();    // monotonic clock
+
+/* calls and total time of one FUSE operation */
+class FSOpStats
+{
+  std::string   m_name;
+
+public:
+  StatsCounter  calls;
+  StatsCounter  time_ns;
+
+  FSOpStats (const std::string& name);
+
+  const std::string& name() const;
+};
+
+class FSOpStatsHandle
+{
+  FSOpStats  *m_stats;
+  guint64     m_start_ns;
+
+public:
+  FSOpStatsHandle (FSOpStats& stats);
+  ~FSOpStatsHandle();
+};
+
+/*
+ * FSStats: counters of the bfsyncfs process, always enabled
+ *
+ * updating a counter is one atomic add; bfsyncfs_stats_json() reports them
+ * for the "stats" server command and the .bfsync/stats file
+ */
+class FSStats
+{
+  std::vector<FSOpStats *> m_ops;
+
+public:
+  enum { LOCK_TYPES = 4 };    // FSLock::LockType
+
+  StatsCounter  lock_count[LOCK_TYPES];
+  StatsCounter  lock_waits[LOCK_TYPES];     // lock was not available immediately
+  StatsCounter  lock_wait_ns[LOCK_TYPES];
+
+  StatsCounter  inode_cache_hits;
+  StatsCounter  inode_cache_misses;
+  StatsCounter  inode_cache_evictions;
+
+  StatsCounter  bytes_read;
+  StatsCounter  bytes_written;
+
+  StatsCounter  cow_files;                  // copy-on-write: files copied
+  StatsCounter  cow_bytes;
+
+  static FSStats* the();
+
+  void                              add_op (FSOpStats *op);
+  const std::vector<FSOpStats *>&   ops() const;
+};
+
+}
+
+#endif /* BFSYNC_STATS_HH */
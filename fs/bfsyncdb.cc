@@ -6,6 +6,8 @@
 #include "bfhistory.hh"
 #include "bftimeprof.hh"
 #include "bfidsorter.hh"
+#include "bfversionindex.hh"
+#include "bfxzwriter.hh"
 #include "config.h"
 
 #include <db_cxx.h>
@@ -13,6 +15,9 @@
 #include <algorithm>
 #include <set>
 
+#include <string.h>
+#include <unistd.h>
+
 using BFSync::DataOutBuffer;
 using BFSync::DataBuffer;
 using BFSync::DbcPtr;
@@ -24,6 +29,8 @@ using BFSync::History;
 using BFSync::TimeProfHandle;
 using BFSync::TimeProfSection;
 using BFSync::BDBError;
+using BFSync::INodeRecord;
+using BFSync::LinkRecord;
 
 using std::string;
 using std::vector;
@@ -289,6 +296,47 @@ BDBPtr::abort_transaction()
     throw BDBException (err);
 }
 
+/* like commit_transaction, but returns false if the transaction was aborted due to a deadlock */
+bool
+BDBPtr::try_commit_transaction()
+{
+  BDBError err = ptr->my_bdb->commit_transaction();
+  if (err == BFSync::BDB_ERROR_DEADLOCK)
+    return false;
+  if (err)
+    throw BDBException (err);
+
+  return true;
+}
+
+bool
+BDBPtr::retry_backoff (int attempt)
+{
+  return ptr->my_bdb->retry_backoff (attempt);
+}
+
+/* bulk mode (config option bulk-mode): "off", "write-nosync" or "nosync" */
+void
+BDBPtr::set_bulk_mode (const string& mode)
+{
+  if (mode == "off")
+    ptr->my_bdb->set_commit_mode (BFSync::BDB_COMMIT_SYNC);
+  else if (mode == "write-nosync")
+    ptr->my_bdb->set_commit_mode (BFSync::BDB_COMMIT_WRITE_NOSYNC);
+  else if (mode == "nosync")
+    ptr->my_bdb->set_commit_mode (BFSync::BDB_COMMIT_NOSYNC);
+  else
+    throw BDBException (BFSync::BDB_ERROR_UNKNOWN);
+}
+
+void
+BDBPtr::checkpoint()
+{
+  BDBError err = ptr->my_bdb->checkpoint();
+  if (err)
+    throw BDBException (err);
+}
+
 void
 id_store (const ID& id, DataOutBuffer& data_buf)
 {
@@ -302,13 +350,81 @@ id_load (ID& id, DataBuffer& dbuf)
   id.valid = true;
 }
 
-TimeProfSection tp_load_inode ("bfsyncdb.load_inode");
+static void
+inode_from_record (INode& inode, const INodeRecord& ir)
+{
+  inode.vmin = ir.vmin;
+  inode.vmax = ir.vmax;
+  inode.uid = ir.uid;
+  inode.gid = ir.gid;
+  inode.mode = ir.mode;
+  inode.type = ir.type;
+  inode.hash = ir.hash;
+  inode.link = ir.link;
+  inode.size = ir.size;
+  inode.major = ir.major;
+  inode.minor = ir.minor;
+  inode.nlink = ir.nlink;
+  inode.ctime = ir.ctime;
+  inode.ctime_ns = ir.ctime_ns;
+  inode.mtime = ir.mtime;
+  inode.mtime_ns = ir.mtime_ns;
+  inode.new_file_number = ir.new_file_number;
+}
 
-INode
-BDBPtr::load_inode (const ID& id, unsigned int version)
+static void
+write_inode_data (DataOutBuffer& dbuf, const INode& inode, BFSync::BDBRecordFormat format)
 {
-  TimeProfHandle h (tp_load_inode);
+  INodeRecord ir;
+
+  ir.vmin = inode.vmin;
+  ir.vmax = inode.vmax;
+  ir.uid = inode.uid;
+  ir.gid = inode.gid;
+  ir.mode = inode.mode;
+  ir.type = inode.type;
+  ir.hash = inode.hash;
+  ir.link = inode.link;
+  ir.size = inode.size;
+  ir.major = inode.major;
+  ir.minor = inode.minor;
+  ir.nlink = inode.nlink;
+  ir.ctime = inode.ctime;
+  ir.ctime_ns = inode.ctime_ns;
+  ir.mtime = inode.mtime;
+  ir.mtime_ns = inode.mtime_ns;
+  ir.new_file_number = inode.new_file_number;
+
+  ir.write (dbuf, format);
+}
+
+static void
+write_link_data (DataOutBuffer& dbuf, const Link& link, BFSync::BDBRecordFormat format)
+{
+  LinkRecord lr;
+
+  lr.vmin = link.vmin;
+  lr.vmax = link.vmax;
+  lr.inode_id = link.inode_id.id;
+  lr.name = link.name;
+
+  lr.write (dbuf, link.dir_id.id, format);
+}
+
+static void
+link_from_record (Link& link, const LinkRecord& lr)
+{
+  link.vmin = lr.vmin;
+  link.vmax = lr.vmax;
+  link.inode_id.id = lr.inode_id;
+  link.inode_id.valid = true;
+  link.name = lr.name;
+}
 
+/* load inode from the database (never from a version index), so the record can be deleted/replaced */
+static INode
+load_inode_db (BFSync::BDB *bdb, const ID& id, unsigned int version)
+{
   INode inode;
   DataOutBuffer kbuf;
 
@@ -318,40 +434,27 @@ BDBPtr::load_inode (const ID& id, unsigned int version)
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata;
 
-  DbcPtr dbc (ptr->my_bdb); /* Acquire a cursor for the database. */
+  DbcPtr dbc (bdb, BDB_TABLE_INODES); /* Acquire a cursor for the database. */
 
   int ret = dbc->get (&ikey, &idata, DB_SET);
   while (ret == 0)
     {
       DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
 
-      inode.vmin = dbuffer.read_uint32();
-      inode.vmax = dbuffer.read_uint32();
+      INodeRecord ir;
+      ir.read (dbuffer, bdb->record_format());
 
-      if (version >= inode.vmin && version <= inode.vmax)
+      if (version >= ir.vmin && version <= ir.vmax)
         {
-          inode.id   = id;
-          inode.uid  = dbuffer.read_uint32();
-          inode.gid  = dbuffer.read_uint32();
-          inode.mode = dbuffer.read_uint32();
-          inode.type = BFSync::FileType (dbuffer.read_uint32());
-          inode.hash = dbuffer.read_string();
-          inode.link = dbuffer.read_string();
-          inode.size = dbuffer.read_uint64();
-          inode.major = dbuffer.read_uint32();
-          inode.minor = dbuffer.read_uint32();
-          inode.nlink = dbuffer.read_uint32();
-          inode.ctime = dbuffer.read_uint32();
-          inode.ctime_ns = dbuffer.read_uint32();
-          inode.mtime = dbuffer.read_uint32();
-          inode.mtime_ns = dbuffer.read_uint32();
-          inode.new_file_number = dbuffer.read_uint32();
+          inode_from_record (inode, ir);
+          inode.id = id;
 
           inode.valid = true; // found
           return inode;
         }
       ret = dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  bdb->txn_check_read (ret);
 
   // not found -> return INode with valid == false
   inode = INode();
@@ -359,6 +462,38 @@ BDBPtr::load_inode (const ID& id, unsigned int version)
   return inode;
 }
 
+TimeProfSection tp_load_inode ("bfsyncdb.load_inode");
+
+INode
+BDBPtr::load_inode (const ID& id, unsigned int version)
+{
+  TimeProfHandle h (tp_load_inode);
+
+  return load_inode_db (ptr->my_bdb, id, version);
+}
+
+/*
+ * read-only lookup: historical versions are read from the version index (if any), so
+ * the result must never be used to modify the database (see bfversionindex.hh)
+ */
+INode
+BDBPtr::read_inode (const ID& id, unsigned int version)
+{
+  BFSync::VersionIndex *version_index = ptr->my_bdb->version_index (version);
+  if (!version_index)
+    return load_inode (id, version);
+
+  INode inode;
+  INodeRecord ir;
+  if (version_index->load_inode (id.id, ir))
+    {
+      inode_from_record (inode, ir);
+      inode.id = id;
+      inode.valid = true;
+    }
+  return inode;
+}
+
 TimeProfSection tp_load_all_inodes ("bfsyncdb.load_all_inodes");
 
 vector<INode>
@@ -377,37 +512,24 @@ BDBPtr::load_all_inodes (const ID& id)
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata;
 
-  DbcPtr dbc (ptr->my_bdb); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_INODES); /* Acquire a cursor for the database. */
 
   int ret = dbc->get (&ikey, &idata, DB_SET);
   while (ret == 0)
     {
       DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
 
-      inode.vmin = dbuffer.read_uint32();
-      inode.vmax = dbuffer.read_uint32();
-
-      inode.id   = id;
-      inode.uid  = dbuffer.read_uint32();
-      inode.gid  = dbuffer.read_uint32();
-      inode.mode = dbuffer.read_uint32();
-      inode.type = BFSync::FileType (dbuffer.read_uint32());
-      inode.hash = dbuffer.read_string();
-      inode.link = dbuffer.read_string();
-      inode.size = dbuffer.read_uint64();
-      inode.major = dbuffer.read_uint32();
-      inode.minor = dbuffer.read_uint32();
-      inode.nlink = dbuffer.read_uint32();
-      inode.ctime = dbuffer.read_uint32();
-      inode.ctime_ns = dbuffer.read_uint32();
-      inode.mtime = dbuffer.read_uint32();
-      inode.mtime_ns = dbuffer.read_uint32();
-      inode.new_file_number = dbuffer.read_uint32();
+      INodeRecord ir;
+      ir.read (dbuffer, ptr->my_bdb->record_format());
+
+      inode_from_record (inode, ir);
+      inode.id = id;
 
       inode.valid = true;
       all_inodes.push_back (inode);
       ret = dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  ptr->my_bdb->txn_check_read (ret);
   return all_inodes;
 }
 
@@ -423,23 +545,7 @@ BDBPtr::store_inode (const INode& inode)
   id_store (inode.id, kbuf);
   kbuf.write_table (BDB_TABLE_INODES);
 
-  dbuf.write_uint32 (inode.vmin);
-  dbuf.write_uint32 (inode.vmax);
-  dbuf.write_uint32 (inode.uid);
-  dbuf.write_uint32 (inode.gid);
-  dbuf.write_uint32 (inode.mode);
-  dbuf.write_uint32 (inode.type);
-  dbuf.write_string (inode.hash);
-  dbuf.write_string (inode.link);
-  dbuf.write_uint64 (inode.size);
-  dbuf.write_uint32 (inode.major);
-  dbuf.write_uint32 (inode.minor);
-  dbuf.write_uint32 (inode.nlink);
-  dbuf.write_uint32 (inode.ctime);
-  dbuf.write_uint32 (inode.ctime_ns);
-  dbuf.write_uint32 (inode.mtime);
-  dbuf.write_uint32 (inode.mtime_ns);
-  dbuf.write_uint32 (inode.new_file_number);
+  write_inode_data (dbuf, inode, ptr->my_bdb->record_format());
 
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata (dbuf.begin(), dbuf.size());
@@ -447,12 +553,40 @@ BDBPtr::store_inode (const INode& inode)
   DbTxn *txn = ptr->my_bdb->get_transaction();
   g_assert (txn);
 
-  int ret = ptr->my_bdb->get_db()->put (txn, &ikey, &idata, 0);
-  g_assert (ret == 0);
+  int ret = ptr->my_bdb->get_db (BDB_TABLE_INODES)->put (txn, &ikey, &idata, 0);
+  ptr->my_bdb->txn_check (ret);
 
   ptr->my_bdb->add_changed_inode (inode.id.id);
 }
 
+TimeProfSection tp_store_inodes ("bfsyncdb.store_inodes");
+
+/* like store_inode, but uses bulk puts to store many inodes at once */
+void
+BDBPtr::store_inodes (const vector<INode>& inodes)
+{
+  if (!ptr->my_bdb->get_transaction())
+    throw BDBException (BFSync::BDB_ERROR_NO_TRANS);
+
+  TimeProfHandle h (tp_store_inodes);
+
+  BFSync::BDBBulkWriter writer (ptr->my_bdb, BDB_TABLE_INODES);
+
+  for (vector<INode>::const_iterator ii = inodes.begin(); ii != inodes.end(); ii++)
+    {
+      DataOutBuffer kbuf, dbuf;
+
+      id_store (ii->id, kbuf);
+      kbuf.write_table (BDB_TABLE_INODES);
+
+      write_inode_data (dbuf, *ii, ptr->my_bdb->record_format());
+      writer.put (kbuf, dbuf);
+
+      ptr->my_bdb->add_changed_inode (ii->id.id);
+    }
+  writer.flush();
+}
+
 TimeProfSection tp_delete_inode ("bfsyncdb.delete_inode");
 
 void
@@ -471,7 +605,7 @@ BDBPtr::delete_inode (const INode& inode)
   Dbt ikey (kbuf.begin(), kbuf.size());
   Dbt idata;
 
-  DbcPtr dbc (ptr->my_bdb, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_INODES, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // iterate over key elements to find inode to delete
   int ret = dbc->get (&ikey, &idata, DB_SET);
@@ -479,16 +613,17 @@ BDBPtr::delete_inode (const INode& inode)
     {
       DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
 
-      unsigned int vmin = dbuffer.read_uint32();
-      unsigned int vmax = dbuffer.read_uint32();
+      INodeRecord ir;
+      ir.read (dbuffer, ptr->my_bdb->record_format());
 
-      if (inode.vmin == vmin && inode.vmax == vmax)
+      if (inode.vmin == ir.vmin && inode.vmax == ir.vmax)
         {
           ret = dbc->del (0);
-          g_assert (ret == 0);
+          ptr->my_bdb->txn_check (ret);
         }
       ret = dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  ptr->my_bdb->txn_check_read (ret);
 }
 
 unsigned int
@@ -537,7 +672,7 @@ BDBPtr::load_links (const ID& id, unsigned int version)
   lmulti_data.set_data (&multi_data_buffer[0]);
   lmulti_data.set_ulen (multi_data_buffer.size());
 
-  DbcPtr dbc (ptr->my_bdb); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_LINKS); /* Acquire a cursor for the database. */
 
   // iterate over key elements and delete records which are in LinkVersionList
   int ret = dbc->get (&lkey, &lmulti_data, DB_SET | DB_MULTIPLE);
@@ -548,24 +683,45 @@ BDBPtr::load_links (const ID& id, unsigned int version)
         {
           DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
 
-          guint32 vmin = dbuffer.read_uint32();
-          guint32 vmax = dbuffer.read_uint32();
+          LinkRecord lr;
+          lr.read (dbuffer, id.id, ptr->my_bdb->record_format());
+          assert (dbuffer.remaining() == 0);
 
-          if (version >= vmin && version <= vmax)
+          if (version >= lr.vmin && version <= lr.vmax)
             {
-              link.vmin = vmin;
-              link.vmax = vmax;
+              link_from_record (link, lr);
               link.dir_id = id;
-              id_load (link.inode_id, dbuffer);
-              link.name = dbuffer.read_string();
 
               result.push_back (link);
-
-              assert (dbuffer.remaining() == 0);
             }
         }
       ret = dbc->get (&lkey, &lmulti_data, DB_NEXT_DUP | DB_MULTIPLE);
     }
+  ptr->my_bdb->txn_check_read (ret);
+  return result;
+}
+
+/* read-only lookup: see read_inode */
+std::vector<Link>
+BDBPtr::read_links (const ID& id, unsigned int version)
+{
+  BFSync::VersionIndex *version_index = ptr->my_bdb->version_index (version);
+  if (!version_index)
+    return load_links (id, version);
+
+  vector<Link> result;
+  Link link;
+
+  vector<LinkRecord> lrs;
+  version_index->load_links (id.id, lrs);
+
+  for (vector<LinkRecord>::const_iterator li = lrs.begin(); li != lrs.end(); li++)
+    {
+      link_from_record (link, *li);
+      link.dir_id = id;
+
+      result.push_back (link);
+    }
   return result;
 }
 
@@ -586,7 +742,7 @@ BDBPtr::load_all_links (const ID& id)
   Dbt lkey (kbuf.begin(), kbuf.size());
   Dbt ldata;
 
-  DbcPtr dbc (ptr->my_bdb); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_LINKS); /* Acquire a cursor for the database. */
 
   // iterate over key elements and delete records which are in LinkVersionList
   int ret = dbc->get (&lkey, &ldata, DB_SET);
@@ -594,18 +750,19 @@ BDBPtr::load_all_links (const ID& id)
     {
       DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
 
+      LinkRecord lr;
+      lr.read (dbuffer, id.id, ptr->my_bdb->record_format());
+
       Link l;
 
-      l.vmin = dbuffer.read_uint32();
-      l.vmax = dbuffer.read_uint32();
+      link_from_record (l, lr);
       l.dir_id = id;
-      id_load (l.inode_id, dbuffer);
-      l.name = dbuffer.read_string();
 
       result.push_back (l);
 
       ret = dbc->get (&lkey, &ldata, DB_NEXT_DUP);
     }
+  ptr->my_bdb->txn_check_read (ret);
   return result;
 }
 
@@ -624,20 +781,46 @@ BDBPtr::store_link (const Link& link)
   id_store (link.dir_id, kbuf);
   kbuf.write_table (BDB_TABLE_LINKS);
 
-  dbuf.write_uint32 (link.vmin);
-  dbuf.write_uint32 (link.vmax);
-  id_store (link.inode_id, dbuf);
-  dbuf.write_string (link.name);
+  write_link_data (dbuf, link, ptr->my_bdb->record_format());
 
   Dbt lkey (kbuf.begin(), kbuf.size());
   Dbt ldata (dbuf.begin(), dbuf.size());
 
-  int ret = ptr->my_bdb->get_db()->put (transaction, &lkey, &ldata, 0);
-  g_assert (ret == 0);
+  int ret = ptr->my_bdb->get_db (BDB_TABLE_LINKS)->put (transaction, &lkey, &ldata, 0);
+  ptr->my_bdb->txn_check (ret);
 
   ptr->my_bdb->add_changed_inode (link.dir_id.id);
 }
 
+TimeProfSection tp_store_links ("bfsyncdb.store_links");
+
+/* like store_link, but uses bulk puts to store many links at once */
+void
+BDBPtr::store_links (const vector<Link>& links)
+{
+  if (!ptr->my_bdb->get_transaction())
+    throw BDBException (BFSync::BDB_ERROR_NO_TRANS);
+
+  TimeProfHandle h (tp_store_links);
+
+  BFSync::BDBBulkWriter writer (ptr->my_bdb, BDB_TABLE_LINKS);
+
+  for (vector<Link>::const_iterator li = links.begin(); li != links.end(); li++)
+    {
+      DataOutBuffer kbuf, dbuf;
+
+      id_store (li->dir_id, kbuf);
+      kbuf.write_table (BDB_TABLE_LINKS);
+
+      write_link_data (dbuf, *li, ptr->my_bdb->record_format());
+
+      writer.put (kbuf, dbuf);
+
+      ptr->my_bdb->add_changed_inode (li->dir_id.id);
+    }
+  writer.flush();
+}
+
 TimeProfSection tp_delete_link ("bfsyncdb.delete_link");
 
 void
@@ -650,15 +833,12 @@ BDBPtr::delete_link (const Link& link)
   id_store (link.dir_id, kbuf);
   kbuf.write_table (BDB_TABLE_LINKS);
 
-  dbuf.write_uint32 (link.vmin);
-  dbuf.write_uint32 (link.vmax);
-  id_store (link.inode_id, dbuf);
-  dbuf.write_string (link.name);
+  write_link_data (dbuf, link, ptr->my_bdb->record_format());
 
   Dbt lkey (kbuf.begin(), kbuf.size());
   Dbt ldata (dbuf.begin(), dbuf.size());
 
-  DbcPtr dbc (ptr->my_bdb, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_LINKS, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // iterate over key elements to find link to delete
   int ret = dbc->get (&lkey, &ldata, DB_GET_BOTH);
@@ -668,11 +848,12 @@ BDBPtr::delete_link (const Link& link)
       if (dbuf.size() == size && memcmp (dbuf.begin(), ldata.get_data(), size) == 0)
         {
           ret = dbc->del (0);
-          g_assert (ret == 0);
+          ptr->my_bdb->txn_check (ret);
         }
 
       ret = dbc->get (&lkey, &ldata, DB_NEXT_DUP);
     }
+  ptr->my_bdb->txn_check_read (ret);
 
   ptr->my_bdb->add_changed_inode (link.dir_id.id);
 }
@@ -699,10 +880,7 @@ BDBPtr::delete_links (const vector<Link>& links)
       id_store (link.dir_id, kbuf);
       kbuf.write_table (BDB_TABLE_LINKS);
 
-      dbuf.write_uint32 (link.vmin);
-      dbuf.write_uint32 (link.vmax);
-      id_store (link.inode_id, dbuf);
-      dbuf.write_string (link.name);
+      write_link_data (dbuf, link, ptr->my_bdb->record_format());
 
       // all links must belong to the same inode id
       if (li == links.begin())
@@ -720,7 +898,7 @@ BDBPtr::delete_links (const vector<Link>& links)
   Dbt lkey (&all_key[0], all_key.size());
   Dbt ldata;
 
-  DbcPtr dbc (ptr->my_bdb, DbcPtr::WRITE); /* Acquire a cursor for the database. */
+  DbcPtr dbc (ptr->my_bdb, BDB_TABLE_LINKS, DbcPtr::WRITE); /* Acquire a cursor for the database. */
 
   // iterate over key elements to find link to delete
   int ret = dbc->get (&lkey, &ldata, DB_SET);
@@ -733,11 +911,12 @@ BDBPtr::delete_links (const vector<Link>& links)
       if (delete_data_set.count (data) != 0)
         {
           ret = dbc->del (0);
-          g_assert (ret == 0);
+          ptr->my_bdb->txn_check (ret);
         }
 
       ret = dbc->get (&lkey, &ldata, DB_NEXT_DUP);
     }
+  ptr->my_bdb->txn_check_read (ret);
 
   ptr->my_bdb->add_changed_inode (links[0].dir_id.id);
 }
@@ -844,7 +1023,9 @@ BDBPtr::walk()
 }
 
 DiffGenerator::DiffGenerator (BDBPtr bdb_ptr) :
-  dbc (bdb_ptr.get_bdb()),
+  dbc (bdb_ptr.get_bdb(), BDB_TABLE_CHANGED_INODES, DbcPtr::SNAPSHOT),
+  inode_dbc (bdb_ptr.get_bdb(), BDB_TABLE_INODES, DbcPtr::SNAPSHOT),
+  link_dbc (bdb_ptr.get_bdb(), BDB_TABLE_LINKS, DbcPtr::SNAPSHOT),
   bdb_ptr (bdb_ptr)
 {
   kbuf.write_table (BDB_TABLE_CHANGED_INODES);
@@ -869,187 +1050,406 @@ DiffGenerator::DiffGenerator (BDBPtr bdb_ptr) :
   v_old = bdb_ptr.get_bdb()->history()->current_version() - 1;
   v_new = bdb_ptr.get_bdb()->history()->current_version();
   id_pos = 0;
+  block_pos = 0;
 }
 
 DiffGenerator::~DiffGenerator()
 {
 }
 
+namespace {
+
+/* appends \0 terminated diff fields to a string */
+class DiffWriter
+{
+  string& out;
+public:
+  DiffWriter (string& out) :
+    out (out)
+  {
+  }
+  void
+  field (const char *str, size_t len)
+  {
+    out.append (str, len);
+    out += '\0';
+  }
+  void
+  field (const char *str)
+  {
+    field (str, strlen (str));
+  }
+  void
+  field (const string& str)
+  {
+    field (str.data(), str.size());
+  }
+  void
+  field (guint64 n)
+  {
+    char buffer[20];
+    char *end = buffer + sizeof (buffer);
+    char *p = end;
+    do
+      {
+        *--p = '0' + n % 10;
+        n /= 10;
+      }
+    while (n);
+    field (p, end - p);
+  }
+  void
+  field (const BFSync::ID& id)
+  {
+    field (id.str());
+  }
+  /* i! entries: empty field if the attribute didn't change */
+  template<class T> void
+  attr (const INodeRecord *i_old, const INodeRecord& i_new, T INodeRecord::*member)
+  {
+    if (i_old && i_old->*member == i_new.*member)
+      field ("", 0);
+    else
+      field (i_new.*member);
+  }
+};
+
+}
+
+/* find records of id for v_old and v_new with a single scan over all inode versions */
 void
-make_lmap (map<string, const Link*>& lmap, const vector<Link>& links)
+DiffGenerator::load_inodes (const BFSync::ID& id, INodeRecord& i_old, bool& old_ok,
+                            INodeRecord& i_new, bool& new_ok)
 {
-  for (vector<Link>::const_iterator li = links.begin(); li != links.end(); li++)
+  BFSync::BDB *bdb = bdb_ptr.get_bdb();
+
+  BFSync::VersionIndex *vi_old = bdb->version_index (v_old);
+  BFSync::VersionIndex *vi_new = bdb->version_index (v_new);
+
+  old_ok = vi_old ? vi_old->load_inode (id, i_old) : false;
+  new_ok = vi_new ? vi_new->load_inode (id, i_new) : false;
+
+  bool need_old = !vi_old;
+  bool need_new = !vi_new;
+  if (!need_old && !need_new)
+    return;
+
+  DataOutBuffer ikbuf;
+
+  id.store (ikbuf);
+  ikbuf.write_table (BDB_TABLE_INODES);
+
+  Dbt ikey (ikbuf.begin(), ikbuf.size());
+  Dbt idata;
+
+  int ret = inode_dbc->get (&ikey, &idata, DB_SET);
+  while (ret == 0)
     {
-      const Link& link = *li;
-      lmap[link.name] = &link;
+      DataBuffer dbuffer ((char *) idata.get_data(), idata.get_size());
+
+      guint32 vmin, vmax;
+      INodeRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+
+      bool is_old = need_old && v_old >= vmin && v_old <= vmax;
+      bool is_new = need_new && v_new >= vmin && v_new <= vmax;
+      if (is_old || is_new)
+        {
+          INodeRecord& ir = is_old ? i_old : i_new;
+          ir.read (dbuffer, bdb->record_format());
+          if (is_old && is_new)
+            i_new = i_old;
+
+          if (is_old)
+            {
+              old_ok = true;
+              need_old = false;
+            }
+          if (is_new)
+            {
+              new_ok = true;
+              need_new = false;
+            }
+          if (!need_old && !need_new)
+            return;
+        }
+      ret = inode_dbc->get (&ikey, &idata, DB_NEXT_DUP);
     }
+  bdb->txn_check_read (ret);
 }
 
-string
-print_id (const ID& id)
+/* fill links_old and links_new with a single scan over all link versions */
+void
+DiffGenerator::load_links (const BFSync::ID& id)
 {
-  return id.id.str();
+  BFSync::BDB *bdb = bdb_ptr.get_bdb();
+
+  links_old.clear();
+  links_new.clear();
+
+  BFSync::VersionIndex *vi_old = bdb->version_index (v_old);
+  BFSync::VersionIndex *vi_new = bdb->version_index (v_new);
+
+  if (vi_old)
+    vi_old->load_links (id, links_old);
+  if (vi_new)
+    vi_new->load_links (id, links_new);
+  if (vi_old && vi_new)
+    return;
+
+  DataOutBuffer lkbuf;
+
+  id.store (lkbuf);
+  lkbuf.write_table (BDB_TABLE_LINKS);
+
+  Dbt lkey (lkbuf.begin(), lkbuf.size());
+  Dbt ldata;
+
+  vector<char>& multi_data_buffer = bdb->multi_data_buffer();
+
+  Dbt lmulti_data;
+  lmulti_data.set_flags (DB_DBT_USERMEM);
+  lmulti_data.set_data (&multi_data_buffer[0]);
+  lmulti_data.set_ulen (multi_data_buffer.size());
+
+  int ret = link_dbc->get (&lkey, &lmulti_data, DB_SET | DB_MULTIPLE);
+  while (ret == 0)
+    {
+      DbMultipleDataIterator data_iterator (lmulti_data);
+      while (data_iterator.next (ldata))
+        {
+          DataBuffer dbuffer ((char *) ldata.get_data(), ldata.get_size());
+
+          guint32 vmin, vmax;
+          LinkRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+
+          bool is_old = !vi_old && v_old >= vmin && v_old <= vmax;
+          bool is_new = !vi_new && v_new >= vmin && v_new <= vmax;
+          if (is_old || is_new)
+            {
+              LinkRecord lr;
+              lr.read (dbuffer, id, bdb->record_format());
+              assert (dbuffer.remaining() == 0);
+
+              if (is_old)
+                links_old.push_back (lr);
+              if (is_new)
+                links_new.push_back (lr);
+            }
+        }
+      ret = link_dbc->get (&lkey, &lmulti_data, DB_NEXT_DUP | DB_MULTIPLE);
+    }
+  bdb->txn_check_read (ret);
 }
 
-vector<string>
-gen_iplus (const INode& inode)
+bool
+DiffGenerator::cmp_link_name (const LinkRecord& a, const LinkRecord& b)
 {
-  vector<string> result;
-  result.push_back ("i+");
-  result.push_back (print_id (inode.id));
-  result.push_back (string_printf ("%u", inode.uid));
-  result.push_back (string_printf ("%u", inode.gid));
-  result.push_back (string_printf ("%u", inode.mode));
-  result.push_back (string_printf ("%u", inode.type));
-  result.push_back (inode.hash);
-  result.push_back (inode.link);
-  result.push_back (string_printf ("%" G_GUINT64_FORMAT, inode.size));
-  result.push_back (string_printf ("%u", inode.major));
-  result.push_back (string_printf ("%u", inode.minor));
-  result.push_back (string_printf ("%u", inode.nlink));
-  result.push_back (string_printf ("%u", inode.ctime));
-  result.push_back (string_printf ("%u", inode.ctime_ns));
-  result.push_back (string_printf ("%u", inode.mtime));
-  result.push_back (string_printf ("%u", inode.mtime_ns));
-  return result;
+  return a.name < b.name;
 }
 
-vector<string>
-gen_ibang (const INode& i_old, const INode& i_new)
+/* append the changes of one id to block: inode change first, then link changes sorted by name */
+void
+DiffGenerator::gen_diff (const BFSync::ID& id)
 {
-  vector<string> result;
-  vector<string> old_str = gen_iplus (i_old);
-  vector<string> new_str = gen_iplus (i_new);
-  g_assert (old_str.size() > 2 && old_str.size() == new_str.size());
+  DiffWriter out (block);
+
+  INodeRecord i_old, i_new;
+  bool        old_ok, new_ok;
+
+  load_inodes (id, i_old, old_ok, i_new, new_ok);
+
+  if (new_ok && (!old_ok || i_old.vmin != i_new.vmin || i_old.vmax != i_new.vmax))
+    {
+      // i+ (new inode) or i! (changed attributes, unchanged ones are empty)
+      const INodeRecord *old_p = old_ok ? &i_old : NULL;
+
+      out.field (old_p ? "i!" : "i+");
+      out.field (id);
+      out.attr (old_p, i_new, &INodeRecord::uid);
+      out.attr (old_p, i_new, &INodeRecord::gid);
+      out.attr (old_p, i_new, &INodeRecord::mode);
+      out.attr (old_p, i_new, &INodeRecord::type);
+      out.attr (old_p, i_new, &INodeRecord::hash);
+      out.attr (old_p, i_new, &INodeRecord::link);
+      out.attr (old_p, i_new, &INodeRecord::size);
+      out.attr (old_p, i_new, &INodeRecord::major);
+      out.attr (old_p, i_new, &INodeRecord::minor);
+      out.attr (old_p, i_new, &INodeRecord::nlink);
+      out.attr (old_p, i_new, &INodeRecord::ctime);
+      out.attr (old_p, i_new, &INodeRecord::ctime_ns);
+      out.attr (old_p, i_new, &INodeRecord::mtime);
+      out.attr (old_p, i_new, &INodeRecord::mtime_ns);
+    }
+  else if (old_ok && !new_ok)
+    {
+      out.field ("i-");
+      out.field (id);
+    }
+
+  load_links (id);
+
+  std::sort (links_old.begin(), links_old.end(), cmp_link_name);
+  std::sort (links_new.begin(), links_new.end(), cmp_link_name);
 
-  result.push_back ("i!");
-  result.push_back (old_str[1]);
-  for (size_t i = 2; i < old_str.size(); i++)
+  vector<LinkRecord>::const_iterator oi = links_old.begin();
+  vector<LinkRecord>::const_iterator ni = links_new.begin();
+  while (oi != links_old.end() || ni != links_new.end())
     {
-      if (old_str[i] != new_str[i])
-        result.push_back (new_str[i]);
+      int c;
+      if (oi == links_old.end())
+        c = 1;
+      else if (ni == links_new.end())
+        c = -1;
+      else
+        c = oi->name.compare (ni->name);
+
+      if (c < 0)
+        {
+          out.field ("l-");
+          out.field (id);
+          out.field (oi->name);
+          oi++;
+        }
+      else if (c > 0)
+        {
+          out.field ("l+");
+          out.field (id);
+          out.field (ni->name);
+          out.field (ni->inode_id);
+          ni++;
+        }
       else
-        result.push_back ("");    // attribute not changed
+        {
+          if (oi->inode_id != ni->inode_id)
+            {
+              out.field ("l!");
+              out.field (id);
+              out.field (ni->name);
+              out.field (ni->inode_id);
+            }
+          oi++;
+          ni++;
+        }
     }
-  return result;
 }
 
-vector<string>
-gen_iminus (const INode& inode)
+static size_t
+diff_field_count (const string& type)
 {
-  vector<string> result;
-  result.push_back ("i-");
-  result.push_back (print_id (inode.id));
-  return result;
+  if (type == "i+" || type == "i!")
+    return 16;
+  if (type == "i-")
+    return 2;
+  if (type == "l+" || type == "l!")
+    return 4;
+  if (type == "l-")
+    return 3;
+
+  g_assert_not_reached();
+  return 0;
 }
 
 vector<string>
-gen_lplus (const Link *link)
+DiffGenerator::get_next()
 {
   vector<string> result;
-  result.push_back ("l+");
-  result.push_back (print_id (link->dir_id));
-  result.push_back (link->name);
-  result.push_back (print_id (link->inode_id));
+
+  while (block_pos == block.size() && id_pos < ids.size())
+    {
+      block.clear();
+      block_pos = 0;
+
+      gen_diff (ids.id (id_pos++));
+    }
+  if (block_pos == block.size())   // done
+    return result;
+
+  size_t n_fields = 0;
+  do
+    {
+      size_t end = block.find ('\0', block_pos);
+      g_assert (end != string::npos);
+
+      result.push_back (block.substr (block_pos, end - block_pos));
+      block_pos = end + 1;
+
+      if (result.size() == 1)
+        n_fields = diff_field_count (result[0]);
+    }
+  while (result.size() < n_fields);
+
   return result;
 }
 
-vector<string>
-gen_lbang (const Link *link)
+/*
+ * returns the next changes (at least max_bytes, unless the diff ends); an empty
+ * string is returned when the diff is complete
+ */
+string
+DiffGenerator::get_block (size_t max_bytes)
 {
-  vector<string> result;
-  result.push_back ("l!");
-  result.push_back (print_id (link->dir_id));
-  result.push_back (link->name);
-  result.push_back (print_id (link->inode_id));
+  // changes left over from get_next()
+  block.erase (0, block_pos);
+  block_pos = 0;
+
+  while (block.size() < max_bytes && id_pos < ids.size())
+    gen_diff (ids.id (id_pos++));
+
+  string result;
+  result.swap (block);
   return result;
 }
 
-vector<string>
-gen_lminus (const Link *link)
+size_t
+DiffGenerator::id_count()
 {
-  vector<string> result;
-  result.push_back ("l-");
-  result.push_back (print_id (link->dir_id));
-  result.push_back (link->name);
-  return result;
+  return ids.size();
 }
 
-vector<string>
-DiffGenerator::get_next()
+DiffXzResult
+write_diff_xz (BDBPtr bdb_ptr, const string& filename, unsigned int threads)
 {
-  while (id_pos < ids.size() && diffs.empty())
-    {
-      ID id;
-      id.id = ids.id (id_pos++);
-
-      // generate i+ / i- and i! entries for id
-      INode i_old = bdb_ptr.load_inode (id, v_old);
-      INode i_new = bdb_ptr.load_inode (id, v_new);
-
-      if (i_old.valid && i_new.valid)
-        {
-          if (i_old.vmin != i_new.vmin || i_old.vmax != i_new.vmax)
-            diffs.push (gen_ibang (i_old, i_new));
-        }
-      else if (!i_old.valid && i_new.valid)
-        {
-          diffs.push (gen_iplus (i_new));
-        }
-      else if (i_old.valid && !i_new.valid)
-        {
-          diffs.push (gen_iminus (i_old));
-        }
-
-      // generate l+ / l- and l! entries for dir_id = id
-      vector<Link> lvec_old = bdb_ptr.load_links (id, v_old);
-      vector<Link> lvec_new = bdb_ptr.load_links (id, v_new);
-
-      map<string, const Link*> lmap_old;
-      map<string, const Link*> lmap_new;
+  DiffXzResult result;
+  result.ok = false;
+  result.diff_size = 0;
+  result.xz_size = 0;
 
-      make_lmap (lmap_old, lvec_old);
-      make_lmap (lmap_new, lvec_new);
-
-      // sort l+ / l- and l! entries by link name
-      set<string> link_names;
-
-      for (map<string, const Link*>::iterator mi = lmap_new.begin(); mi != lmap_new.end(); mi++)
-        link_names.insert (mi->first);
+  BFSync::XzWriter writer;
+  if (!writer.open (filename, threads))
+    {
+      result.error = writer.error();
+      return result;
+    }
 
-      for (map<string, const Link*>::iterator mi = lmap_old.begin(); mi != lmap_old.end(); mi++)
-        link_names.insert (mi->first);
+  DiffGenerator dg (bdb_ptr);
+  for (;;)
+    {
+      string block = dg.get_block (1024 * 1024);
+      if (block.empty())
+        break;
 
-      for (set<string>::iterator lni = link_names.begin(); lni != link_names.end(); lni++)
+      if (!writer.write (block.data(), block.size()))
         {
-          const Link *l_old = lmap_old[*lni];
-          const Link *l_new = lmap_new[*lni];
-
-          if (!l_old && l_new)
-            {
-              diffs.push (gen_lplus (l_new));
-            }
-          else if (l_old && l_new)
-            {
-              if (l_old->inode_id.id != l_new->inode_id.id)
-                diffs.push (gen_lbang (l_new));
-            }
-          else if (l_old && !l_new)
-            {
-              diffs.push (gen_lminus (l_old));
-            }
+          result.error = writer.error();
+          unlink (filename.c_str());
+          return result;
         }
     }
-  if (!diffs.empty())
+  if (!writer.close())
     {
-      vector<string> d = diffs.front();
-      diffs.pop();
-      return d;
+      result.error = writer.error();
+      unlink (filename.c_str());
+      return result;
     }
+  result.ok = true;
+  result.diff_size = writer.in_bytes();
+  result.xz_size = writer.out_bytes();
+  if (result.diff_size != 0)
+    result.hash = writer.hash();
   else
-    {
-      return vector<string>();
-    }
+    unlink (filename.c_str());
+
+  return result;
 }
 
 void
@@ -1115,6 +1515,15 @@ BDBPtr::delete_hash2file (const string& hash)
   ptr->my_bdb->delete_hash2file (hash);
 }
 
+void
+BDBPtr::delete_hash2file_bin (const string& bin_hash)
+{
+  if (bin_hash.size() != 20)
+    throw BDBException (BFSync::BDB_ERROR_UNKNOWN);
+
+  ptr->my_bdb->delete_hash2file_bin (bin_hash);
+}
+
 void
 BDBPtr::add_deleted_file (unsigned int file_number)
 {
@@ -1189,13 +1598,104 @@ BDBPtr::set_variable (const string& variable, const vector<string>& value)
     throw BDBException (err);
 }
 
-void
-print_leak_debugger_stats()
+string
+BDBPtr::cache_stats()
 {
-  BFSync::LeakDebugger::print_stats();
-}
+  BFSync::BDBCacheStats stats;
 
-/* refcounting BDB wrapper */
+  BDBError err = ptr->my_bdb->cache_stats (stats);
+  if (err)
+    throw BDBException (err);
+
+  return stats.to_string();
+}
+
+int
+BDBPtr::recommended_cache_size()
+{
+  BFSync::BDBCacheStats stats;
+
+  BDBError err = ptr->my_bdb->cache_stats (stats);
+  if (err)
+    throw BDBException (err);
+
+  return stats.recommended_cache_mb();
+}
+
+string
+BDBPtr::lock_stats()
+{
+  BFSync::BDBLockStats stats;
+
+  BDBError err = ptr->my_bdb->lock_stats (stats);
+  if (err)
+    throw BDBException (err);
+
+  return stats.to_string();
+}
+
+string
+BDBPtr::hash2file_stats()
+{
+  BFSync::BDBHash2FileStats stats;
+
+  ptr->my_bdb->hash2file_stats (stats);
+
+  return stats.to_string();
+}
+
+/*
+ * online compaction: max_seconds <= 0 means no time limit
+ *
+ * after conflicts with other processes, compaction waits (like transactions that failed
+ * with a deadlock) and gives up if the same range conflicts too often
+ */
+string
+BDBPtr::compact (double max_seconds)
+{
+  BFSync::BDBCompactor compactor (ptr->my_bdb, true);
+
+  double end_t = max_seconds > 0 ? BFSync::gettime() + max_seconds : G_MAXDOUBLE;
+  for (;;)
+    {
+      BDBError err = compactor.step (max_seconds > 0 ? end_t - BFSync::gettime() : G_MAXDOUBLE);
+      if (err)
+        throw BDBException (err);
+
+      if (compactor.done() || BFSync::gettime() >= end_t || compactor.conflicts() == 0 ||
+          !ptr->my_bdb->retry_backoff (compactor.conflicts() - 1))
+        break;
+    }
+
+  string s = compactor.stats().to_string();
+  s += string_printf ("compact-complete %d;\n", compactor.done() ? 1 : 0);
+  return s;
+}
+
+bool
+BDBPtr::build_version_index (unsigned int version)
+{
+  return BFSync::version_index_build (ptr->my_bdb, version, ptr->my_bdb->version_index_filename (version));
+}
+
+bool
+BDBPtr::verify_version_index (unsigned int version)
+{
+  BFSync::VersionIndex index;
+
+  if (!index.open (ptr->my_bdb->version_index_filename (version)))
+    return false;
+
+  return index.version() == version && index.verify();
+}
+
+void
+print_leak_debugger_stats()
+{
+  BFSync::LeakDebugger::print_stats();
+}
+
+/* refcounting BDB wrapper */
 
 BDBPtr::BDBPtr (BDBWrapper *wrapper) :
   ptr (wrapper)
@@ -1259,7 +1759,7 @@ BDBWrapper::~BDBWrapper()
 }
 
 ChangedINodesIterator::ChangedINodesIterator (BDBPtr bdb_ptr) :
-  dbc (bdb_ptr.get_bdb()),
+  dbc (bdb_ptr.get_bdb(), BDB_TABLE_CHANGED_INODES, DbcPtr::SNAPSHOT),
   bdb_ptr (bdb_ptr)
 {
   kbuf.write_table (BDB_TABLE_CHANGED_INODES);
@@ -1292,8 +1792,511 @@ ChangedINodesIterator::~ChangedINodesIterator()
 {
 }
 
+//---------------------------- IDList -----------------------------
+
+/* file format: magic, number of IDs, IDs (as stored in the db) */
+static const char   ID_LIST_MAGIC[8] = { 'B', 'F', 'I', 'D', 'L', 'S', 'T', '1' };
+static const size_t ID_LIST_HEADER_SIZE = 16;
+static const size_t ID_LIST_BUFFER_SIZE = 1024 * 1024;
+
+bool
+make_changed_id_list (BDBPtr bdb_ptr, const string& filename)
+{
+  FILE *file = fopen (filename.c_str(), "w");
+  if (!file)
+    return false;
+
+  DataOutBuffer out;
+  out.write_bytes (ID_LIST_MAGIC, sizeof (ID_LIST_MAGIC));
+  out.write_uint64 (0);   /* number of IDs: updated when done */
+
+  /* changed inodes table is DB_DUPSORT, so the IDs are already sorted */
+  DbcPtr dbc (bdb_ptr.get_bdb(), BDB_TABLE_CHANGED_INODES, DbcPtr::SNAPSHOT);
+
+  DataOutBuffer kbuf;
+  kbuf.write_table (BDB_TABLE_CHANGED_INODES);
+
+  Dbt key (kbuf.begin(), kbuf.size());
+  Dbt data;
+
+  bool     write_ok = true;
+  guint64  n_ids = 0;
+
+  int ret = dbc->get (&key, &data, DB_SET);
+  while (ret == 0 && write_ok)
+    {
+      out.write_bytes ((char *) data.get_data(), data.get_size());
+      n_ids++;
+
+      if (out.size() >= ID_LIST_BUFFER_SIZE)
+        {
+          write_ok = fwrite (out.begin(), out.size(), 1, file) == 1;
+          out.clear();
+        }
+      ret = dbc->get (&key, &data, DB_NEXT_DUP);
+    }
+  if (out.size() && write_ok)
+    write_ok = fwrite (out.begin(), out.size(), 1, file) == 1;
+
+  out.clear();
+  out.write_uint64 (n_ids);
+  if (write_ok)
+    write_ok = fseek (file, sizeof (ID_LIST_MAGIC), SEEK_SET) == 0 && fwrite (out.begin(), out.size(), 1, file) == 1;
+
+  /* the list must be on disk before the journal entry refers to it */
+  if (write_ok)
+    write_ok = fflush (file) == 0 && fsync (fileno (file)) == 0;
+
+  if (fclose (file) != 0)
+    write_ok = false;
+
+  return write_ok && (ret == DB_NOTFOUND);
+}
+
+IDList::IDList() :
+  file (NULL),
+  buffer (ID_LIST_BUFFER_SIZE),
+  buffer_start (0),
+  buffer_end (0),
+  m_size (0),
+  m_position (0)
+{
+}
+
+IDList::~IDList()
+{
+  if (file)
+    fclose (file);
+}
+
+bool
+IDList::open (const string& filename)
+{
+  if (file)
+    fclose (file);
+
+  buffer_start = buffer_end = 0;
+  m_size = m_position = 0;
+
+  file = fopen (filename.c_str(), "r");
+  if (!file)
+    return false;
+
+  char header[ID_LIST_HEADER_SIZE];
+  if (fread (header, sizeof (header), 1, file) != 1 || memcmp (header, ID_LIST_MAGIC, sizeof (ID_LIST_MAGIC)) != 0)
+    {
+      fclose (file);
+      file = NULL;
+      return false;
+    }
+  DataBuffer dbuffer (header + sizeof (ID_LIST_MAGIC), sizeof (header) - sizeof (ID_LIST_MAGIC));
+  m_size = dbuffer.read_uint64();
+  return true;
+}
+
+uint64_t
+IDList::size() const
+{
+  return m_size;
+}
+
+uint64_t
+IDList::position() const
+{
+  return m_position;
+}
+
+void
+IDList::seek (uint64_t position)
+{
+  if (!file || fseek (file, ID_LIST_HEADER_SIZE, SEEK_SET) != 0)
+    throw BDBException (BFSync::BDB_ERROR_IO);
+
+  buffer_start = buffer_end = 0;
+  m_position = 0;
+
+  /* records have variable length, so we need to skip over them */
+  while (m_position < position && m_position < m_size)
+    next_batch (std::min<uint64_t> (position - m_position, 4096));
+}
+
+bool
+IDList::fill_buffer()
+{
+  memmove (&buffer[0], &buffer[buffer_start], buffer_end - buffer_start);
+  buffer_end -= buffer_start;
+  buffer_start = 0;
+
+  size_t bytes = fread (&buffer[buffer_end], 1, buffer.size() - buffer_end, file);
+  buffer_end += bytes;
+
+  return bytes > 0;
+}
+
+vector<ID>
+IDList::next_batch (unsigned int max_ids)
+{
+  if (!file)
+    throw BDBException (BFSync::BDB_ERROR_IO);
+
+  vector<ID> ids;
+  while (ids.size() < max_ids && m_position < m_size)
+    {
+      /* record: zero terminated path prefix, a, b, c, d, e */
+      const char *start = &buffer[0] + buffer_start;
+      const char *zero  = (const char *) memchr (start, 0, buffer_end - buffer_start);
+
+      if (!zero || size_t (&buffer[0] + buffer_end - zero) < 1 + 5 * 4)
+        {
+          if (!fill_buffer())
+            throw BDBException (BFSync::BDB_ERROR_IO);  /* truncated file */
+          continue;
+        }
+      DataBuffer dbuffer (start, buffer_end - buffer_start);
+
+      ID id;
+      id_load (id, dbuffer);
+      ids.push_back (id);
+
+      buffer_start = buffer_end - dbuffer.remaining();
+      m_position++;
+    }
+  return ids;
+}
+
+//---------------------------- FileHasher -----------------------------
+
+FileHasher::FileHasher (unsigned int n_threads) :
+  hasher (new BFSync::FileHasher (n_threads))
+{
+}
+
+FileHasher::~FileHasher()
+{
+  delete hasher;
+}
+
+void
+FileHasher::add_file (const string& filename)
+{
+  hasher->add_file (filename);
+}
+
+bool
+FileHasher::wait_result (double timeout)
+{
+  return hasher->wait_result (timeout);
+}
+
+FileHashResult
+FileHasher::next_result()
+{
+  BFSync::FileHashResult r = hasher->next_result();
+
+  FileHashResult result;
+  result.hash = r.hash;
+  result.size = r.size;
+  result.ok = r.ok;
+  result.error = r.error;
+  return result;
+}
+
+uint64_t
+FileHasher::bytes_done()
+{
+  return hasher->bytes_done();
+}
+
+unsigned int
+FileHasher::n_threads()
+{
+  return hasher->n_threads();
+}
+
+//---------------------------- CommitEngine -----------------------------
+
+CommitEngine::CommitEngine (BDBPtr bdb_ptr, const string& repo_path, const string& id_list_filename,
+                            unsigned int version, unsigned int hash_threads) :
+  bdb_ptr (bdb_ptr),
+  repo_path (repo_path),
+  version (version),
+  hash_threads (hash_threads),
+  batch_pos (0),
+  hasher (NULL),
+  m_total_file_count (0),
+  m_total_file_size (0),
+  m_files_added (0),
+  m_bytes_done (0)
+{
+  m_open_ok = id_list.open (id_list_filename);
+}
+
+CommitEngine::~CommitEngine()
+{
+  delete hasher;
+}
+
+bool
+CommitEngine::open_ok()
+{
+  return m_open_ok;
+}
+
+/* same as Repo.make_number_filename */
+string
+CommitEngine::file_name (unsigned int file_number)
+{
+  return repo_path + string_printf ("/objects/%x/%03x", file_number / 4096, file_number % 4096);
+}
+
+/* count new files and their size (for progress information) */
+void
+CommitEngine::scan()
+{
+  m_total_file_count = 0;
+  m_total_file_size = 0;
+
+  id_list.seek (0);
+  for (;;)
+    {
+      vector<ID> ids = id_list.next_batch (1024);
+      if (ids.empty())
+        break;
+
+      for (size_t i = 0; i < ids.size(); i++)
+        {
+          INode inode = bdb_ptr.load_inode (ids[i], version);
+          if (inode.valid && inode.hash == "new")
+            {
+              struct stat st;
+              if (stat (file_name (inode.new_file_number).c_str(), &st) == 0)
+                m_total_file_size += st.st_size;
+              m_total_file_count++;
+            }
+        }
+    }
+  id_list.seek (0);
+}
+
+uint64_t
+CommitEngine::total_file_count()
+{
+  return m_total_file_count;
+}
+
+uint64_t
+CommitEngine::total_file_size()
+{
+  return m_total_file_size;
+}
+
+void
+CommitEngine::seek (uint64_t position)
+{
+  id_list.seek (position);
+}
+
+uint64_t
+CommitEngine::position()
+{
+  return id_list.position();
+}
+
+bool
+CommitEngine::cmp_file_number (const Entry& a, const Entry& b)
+{
+  return a.inode_new.new_file_number < b.inode_new.new_file_number;
+}
+
+/* load the next max_ids ids; returns false if there are no more ids */
+bool
+CommitEngine::load_batch (unsigned int max_ids)
+{
+  delete hasher;
+  hasher = NULL;
+
+  batch.clear();
+  batch_pos = 0;
+
+  vector<ID> ids = id_list.next_batch (max_ids);
+  if (ids.empty())
+    return false;
+
+  for (size_t i = 0; i < ids.size(); i++)
+    {
+      INode inode = bdb_ptr.load_inode (ids[i], version);
+      if (inode.valid && inode.hash == "new")
+        {
+          batch.push_back (Entry());
+
+          Entry& entry = batch.back();
+          entry.inode_new = inode;
+          /* records of the old version are deleted/replaced by finish_entry */
+          entry.inode_old = load_inode_db (bdb_ptr.get_bdb(), ids[i], version - 1);
+          entry.size = 0;
+        }
+    }
+  // read files in file number order
+  std::sort (batch.begin(), batch.end(), cmp_file_number);
+  return true;
+}
+
+vector<unsigned int>
+CommitEngine::batch_file_numbers()
+{
+  vector<unsigned int> result;
+  for (size_t i = 0; i < batch.size(); i++)
+    result.push_back (batch[i].inode_new.new_file_number);
+  return result;
+}
+
+/* set hash that is already known (from bfsyncfs), so the file needs not to be hashed */
+void
+CommitEngine::set_hash (unsigned int file_number, const string& hash)
+{
+  for (size_t i = 0; i < batch.size(); i++)
+    {
+      Entry& entry = batch[i];
+      if (entry.inode_new.new_file_number == file_number && entry.hash.empty())
+        {
+          struct stat st;
+          if (stat (file_name (file_number).c_str(), &st) == 0)
+            {
+              entry.hash = hash;
+              entry.size = st.st_size;
+            }
+        }
+    }
+}
+
+void
+CommitEngine::start_hashing()
+{
+  hasher = new BFSync::FileHasher (hash_threads);
+
+  for (size_t i = 0; i < batch.size(); i++)
+    {
+      if (batch[i].hash.empty())
+        hasher->add_file (file_name (batch[i].inode_new.new_file_number));
+    }
+}
+
+static bool
+inode_attrs_equal (const INode& a, const INode& b)
+{
+  return a.uid == b.uid && a.gid == b.gid && a.mode == b.mode && a.type == b.type &&
+         a.link == b.link && a.size == b.size && a.major == b.major && a.minor == b.minor &&
+         a.nlink == b.nlink && a.ctime == b.ctime && a.ctime_ns == b.ctime_ns &&
+         a.mtime == b.mtime && a.mtime_ns == b.mtime_ns;
+}
+
+void
+CommitEngine::finish_entry (Entry& entry)
+{
+  INode& inode_new = entry.inode_new;
+  INode& inode_old = entry.inode_old;
+
+  /* in some (very rare) cases, bfsyncfs will copy-on-write the file associated with the inode
+   * without modifying the file data or inode attributes: reset the inode to the old version
+   */
+  if (inode_old.valid && (inode_old.vmin != inode_new.vmin || inode_old.vmax != inode_new.vmax) &&
+      inode_attrs_equal (inode_old, inode_new) && inode_old.hash == entry.hash)
+    {
+      bdb_ptr.delete_inode (inode_new);
+      bdb_ptr.delete_inode (inode_old);
+      inode_old.vmax = VERSION_INF;
+      bdb_ptr.store_inode (inode_old);
+      bdb_ptr.add_deleted_file (inode_new.new_file_number);
+      return;
+    }
+
+  bdb_ptr.delete_inode (inode_new);
+
+  if (bdb_ptr.load_hash2file (entry.hash) == 0)
+    bdb_ptr.store_hash2file (entry.hash, inode_new.new_file_number);
+  else
+    bdb_ptr.add_deleted_file (inode_new.new_file_number);
+
+  inode_new.hash = entry.hash;
+  inode_new.size = entry.size;
+  inode_new.new_file_number = 0;
+  bdb_ptr.store_inode (inode_new);
+
+  m_files_added++;
+}
+
+/*
+ * update the database for the entries of the current batch (in order), waiting
+ * at most timeout seconds for hash results; returns true if the batch is done
+ * (or an error occurred, see error())
+ */
+bool
+CommitEngine::process (double timeout)
+{
+  double end_time = BFSync::gettime() + timeout;
+
+  while (batch_pos < batch.size())
+    {
+      Entry& entry = batch[batch_pos];
+      if (entry.hash.empty())
+        {
+          if (!hasher->wait_result (std::max (end_time - BFSync::gettime(), 0.0)))
+            return false;
+
+          BFSync::FileHashResult result = hasher->next_result();
+          if (!result.ok)
+            {
+              m_error = result.error;
+              return true;
+            }
+          entry.hash = result.hash;
+          entry.size = result.size;
+        }
+      else
+        {
+          m_bytes_done += entry.size;
+        }
+      finish_entry (entry);
+      batch_pos++;
+    }
+  if (hasher)
+    {
+      m_bytes_done += hasher->bytes_done();
+
+      delete hasher;
+      hasher = NULL;
+    }
+  return true;
+}
+
+uint64_t
+CommitEngine::files_added()
+{
+  return m_files_added;
+}
+
+uint64_t
+CommitEngine::bytes_done()
+{
+  return m_bytes_done + (hasher ? hasher->bytes_done() : 0);
+}
+
+/* continue progress information of an interrupted commit */
+void
+CommitEngine::set_progress (uint64_t files_added, uint64_t bytes_done)
+{
+  m_files_added = files_added;
+  m_bytes_done = bytes_done;
+}
+
+string
+CommitEngine::error()
+{
+  return m_error;
+}
+
 INodeHashIterator::INodeHashIterator (BDBPtr bdb_ptr) :
-  dbc (bdb_ptr.get_bdb()),
+  dbc (bdb_ptr.get_bdb(), BDB_TABLE_INODES, DbcPtr::SNAPSHOT),
   db_it (dbc.dbc),
   bdb_ptr (bdb_ptr)
 {
@@ -1309,59 +2312,36 @@ INodeHashIterator::get_next()
 {
   const History *history = bdb_ptr.get_bdb()->history();
 
-  while (db_it.next (key, data))
+  while (db_it.next (key, data))   /* cursor only iterates over inode records */
     {
       string hash;
-      char table = ((char *) key.get_data()) [key.get_size() - 1];
 
-      if (table == BDB_TABLE_INODES)
-        {
-          DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
-
-          unsigned int vmin = dbuffer.read_uint32();
-          unsigned int vmax = dbuffer.read_uint32();
+      DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
 
-          bool needed = false;
-          if (vmax == VERSION_INF)
-            {
-              needed = true;
-            }
-          else
-            {
-              for (unsigned int version = vmin; version <= vmax; version++)
-                {
-                  if (history->have_version (version))
-                    {
-                      needed = true;
-                      break;
-                    }
-                }
-            }
+      INodeRecord ir;
+      ir.read (dbuffer, bdb_ptr.get_bdb()->record_format());
 
-          if (needed)
-            {
-              dbuffer.read_uint32();
-              dbuffer.read_uint32();
-              dbuffer.read_uint32();
-              dbuffer.read_uint32();
+      unsigned int vmin = ir.vmin;
+      unsigned int vmax = ir.vmax;
 
-              hash = dbuffer.read_string();
-            }
-        }
+      bool needed = (vmax == VERSION_INF) || history->have_version_in_range (vmin, vmax);
+      if (needed)
+        hash = ir.hash;
       if (hash.size() == 40)  /* skip empty hash (for instance symlink) and "new" hash (newly changed inode) */
         {
-          if (all_hashes.count (hash) == 0) // deduplication: never return the same hash twice
-            {
-              all_hashes.insert (hash);
-              return hash;
-            }
+          DataOutBuffer hash_buf;
+          hash_buf.write_hash (hash);
+
+          // deduplication: never return the same hash twice
+          if (!all_hashes.insert ((unsigned char *) hash_buf.begin()))
+            return hash;
         }
     }
   return "";
 }
 
 AllINodesIterator::AllINodesIterator (BDBPtr bdb_ptr) :
-  dbc (bdb_ptr.get_bdb()),
+  dbc (bdb_ptr.get_bdb(), BDB_TABLE_INODES, DbcPtr::SNAPSHOT),
   bdb_ptr (bdb_ptr),
   current_id_idx (0),
   multi_data_buffer (64 * 1024)
@@ -1392,27 +2372,23 @@ AllINodesIterator::get_next()
         {
           DbMultipleKeyDataIterator data_iterator (multi_data);
 
-          while (data_iterator.next (key, data))
+          while (data_iterator.next (key, data))   /* cursor only iterates over inode records */
             {
-              char table = ((char *) key.get_data()) [key.get_size() - 1];
-              if (table == BDB_TABLE_INODES)
-                {
-                  DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
-                  id_load (id, kbuffer);
-
-                  /* we don't store the prefix part, because a..e should be enough to figure out
-                   * duplicates reliably - this results in a slightly reduced memory usage and
-                   * it should be a bit faster (because now all known IDs have the same size) */
-                  id_buf.clear();
-                  id_buf.write_uint32 (id.id.a);
-                  id_buf.write_uint32 (id.id.b);
-                  id_buf.write_uint32 (id.id.c);
-                  id_buf.write_uint32 (id.id.d);
-                  id_buf.write_uint32 (id.id.e);
-
-                  if (!known_ids.insert ((unsigned char *) id_buf.begin()))
-                    ids.push_back (id);
-                }
+              DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+              id_load (id, kbuffer);
+
+              /* we don't store the prefix part, because a..e should be enough to figure out
+               * duplicates reliably - this results in a slightly reduced memory usage and
+               * it should be a bit faster (because now all known IDs have the same size) */
+              id_buf.clear();
+              id_buf.write_uint32 (id.id.a);
+              id_buf.write_uint32 (id.id.b);
+              id_buf.write_uint32 (id.id.c);
+              id_buf.write_uint32 (id.id.d);
+              id_buf.write_uint32 (id.id.e);
+
+              if (!known_ids.insert ((unsigned char *) id_buf.begin()))
+                ids.push_back (id);
             }
           dbc_ret = dbc->get (&key, &multi_data, DB_NEXT | DB_MULTIPLE_KEY);
 
@@ -1434,29 +2410,55 @@ AllINodesIterator::get_next()
     }
 }
 
-Hash2FileIterator::Hash2FileIterator (BDBPtr bdb_ptr) :
+//---------------------------- LiveVersions -----------------------------
+
+LiveVersions::LiveVersions (BDBPtr bdb_ptr) :
   bdb_ptr (bdb_ptr)
 {
-  int ret;
+  bdb_ptr.get_bdb()->history()->read();
+}
 
-  DbTxn *txn = bdb_ptr.get_bdb()->get_transaction();
+LiveVersions::~LiveVersions()
+{
+}
+
+bool
+LiveVersions::contains (unsigned int version)
+{
+  return bdb_ptr.get_bdb()->history()->have_version (version);
+}
+
+bool
+LiveVersions::contains_range (unsigned int vmin, unsigned int vmax)
+{
+  return bdb_ptr.get_bdb()->history()->have_version_in_range (vmin, vmax);
+}
 
-  /* Acquire a cursor for the database. */
-  if ((ret = bdb_ptr.get_bdb()->get_db_hash2file()->cursor (txn, &cursor, 0)) != 0)
+/* versions that have a history entry, but are tagged deleted */
+vector<unsigned int>
+LiveVersions::deleted_versions()
+{
+  const History *history = bdb_ptr.get_bdb()->history();
+
+  vector<unsigned int> result;
+  for (unsigned int version = history->vbegin(); version < history->current_version(); version++)
     {
-      bdb_ptr.get_bdb()->get_db_hash2file()->err (ret, "DB->cursor");
-      cursor = 0;
-      dbc_ret = ret;
-      return;
+      if (!history->have_version (version))
+        result.push_back (version);
     }
+  return result;
+}
 
-  dbc_ret = cursor->get (&key, &data, DB_FIRST);
+Hash2FileIterator::Hash2FileIterator (BDBPtr bdb_ptr, bool binary_hashes) :
+  dbc (bdb_ptr.get_bdb(), bdb_ptr.get_bdb()->get_db_hash2file(), DbcPtr::SNAPSHOT),
+  bdb_ptr (bdb_ptr),
+  binary_hashes (binary_hashes)
+{
+  dbc_ret = dbc->get (&key, &data, DB_FIRST);
 }
 
 Hash2FileIterator::~Hash2FileIterator()
 {
-  if (cursor)
-    cursor->close();
 }
 
 
@@ -1472,18 +2474,25 @@ Hash2FileIterator::get_next()
 
       assert (key.get_size() == 20);
 
-      char hash_str[41];
+      if (binary_hashes)
+        {
+          h2f.hash.assign ((const char *) kptr, 20);
+        }
+      else
+        {
+          char hash_str[41];
 
-      for (size_t i = 0; i < 20; i++)
-        BFSync::uint8_hex (kptr[i], hash_str + i * 2);
+          for (size_t i = 0; i < 20; i++)
+            BFSync::uint8_hex (kptr[i], hash_str + i * 2);
 
-      hash_str[40] = 0;
+          hash_str[40] = 0;
 
-      h2f.hash = hash_str;
+          h2f.hash = hash_str;
+        }
       h2f.file_number = dbuffer.read_uint32();
       h2f.valid = true;
 
-      dbc_ret = cursor->get (&key, &data, DB_NEXT);
+      dbc_ret = dbc->get (&key, &data, DB_NEXT);
       return h2f;
     }
   h2f.valid = false;
@@ -1836,13 +2845,14 @@ INodeRepo::create_inode_with_id (const ID& id, unsigned int version)
 void
 INodeRepo::save_changes()
 {
-  inode_repo->save_changes();
+  if (!inode_repo->save_changes())
+    throw BDBException (BFSync::BDB_ERROR_UNKNOWN);
 }
 
 void
 INodeRepo::save_changes_no_txn()
 {
-  inode_repo->save_changes (BFSync::INodeRepo::SC_NO_TXN);
+  inode_repo->save_changes (BFSync::INodeRepo::SC_NO_TXN);   // caller commits
 }
 
 void
@@ -1889,6 +2899,9 @@ BDBException::error_string() const
 
       case BFSync::BDB_ERROR_IO:
         return "input/output error";
+
+      case BFSync::BDB_ERROR_DEADLOCK:
+        return "transaction aborted due to deadlock";
     }
   return "unknown error";
 }
@@ -1910,3 +2923,9 @@ repo_version()
 {
   return VERSION;
 }
+
+bool
+upgrade_tables (const string& db, int cache_size_mb)
+{
+  return BFSync::bdb_upgrade_tables (db, cache_size_mb);
+}
@@ -3,11 +3,12 @@
 #include "bfbdb.hh"
 #include "bfdeduptable.hh"
 #include "bfidsorter.hh"
+#include "bffilehasher.hh"
 #include <glib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string>
 #include <vector>
-#include <queue>
 #include <boost/unordered_set.hpp>
 
 #undef major
@@ -172,17 +173,25 @@ public:
   void               begin_transaction();
   void               commit_transaction();
   void               abort_transaction();
+  bool               try_commit_transaction();
+  bool               retry_backoff (int attempt);
+  void               set_bulk_mode (const std::string& mode);
+  void               checkpoint();
 
   INode              load_inode (const ID& id, unsigned int version);
+  INode              read_inode (const ID& id, unsigned int version);
   std::vector<INode> load_all_inodes (const ID& id);
   void               store_inode (const INode& inode);
+  void               store_inodes (const std::vector<INode>& inodes);
   void               delete_inode (const INode& inode);
 
   unsigned int       clear_changed_inodes (unsigned int max_inodes);
 
   std::vector<Link>  load_links (const ID& id, unsigned int version);
+  std::vector<Link>  read_links (const ID& id, unsigned int version);
   std::vector<Link>  load_all_links (const ID& id);
   void               store_link (const Link& link);
+  void               store_links (const std::vector<Link>& links);
   void               delete_link (const Link& link);
   void               delete_links (const std::vector<Link>& links);
 
@@ -198,6 +207,7 @@ public:
   void               store_hash2file (const std::string& hash, unsigned int file_number);
   unsigned int       load_hash2file (const std::string& hash);
   void               delete_hash2file (const std::string& hash);
+  void               delete_hash2file_bin (const std::string& bin_hash);
 
   void               add_deleted_file (unsigned int file_number);
   std::vector<unsigned int>
@@ -220,6 +230,15 @@ public:
   std::vector<std::string>  get_variable (const std::string& variable);
   void                      set_variable (const std::string& variable, const std::vector<std::string>& value);
 
+  std::string               cache_stats();
+  int                       recommended_cache_size();
+  std::string               lock_stats();
+  std::string               hash2file_stats();
+  std::string               compact (double max_seconds);
+
+  bool                      build_version_index (unsigned int version);
+  bool                      verify_version_index (unsigned int version);
+
   unsigned int       gen_new_file_number();
 
   void               close();
@@ -234,14 +253,25 @@ public:
 extern BDBPtr             open_db (const std::string& db, int cache_size_mb, bool recover);
 extern void               remove_db (const std::string& db);
 extern bool               need_recover_db (const std::string& db);
+extern bool               upgrade_tables (const std::string& db, int cache_size_mb);
 extern ID                 id_root();
 extern std::string        time_prof_result();
 extern void               time_prof_reset();
 extern void               print_leak_debugger_stats();
 
+/*
+ * DiffGenerator: computes the changes between the last and the current version
+ *
+ * for each changed id, the inode and link records are read with one duplicate
+ * scan (finding both versions), and the link lists are merge-joined by name;
+ * the changes are written as \0 terminated fields into a block, which can be
+ * read as a whole (get_block) or one change at a time (get_next)
+ */
 class DiffGenerator
 {
   BFSync::DbcPtr dbc;
+  BFSync::DbcPtr inode_dbc;
+  BFSync::DbcPtr link_dbc;
 
   BFSync::DataOutBuffer kbuf;
   BFSync::IDSorter      ids;
@@ -255,14 +285,43 @@ class DiffGenerator
   unsigned int v_old, v_new;
 
   BDBPtr bdb_ptr;
-  std::queue< std::vector<std::string> > diffs;
+
+  std::string                     block;
+  size_t                          block_pos;
+  std::vector<BFSync::LinkRecord> links_old;
+  std::vector<BFSync::LinkRecord> links_new;
+
+  void        load_inodes (const BFSync::ID& id, BFSync::INodeRecord& i_old, bool& old_ok,
+                           BFSync::INodeRecord& i_new, bool& new_ok);
+  void        load_links (const BFSync::ID& id);
+  void        gen_diff (const BFSync::ID& id);
+  static bool cmp_link_name (const BFSync::LinkRecord& a, const BFSync::LinkRecord& b);
+
 public:
   DiffGenerator (BDBPtr bdb_ptr);
   ~DiffGenerator();
 
   std::vector<std::string> get_next();
+  std::string              get_block (size_t max_bytes);
+  size_t                   id_count();
 };
 
+struct DiffXzResult
+{
+  bool        ok;
+  std::string error;
+  std::string hash;       // SHA-1 of the xz file, or "" if there are no changes
+  uint64_t    diff_size;
+  uint64_t    xz_size;
+};
+
+/*
+ * writes the output of DiffGenerator to an xz compressed file, using the
+ * multi-threaded encoder (see fs/bfxzwriter.hh); if the diff is empty, the
+ * file is removed
+ */
+DiffXzResult write_diff_xz (BDBPtr bdb_ptr, const std::string& filename, unsigned int threads);
+
 class ChangedINodesIterator
 {
   BFSync::DbcPtr dbc;
@@ -278,13 +337,152 @@ public:
   ID get_next();
 };
 
+/*
+ * IDList: binary IDs stored in a file
+ *
+ * make_changed_id_list() writes the IDs of all changed inodes in db order; since
+ * the file is kept until the commit is done, reading can continue at position()
+ * after a restart
+ */
+class IDList
+{
+  FILE              *file;
+  std::vector<char>  buffer;
+  size_t             buffer_start;
+  size_t             buffer_end;
+  uint64_t           m_size;
+  uint64_t           m_position;
+
+  bool fill_buffer();
+public:
+  IDList();
+  ~IDList();
+
+  bool              open (const std::string& filename);
+  uint64_t          size() const;
+  uint64_t          position() const;
+  void              seek (uint64_t position);
+  std::vector<ID>   next_batch (unsigned int max_ids);
+};
+
+bool make_changed_id_list (BDBPtr bdb_ptr, const std::string& filename);
+
+struct FileHashResult
+{
+  std::string hash;
+  uint64_t    size;
+  bool        ok;
+  std::string error;
+};
+
+/*
+ * hashes files with a pool of threads (see fs/bffilehasher.hh); results are
+ * returned in the order the files were added
+ */
+class FileHasher
+{
+  BFSync::FileHasher *hasher;
+public:
+  FileHasher (unsigned int n_threads);
+  ~FileHasher();
+
+  void            add_file (const std::string& filename);
+  bool            wait_result (double timeout);
+  FileHashResult  next_result();
+  uint64_t        bytes_done();
+  unsigned int    n_threads();
+};
+
+/*
+ * CommitEngine: scan and add phase of bfsync commit (see commitutils.py)
+ *
+ * the changed id list is processed in batches; for each changed inode that has
+ * a new file, the new and the old version are loaded together and the file is
+ * hashed (in parallel, unless its hash is already known from bfsyncfs):
+ *  - if bfsyncfs did copy-on-write without changing attributes or file contents,
+ *    the old inode is restored
+ *  - otherwise the file is added to hash2file (or to deleted_files if its
+ *    contents are already known) and the inode gets the hash
+ *
+ * the caller runs each batch in one transaction and writes a journal entry with
+ * position(), so an interrupted commit can continue with the next batch
+ */
+class CommitEngine
+{
+  struct Entry
+  {
+    INode         inode_new;
+    INode         inode_old;
+    std::string   hash;
+    uint64_t      size;
+  };
+  BDBPtr                      bdb_ptr;
+  std::string                 repo_path;
+  unsigned int                version;
+  unsigned int                hash_threads;
+  IDList                      id_list;
+  bool                        m_open_ok;
+  std::vector<Entry>          batch;
+  size_t                      batch_pos;        // next entry to finish
+  BFSync::FileHasher         *hasher;
+  uint64_t                    m_total_file_count;
+  uint64_t                    m_total_file_size;
+  uint64_t                    m_files_added;
+  uint64_t                    m_bytes_done;     // not including files that are hashed right now
+  std::string                 m_error;
+
+  std::string file_name (unsigned int file_number);
+  void        finish_entry (Entry& entry);
+  static bool cmp_file_number (const Entry& a, const Entry& b);
+
+public:
+  CommitEngine (BDBPtr bdb_ptr, const std::string& repo_path, const std::string& id_list_filename,
+                unsigned int version, unsigned int hash_threads);
+  ~CommitEngine();
+
+  bool                      open_ok();
+  void                      scan();
+  uint64_t                  total_file_count();
+  uint64_t                  total_file_size();
+
+  void                      seek (uint64_t position);
+  uint64_t                  position();
+
+  bool                      load_batch (unsigned int max_ids);
+  std::vector<unsigned int> batch_file_numbers();
+  void                      set_hash (unsigned int file_number, const std::string& hash);
+  void                      start_hashing();
+  bool                      process (double timeout);
+
+  uint64_t                  files_added();
+  uint64_t                  bytes_done();
+  void                      set_progress (uint64_t files_added, uint64_t bytes_done);
+  std::string               error();
+};
+
+struct HashHash
+{
+  static size_t
+  size (unsigned char *)
+  {
+    return 20; /* binary SHA-1 */
+  }
+  static unsigned int
+  hash (unsigned char *mem)
+  {
+    guint32 result;
+    std::copy (mem, mem + 4, (unsigned char *) &result); // SHA-1 bytes are random enough
+    return result;
+  }
+};
+
 class INodeHashIterator
 {
   BFSync::DbcPtr              dbc;
   BFSync::AllRecordsIterator  db_it;
   BDBPtr                      bdb_ptr;
 
-  boost::unordered_set<std::string> all_hashes;
+  DedupTable<HashHash>        all_hashes;   // binary hashes
 
   Dbt key, data;
 public:
@@ -330,14 +528,34 @@ public:
   ID get_next();
 };
 
+/*
+ * LiveVersions: which versions exist (have not been tagged deleted)
+ *
+ * contains_range() is O(1), so checking if an inode is still needed is cheap even
+ * for inodes that span thousands of versions
+ */
+class LiveVersions
+{
+  BDBPtr bdb_ptr;
+public:
+  LiveVersions (BDBPtr bdb_ptr);
+  ~LiveVersions();
+
+  bool                      contains (unsigned int version);
+  bool                      contains_range (unsigned int vmin, unsigned int vmax);
+  std::vector<unsigned int> deleted_versions();
+};
+
 class Hash2FileIterator
 {
-  Dbc            *cursor;
+  BFSync::DbcPtr  dbc;
   BDBPtr          bdb_ptr;
+  bool            binary_hashes;
   int             dbc_ret;
   Dbt             key, data;
 public:
-  Hash2FileIterator (BDBPtr bdb_ptr);
+  /* binary_hashes: return 20 byte binary hashes (as stored in the db) instead of hex */
+  Hash2FileIterator (BDBPtr bdb_ptr, bool binary_hashes = false);
   ~Hash2FileIterator();
 
   Hash2FileEntry get_next();
@@ -442,7 +660,6 @@ class SQLExport
 {
   unsigned int version;
   BDBPtr       bdb_ptr;
-  int          transaction_ops;
   int          scan_ops;
   double       last_status_time;
   double       start_time;
@@ -456,8 +673,13 @@ class SQLExport
   std::map<unsigned int, std::string> filelist_map;
   std::string                         m_repo_id;
 
-  BFSync::BDBError walk (const ID& id, const ID& parent_id, const std::string& name, FILE *file);
-  void maybe_split_transaction();
+  BFSync::VersionIndex               *version_index;  // only during build_filelist, NULL: no index
+  BFSync::DbcPtr                     *inode_dbc;      // snapshot cursors (only during build_filelist)
+  BFSync::DbcPtr                     *link_dbc;
+
+  bool             load_inode (const BFSync::ID& id, BFSync::INodeRecord& ir);
+  void             load_links (const BFSync::ID& id, std::vector<BFSync::LinkRecord>& links);
+  BFSync::BDBError walk (const BFSync::ID& id, const BFSync::ID& parent_id, const std::string& name, FILE *file);
   BFSync::BDBError build_filelist (unsigned int version, std::string& filename);
 
 public:
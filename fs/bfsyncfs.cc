@@ -8,6 +8,8 @@
 #include "bfcfgparser.hh"
 #include "bfbdb.hh"
 #include "bftimeprof.hh"
+#include "bfstats.hh"
+#include "bfbghasher.hh"
 #include "bfgroup.hh"
 #include "config.h"
 
@@ -48,8 +50,36 @@ Options::the()
 struct FileHandle
 {
   int fd;
-  enum { NONE, INFO } special_file;
+  enum { NONE, INFO, CACHE_STATS, STATS } special_file;
   bool open_for_write;
+  unsigned int new_file_number;  // open_for_write: file number for background hashing
+  unsigned int bg_generation;    // see BackgroundHasher::file_opened()
+  StreamHasher *stream_hasher;   // hash of sequential writes, if file was empty when opened
+  std::string special_content;   // CACHE_STATS, STATS: stats at the time the file was opened
+
+  FileHandle() :
+    fd (-1),
+    special_file (NONE),
+    open_for_write (false),
+    new_file_number (0),
+    bg_generation (0),
+    stream_hasher (NULL)
+  {
+  }
+  ~FileHandle()
+  {
+    delete stream_hasher;
+  }
+  void
+  start_write (unsigned int file_number, const string& filename)
+  {
+    new_file_number = file_number;
+    bg_generation = BackgroundHasher::the()->file_opened (file_number, filename);
+
+    struct stat st;
+    if (bg_generation && fstat (fd, &st) == 0 && st.st_size == 0)
+      stream_hasher = new StreamHasher();
+  }
 };
 
 struct SpecialFiles
@@ -100,6 +130,114 @@ debug_file()
   return bf_debug_file;
 }
 
+string
+bfsyncfs_cache_stats()
+{
+  BDBCacheStats stats;
+
+  if (INodeRepo::the()->bdb->cache_stats (stats) != BDB_ERROR_NONE)
+    return "";
+
+  return stats.to_string();
+}
+
+static void
+json_add_counter (string& json, const char *name, guint64 value, bool last = false)
+{
+  json += string_printf ("\"%s\": %" G_GUINT64_FORMAT "%s", name, value, last ? "" : ", ");
+}
+
+/*
+ * runtime statistics as JSON (stats server command, .bfsync/stats); times are in
+ * milliseconds, time profiler sections include the BDB call counts
+ */
+string
+bfsyncfs_stats_json()
+{
+  FSStats *stats = FSStats::the();
+
+  string json = "{\n  \"fuse_ops\": {";
+
+  const vector<FSOpStats *>& ops = stats->ops();
+  for (size_t i = 0; i < ops.size(); i++)
+    {
+      guint64 calls = ops[i]->calls.value();
+      guint64 time_ns = ops[i]->time_ns.value();
+
+      json += string_printf ("%s\n    \"%s\": { ", i ? "," : "", ops[i]->name().c_str());
+      json_add_counter (json, "calls", calls);
+      json += string_printf ("\"time_ms\": %.3f, \"avg_ms\": %.6f }", time_ns / 1e6, calls ? time_ns / 1e6 / calls : 0.0);
+    }
+  json += "\n  },\n  \"locks\": {";
+
+  static const char *lock_names[FSStats::LOCK_TYPES] = { "read", "write", "reorg", "rdonly" };
+  for (int t = 0; t < FSStats::LOCK_TYPES; t++)
+    {
+      json += string_printf ("%s\n    \"%s\": { ", t ? "," : "", lock_names[t]);
+      json_add_counter (json, "count", stats->lock_count[t].value());
+      json_add_counter (json, "waits", stats->lock_waits[t].value());
+      json += string_printf ("\"wait_ms\": %.3f }", stats->lock_wait_ns[t].value() / 1e6);
+    }
+  json += "\n  },\n  \"inode_cache\": { ";
+  json_add_counter (json, "inodes", INodeRepo::the()->cached_inode_count());
+  json_add_counter (json, "dirs", INodeRepo::the()->cached_dir_count());
+  json_add_counter (json, "hits", stats->inode_cache_hits.value());
+  json_add_counter (json, "misses", stats->inode_cache_misses.value());
+  json_add_counter (json, "evictions", stats->inode_cache_evictions.value(), true);
+
+  json += " },\n  \"io\": { ";
+  json_add_counter (json, "bytes_read", stats->bytes_read.value());
+  json_add_counter (json, "bytes_written", stats->bytes_written.value());
+  json_add_counter (json, "cow_files", stats->cow_files.value());
+  json_add_counter (json, "cow_bytes", stats->cow_bytes.value(), true);
+
+  BackgroundHasher *bg_hasher = BackgroundHasher::the();
+  guint64 bg_hash_time_ns = bg_hasher->hash_time_ns();
+
+  json += " },\n  \"bg_hash\": { ";
+  json_add_counter (json, "queue", bg_hasher->queue_size());
+  json_add_counter (json, "hashes", bg_hasher->hash_count());
+  json_add_counter (json, "files_hashed", bg_hasher->files_hashed());
+  json_add_counter (json, "bytes_hashed", bg_hasher->bytes_hashed());
+  json_add_counter (json, "hashes_used", bg_hasher->hashes_used());
+  json_add_counter (json, "stream_hashes", bg_hasher->stream_hashes());
+  json += string_printf ("\"time_ms\": %.3f, \"rate_mb_s\": %.2f", bg_hash_time_ns / 1e6,
+                         bg_hash_time_ns ? bg_hasher->bytes_hashed() / 1048576.0 / (bg_hash_time_ns / 1e9) : 0.0);
+
+  json += " },\n  \"bdb\": { ";
+
+  BDB *bdb = INodeRepo::the()->bdb;
+
+  BDBLockStats lock_stats;
+  if (bdb->lock_stats (lock_stats) == BDB_ERROR_NONE)
+    {
+      json_add_counter (json, "deadlocks", lock_stats.deadlocks);
+      json_add_counter (json, "retries", lock_stats.retries);
+      json_add_counter (json, "env_lock_waits", lock_stats.env_lock_waits);
+    }
+  BDBCacheStats cache_stats;
+  if (bdb->cache_stats (cache_stats) == BDB_ERROR_NONE)
+    {
+      json_add_counter (json, "cache_hit", cache_stats.cache_hit);
+      json_add_counter (json, "cache_miss", cache_stats.cache_miss);
+      json_add_counter (json, "cache_evictions", cache_stats.evictions);
+    }
+  BDBHash2FileStats h2f_stats;
+  bdb->hash2file_stats (h2f_stats);
+  json_add_counter (json, "hash2file_lookups", h2f_stats.lookups, true);
+
+  json += " },\n  \"prof\": {";
+
+  const vector<TimeProfSection *>& sections = TimeProf::the()->sections();
+  for (size_t i = 0; i < sections.size(); i++)
+    {
+      json += string_printf ("%s\n    \"%s\": { \"calls\": %d, \"time_ms\": %.3f }", i ? "," : "",
+                             sections[i]->name().c_str(), sections[i]->calls(), sections[i]->time() * 1000);
+    }
+  json += "\n  }\n}\n";
+  return json;
+}
+
 static bool bfsyncfs_read_only = false;
 
 void
@@ -159,6 +297,21 @@ Cond::~Cond()
   pthread_cond_destroy (&cond);
 }
 
+void
+Cond::timed_wait (Mutex& mutex, double seconds)
+{
+  timespec abstime;
+
+  int r = clock_gettime (CLOCK_REALTIME, &abstime);
+  assert (r == 0);
+
+  double t = abstime.tv_sec + abstime.tv_nsec * 1e-9 + seconds;
+  abstime.tv_sec = t;
+  abstime.tv_nsec = (t - abstime.tv_sec) * 1e9;
+
+  pthread_cond_timedwait (&cond, &mutex.mutex, &abstime);
+}
+
 struct LockState
 {
   Mutex mutex;
@@ -168,6 +321,7 @@ struct LockState
 
   LockState();
 
+  bool try_lock (FSLock::LockType lock_type);
   void lock (FSLock::LockType lock_type);
   void unlock (FSLock::LockType lock_type);
 } lock_state;
@@ -178,74 +332,90 @@ LockState::LockState() :
 {
 }
 
+/* called with mutex locked */
+bool
+LockState::try_lock (FSLock::LockType lock_type)
+{
+  switch (lock_type)
+    {
+      /* READ is allowed if:
+         - no other thread reads or writes at the same time
+         - no other thread performs data reorganization (like during commit) at the same time
+
+         Its ok to read if the filesystem is in readonly mode.
+       */
+      case FSLock::READ:
+        if (!fs_busy)
+          {
+            fs_busy = true;
+            return true;
+          }
+        break;
+      /* WRITE is allowed if:
+         - no other thread reads or writes at the same time
+         - no other thread performs data reorganization (like during commit) at the same time
+         - the filesystem is not in readonly mode
+       */
+      case FSLock::WRITE:
+        if (!fs_busy && !fs_rdonly)
+          {
+            fs_busy = true;
+            return true;
+          }
+        break;
+      /* REORG is allowed if:
+         - no other thread reads or writes at the same time
+         - no other thread performs data reorganization (like during commit) at the same time
+         - the filesystem is in readonly mode
+
+         Reorg is ok during readonly mode (although reorg writes to the disk, it doesn't
+         change the contents of the filesystem, therefore its technically something different
+         than write).
+       */
+      case FSLock::REORG:
+        if (!fs_busy && fs_rdonly)
+          {
+            fs_busy = true;
+            return true;
+          }
+        break;
+      /* RDONLY (making the filesystem readonly) is allowed if:
+         - no other thread reads or writes at the same time
+         - no other thread performs data reorganization (like during commit) at the same time
+         - the filesystem is not in readonly mode
+
+         Reads performed in other threads do not affect making the FS readonly.
+       */
+      case FSLock::RDONLY:
+        if (!fs_busy && !fs_rdonly)
+          {
+            fs_rdonly = true;
+            return true;
+          }
+        break;
+      default:
+        g_assert_not_reached();
+    }
+  return false;
+}
+
 void
 LockState::lock (FSLock::LockType lock_type)
 {
+  FSStats *stats = FSStats::the();
+
   Lock lock (mutex);
-  while (1)
-    {
-      switch (lock_type)
-        {
-          /* READ is allowed if:
-             - no other thread reads or writes at the same time
-             - no other thread performs data reorganization (like during commit) at the same time
-
-             Its ok to read if the filesystem is in readonly mode.
-           */
-          case FSLock::READ:
-            if (!fs_busy)
-              {
-                fs_busy = true;
-                return;
-              }
-            break;
-          /* WRITE is allowed if:
-             - no other thread reads or writes at the same time
-             - no other thread performs data reorganization (like during commit) at the same time
-             - the filesystem is not in readonly mode
-           */
-          case FSLock::WRITE:
-            if (!fs_busy && !fs_rdonly)
-              {
-                fs_busy = true;
-                return;
-              }
-            break;
-          /* REORG is allowed if:
-             - no other thread reads or writes at the same time
-             - no other thread performs data reorganization (like during commit) at the same time
-             - the filesystem is in readonly mode
-
-             Reorg is ok during readonly mode (although reorg writes to the disk, it doesn't
-             change the contents of the filesystem, therefore its technically something different
-             than write).
-           */
-          case FSLock::REORG:
-            if (!fs_busy && fs_rdonly)
-              {
-                fs_busy = true;
-                return;
-              }
-            break;
-          /* RDONLY (making the filesystem readonly) is allowed if:
-             - no other thread reads or writes at the same time
-             - no other thread performs data reorganization (like during commit) at the same time
-             - the filesystem is not in readonly mode
-
-             Reads performed in other threads do not affect making the FS readonly.
-           */
-          case FSLock::RDONLY:
-            if (!fs_busy && !fs_rdonly)
-              {
-                fs_rdonly = true;
-                return;
-              }
-            break;
-          default:
-            g_assert_not_reached();
-        }
-      cond.wait (mutex);
-    }
+
+  stats->lock_count[lock_type].add (1);
+  if (try_lock (lock_type))
+    return;
+
+  guint64 wait_start_ns = stats_time_ns();
+  while (!try_lock (lock_type))
+    cond.wait (mutex);
+
+  stats->lock_waits[lock_type].add (1);
+  stats->lock_wait_ns[lock_type].add (stats_time_ns() - wait_start_ns);
 }
 
 void
@@ -427,42 +597,33 @@ bfsyncdir_getattr (const string& path, struct stat *stbuf)
           stbuf->st_ino  = intern_inode (path);
           return 0;
         }
-      if (pvec[1] == "commits")
+      if (pvec[1] == "cache-stats")
         {
+          // size is only an estimate: the file is read with direct_io, so reads are not limited by it
+          string stats = bfsyncfs_cache_stats();
+
           memset (stbuf, 0, sizeof (struct stat));
-          stbuf->st_mode = 0755 | S_IFDIR;
+          stbuf->st_mode = 0444 | S_IFREG;
           stbuf->st_uid  = getuid();
           stbuf->st_gid  = getgid();
+          stbuf->st_size = stats.size();
           stbuf->st_ino  = intern_inode (path);
           return 0;
         }
-    }
-  return -ENOENT;
-}
-
-int
-bfsync_getattr (const char *path_arg, struct stat *stbuf)
-{
-  string path = path_arg;
-
-  FSLock lock (FSLock::READ);
-
-  Context ctx;
-  const string& bfsync_group = Options::the()->bfsync_group;
-  if (!bfsync_group.empty() && get_bfsync_group (ctx.fc->pid) != bfsync_group)
-    return -EACCES;
-
-  int version = version_map_path (path);
-  if (version > 0)
-    {
-      ctx.version = version;
-    }
-  else
-    {
-      if (path.substr (0, 9) == "/.bfsync/")
-        return bfsyncdir_getattr (path, stbuf);
+      if (pvec[1] == "stats")
+        {
+          // size is only an estimate, see cache-stats
+          string stats = bfsyncfs_stats_json();
 
-      if (path == "/.bfsync")
+          memset (stbuf, 0, sizeof (struct stat));
+          stbuf->st_mode = 0444 | S_IFREG;
+          stbuf->st_uid  = getuid();
+          stbuf->st_gid  = getgid();
+          stbuf->st_size = stats.size();
+          stbuf->st_ino  = intern_inode (path);
+          return 0;
+        }
+      if (pvec[1] == "commits")
         {
           memset (stbuf, 0, sizeof (struct stat));
           stbuf->st_mode = 0755 | S_IFDIR;
@@ -472,17 +633,12 @@ bfsync_getattr (const char *path_arg, struct stat *stbuf)
           return 0;
         }
     }
+  return -ENOENT;
+}
 
-  IFPStatus ifp;
-  INodePtr  inode = inode_from_path (ctx, path, ifp);
-  if (!inode)
-    {
-      if (ifp == IFP_ERR_NOENT)
-        return -ENOENT;
-      if (ifp == IFP_ERR_PERM)
-        return -EACCES;
-    }
-
+static void
+inode_stat (const INodePtr& inode, struct stat *stbuf)
+{
   int inode_mode = inode->mode & ~S_IFMT;
 
   memset (stbuf, 0, sizeof (struct stat));
@@ -547,9 +703,188 @@ bfsync_getattr (const char *path_arg, struct stat *stbuf)
       stbuf->st_mode = inode_mode | S_IFCHR;
       stbuf->st_rdev = makedev (inode->major, inode->minor);
     }
+}
+
+static FSOpStats os_getattr ("getattr");
+
+int
+bfsync_getattr (const char *path_arg, struct stat *stbuf)
+{
+  FSOpStatsHandle sh (os_getattr);
+
+  string path = path_arg;
+
+  FSLock lock (FSLock::READ);
+
+  Context ctx;
+  const string& bfsync_group = Options::the()->bfsync_group;
+  if (!bfsync_group.empty() && get_bfsync_group (ctx.fc->pid) != bfsync_group)
+    return -EACCES;
+
+  int version = version_map_path (path);
+  if (version > 0)
+    {
+      ctx.version = version;
+    }
+  else
+    {
+      if (path.substr (0, 9) == "/.bfsync/")
+        return bfsyncdir_getattr (path, stbuf);
+
+      if (path == "/.bfsync")
+        {
+          memset (stbuf, 0, sizeof (struct stat));
+          stbuf->st_mode = 0755 | S_IFDIR;
+          stbuf->st_uid  = getuid();
+          stbuf->st_gid  = getgid();
+          stbuf->st_ino  = intern_inode (path);
+          return 0;
+        }
+    }
+
+  IFPStatus ifp;
+  INodePtr  inode = inode_from_path (ctx, path, ifp);
+  if (!inode)
+    {
+      if (ifp == IFP_ERR_NOENT)
+        return -ENOENT;
+      if (ifp == IFP_ERR_PERM)
+        return -EACCES;
+    }
+
+  inode_stat (inode, stbuf);
   return 0;
 }
 
+/*
+ * batched metadata query ("query" server command)
+ *
+ * request:  query path <path>...            (paths may start with /.bfsync/commits/<version>)
+ *           query id <version> <id>...
+ *
+ * result:   one entry per path/id, empty if the file doesn't exist, otherwise
+ *
+ *   <id> <type> <mode> <uid> <gid> <size> <mtime> <mtime_ns> <ctime> <ctime_ns> <nlink>
+ *   <major> <minor> <hash> <file_number> <link>
+ *
+ * type is the numeric FileType, mode is octal and includes the file type bits;
+ * hash is "-" for non-regular files; file_number is 0 if the file has no data
+ * file, for changed files (hash "new") it is the number of the new file
+ *
+ * all entries are resolved under one READ lock from the INodeRepo cache, without
+ * permission checks (only the repository owner can connect to the server)
+ */
+static bool
+query_id_ok (const string& id_str)
+{
+  // ID (const string&) asserts on invalid input, so check it first
+  size_t slash = id_str.find ('/');
+  if (slash == string::npos || slash % 2 != 0 || id_str.size() - slash - 1 != 40)
+    return false;
+
+  for (size_t i = 0; i < id_str.size(); i++)
+    {
+      if (i != slash && from_hex_nibble (id_str[i]) >= 16)
+        return false;
+    }
+  return true;
+}
+
+static string
+query_result (const INodePtr& inode)
+{
+  if (!inode)
+    return "";
+
+  struct stat st;
+  inode_stat (inode, &st);
+
+  string hash = "-";
+  unsigned int file_number = 0;
+  if (inode->type == FILE_REGULAR)
+    {
+      hash = inode->hash;
+      if (hash == "new")
+        file_number = inode->new_file_number;
+      else if (!hash.empty())
+        file_number = INodeRepo::the()->bdb->load_hash2file (hash);
+    }
+  return string_printf ("%s %d %o %u %u %" G_GUINT64_FORMAT " %ld %d %ld %d %d %u %u %s %u %s",
+                        inode->id.str().c_str(), inode->type, st.st_mode, inode->uid, inode->gid,
+                        guint64 (st.st_size), long (inode->mtime), inode->mtime_ns,
+                        long (inode->ctime), inode->ctime_ns, inode->nlink,
+                        (unsigned int) inode->major, (unsigned int) inode->minor,
+                        hash.c_str(), file_number, inode->link.c_str());
+}
+
+static INodePtr
+query_inode_from_path (const Context& ctx, const string& path)
+{
+  INodePtr inode (ctx, ID::root());
+
+  SplitPath s_path = SplitPath (path.c_str());
+  const char *pi;
+  while (inode && (pi = s_path.next()))
+    inode = inode->get_child (ctx, pi);
+
+  return inode;
+}
+
+void
+bfsyncfs_query (const vector<string>& request, vector<string>& result)
+{
+  if (request.size() < 2 || (request[1] != "path" && request[1] != "id"))
+    {
+      result.push_back ("fail: query needs type (path or id)");
+      return;
+    }
+
+  FSLock lock (FSLock::READ);
+
+  if (request[1] == "path")
+    {
+      for (size_t i = 2; i < request.size(); i++)
+        {
+          Context ctx;
+          string  path = request[i];
+
+          int version = version_map_path (path);
+          if (version > 0)
+            ctx.version = version;
+          else if (path.substr (0, 9) == "/.bfsync/" || path == "/.bfsync")
+            {
+              result.push_back ("");
+              continue;
+            }
+          result.push_back (query_result (query_inode_from_path (ctx, path)));
+        }
+    }
+  else
+    {
+      if (request.size() < 3)
+        {
+          result.push_back ("fail: query id needs version");
+          return;
+        }
+      Context ctx;
+      ctx.version = atoi (request[2].c_str());
+
+      const History *history = INodeRepo::the()->bdb->history();
+      if (!history->have_version (ctx.version) && ctx.version != history->current_version())
+        {
+          result.push_back ("fail: query id: bad version " + request[2]);
+          return;
+        }
+      for (size_t i = 3; i < request.size(); i++)
+        {
+          if (query_id_ok (request[i]))
+            result.push_back (query_result (INodePtr (ctx, ID (request[i]))));
+          else
+            result.push_back ("");
+        }
+    }
+}
+
 bool
 read_dir_contents (const Context& ctx, const string& path, vector<string>& entries)
 {
@@ -573,6 +908,8 @@ read_dir_contents (const Context& ctx, const string& path, vector<string>& entri
   else if (path == "/.bfsync")
     {
       entries.push_back ("info");
+      entries.push_back ("cache-stats");
+      entries.push_back ("stats");
       entries.push_back ("commits");
     }
   else if (path == "/.bfsync/commits")
@@ -592,9 +929,13 @@ read_dir_contents (const Context& ctx, const string& path, vector<string>& entri
   return dir_ok;
 }
 
+static FSOpStats os_opendir ("opendir");
+
 static int
 bfsync_opendir (const char *path_arg, struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_opendir);
+
   string path = path_arg;
 
   FSLock lock (FSLock::READ);
@@ -630,10 +971,14 @@ bfsync_opendir (const char *path_arg, struct fuse_file_info *fi)
   return 0;
 }
 
+static FSOpStats os_readdir ("readdir");
+
 static int
 bfsync_readdir (const char *path_arg, void *buf, fuse_fill_dir_t filler,
                 off_t offset, struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_readdir);
+
   string path = path_arg;
 
   FSLock lock (FSLock::READ);
@@ -668,9 +1013,13 @@ bfsync_readdir (const char *path_arg, void *buf, fuse_fill_dir_t filler,
     }
 }
 
+static FSOpStats os_open ("open");
+
 static int
 bfsync_open (const char *path_arg, struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_open);
+
   string path = path_arg;
   int accmode = fi->flags & O_ACCMODE;
   // can both be true (for O_RDWR)
@@ -698,6 +1047,34 @@ bfsync_open (const char *path_arg, struct fuse_file_info *fi)
       fi->fh = reinterpret_cast<uint64_t> (fh);
       return 0;
     }
+  if (string (path) == "/.bfsync/cache-stats")
+    {
+      if (open_for_write)
+        return -EACCES;
+
+      FileHandle *fh = new FileHandle;
+      fh->fd = -1;
+      fh->special_file = FileHandle::CACHE_STATS;
+      fh->open_for_write = false;
+      fh->special_content = bfsyncfs_cache_stats();
+      fi->fh = reinterpret_cast<uint64_t> (fh);
+      fi->direct_io = 1;
+      return 0;
+    }
+  if (string (path) == "/.bfsync/stats")
+    {
+      if (open_for_write)
+        return -EACCES;
+
+      FileHandle *fh = new FileHandle;
+      fh->fd = -1;
+      fh->special_file = FileHandle::STATS;
+      fh->open_for_write = false;
+      fh->special_content = bfsyncfs_stats_json();
+      fi->fh = reinterpret_cast<uint64_t> (fh);
+      fi->direct_io = 1;
+      return 0;
+    }
 
   IFPStatus ifp;
   INodePtr  inode = inode_from_path (ctx, path, ifp);
@@ -726,6 +1103,8 @@ bfsync_open (const char *path_arg, struct fuse_file_info *fi)
       fh->fd = fd;
       fh->special_file = FileHandle::NONE;
       fh->open_for_write = open_for_write;
+      if (open_for_write)
+        fh->start_write (inode->new_file_number, filename);
       fi->fh = reinterpret_cast<uint64_t> (fh);
       return 0;
     }
@@ -735,23 +1114,40 @@ bfsync_open (const char *path_arg, struct fuse_file_info *fi)
     }
 }
 
+static FSOpStats os_release ("release");
+
 static int
 bfsync_release (const char *path, struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_release);
+
   FileHandle *fh = reinterpret_cast<FileHandle *> (fi->fh);
 
   FSLock lock (fh->open_for_write ? FSLock::WRITE : FSLock::READ);
 
   if (fh->fd != -1)
     close (fh->fd);
+  if (fh->new_file_number)
+    {
+      string  stream_hash;
+      guint64 stream_size = 0;
+      if (fh->stream_hasher)
+        stream_hash = fh->stream_hasher->finish (stream_size);
+
+      BackgroundHasher::the()->file_closed (fh->new_file_number, fh->bg_generation, stream_hash, stream_size);
+    }
   delete fh;
   return 0;
 }
 
+static FSOpStats os_read ("read");
+
 static int
 bfsync_read (const char *path, char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_read);
+
   FSLock lock (FSLock::READ);
 
   debug ("read (\"%s\")\n", path);
@@ -761,7 +1157,11 @@ bfsync_read (const char *path, char *buf, size_t size, off_t offset,
   ssize_t bytes_read = 0;
 
   if (fh->fd != -1)
-    bytes_read = pread (fh->fd, buf, size, offset);
+    {
+      bytes_read = pread (fh->fd, buf, size, offset);
+      if (bytes_read > 0)
+        FSStats::the()->bytes_read.add (bytes_read);
+    }
 
   if (fh->special_file == FileHandle::INFO)
     {
@@ -778,44 +1178,75 @@ bfsync_read (const char *path, char *buf, size_t size, off_t offset,
           bytes_read = 0;
         }
     }
+  if (fh->special_file == FileHandle::CACHE_STATS || fh->special_file == FileHandle::STATS)
+    {
+      const string& stats = fh->special_content;
+      if (offset < (off_t) stats.size())
+        {
+          bytes_read = std::min (size, stats.size() - offset);
+          memcpy (buf, &stats[offset], bytes_read);
+        }
+      else
+        {
+          bytes_read = 0;
+        }
+    }
 
   return bytes_read;
 }
 
+static FSOpStats os_write ("write");
+
 static int
 bfsync_write (const char *path_arg, const char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
-  string path = path_arg;
+  FSOpStatsHandle sh (os_write);
 
-  FSLock lock (FSLock::WRITE);
-  Context ctx;
-  int version = version_map_path (path);
-  if (version > 0 || bfsyncfs_read_only)
-    return -EROFS;
+  string path = path_arg;
 
   FileHandle *fh = reinterpret_cast<FileHandle *> (fi->fh);
 
   ssize_t bytes_written = 0;
-
-  if (fh->fd != -1)
+  {
+    FSLock lock (FSLock::WRITE);
+    Context ctx;
+    int version = version_map_path (path);
+    if (version > 0 || bfsyncfs_read_only)
+      return -EROFS;
+
+    if (fh->fd != -1)
+      {
+        bytes_written = pwrite (fh->fd, buf, size, offset);
+        if (bytes_written > 0)
+          {
+            FSStats::the()->bytes_written.add (bytes_written);
+
+            IFPStatus ifp;
+            INodePtr inode = inode_from_path (ctx, path, ifp);
+            if (inode)
+              inode.update()->set_mtime_ctime (INodeTime::now());
+          }
+      }
+  }
+  // hashing is done without holding the filesystem lock
+  if (fh->stream_hasher)
     {
-      bytes_written = pwrite (fh->fd, buf, size, offset);
       if (bytes_written > 0)
-        {
-          IFPStatus ifp;
-          INodePtr inode = inode_from_path (ctx, path, ifp);
-          if (inode)
-            inode.update()->set_mtime_ctime (INodeTime::now());
-        }
+        fh->stream_hasher->update (offset, buf, bytes_written);
+      else if (size > 0)
+        fh->stream_hasher->invalidate();
     }
-
   return bytes_written;
 }
 
+static FSOpStats os_mknod ("mknod");
+
 static int
 bfsync_mknod (const char *path_arg, mode_t mode, dev_t dev)
 {
+  FSOpStatsHandle sh (os_mknod);
+
   string path = path_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -885,9 +1316,13 @@ bfsync_mknod (const char *path_arg, mode_t mode, dev_t dev)
   return 0;
 }
 
+static FSOpStats os_create ("create");
+
 static int
 bfsync_create (const char *path_arg, mode_t mode, struct fuse_file_info *fi)
 {
+  FSOpStatsHandle sh (os_create);
+
   /* create the file */
   int mknod_result = bfsync_mknod (path_arg, mode | S_IFREG, 0);
   if (mknod_result != 0)
@@ -923,6 +1358,7 @@ bfsync_create (const char *path_arg, mode_t mode, struct fuse_file_info *fi)
       fh->fd = fd;
       fh->special_file = FileHandle::NONE;
       fh->open_for_write = true;
+      fh->start_write (inode->new_file_number, filename);
       fi->fh = reinterpret_cast<uint64_t> (fh);
       return 0;
     }
@@ -933,9 +1369,13 @@ bfsync_create (const char *path_arg, mode_t mode, struct fuse_file_info *fi)
 }
 
 
+static FSOpStats os_chmod ("chmod");
+
 int
 bfsync_chmod (const char *name_arg, mode_t mode)
 {
+  FSOpStatsHandle sh (os_chmod);
+
   string name = name_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -965,9 +1405,13 @@ bfsync_chmod (const char *name_arg, mode_t mode)
   return 0;
 }
 
+static FSOpStats os_chown ("chown");
+
 int
 bfsync_chown (const char *name_arg, uid_t uid, gid_t gid)
 {
+  FSOpStatsHandle sh (os_chown);
+
   string name = name_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -1036,9 +1480,13 @@ bfsync_chown (const char *name_arg, uid_t uid, gid_t gid)
   return 0;
 }
 
+static FSOpStats os_utimens ("utimens");
+
 int
 bfsync_utimens (const char *name_arg, const struct timespec times[2])
 {
+  FSOpStatsHandle sh (os_utimens);
+
   string name = name_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -1064,9 +1512,13 @@ bfsync_utimens (const char *name_arg, const struct timespec times[2])
   return 0;
 }
 
+static FSOpStats os_truncate ("truncate");
+
 int
 bfsync_truncate (const char *name_arg, off_t off)
 {
+  FSOpStatsHandle sh (os_truncate);
+
   string name = name_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -1090,19 +1542,25 @@ bfsync_truncate (const char *name_arg, off_t off)
 
   inode.update()->copy_on_write();
 
-  int rc = truncate (inode->file_path().c_str(), off);
+  string filename = inode->file_path();
+  int rc = truncate (filename.c_str(), off);
   if (rc == 0)
     {
       inode.update()->set_mtime_ctime (INodeTime::now());
+      BackgroundHasher::the()->file_changed (inode->new_file_number, filename);
       return 0;
     }
   return -errno;
 }
 
 // FIXME: should check that name is not directory
+static FSOpStats os_unlink ("unlink");
+
 static int
 bfsync_unlink (const char *name_arg)
 {
+  FSOpStatsHandle sh (os_unlink);
+
   string name = name_arg;
   FSLock lock (FSLock::WRITE);
   Context ctx;
@@ -1151,9 +1609,13 @@ bfsync_unlink (const char *name_arg)
   return 0;
 }
 
+static FSOpStats os_mkdir ("mkdir");
+
 static int
 bfsync_mkdir (const char *path_arg, mode_t mode)
 {
+  FSOpStatsHandle sh (os_mkdir);
+
   string path = path_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -1187,9 +1649,13 @@ bfsync_mkdir (const char *path_arg, mode_t mode)
 }
 
 // FIXME: should check that name is a directory
+static FSOpStats os_rmdir ("rmdir");
+
 static int
 bfsync_rmdir (const char *name_arg)
 {
+  FSOpStatsHandle sh (os_rmdir);
+
   string name = name_arg;
 
   FSLock lock (FSLock::WRITE);
@@ -1242,9 +1708,13 @@ bfsync_rmdir (const char *name_arg)
   return 0;
 }
 
+static FSOpStats os_rename ("rename");
+
 static int
 bfsync_rename (const char *old_path_arg, const char *new_path_arg)
 {
+  FSOpStatsHandle sh (os_rename);
+
   string old_path = old_path_arg;
   string new_path = new_path_arg;
 
@@ -1323,9 +1793,13 @@ bfsync_rename (const char *old_path_arg, const char *new_path_arg)
   return 0;
 }
 
+static FSOpStats os_symlink ("symlink");
+
 static int
 bfsync_symlink (const char *from_arg, const char *to_arg)
 {
+  FSOpStatsHandle sh (os_symlink);
+
   string from = from_arg;
   string to   = to_arg;
 
@@ -1364,9 +1838,13 @@ bfsync_symlink (const char *from_arg, const char *to_arg)
   return 0;
 }
 
+static FSOpStats os_readlink ("readlink");
+
 static int
 bfsync_readlink (const char *path_arg, char *buffer, size_t size)
 {
+  FSOpStatsHandle sh (os_readlink);
+
   string path = path_arg;
 
   FSLock lock (FSLock::READ);
@@ -1398,9 +1876,13 @@ bfsync_readlink (const char *path_arg, char *buffer, size_t size)
   return 0;
 }
 
+static FSOpStats os_link ("link");
+
 static int
 bfsync_link (const char *old_path_arg, const char *new_path_arg)
 {
+  FSOpStatsHandle sh (os_link);
+
   string old_path = old_path_arg;
   string new_path = new_path_arg;
 
@@ -1609,6 +2091,14 @@ bfsyncfs_main (int argc, char **argv)
         options.use_uid_gid = true;
     }
 
+  const vector<string>& online_compact = cfg_values["online-compact"];
+  options.online_compact = false;
+  if (online_compact.size() == 1)
+    {
+      if (online_compact[0] == "on")
+        options.online_compact = true;
+    }
+
   const vector<string>& cache_size = cfg_values["cache-size"];
   options.cache_size_mb = 0;
   if (cache_size.size() == 1)
@@ -1723,8 +2213,10 @@ bfsyncfs_main (int argc, char **argv)
   int fuse_rc = fuse_main (my_argc, my_argv, &bfsync_oper, NULL);
 
   server.stop_thread();
+  BackgroundHasher::the()->stop();
 
-  inode_repo.save_changes();
+  if (!inode_repo.save_changes())
+    printf ("bfsyncfs: error saving changes to database\n");
   inode_repo.delete_unused_inodes (INodeRepo::DM_ALL);
 
   if (!bdb->close())
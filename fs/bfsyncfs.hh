@@ -54,6 +54,7 @@ public:
 
   void broadcast()            { pthread_cond_broadcast (&cond); }
   void wait (Mutex& mutex)    { pthread_cond_wait (&cond, &mutex.mutex); }
+  void timed_wait (Mutex& mutex, double seconds);
 };
 
 struct FSLock
@@ -157,6 +158,7 @@ struct Options {
   int          cache_size_mb;
   std::string  bfsync_group;
   bool         show_all_versions;
+  bool         online_compact;
 
   void debug() const;
   void parse_or_exit (int argc, char **argv);
@@ -166,6 +168,9 @@ struct Options {
 
 int   bfsync_getattr (const char *path_arg, struct stat *stbuf);
 void  bfsyncfs_update_read_only();
+std::string bfsyncfs_cache_stats();
+std::string bfsyncfs_stats_json();
+void  bfsyncfs_query (const std::vector<std::string>& request, std::vector<std::string>& result);
 
 class Context
 {
@@ -7,6 +7,7 @@
 #include "bfhistory.hh"
 #include "bfbdb.hh"
 #include "bftimeprof.hh"
+#include "bfbghasher.hh"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -16,7 +17,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <glib.h>
@@ -24,16 +25,39 @@
 
 #include <string>
 #include <vector>
+#include <algorithm>
 
 using namespace BFSync;
 
 using std::string;
 using std::vector;
 
+/* 4 workers: a long command of one client doesn't delay the commands of others */
+static const size_t SERVER_WORKERS = 4;
+
+/* requests are small: larger frames are only sent by broken clients */
+static const size_t SERVER_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+Server::Connection::Connection (int fd) :
+  fd (fd),
+  out_pos (0),
+  want_write (false),
+  busy (false),
+  closed (false),
+  lock_wait (false),
+  lock (NULL)
+{
+}
+
 Server::Server() :
   socket_ok (false),
   socket_fd (-1),
-  thread_running (false)
+  thread_running (false),
+  epoll_fd (-1),
+  lock_owner (NULL),
+  workers_quit (false),
+  compactor (NULL),
+  compact_next_t (0)
 {
 }
 
@@ -41,6 +65,8 @@ Server::~Server()
 {
   assert (!thread_running);
 
+  delete compactor;
+
   if (socket_ok)
     {
       close (socket_fd);
@@ -56,6 +82,14 @@ thread_start (void *arg)
   return NULL;
 }
 
+static void*
+worker_start (void *arg)
+{
+  Server *instance = static_cast<Server *> (arg);
+  instance->run_worker();
+  return NULL;
+}
+
 bool
 Server::init_socket (const string& repo_path)
 {
@@ -124,11 +158,36 @@ Server::start_thread()
 
   if (socket_ok)
     {
-      pthread_create (&thread, NULL, thread_start, this);
-
       int pipe_ok = pipe (wakeup_pipe_fds);
       assert (pipe_ok == 0);
 
+      pipe_ok = pipe (done_pipe_fds);
+      assert (pipe_ok == 0);
+
+      /* a full pipe already wakes up the server thread, so writes may fail */
+      fcntl (done_pipe_fds[0], F_SETFL, O_NONBLOCK);
+      fcntl (done_pipe_fds[1], F_SETFL, O_NONBLOCK);
+
+      epoll_fd = epoll_create (16);
+      assert (epoll_fd >= 0);
+
+      int fds[3] = { socket_fd, wakeup_pipe_fds[0], done_pipe_fds[0] };
+      for (size_t i = 0; i < 3; i++)
+        {
+          struct epoll_event event;
+
+          event.events = EPOLLIN;
+          event.data.fd = fds[i];
+          epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fds[i], &event);
+        }
+
+      workers_quit = false;
+      workers.resize (SERVER_WORKERS);
+      for (size_t i = 0; i < workers.size(); i++)
+        pthread_create (&workers[i], NULL, worker_start, this);
+
+      pthread_create (&thread, NULL, thread_start, this);
+
       thread_running = true;
     }
 }
@@ -144,6 +203,12 @@ Server::stop_thread()
       void *result;
       pthread_join (thread, &result);
       thread_running = false;
+
+      close (epoll_fd);
+      close (done_pipe_fds[0]);
+      close (done_pipe_fds[1]);
+      close (wakeup_pipe_fds[0]);
+      close (wakeup_pipe_fds[1]);
     }
 }
 
@@ -159,291 +224,704 @@ Server::run()
       fclose (pid_file);
     }
 
-  struct pollfd poll_fds[2];
-
-  poll_fds[0].fd = socket_fd;
-  poll_fds[0].events = POLLIN;
-  poll_fds[0].revents = 0;
+  bool quit = false;
+  while (!quit)
+    {
+      struct epoll_event events[64];
 
-  poll_fds[1].fd = wakeup_pipe_fds[0];
-  poll_fds[1].events = POLLIN;
-  poll_fds[1].revents = 0;
+      int n_events = epoll_wait (epoll_fd, events, 64, 5000);
+      if (n_events == 0)
+        idle();
 
-  while (1)
-    {
-      if (poll (poll_fds, 2, 5000) > 0)
+      for (int e = 0; e < n_events; e++)
         {
-          if (poll_fds[1].revents)
+          int fd = events[e].data.fd;
+
+          if (fd == wakeup_pipe_fds[0])
             {
               // filesystem is terminating -> exit from this thread
-              return;
+              quit = true;
             }
-
-          if (poll_fds[0].revents)
+          else if (fd == socket_fd)
             {
-              struct sockaddr_un incoming;
-              socklen_t size_in = sizeof (struct sockaddr_un);
-
-              int client_fd = accept (socket_fd, (struct sockaddr*) &incoming, &size_in);
-              if (client_fd > 0)
+              accept_clients();
+            }
+          else if (fd == done_pipe_fds[0])
+            {
+              finish_jobs();
+            }
+          else
+            {
+              std::map<int, Connection *>::iterator ci = connections.find (fd);
+              if (ci != connections.end())
                 {
-                  debug ("Server: handle_client (%d)\n", client_fd);
-                  handle_client (client_fd);
+                  Connection *conn = ci->second;
+
+                  if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_client (conn);
+                  if (!conn->closed && (events[e].events & EPOLLOUT))
+                    write_client (conn);
+
+                  if (conn->closed && !conn->busy)
+                    close_client (conn, true);
                 }
             }
         }
-      else  // timeout
-        {
-          FSLock lock (FSLock::WRITE); // we don't want anybody to modify stuff while we write
+    }
+
+  /* stop workers; jobs that were not started yet are discarded */
+  {
+    Lock lock (job_mutex);
+    workers_quit = true;
+    job_cond.broadcast();
+  }
+  for (size_t i = 0; i < workers.size(); i++)
+    pthread_join (workers[i], NULL);
+  workers.clear();
+
+  for (std::deque<Job *>::iterator ji = todo_jobs.begin(); ji != todo_jobs.end(); ji++)
+    {
+      (*ji)->conn->busy = false;
+      delete *ji;
+    }
+  todo_jobs.clear();
+  finish_jobs();
+
+  while (!connections.empty())
+    close_client (connections.begin()->second, false);
+}
+
+/* nothing happened for a while: write changes to the database */
+void
+Server::idle()
+{
+  /* clients that hold the lock (commit) or wait for it would block us */
+  for (std::map<int, Connection *>::iterator ci = connections.begin(); ci != connections.end(); ci++)
+    {
+      if (ci->second->busy || ci->second->lock)
+        return;
+    }
+
+  FSLock lock (FSLock::WRITE); // we don't want anybody to modify stuff while we write
 
-          INodeRepo::the()->save_changes();
-          INodeRepo::the()->delete_unused_inodes (INodeRepo::DM_SOME);
+  // on error, the changes stay in the cache and are written again next time
+  INodeRepo::the()->save_changes();
+  INodeRepo::the()->delete_unused_inodes (INodeRepo::DM_SOME);
 
-          bfsyncfs_update_read_only(); // check for finished operations
+  bfsyncfs_update_read_only(); // check for finished operations
+
+  if (Options::the()->online_compact)
+    compact_step();
+}
+
+/*
+ * online compaction (config option online-compact): whenever the server is idle, the
+ * databases are compacted for a short time; a full pass is started once per day
+ */
+void
+Server::compact_step()
+{
+  if (!compactor)
+    {
+      if (gettime() < compact_next_t)
+        return;
+
+      compactor = new BDBCompactor (INodeRepo::the()->bdb, false);
+    }
+
+  BDBError err = compactor->step (0.25);
+  if (err || compactor->done())
+    {
+      debug ("online compaction %s:\n%s", err ? "failed" : "done", compactor->stats().to_string().c_str());
+
+      delete compactor;
+      compactor = NULL;
+
+      compact_next_t = gettime() + 24 * 3600;
+    }
+}
+
+void
+Server::accept_clients()
+{
+  while (1)
+    {
+      struct sockaddr_un incoming;
+      socklen_t size_in = sizeof (struct sockaddr_un);
+
+      int client_fd = accept (socket_fd, (struct sockaddr*) &incoming, &size_in);
+      if (client_fd < 0)
+        return;   // EAGAIN: no more pending connections
+
+      fcntl (client_fd, F_SETFL, O_NONBLOCK);
+
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.fd = client_fd;
+      if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0)
+        {
+          close (client_fd);
+          continue;
         }
+      debug ("Server: new client %d\n", client_fd);
+      connections[client_fd] = new Connection (client_fd);
     }
 }
 
-bool
-Server::decode (const vector<char>& buffer, vector<string>& request)
+void
+Server::read_client (Connection *conn)
 {
-  string client_req_len;
-  int    len = -1;
-  for (size_t i = 0; i < buffer.size(); i++)
+  while (1)
     {
-      if (buffer[i] == 0)
+      char buffer[16 * 1024];
+      ssize_t len = read (conn->fd, buffer, sizeof (buffer));
+
+      if (len > 0)
+        {
+          conn->in_buffer.insert (conn->in_buffer.end(), buffer, buffer + len);
+        }
+      else if (len < 0 && errno == EINTR)
+        {
+          continue;
+        }
+      else if (len < 0 && errno == EAGAIN)
+        {
+          break;
+        }
+      else
         {
-          len = atoi (&buffer[0]);
+          /* remote end closed connection or some error */
+          conn->closed = true;
+          epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
           break;
         }
     }
-  if (len == -1)
-    return false;
 
-  size_t skip = strlen (&buffer[0]) + 1; // skip len field
-  if (buffer.size() != skip + len)
-    return false;
+  vector<string> request;
+  while (!conn->closed && decode (conn->in_buffer, request))
+    conn->requests.push_back (request);
 
-  request.clear();
-  string s;
-  for (size_t i = skip; i < buffer.size(); i++)
+  if (conn->in_buffer.size() >= 4)
     {
-      if (buffer[i] == 0)
+      DataBuffer dbuffer (&conn->in_buffer[0], 4);
+      if (dbuffer.read_uint32_be() > SERVER_MAX_FRAME_SIZE)
         {
-          request.push_back (s);
-          s = "";
+          debug ("Server: client %d: frame too large\n", conn->fd);
+          conn->closed = true;
+          epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        }
+    }
+  process_requests (conn);
+}
+
+void
+Server::write_client (Connection *conn)
+{
+  while (conn->out_pos < conn->out_buffer.size())
+    {
+      ssize_t len = send (conn->fd, &conn->out_buffer[conn->out_pos], conn->out_buffer.size() - conn->out_pos, MSG_NOSIGNAL);
+      if (len > 0)
+        {
+          conn->out_pos += len;
+        }
+      else if (len < 0 && errno == EINTR)
+        {
+          continue;
+        }
+      else if (len < 0 && errno == EAGAIN)
+        {
+          if (!conn->want_write)
+            {
+              struct epoll_event event;
+              event.events = EPOLLIN | EPOLLOUT;
+              event.data.fd = conn->fd;
+              epoll_ctl (epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+
+              conn->want_write = true;
+            }
+          return;
         }
       else
         {
-          s += buffer[i];
+          conn->closed = true;
+          epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+          return;
+        }
+    }
+  conn->out_buffer.clear();
+  conn->out_pos = 0;
+
+  if (conn->want_write)
+    {
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.fd = conn->fd;
+      epoll_ctl (epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+
+      conn->want_write = false;
+    }
+}
+
+/* run requests of one client in order: quick commands directly, others on workers */
+void
+Server::process_requests (Connection *conn)
+{
+  while (!conn->busy && !conn->lock_wait && !conn->closed && !conn->requests.empty())
+    {
+      vector<string> request = conn->requests.front();
+
+      if (!request.empty() && request[0] == "get-lock" && !conn->lock)
+        {
+          if (lock_owner && lock_owner != conn)
+            {
+              // another client holds the lock: wait without blocking a worker
+              conn->lock_wait = true;
+              lock_waiters.push_back (conn);
+              return;
+            }
+          lock_owner = conn;
+        }
+      conn->requests.pop_front();
+
+      vector<string> result;
+
+      CommandFunc func;
+      bool        worker;
+      if (!request.empty() && find_command (request[0], func, worker))
+        {
+          if (worker)
+            {
+              Job *job = new Job();
+              job->conn = conn;
+              job->func = func;
+              job->request = request;
+
+              conn->busy = true;
+
+              Lock lock (job_mutex);
+              todo_jobs.push_back (job);
+              job_cond.broadcast();
+              return;
+            }
+          (this->*func) (conn, request, result);
         }
+      vector<char> rbuffer;
+      encode (result, rbuffer);
+      conn->out_buffer.insert (conn->out_buffer.end(), rbuffer.begin(), rbuffer.end());
+      write_client (conn);
     }
+}
+
+/* send results of jobs that are done, continue with next requests */
+void
+Server::finish_jobs()
+{
+  char buffer[256];
+  while (read (done_pipe_fds[0], buffer, sizeof (buffer)) > 0)
+    ;
+
+  std::deque<Job *> jobs;
+  {
+    Lock lock (job_mutex);
+    jobs.swap (done_jobs);
+  }
+
+  for (std::deque<Job *>::iterator ji = jobs.begin(); ji != jobs.end(); ji++)
+    {
+      Connection *conn = (*ji)->conn;
+      conn->busy = false;
+
+      if (conn == lock_owner && !conn->lock)   // get-lock failed
+        lock_released();
+
+      if (!conn->closed)
+        {
+          vector<char> rbuffer;
+          encode ((*ji)->result, rbuffer);
+          conn->out_buffer.insert (conn->out_buffer.end(), rbuffer.begin(), rbuffer.end());
+          write_client (conn);
+          process_requests (conn);
+        }
+      delete *ji;
+
+      if (conn->closed && !conn->busy)
+        close_client (conn, true);
+    }
+}
+
+void
+Server::close_client (Connection *conn, bool update_state)
+{
+  debug ("Server: close client %d\n", conn->fd);
+
+  connections.erase (conn->fd);
+  if (!conn->closed)
+    epoll_ctl (epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close (conn->fd);
+
+  FSLock *lock = conn->lock;
+  bool lock_owned = (conn == lock_owner);
+
+  std::deque<Connection *>::iterator wi = std::find (lock_waiters.begin(), lock_waiters.end(), conn);
+  if (wi != lock_waiters.end())
+    lock_waiters.erase (wi);
+  delete conn;
+
+  if (update_state)
+    bfsyncfs_update_read_only(); // there might be a new operation in journal now
+  delete lock;
+
+  if (update_state)
+    {
+      // update history (relevant after commits)
+      INodeRepo::the()->bdb->history()->read();
+
+      // commits may have created version index files
+      INodeRepo::the()->bdb->version_index_refresh();
+    }
+  if (lock_owned)
+    {
+      lock_owner = NULL;
+      if (update_state)
+        lock_released();
+    }
+}
+
+/* the lock owner released the lock (or failed to get it): next waiting client may get it */
+void
+Server::lock_released()
+{
+  lock_owner = NULL;
+
+  if (!lock_waiters.empty())
+    {
+      Connection *conn = lock_waiters.front();
+      lock_waiters.pop_front();
+
+      conn->lock_wait = false;
+      process_requests (conn);
+    }
+}
+
+void
+Server::run_worker()
+{
+  Lock lock (job_mutex);
+
+  while (!workers_quit)
+    {
+      if (todo_jobs.empty())
+        {
+          job_cond.wait (job_mutex);
+          continue;
+        }
+      Job *job = todo_jobs.front();
+      todo_jobs.pop_front();
+
+      job_mutex.unlock();
+      (this->*job->func) (job->conn, job->request, job->result);
+      job_mutex.lock();
+
+      done_jobs.push_back (job);
+      while (write (done_pipe_fds[1], "D", 1) != 1 && errno == EINTR)
+        ;
+    }
+}
+
+/*
+ * decode the first frame of the buffer (and remove it from the buffer)
+ *
+ * returns false if the buffer doesn't contain a complete frame
+ */
+bool
+Server::decode (vector<char>& buffer, vector<string>& request)
+{
+  if (buffer.size() < 4)
+    return false;
+
+  DataBuffer frame_buffer (&buffer[0], buffer.size());
+
+  size_t frame_size = frame_buffer.read_uint32_be();
+  if (buffer.size() < 4 + frame_size)
+    return false;
+
+  request.clear();
+
+  size_t pos = 4;
+  while (pos + 4 <= 4 + frame_size)
+    {
+      DataBuffer dbuffer (&buffer[pos], 4);
+
+      size_t len = dbuffer.read_uint32_be();
+      pos += 4;
+      if (pos + len > 4 + frame_size)   // bad string length
+        break;
+
+      request.push_back (string (buffer.begin() + pos, buffer.begin() + pos + len));
+      pos += len;
+    }
+  buffer.erase (buffer.begin(), buffer.begin() + 4 + frame_size);
   return true;
 }
 
 void
 Server::encode (const vector<string>& reply, vector<char>& buffer)
 {
-  buffer.clear();
+  DataOutBuffer out;
 
   // compute reply size
   size_t reply_size = 0;
   for (size_t i = 0; i < reply.size(); i++)
-    reply_size += reply[i].size() + 1;
+    reply_size += 4 + reply[i].size();
 
-  // build buffer
-  string l = string_printf ("%zd", reply_size);
+  out.write_uint32_be (reply_size);
+  for (size_t i = 0; i < reply.size(); i++)
+    {
+      out.write_uint32_be (reply[i].size());
+      out.write_bytes (reply[i].data(), reply[i].size());
+    }
+  buffer = out.data();
+}
 
-  buffer.resize (l.size() + 1 + reply_size);
+/*
+ * commands: worker = true for commands that may block or take long
+ */
+bool
+Server::find_command (const string& name, CommandFunc& func, bool& worker)
+{
+  static const struct {
+    const char  *name;
+    CommandFunc  func;
+    bool         worker;
+  } commands[] = {
+    { "print",              &Server::cmd_print,               false },
+    { "get-lock",           &Server::cmd_get_lock,            true },
+    { "save-changes",       &Server::cmd_save_changes,        true },
+    { "get-prof",           &Server::cmd_get_prof,            false },
+    { "reset-prof",         &Server::cmd_reset_prof,          false },
+    { "cache-stats",        &Server::cmd_cache_stats,         false },
+    { "lock-stats",         &Server::cmd_lock_stats,          false },
+    { "stats",              &Server::cmd_stats,               false },
+    { "query",              &Server::cmd_query,               true },
+    { "bg-hashes",          &Server::cmd_bg_hashes,           false },
+    { "clear-cache",        &Server::cmd_clear_cache,         true },
+    { "update-read-only",   &Server::cmd_update_read_only,    false },
+    { "perf-getattr",       &Server::cmd_perf_getattr,        true },
+    { "perf-getattr-list",  &Server::cmd_perf_getattr_list,   true },
+  };
+  for (size_t i = 0; i < sizeof (commands) / sizeof (commands[0]); i++)
+    {
+      if (name == commands[i].name)
+        {
+          func = commands[i].func;
+          worker = commands[i].worker;
+          return true;
+        }
+    }
+  return false;
+}
 
-  // len => buffer
-  vector<char>::iterator bi = buffer.begin();
-  std::copy (l.begin(), l.end(), bi);
-  bi += l.size() + 1;
+void
+Server::cmd_print (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  for (size_t i = 1; i < request.size(); i++)
+    printf ("%s", request[i].c_str());
+  result.push_back ("ok");
+}
 
-  for (size_t i = 0; i < reply.size(); i++)
+void
+Server::cmd_get_lock (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  if (conn->lock)
     {
-      // reply[i] => buffer
-      std::copy (reply[i].begin(), reply[i].end(), bi);
-      bi += reply[i].size() + 1;
+      result.push_back ("fail: lock already acquired");
+      return;
+    }
+  conn->lock = new FSLock (FSLock::RDONLY);
+
+  bool saved;
+  {
+    FSLock sc_lock (FSLock::REORG);
+    saved = INodeRepo::the()->save_changes();
+  }
+  if (!saved)
+    {
+      // commit would not see all changes => don't hand out the lock
+      delete conn->lock;
+      conn->lock = NULL;
+
+      result.push_back ("fail: saving changes to database failed");
+      return;
     }
+  result.push_back ("ok");
 }
 
 void
-Server::handle_client (int client_fd)
+Server::cmd_save_changes (Connection *conn, const vector<string>& request, vector<string>& result)
 {
-  struct pollfd cpoll_fds[1];
-  FSLock *lock = 0;
+  if (!conn->lock)
+    {
+      result.push_back ("fail: save-changes requires using get-lock first");
+      return;
+    }
+
+  FSLock sc_lock (FSLock::REORG);
+  if (INodeRepo::the()->save_changes())
+    result.push_back ("ok");
+  else
+    result.push_back ("fail: saving changes to database failed");
+}
+
+void
+Server::cmd_get_prof (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  result.push_back (TimeProf::the()->result());
+}
 
-  vector<char> client_req;
+void
+Server::cmd_reset_prof (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  TimeProf::the()->reset();
+
+  result.push_back ("ok");
+}
+
+void
+Server::cmd_cache_stats (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  string stats = bfsyncfs_cache_stats();
+  if (stats.empty())
+    result.push_back ("fail: could not read cache statistics");
+  else
+    result.push_back (stats);
+}
+
+void
+Server::cmd_lock_stats (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  BDBLockStats stats;
 
-  while (client_fd > 0)
+  if (INodeRepo::the()->bdb->lock_stats (stats) == BDB_ERROR_NONE)
+    result.push_back (stats.to_string());
+  else
+    result.push_back ("fail: could not read lock statistics");
+}
+
+void
+Server::cmd_stats (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  result.push_back (bfsyncfs_stats_json());
+}
+
+/* hashes computed by background hashing; one result per file number, "" if unknown */
+void
+Server::cmd_bg_hashes (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  for (size_t i = 1; i < request.size(); i++)
+    result.push_back (BackgroundHasher::the()->take_hash (atoi (request[i].c_str())));
+}
+
+void
+Server::cmd_query (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  bfsyncfs_query (request, result);
+}
+
+void
+Server::cmd_clear_cache (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  if (!conn->lock)
     {
-      cpoll_fds[0].fd = client_fd;
-      cpoll_fds[0].events = POLLIN;
-      cpoll_fds[0].revents = 0;
-      if (poll (cpoll_fds, 1, -1) > 0)
-        {
-          char buffer[1024];
-          int len = read (client_fd, buffer, 1024);
+      result.push_back ("fail: clear-cache requires using get-lock first");
+      return;
+    }
 
-          if (len == 0 /* remote end closed connection */
-          || (len == -1 && errno != EAGAIN && errno != EINTR)) /* some error */
-            {
-              close (client_fd);
-              client_fd = -1;
-            }
-          else
-            {
-              client_req.insert (client_req.end(), buffer, buffer + len);
-            }
-        }
-      debug ("Server: client_req.size() = %zd\n", client_req.size());
-      vector<string> request;
-      if (decode (client_req, request))
-        {
-          /*
-          printf ("REQUEST:\n");
-          for (vector<string>::iterator ri = request.begin(); ri != request.end(); ri++)
-            {
-              printf (" - %s\n", ri->c_str());
-            }
-          */
-          vector<string> result;
-          if (request.size() > 0)
-            {
-              if (request[0] == "print")
-                {
-                  for (size_t i = 1; i < request.size(); i++)
-                    printf ("%s", request[i].c_str());
-                  result.push_back ("ok");
-                }
-              else if (request[0] == "get-lock")
-                {
-                  if (lock)
-                    result.push_back ("fail: lock already acquired");
-                  else
-                    {
-                      lock = new FSLock (FSLock::RDONLY);
-                      result.push_back ("ok");
-
-                      FSLock sc_lock (FSLock::REORG);
-                      INodeRepo::the()->save_changes();
-                    }
-                }
-              else if (request[0] == "save-changes")
-                {
-                  if (!lock)
-                    result.push_back ("fail: save-changes requires using get-lock first");
-                  else
-                    {
-                      result.push_back ("ok");
-
-                      FSLock sc_lock (FSLock::REORG);
-                      INodeRepo::the()->save_changes();
-                    }
-                }
-              else if (request[0] == "get-prof")
-                {
-                  result.push_back (TimeProf::the()->result());
-                }
-              else if (request[0] == "reset-prof")
-                {
-                  TimeProf::the()->reset();
+  FSLock cc_lock (FSLock::REORG);
+  if (INodeRepo::the()->clear_cache())
+    result.push_back ("ok");
+  else
+    result.push_back ("fail: saving changes to database failed");
 
-                  result.push_back ("ok");
-                }
-              else if (request[0] == "clear-cache")
-                {
-                  if (!lock)
-                    result.push_back ("fail: clear-cache requires using get-lock first");
-                  else
-                    {
-                      result.push_back ("ok");
-
-                      FSLock cc_lock (FSLock::REORG);
-                      INodeRepo::the()->clear_cache();
-                    }
-                }
-              else if (request[0] == "update-read-only")
-                {
-                  result.push_back ("ok");
-                  bfsyncfs_update_read_only();
-                }
-              else if (request[0] == "perf-getattr")
-                {
-                  string filename = request[1];
-                  int    count    = atoi (request[2].c_str());
-
-                  struct stat st;
-                  double time = gettime();
-                  for (int i = 0; i < count; i++)
-                    {
-                      int rc = bfsync_getattr (filename.c_str(), &st);
-                      if (rc != 0)
-                        {
-                          result.push_back ("fail");
-                          break;
-                        }
-                    }
-                  time = gettime() - time;
-                  if (!result.size())
-                    {
-                      string msg = string_printf ("getattr took %.2f ms <=> %.f getattr/s",
-                                                  time * 1000, count / time);
-                      result.push_back (msg);
-                    }
-                }
-              else if (request[0] == "perf-getattr-list")
-                {
-                  string filename = request[1];
-
-                  vector<string> names;
-                  FILE *f = fopen (filename.c_str(), "r");
-                  char buffer[16 * 1024];
-                  while (fgets (buffer, 16 * 1024, f))
-                    {
-                      strtok (buffer, "\n");
-                      if (buffer[0] != '#')
-                        names.push_back (buffer);
-                    }
-                  fclose (f);
-
-                  struct stat st;
-                  double time = gettime();
-                  for (int i = 0; i < names.size(); i++)
-                    {
-                      int rc = bfsync_getattr (names[i].c_str(), &st);
-                      if (rc != 0)
-                        {
-                          result.push_back ("fail");
-                          break;
-                        }
-                      if ((i % 100000) == 0)
-                        INodeRepo::the()->delete_unused_keep_count (100000);
-                    }
-                  time = gettime() - time;
-
-                  if (!result.size())
-                    {
-                      string msg = string_printf ("getattr took %.2f ms <=> %.f getattr/s",
-                                                  time * 1000, names.size() / time);
-                      result.push_back (msg);
-                    }
-                }
-            }
-          vector<char> rbuffer;
-          encode (result, rbuffer);
-          write (client_fd, &rbuffer[0], rbuffer.size());
-          client_req.clear();
+  // commit sends clear-cache after removing the new files it committed or deleted
+  BackgroundHasher::the()->prune();
+}
+
+void
+Server::cmd_update_read_only (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  result.push_back ("ok");
+  bfsyncfs_update_read_only();
+}
+
+void
+Server::cmd_perf_getattr (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  if (request.size() != 3)
+    {
+      result.push_back ("fail: perf-getattr needs filename and count");
+      return;
+    }
+  string filename = request[1];
+  int    count    = atoi (request[2].c_str());
+
+  struct stat st;
+  double time = gettime();
+  for (int i = 0; i < count; i++)
+    {
+      int rc = bfsync_getattr (filename.c_str(), &st);
+      if (rc != 0)
+        {
+          result.push_back ("fail");
+          return;
         }
     }
-  bfsyncfs_update_read_only(); // there might be a new operation in journal now
-  if (lock)
+  time = gettime() - time;
+
+  string msg = string_printf ("getattr took %.2f ms <=> %.f getattr/s", time * 1000, count / time);
+  result.push_back (msg);
+}
+
+void
+Server::cmd_perf_getattr_list (Connection *conn, const vector<string>& request, vector<string>& result)
+{
+  if (request.size() != 2)
     {
-      delete lock;
-      lock = NULL;
+      result.push_back ("fail: perf-getattr-list needs filename");
+      return;
     }
-  // update history (relevant after commits)
-  INodeRepo::the()->bdb->history()->read();
+  string filename = request[1];
+
+  vector<string> names;
+  FILE *f = fopen (filename.c_str(), "r");
+  if (!f)
+    {
+      result.push_back ("fail: can't open " + filename);
+      return;
+    }
+  char buffer[16 * 1024];
+  while (fgets (buffer, 16 * 1024, f))
+    {
+      strtok (buffer, "\n");
+      if (buffer[0] != '#')
+        names.push_back (buffer);
+    }
+  fclose (f);
+
+  struct stat st;
+  double time = gettime();
+  for (size_t i = 0; i < names.size(); i++)
+    {
+      int rc = bfsync_getattr (names[i].c_str(), &st);
+      if (rc != 0)
+        {
+          result.push_back ("fail");
+          return;
+        }
+      if ((i % 100000) == 0)
+        INodeRepo::the()->delete_unused_keep_count (100000);
+    }
+  time = gettime() - time;
+
+  string msg = string_printf ("getattr took %.2f ms <=> %.f getattr/s", time * 1000, names.size() / time);
+  result.push_back (msg);
 }
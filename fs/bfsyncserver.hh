@@ -1,13 +1,68 @@
 // Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
 
+#ifndef BFSYNC_SERVER_HH
+#define BFSYNC_SERVER_HH
+
+#include "bfsyncfs.hh"
+
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 
 namespace BFSync
 {
 
+class BDBCompactor;
+
+/*
+ * Server: control socket of bfsyncfs (<repo>/socket)
+ *
+ * requests and replies are sent as length prefixed frames (integers are big endian):
+ *
+ *   frame  := uint32 payload_size, string*
+ *   string := uint32 length, bytes
+ *
+ * the first string of a request is the command; clients may send more requests
+ * without waiting for replies, replies are sent in request order
+ *
+ * all clients are handled by one epoll loop; commands that may block (waiting for
+ * locks) or take long run on worker threads, so they only delay the client that
+ * sent them
+ *
+ * only one client at a time may hold (or acquire) the lock of get-lock; other
+ * get-lock requests wait in the server thread until it is released, so they never
+ * occupy workers that the lock owner needs for its own commands
+ */
 class Server
 {
+public:
+  struct Connection
+  {
+    int                                     fd;
+    std::vector<char>                       in_buffer;
+    std::vector<char>                       out_buffer;
+    size_t                                  out_pos;
+    bool                                    want_write;   // EPOLLOUT registered
+    std::deque< std::vector<std::string> >  requests;     // received, not yet processed
+    bool                                    busy;         // a worker processes a request
+    bool                                    closed;       // client closed connection
+    bool                                    lock_wait;    // get-lock waits for lock_owner
+    FSLock                                 *lock;         // acquired by get-lock
+
+    Connection (int fd);
+  };
+  typedef void (Server::*CommandFunc) (Connection *conn, const std::vector<std::string>& request,
+                                       std::vector<std::string>& result);
+private:
+  struct Job
+  {
+    Connection               *conn;
+    CommandFunc               func;
+    std::vector<std::string>  request;
+    std::vector<std::string>  result;
+  };
+
   bool        socket_ok;
   int         socket_fd;
   std::string socket_path;
@@ -15,6 +70,51 @@ class Server
   pthread_t   thread;
   bool        thread_running;
 
+  int                           epoll_fd;
+  int                           done_pipe_fds[2];     // workers -> server thread
+  std::map<int, Connection *>   connections;          // fd -> connection
+  Connection                   *lock_owner;           // holds lock or runs get-lock
+  std::deque<Connection *>      lock_waiters;
+
+  std::vector<pthread_t>        workers;
+  Mutex                         job_mutex;
+  Cond                          job_cond;
+  std::deque<Job *>             todo_jobs;
+  std::deque<Job *>             done_jobs;
+  bool                          workers_quit;
+
+  BDBCompactor *compactor;
+  double        compact_next_t;
+
+  void compact_step();
+  void idle();
+
+  // server thread:
+  void accept_clients();
+  void read_client (Connection *conn);
+  void write_client (Connection *conn);
+  void process_requests (Connection *conn);
+  void finish_jobs();
+  void close_client (Connection *conn, bool update_state);
+  void lock_released();
+  bool find_command (const std::string& name, CommandFunc& func, bool& worker);
+
+  // commands:
+  void cmd_print (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_get_lock (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_save_changes (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_get_prof (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_reset_prof (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_cache_stats (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_lock_stats (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_stats (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_query (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_bg_hashes (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_clear_cache (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_update_read_only (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_perf_getattr (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+  void cmd_perf_getattr_list (Connection *conn, const std::vector<std::string>& request, std::vector<std::string>& result);
+
 public:
   Server();
   ~Server();
@@ -25,9 +125,14 @@ public:
 
   // server thread:
   void run();
-  void handle_client (int client_fd);
-  bool decode (const std::vector<char>& buffer, std::vector<std::string>& request);
-  void encode (const std::vector<std::string>& result, std::vector<char>& buffer);
+
+  // worker threads:
+  void run_worker();
+
+  static bool decode (std::vector<char>& buffer, std::vector<std::string>& request);
+  static void encode (const std::vector<std::string>& result, std::vector<char>& buffer);
 };
 
 }
+
+#endif
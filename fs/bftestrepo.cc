@@ -0,0 +1,139 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bftestrepo.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace BFSync
+{
+
+static bool
+copy_file (const string& src, const string& dest)
+{
+  FILE *in = fopen (src.c_str(), "r");
+  if (!in)
+    return false;
+
+  FILE *out = fopen (dest.c_str(), "w");
+  if (!out)
+    {
+      fclose (in);
+      return false;
+    }
+
+  bool ok = true;
+  char buffer[64 * 1024];
+  size_t len;
+  while ((len = fread (buffer, 1, sizeof (buffer), in)) > 0)
+    {
+      if (fwrite (buffer, 1, len, out) != len)
+        ok = false;
+    }
+  if (ferror (in))
+    ok = false;
+
+  fclose (in);
+  if (fclose (out) != 0)
+    ok = false;
+  return ok;
+}
+
+/*
+ * copy regular files of the repository and its bdb directory; BDB environment
+ * region files (__db.*) are not copied, they are recreated when the copy is opened
+ */
+static bool
+copy_repo (const string& src, const string& dest, bool top_level = true)
+{
+  DIR *dir = opendir (src.c_str());
+  if (!dir)
+    return false;
+
+  bool ok = true;
+  struct dirent *de;
+  while (ok && (de = readdir (dir)))
+    {
+      string name = de->d_name;
+      string src_name = src + "/" + name;
+      string dest_name = dest + "/" + name;
+
+      struct stat st;
+      if (name == "." || name == ".." || lstat (src_name.c_str(), &st) != 0)
+        continue;
+
+      if (S_ISREG (st.st_mode) && name.compare (0, 5, "__db.") != 0)
+        {
+          ok = copy_file (src_name, dest_name);
+        }
+      else if (S_ISDIR (st.st_mode) && top_level && name == "bdb")
+        {
+          ok = mkdir (dest_name.c_str(), 0700) == 0 && copy_repo (src_name, dest_name, false);
+        }
+    }
+  closedir (dir);
+  return ok;
+}
+
+void
+scratch_repo_remove (const string& path)
+{
+  DIR *dir = opendir (path.c_str());
+  if (dir)
+    {
+      struct dirent *de;
+      while ((de = readdir (dir)))
+        {
+          string name = de->d_name;
+          if (name == "." || name == "..")
+            continue;
+
+          string full_name = path + "/" + name;
+          struct stat st;
+          if (lstat (full_name.c_str(), &st) == 0 && S_ISDIR (st.st_mode))
+            scratch_repo_remove (full_name);
+          else
+            unlink (full_name.c_str());
+        }
+      closedir (dir);
+    }
+  rmdir (path.c_str());
+}
+
+bool
+scratch_repo_create (const string& repo_path, const string& test_name, string& scratch_repo)
+{
+  string repo = repo_path;
+  while (repo.size() > 1 && repo[repo.size() - 1] == '/')
+    repo.resize (repo.size() - 1);
+
+  string suffix = "." + test_name + ".XXXXXX";
+
+  vector<char> scratch_template (repo.begin(), repo.end());
+  scratch_template.insert (scratch_template.end(), suffix.c_str(), suffix.c_str() + suffix.size() + 1);
+
+  if (!mkdtemp (&scratch_template[0]))
+    {
+      printf ("can't create scratch directory for %s: %s\n", repo.c_str(), strerror (errno));
+      return false;
+    }
+  scratch_repo = &scratch_template[0];
+  if (!copy_repo (repo, scratch_repo))
+    {
+      printf ("error copying repository %s to %s\n", repo.c_str(), scratch_repo.c_str());
+      scratch_repo_remove (scratch_repo);
+      return false;
+    }
+  return true;
+}
+
+}
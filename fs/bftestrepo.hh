@@ -0,0 +1,21 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_TEST_REPO_HH
+#define BFSYNC_TEST_REPO_HH
+
+#include <string>
+
+namespace BFSync
+{
+
+/*
+ * scratch copies of repositories for tests that modify the database: the copy is
+ * created next to the repository (so it is on the same filesystem) and contains
+ * the regular files of the repository and its bdb directory
+ */
+bool scratch_repo_create (const std::string& repo, const std::string& test_name, std::string& scratch_repo);
+void scratch_repo_remove (const std::string& scratch_repo);
+
+}
+
+#endif
@@ -75,6 +75,12 @@ TimeProf::add_section (TimeProfSection *section)
   m_sections.push_back (section);
 }
 
+const vector<TimeProfSection *>&
+TimeProf::sections() const
+{
+  return m_sections;
+}
+
 TimeProfHandle::TimeProfHandle (TimeProfSection& section) :
   m_section (&section)
 {
@@ -46,6 +46,7 @@ public:
   static TimeProf* the();
 
   void                            add_section (TimeProfSection *section);
+  const std::vector<TimeProfSection *>& sections() const;
   std::string                     result();
   void                            reset();
 };
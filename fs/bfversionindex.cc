@@ -0,0 +1,468 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bfversionindex.hh"
+#include "bfsyncfs.hh"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+using std::string;
+using std::vector;
+
+namespace BFSync
+{
+
+static const char    VI_MAGIC[]    = "BFSYNCVI";
+static const size_t  VI_MAGIC_SIZE = 8;
+static const guint32 VI_FORMAT     = 1;
+static const size_t  VI_HEADER     = VI_MAGIC_SIZE + 3 * 4;
+static const size_t  VI_SHA1_SIZE  = 20;
+
+string
+version_index_filename (const string& repo_path, unsigned int version)
+{
+  return string_printf ("%s/version-index/%u", repo_path.c_str(), version);
+}
+
+VersionIndex::VersionIndex() :
+  fd (-1),
+  m_data (NULL),
+  m_size (0),
+  m_version (0),
+  m_n_entries (0)
+{
+}
+
+VersionIndex::~VersionIndex()
+{
+  if (m_data)
+    munmap ((void *) m_data, m_size);
+  if (fd >= 0)
+    close (fd);
+}
+
+bool
+VersionIndex::open (const string& filename)
+{
+  fd = ::open (filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || size_t (st.st_size) < VI_HEADER + VI_SHA1_SIZE)
+    return false;
+
+  m_size = st.st_size;
+
+  void *data = mmap (NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return false;
+
+  m_data = (const char *) data;
+
+  if (memcmp (m_data, VI_MAGIC, VI_MAGIC_SIZE) != 0)
+    return false;
+
+  DataBuffer hbuffer (m_data + VI_MAGIC_SIZE, VI_HEADER - VI_MAGIC_SIZE);
+  if (hbuffer.read_uint32() != VI_FORMAT)
+    return false;
+
+  m_version = hbuffer.read_uint32();
+  m_n_entries = hbuffer.read_uint32();
+
+  /* offsets must fit, entries are checked by verify() */
+  return VI_HEADER + guint64 (m_n_entries) * 8 + VI_SHA1_SIZE <= m_size;
+}
+
+/* check sha1 sum of the whole file */
+bool
+VersionIndex::verify()
+{
+  g_return_val_if_fail (m_data != NULL, false);
+
+  GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (sum, (const guchar *) m_data, m_size - VI_SHA1_SIZE);
+
+  vector<guint8> sha1 (VI_SHA1_SIZE);
+  gsize digest_len = sha1.size();
+  g_checksum_get_digest (sum, &sha1[0], &digest_len);
+  g_checksum_free (sum);
+
+  return memcmp (&sha1[0], m_data + m_size - VI_SHA1_SIZE, VI_SHA1_SIZE) == 0;
+}
+
+guint32
+VersionIndex::version() const
+{
+  return m_version;
+}
+
+size_t
+VersionIndex::n_entries() const
+{
+  return m_n_entries;
+}
+
+/* binary search for id: entry is set to the data after the id */
+bool
+VersionIndex::find (const ID& id, DataBuffer& entry)
+{
+  DataOutBuffer kbuf;
+  id.store (kbuf);
+
+  const char *offsets = m_data + VI_HEADER;
+  const char *end = m_data + m_size - VI_SHA1_SIZE;
+
+  size_t lo = 0, hi = m_n_entries;
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+
+      guint64 offset;
+      memcpy (&offset, offsets + mid * 8, 8);
+
+      DataBuffer ebuffer (m_data + offset, end - (m_data + offset));
+      size_t id_len = ebuffer.read_varint();
+
+      const char *id_ptr = end - ebuffer.remaining();
+      int cmp = memcmp (id_ptr, kbuf.begin(), std::min (id_len, kbuf.size()));
+      if (cmp == 0 && id_len != kbuf.size())
+        cmp = id_len < kbuf.size() ? -1 : 1;
+
+      if (cmp < 0)
+        {
+          lo = mid + 1;
+        }
+      else if (cmp > 0)
+        {
+          hi = mid;
+        }
+      else
+        {
+          entry = DataBuffer (id_ptr + id_len, end - (id_ptr + id_len));
+          return true;
+        }
+    }
+  return false;
+}
+
+bool
+VersionIndex::load_inode (const ID& id, INodeRecord& ir)
+{
+  DataBuffer entry (NULL, 0);
+  if (!find (id, entry))
+    return false;
+
+  size_t inode_len = entry.read_varint();
+  if (inode_len == 0)     // links without inode (should not happen)
+    return false;
+
+  ir.read (entry, BDB_RECORD_FORMAT_COMPACT);
+
+  /* the stored vmax may be VERSION_INF although the record was changed later */
+  ir.vmin = ir.vmax = m_version;
+  return true;
+}
+
+void
+VersionIndex::load_links (const ID& id, vector<LinkRecord>& links)
+{
+  DataBuffer entry (NULL, 0);
+  if (!find (id, entry))
+    return;
+
+  vector<char> skip;
+  entry.read_bytes (skip, entry.read_varint());
+
+  size_t n_links = entry.read_varint();
+  for (size_t i = 0; i < n_links; i++)
+    {
+      entry.read_varint();     // record length
+
+      LinkRecord lr;
+      lr.read (entry, id, BDB_RECORD_FORMAT_COMPACT);
+      lr.vmin = lr.vmax = m_version;
+      links.push_back (lr);
+    }
+}
+
+//----- building a version index from the database -------
+
+static void
+build_update_status (unsigned int version, size_t n_records)
+{
+  printf ("\rVersion index %u: %zd records ... ", version, n_records);
+  fflush (stdout);
+}
+
+namespace
+{
+
+/*
+ * reads the records of one table that are valid at version; the records are sorted
+ * by key, and since stored ids are prefix free (zero terminated path prefix + fixed
+ * size), this is the id order of the index for both the inode and the link table
+ */
+class VersionRecordReader
+{
+  BDB                *bdb;
+  DbcPtr              dbc;
+  AllRecordsIterator  ari;
+  BDBTables           table;
+  unsigned int        version;
+  size_t&             n_records;
+
+public:
+  bool    valid;
+  string  id;       // stored id (without table byte)
+  string  record;   // record in compact format
+
+  VersionRecordReader (BDB *bdb, BDBTables table, unsigned int version, size_t& n_records) :
+    bdb (bdb),
+    dbc (bdb, table, DbcPtr::SNAPSHOT),
+    ari (dbc.dbc),
+    table (table),
+    version (version),
+    n_records (n_records),
+    valid (false)
+  {
+    next();
+  }
+  void
+  next()
+  {
+    Dbt key, data;
+
+    valid = false;
+    while (ari.next (key, data))
+      {
+        if (++n_records % 100000 == 0)
+          build_update_status (version, n_records);
+
+        DataBuffer dbuffer ((char *) data.get_data(), data.get_size());
+        DataOutBuffer dbuf;
+
+        if (table == BDB_TABLE_INODES)
+          {
+            guint32 vmin, vmax;
+            INodeRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+            if (version < vmin || version > vmax)
+              continue;
+
+            INodeRecord ir;
+            ir.read (dbuffer, bdb->record_format());
+            ir.write (dbuf, BDB_RECORD_FORMAT_COMPACT);
+          }
+        else
+          {
+            guint32 vmin, vmax;
+            LinkRecord::read_versions (dbuffer, bdb->record_format(), vmin, vmax);
+            if (version < vmin || version > vmax)
+              continue;
+
+            DataBuffer kbuffer ((char *) key.get_data(), key.get_size());
+            ID dir_id (kbuffer);
+
+            LinkRecord lr;
+            lr.read (dbuffer, dir_id, bdb->record_format());
+            lr.write (dbuf, dir_id, BDB_RECORD_FORMAT_COMPACT);
+          }
+        id.assign ((char *) key.get_data(), key.get_size() - 1);   // strip table byte
+        record.assign (dbuf.begin(), dbuf.size());
+        valid = true;
+        return;
+      }
+  }
+};
+
+}
+
+static bool
+write_all (int fd, const char *data, size_t size, GChecksum *sum)
+{
+  if (sum)
+    g_checksum_update (sum, (const guchar *) data, size);
+
+  while (size)
+    {
+      ssize_t w = write (fd, data, size);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return false;
+
+      data += w;
+      size -= w;
+    }
+  return true;
+}
+
+/* append the contents of in_file to fd, adding base to each uint64 if offsets is true */
+static bool
+copy_part (FILE *in_file, int fd, GChecksum *sum, bool offsets, guint64 base)
+{
+  if (fflush (in_file) != 0 || fseek (in_file, 0, SEEK_SET) != 0)
+    return false;
+
+  vector<char> buffer (64 * 1024);
+  size_t len;
+  while ((len = fread (&buffer[0], 1, buffer.size(), in_file)) > 0)
+    {
+      if (offsets)
+        {
+          g_return_val_if_fail (len % 8 == 0, false);    // buffer size is a multiple of 8
+
+          for (size_t i = 0; i < len; i += 8)
+            {
+              guint64 offset;
+              memcpy (&offset, &buffer[i], 8);
+              offset += base;
+              memcpy (&buffer[i], &offset, 8);
+            }
+        }
+      if (!write_all (fd, &buffer[0], len, sum))
+        return false;
+    }
+  return !ferror (in_file);
+}
+
+/*
+ * scans inode and link tables and writes the records valid at version to the
+ * index file; the file is written under a temporary name and renamed when
+ * complete, so readers never see partial indexes
+ *
+ * the tables are read in id order at the same time and merged, so the entries are
+ * written while scanning: entries and offsets go to temporary files, which are
+ * copied behind the header once the number of entries is known
+ */
+bool
+version_index_build (BDB *bdb, unsigned int version, const string& filename)
+{
+  string dir_name = filename.substr (0, filename.rfind ('/'));
+  if (mkdir (dir_name.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      printf ("\nVersion index: can't create directory '%s'.\n", dir_name.c_str());
+      return false;
+    }
+
+  /* temporary files: removed by prune_version_indexes if the build is interrupted */
+  string part_filename = filename + ".part";
+  string body_filename = filename + ".body.part";
+  string offsets_filename = filename + ".offsets.part";
+
+  FILE *body_file = fopen (body_filename.c_str(), "w+");
+  FILE *offsets_file = fopen (offsets_filename.c_str(), "w+");
+
+  bool ok = body_file && offsets_file;
+
+  size_t n_records = 0;
+  guint32 n_entries = 0;
+  guint64 body_size = 0;
+
+  build_update_status (version, 0);
+
+  if (ok)
+    {
+      VersionRecordReader inodes (bdb, BDB_TABLE_INODES, version, n_records);
+      VersionRecordReader links (bdb, BDB_TABLE_LINKS, version, n_records);
+
+      DataOutBuffer entry;
+      while (ok && (inodes.valid || links.valid))
+        {
+          /* smallest id of both tables */
+          string id;
+          if (!links.valid || (inodes.valid && inodes.id <= links.id))
+            id = inodes.id;
+          else
+            id = links.id;
+
+          entry.clear();
+          entry.write_varint (id.size());
+          entry.write_bytes (id.data(), id.size());
+          if (inodes.valid && inodes.id == id)
+            {
+              entry.write_varint (inodes.record.size());
+              entry.write_bytes (inodes.record.data(), inodes.record.size());
+              inodes.next();
+            }
+          else
+            {
+              entry.write_varint (0);   // links without inode
+            }
+
+          vector<string> entry_links;
+          while (links.valid && links.id == id)
+            {
+              entry_links.push_back (links.record);
+              links.next();
+            }
+          entry.write_varint (entry_links.size());
+          for (vector<string>::const_iterator li = entry_links.begin(); li != entry_links.end(); li++)
+            {
+              entry.write_varint (li->size());
+              entry.write_bytes (li->data(), li->size());
+            }
+
+          /* offset relative to the start of the entries, see copy_part */
+          ok = fwrite (&body_size, 8, 1, offsets_file) == 1;
+          ok = ok && fwrite (entry.begin(), entry.size(), 1, body_file) == 1;
+
+          body_size += entry.size();
+          n_entries++;
+        }
+    }
+  build_update_status (version, n_records);
+
+  int fd = -1;
+  if (ok)
+    {
+      fd = ::open (part_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      ok = fd >= 0;
+    }
+  if (ok)
+    {
+      DataOutBuffer header;
+      header.write_bytes (VI_MAGIC, VI_MAGIC_SIZE);
+      header.write_uint32 (VI_FORMAT);
+      header.write_uint32 (version);
+      header.write_uint32 (n_entries);
+
+      GChecksum *sum = g_checksum_new (G_CHECKSUM_SHA1);
+
+      ok = write_all (fd, header.begin(), header.size(), sum);
+      ok = ok && copy_part (offsets_file, fd, sum, true, VI_HEADER + guint64 (n_entries) * 8);
+      ok = ok && copy_part (body_file, fd, sum, false, 0);
+
+      vector<guint8> sha1 (VI_SHA1_SIZE);
+      gsize digest_len = sha1.size();
+      g_checksum_get_digest (sum, &sha1[0], &digest_len);
+      g_checksum_free (sum);
+
+      ok = ok && write_all (fd, (const char *) &sha1[0], sha1.size(), NULL);
+      ok = ok && fdatasync (fd) == 0;
+      ok = (close (fd) == 0) && ok;
+      ok = ok && rename (part_filename.c_str(), filename.c_str()) == 0;
+    }
+  if (body_file)
+    fclose (body_file);
+  if (offsets_file)
+    fclose (offsets_file);
+  unlink (body_filename.c_str());
+  unlink (offsets_filename.c_str());
+
+  if (!ok)
+    {
+      printf ("\nVersion index: error writing file '%s'.\n", filename.c_str());
+      unlink (part_filename.c_str());
+      return false;
+    }
+  printf ("done.\n");
+  return true;
+}
+
+}
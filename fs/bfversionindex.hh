@@ -0,0 +1,56 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_VERSION_INDEX_HH
+#define BFSYNC_VERSION_INDEX_HH
+
+#include "bfbdb.hh"
+
+namespace BFSync
+{
+
+/*
+ * VersionIndex: immutable index file for one committed version; for each inode
+ * id it contains the inode record and the link records (directories) that are
+ * valid at this version, sorted by id, so lookups are binary searches in the
+ * memory mapped file that don't use the database
+ *
+ * file format:
+ *   header     magic "BFSYNCVI", format, version, number of entries
+ *   offsets    one uint64 per entry, sorted by id
+ *   entries    id, inode record, link records (compact record format)
+ *   sha1       checksum of everything before it
+ *
+ * records are stored as they were when the index was built, so vmax may be
+ * VERSION_INF for records that have been changed in later versions; loaded
+ * records have vmin = vmax = version, they can't be used to modify the database
+ */
+class VersionIndex
+{
+  int           fd;
+  const char   *m_data;
+  size_t        m_size;
+  guint32       m_version;
+  guint32       m_n_entries;
+
+  bool          find (const ID& id, DataBuffer& entry);
+
+public:
+  VersionIndex();
+  ~VersionIndex();
+
+  bool          open (const std::string& filename);
+  bool          verify();
+
+  guint32       version() const;
+  size_t        n_entries() const;
+
+  bool          load_inode (const ID& id, INodeRecord& ir);
+  void          load_links (const ID& id, std::vector<LinkRecord>& links);
+};
+
+std::string version_index_filename (const std::string& repo_path, unsigned int version);
+bool        version_index_build (BDB *bdb, unsigned int version, const std::string& filename);
+
+}
+
+#endif
@@ -0,0 +1,220 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+/*
+ * test that version index records never get into the database
+ *
+ * builds the index of the last committed version, browses this version and the
+ * current version with an INodeRepo (like bfsyncfs does for .bfsync/commits/<N>
+ * and the mount point), modifies the root directory and saves the changes; the
+ * test fails if the root inode or its links have records that were not in the
+ * database before (index records have vmin = vmax = indexed version) or if the
+ * indexed version can't be read the same way from the index and the database
+ *
+ * the test runs on a scratch copy of the repository (see bftestrepo.hh), which
+ * needs at least one commit; the repository must not be in use
+ */
+
+#include "bfsyncdb.hh"
+#include "bfversionindex.hh"
+#include "bftestrepo.hh"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::pair;
+
+typedef vector< pair<unsigned int, unsigned int> > VersionRanges;
+
+static VersionRanges
+inode_ranges (BDBPtr& bdb_ptr, const ID& id)
+{
+  VersionRanges ranges;
+
+  vector<INode> inodes = bdb_ptr.load_all_inodes (id);
+  for (vector<INode>::const_iterator ii = inodes.begin(); ii != inodes.end(); ii++)
+    ranges.push_back (std::make_pair (ii->vmin, ii->vmax));
+
+  std::sort (ranges.begin(), ranges.end());
+  return ranges;
+}
+
+static VersionRanges
+link_ranges (BDBPtr& bdb_ptr, const ID& id)
+{
+  VersionRanges ranges;
+
+  vector<Link> links = bdb_ptr.load_all_links (id);
+  for (vector<Link>::const_iterator li = links.begin(); li != links.end(); li++)
+    ranges.push_back (std::make_pair (li->vmin, li->vmax));
+
+  std::sort (ranges.begin(), ranges.end());
+  return ranges;
+}
+
+static vector<string>
+link_names (const vector<Link>& links)
+{
+  vector<string> names;
+
+  for (vector<Link>::const_iterator li = links.begin(); li != links.end(); li++)
+    names.push_back (li->name + "=" + li->inode_id.id.pretty_str());
+
+  std::sort (names.begin(), names.end());
+  return names;
+}
+
+/* records of the indexed version that were not in the database before */
+static bool
+check_ranges (const char *what, const VersionRanges& before, const VersionRanges& after, unsigned int version)
+{
+  bool ok = true;
+
+  for (VersionRanges::const_iterator ri = after.begin(); ri != after.end(); ri++)
+    {
+      if (ri->first == version && ri->second == version &&
+          std::find (before.begin(), before.end(), *ri) == before.end())
+        {
+          printf ("FAIL: %s record %u..%u written from version index\n", what, ri->first, ri->second);
+          ok = false;
+        }
+    }
+  return ok;
+}
+
+static size_t
+count_ranges (const VersionRanges& ranges, unsigned int version)
+{
+  size_t count = 0;
+
+  for (VersionRanges::const_iterator ri = ranges.begin(); ri != ranges.end(); ri++)
+    {
+      if (version >= ri->first && version <= ri->second)
+        count++;
+    }
+  return count;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      printf ("usage: bfversionindextest <repo>\n");
+      exit (1);
+    }
+
+  string scratch_repo;
+  if (!BFSync::scratch_repo_create (argv[1], "versionindextest", scratch_repo))
+    exit (1);
+
+  BDBPtr bdb_ptr = open_db (scratch_repo, 16, false);
+  if (!bdb_ptr.open_ok())
+    {
+      printf ("error opening db %s\n", scratch_repo.c_str());
+      BFSync::scratch_repo_remove (scratch_repo);
+      exit (1);
+    }
+
+  BFSync::BDB *bdb = bdb_ptr.get_bdb();
+  bdb->history()->read();
+
+  const unsigned int current_version = bdb->history()->current_version();
+  const unsigned int version = current_version - 1;
+  if (version < 1)
+    {
+      printf ("repository %s has no commits\n", argv[1]);
+      BFSync::scratch_repo_remove (scratch_repo);
+      exit (1);
+    }
+
+  bool ok = true;
+
+  if (!BFSync::version_index_build (bdb, version, bdb->version_index_filename (version)))
+    {
+      printf ("FAIL: building version index %u failed\n", version);
+      ok = false;
+    }
+  bdb->version_index_refresh();
+  if (!bdb->version_index (version))
+    {
+      printf ("FAIL: no version index for version %u\n", version);
+      ok = false;
+    }
+
+  ID root = id_root();
+
+  VersionRanges inodes_before = inode_ranges (bdb_ptr, root);
+  VersionRanges links_before = link_ranges (bdb_ptr, root);
+  vector<string> names_before = link_names (bdb_ptr.load_links (root, version));
+
+  /* the read-only lookups must see the same version as the database */
+  if (link_names (bdb_ptr.read_links (root, version)) != names_before)
+    {
+      printf ("FAIL: version index links of version %u differ from database\n", version);
+      ok = false;
+    }
+  if (!bdb_ptr.read_inode (root, version).valid)
+    {
+      printf ("FAIL: version index has no root inode for version %u\n", version);
+      ok = false;
+    }
+
+  {
+    INodeRepo inr (bdb_ptr);
+
+    /* browse the indexed version (.bfsync/commits/<version>) */
+    INodeRepoINode old_root = inr.load_inode (root, version);
+    if (!old_root.valid())
+      {
+        printf ("FAIL: can't load root inode of version %u\n", version);
+        ok = false;
+      }
+    else
+      {
+        vector<string> children = old_root.get_child_names (version);
+        for (vector<string>::const_iterator ci = children.begin(); ci != children.end(); ci++)
+          old_root.get_child (version, *ci);
+      }
+
+    /* modify the same inode in the current version */
+    INodeRepoINode new_root = inr.load_inode (root, current_version);
+    if (!new_root.valid())
+      {
+        printf ("FAIL: can't load root inode of version %u\n", current_version);
+        ok = false;
+      }
+    else
+      {
+        new_root.set_mtime (new_root.mtime() + 1);
+        inr.save_changes();
+      }
+  }
+
+  VersionRanges inodes_after = inode_ranges (bdb_ptr, root);
+  VersionRanges links_after = link_ranges (bdb_ptr, root);
+
+  ok = check_ranges ("inode", inodes_before, inodes_after, version) && ok;
+  ok = check_ranges ("link", links_before, links_after, version) && ok;
+
+  if (count_ranges (inodes_after, version) != 1 || count_ranges (links_after, version) != count_ranges (links_before, version))
+    {
+      printf ("FAIL: duplicate records for version %u\n", version);
+      ok = false;
+    }
+
+  if (link_names (bdb_ptr.load_links (root, version)) != names_before)
+    {
+      printf ("FAIL: links of version %u changed\n", version);
+      ok = false;
+    }
+
+  bdb_ptr.close();
+  BFSync::scratch_repo_remove (scratch_repo);
+
+  printf ("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
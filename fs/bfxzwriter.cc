@@ -0,0 +1,194 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#include "bfxzwriter.hh"
+#include "bfsyncfs.hh"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using std::string;
+
+namespace BFSync
+{
+
+static const size_t XZ_BUFFER_SIZE = 1024 * 1024;
+
+XzWriter::XzWriter() :
+  stream_init (false),
+  file (NULL),
+  sum (NULL),
+  m_in_bytes (0),
+  m_out_bytes (0)
+{
+  lzma_stream init = LZMA_STREAM_INIT;
+  stream = init;
+}
+
+XzWriter::~XzWriter()
+{
+  cleanup();
+}
+
+void
+XzWriter::cleanup()
+{
+  if (stream_init)
+    {
+      lzma_end (&stream);
+      stream_init = false;
+    }
+  if (file)
+    {
+      fclose (file);
+      file = NULL;
+    }
+  if (sum)
+    {
+      g_checksum_free (sum);
+      sum = NULL;
+    }
+}
+
+/*
+ * threads = 0: one thread per cpu, but at most 4, since each thread needs
+ * about 100 MB of memory at the default preset
+ */
+bool
+XzWriter::open (const string& filename, unsigned int threads, unsigned int preset)
+{
+  cleanup();
+
+  if (threads == 0)
+    threads = std::min (std::max (lzma_cputhreads(), 1u), 4u);
+
+  lzma_mt mt;
+  memset (&mt, 0, sizeof (mt));
+  mt.threads = threads;
+  mt.preset  = preset;
+  mt.check   = LZMA_CHECK_CRC64;
+
+  lzma_ret ret = lzma_stream_encoder_mt (&stream, &mt);
+  if (ret != LZMA_OK)
+    {
+      m_error = string_printf ("xz encoder init failed (error %d)", ret);
+      return false;
+    }
+  stream_init = true;
+
+  file = fopen (filename.c_str(), "w");
+  if (!file)
+    {
+      m_error = string_printf ("can't open file '%s': %s", filename.c_str(), strerror (errno));
+      cleanup();
+      return false;
+    }
+  sum = g_checksum_new (G_CHECKSUM_SHA1);
+  out_buffer.resize (XZ_BUFFER_SIZE);
+  m_in_bytes = m_out_bytes = 0;
+  m_hash = "";
+
+  stream.next_out  = &out_buffer[0];
+  stream.avail_out = out_buffer.size();
+  return true;
+}
+
+/* run encoder until input is consumed (LZMA_RUN) or the stream is finished (LZMA_FINISH) */
+bool
+XzWriter::encode (lzma_action action)
+{
+  for (;;)
+    {
+      lzma_ret ret = lzma_code (&stream, action);
+
+      if (stream.avail_out == 0 || ret == LZMA_STREAM_END)
+        {
+          size_t out_size = out_buffer.size() - stream.avail_out;
+          if (fwrite (&out_buffer[0], 1, out_size, file) != out_size)
+            {
+              m_error = string_printf ("write error: %s", strerror (errno));
+              return false;
+            }
+          g_checksum_update (sum, &out_buffer[0], out_size);
+          m_out_bytes += out_size;
+
+          stream.next_out  = &out_buffer[0];
+          stream.avail_out = out_buffer.size();
+        }
+      if (ret == LZMA_STREAM_END)
+        return true;
+      if (ret != LZMA_OK)
+        {
+          m_error = string_printf ("xz encoder failed (error %d)", ret);
+          return false;
+        }
+      if (action == LZMA_RUN && stream.avail_in == 0)
+        return true;
+    }
+}
+
+bool
+XzWriter::write (const void *data, size_t size)
+{
+  if (!stream_init)
+    return false;
+
+  stream.next_in  = static_cast<const guint8 *> (data);
+  stream.avail_in = size;
+  m_in_bytes += size;
+
+  return encode (LZMA_RUN);
+}
+
+bool
+XzWriter::close()
+{
+  if (!stream_init)
+    return false;
+
+  stream.next_in  = NULL;
+  stream.avail_in = 0;
+
+  bool ok = encode (LZMA_FINISH);
+  if (ok)
+    {
+      if (fflush (file) != 0 || fsync (fileno (file)) != 0)
+        {
+          m_error = string_printf ("write error: %s", strerror (errno));
+          ok = false;
+        }
+    }
+  if (ok)
+    m_hash = g_checksum_get_string (sum);
+
+  cleanup();
+  return ok;
+}
+
+string
+XzWriter::hash() const
+{
+  return m_hash;
+}
+
+guint64
+XzWriter::in_bytes() const
+{
+  return m_in_bytes;
+}
+
+guint64
+XzWriter::out_bytes() const
+{
+  return m_out_bytes;
+}
+
+string
+XzWriter::error() const
+{
+  return m_error;
+}
+
+}
@@ -0,0 +1,53 @@
+// Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+#ifndef BFSYNC_XZ_WRITER_HH
+#define BFSYNC_XZ_WRITER_HH
+
+#include <glib.h>
+#include <lzma.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+namespace BFSync
+{
+
+/*
+ * XzWriter: writes an xz compressed file, using the multi-threaded encoder
+ *
+ * the SHA-1 hash of the compressed data is computed while writing, so the file
+ * doesn't need to be read again to store it as object
+ */
+class XzWriter
+{
+  lzma_stream           stream;
+  bool                  stream_init;
+  FILE                 *file;
+  GChecksum            *sum;
+  std::vector<guint8>   out_buffer;
+  guint64               m_in_bytes;
+  guint64               m_out_bytes;
+  std::string           m_hash;
+  std::string           m_error;
+
+  bool encode (lzma_action action);
+  void cleanup();
+
+public:
+  XzWriter();
+  ~XzWriter();
+
+  bool          open (const std::string& filename, unsigned int threads = 0, unsigned int preset = 6);
+  bool          write (const void *data, size_t size);
+  bool          close();
+
+  std::string   hash() const;       // SHA-1 of the compressed file, after close()
+  guint64       in_bytes() const;
+  guint64       out_bytes() const;
+  std::string   error() const;
+};
+
+}
+
+#endif /* BFSYNC_XZ_WRITER_HH */
@@ -4,39 +4,72 @@
 # Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
 
 import socket
+import struct
 
+class QueryResult:
+  def __init__ (self, entry):
+    f = entry.split (" ", 15)
+    self.id = f[0]
+    self.type = int (f[1])
+    self.mode = int (f[2], 8)
+    self.uid = int (f[3])
+    self.gid = int (f[4])
+    self.size = int (f[5])
+    self.mtime = int (f[6])
+    self.mtime_ns = int (f[7])
+    self.ctime = int (f[8])
+    self.ctime_ns = int (f[9])
+    self.nlink = int (f[10])
+    self.major = int (f[11])
+    self.minor = int (f[12])
+    self.hash = f[13]
+    self.file_number = int (f[14])
+    self.link = f[15]
+
+# frames: uint32 payload size, then for each string: uint32 length, bytes
+# (big endian, see fs/bfsyncserver.hh)
 class ServerConn:
+  # returns (message, remaining data) or (False, data) if more data is needed
   def decode (self, data):
-    content_size = -1
-    skip = 0
-    while skip < len (data):
-      if data[skip] == '\0':
-        content_size = int (data[0:skip])
-        break
-      skip += 1
-    if content_size != -1:
-      if ((skip + 1 + content_size) == len (data)):
-        split_data = data[skip + 1:].split ("\0")
-        return split_data[:-1]
-    return False # need more data
+    if len (data) < 4:
+      return False, data
+    frame_size = struct.unpack (">I", data[0:4])[0]
+    if len (data) < 4 + frame_size:
+      return False, data
+    msg = []
+    pos = 4
+    while pos < 4 + frame_size:
+      l = struct.unpack (">I", data[pos:pos + 4])[0]
+      msg.append (data[pos + 4:pos + 4 + l])
+      pos += 4 + l
+    return msg, data[4 + frame_size:]
 
   def encode (self, msg):
     serialized = ""
     for m in msg:
-      serialized += m
-      serialized += "\0"
-    serialized = str (len (serialized)) + "\0" + serialized
-    return serialized
+      serialized += struct.pack (">I", len (m)) + m
+    return struct.pack (">I", len (serialized)) + serialized
 
   def process_call (self, msg):
-    request_data = self.encode (msg)
-    self.conn_socket.send (request_data)
-    data = ""
-    while True:
-      data += self.conn_socket.recv (1024)
-      result = self.decode (data)
-      if result != False:
-        return result
+    return self.process_calls ([ msg ])[0]
+
+  # send all requests at once, then wait for the results (in request order)
+  def process_calls (self, msgs):
+    request_data = ""
+    for msg in msgs:
+      request_data += self.encode (msg)
+    self.conn_socket.sendall (request_data)
+    results = []
+    while len (results) < len (msgs):
+      result, self.data = self.decode (self.data)
+      if result == False:
+        received = self.conn_socket.recv (64 * 1024)
+        if received == "":
+          raise Exception ("ServerConn: connection closed by server")
+        self.data += received
+      else:
+        results.append (result)
+    return results
 
   def get_lock (self):
     result = self.process_call (["get-lock"])
@@ -74,10 +107,45 @@ class ServerConn:
         raise Exception (result[0])
     raise Exception ("ServerConn: unable to update read only mode (bad response received)")
 
+  # hashes computed by bfsyncfs background hashing, "" if unknown or invalid
+  def bg_hashes (self, file_numbers):
+    if not file_numbers:
+      return []
+    result = self.process_call ([ "bg-hashes" ] + [ "%d" % n for n in file_numbers ])
+    if len (result) != len (file_numbers):
+      raise Exception ("ServerConn: unable to get background hashes (bad response received)")
+    return result
+
+  # batched metadata query, see bfsyncfs_query() in fs/bfsyncfs.cc
+  #
+  # returns one QueryResult per path/id, or None if the file doesn't exist;
+  # the requests are pipelined, batch_size entries per request
+  def query (self, query_type, args, items, batch_size = 10000):
+    msgs = []
+    for start in range (0, len (items), batch_size):
+      msgs.append ([ "query", query_type ] + args + items[start:start + batch_size])
+    results = []
+    for reply in self.process_calls (msgs):
+      if len (reply) == 1 and reply[0].startswith ("fail"):
+        raise Exception (reply[0])
+      for entry in reply:
+        if entry == "":
+          results.append (None)
+        else:
+          results.append (QueryResult (entry))
+    return results
+
+  def query_paths (self, paths, batch_size = 10000):
+    return self.query ("path", [], paths, batch_size)
+
+  def query_ids (self, version, ids, batch_size = 10000):
+    return self.query ("id", [ "%d" % version ], ids, batch_size)
+
   def close (self):
     self.conn_socket.close()
     self.conn_socket = None
 
   def __init__ (self, repo_dir):
+    self.data = ""
     self.conn_socket = socket.socket (socket.AF_UNIX, socket.SOCK_STREAM)
     self.conn_socket.connect (repo_dir + "/socket")
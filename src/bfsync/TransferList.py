@@ -130,8 +130,7 @@ class TransferList:
         if verbose and self.need_update():
           self.update_status_line()
       f.close()
-      move_file_to_objects (repo, dest_path, False)
-      tsplitter.split()             # start new transaction every once in a while
+      move_file_to_objects (repo, dest_path, False, tsplitter)
     if (verbose):
       self.update_status_line()
       status_line.cleanup()
@@ -145,14 +144,13 @@ class TransferList:
       src_path = os.path.join (src_repo.path, "objects", src_repo.make_number_filename (tfile.number))
       try:
         shutil.copyfile (src_path, dest_path)
-        move_file_to_objects (dest_repo, dest_path, False)
+        move_file_to_objects (dest_repo, dest_path, False, tsplitter)
       except Exception, ex:
         sys.stderr.write ("can't copy file %s to %s: %s\n" % (src_path, dest_path, ex))
         sys.exit (1)
       self.bytes_done += tfile.size
       if self.need_update():
         self.update_status_line()
-      tsplitter.split()             # start new transaction every once in a while
     self.update_status_line()
     status_line.cleanup()
     tsplitter.commit()
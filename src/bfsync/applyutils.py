@@ -5,6 +5,7 @@ from diffutils import DiffIterator
 from commitutils import commit
 from journal import mk_journal_entry, queue_command, CMD_DONE, CMD_AGAIN
 from StatusLine import status_line, OutputSubsampler
+from utils import try_commit_or_backoff
 import os
 import bfsyncdb
 
@@ -106,10 +107,26 @@ class ApplyCommand:
     self.repo = repo
     self.open_diff()
 
+  # commit the changes applied so far; if the transaction is aborted due to a
+  # deadlock, the state is reset to the last commit (the changes since then are
+  # applied again with a new ApplyTool, since the cached changes were lost)
+  def commit_changes (self, attempt):
+    self.apply_tool.save_changes_no_txn()
+    if try_commit_or_backoff (self.repo, attempt):
+      self.committed_state = (self.state.phase, self.state.change_pos)
+      return True
+
+    self.state.phase, self.state.change_pos = self.committed_state
+    self.apply_tool = None    # only one INodeRepo instance may exist at a time
+    self.apply_tool = ApplyTool (self.repo.bdb, self.state.VERSION)
+    return False
+
   def execute (self):
-    apply_tool = ApplyTool (self.repo.bdb, self.state.VERSION)
+    self.apply_tool = ApplyTool (self.repo.bdb, self.state.VERSION)
+    self.committed_state = (self.state.phase, self.state.change_pos)
 
     OPS = 0
+    attempt = 0
     self.repo.bdb.begin_transaction()
 
     # apply is done in three phases:
@@ -121,11 +138,22 @@ class ApplyCommand:
     # this ensures that l+, l- and l! are executed on a database that
     # contains both, the directory inode (link src) and the inode the
     # link points to (link dest)
-    while self.state.phase < 3:
+    while True:
+      if self.state.phase == 3:
+        # all changes applied
+        if self.commit_changes (attempt):
+          break
+        attempt += 1
+        self.repo.bdb.begin_transaction()
+        continue
+
       self.diff_iterator.seek (self.state.change_pos)
       while True:
         change = self.diff_iterator.next()
         if change is None:
+          # next phase
+          self.state.change_pos = 0
+          self.state.phase += 1
           break
 
         self.state.change_pos += 1
@@ -133,35 +161,36 @@ class ApplyCommand:
         # apply one change
         if self.state.phase == 0:
           if change[0] == "i+":
-            apply_tool.apply_inode_plus (change[1:])
+            self.apply_tool.apply_inode_plus (change[1:])
           if change[0] == "i!":
-            apply_tool.apply_inode_change (change[1:])
+            self.apply_tool.apply_inode_change (change[1:])
 
         if self.state.phase == 1:
           if change[0] == "l+":
-            apply_tool.apply_link_plus (change[1:])
+            self.apply_tool.apply_link_plus (change[1:])
           if change[0] == "l!":
-            apply_tool.apply_link_change (change[1:])
+            self.apply_tool.apply_link_change (change[1:])
           if change[0] == "l-":
-            apply_tool.apply_link_minus (change[1:])
+            self.apply_tool.apply_link_minus (change[1:])
 
         if self.state.phase == 2:
           if change[0] == "i-":
-            apply_tool.apply_inode_minus (change[1:])
+            self.apply_tool.apply_inode_minus (change[1:])
 
         OPS += 1
         if OPS >= 20000:
           OPS = 0
           mk_journal_entry (self.repo)
-          apply_tool.save_changes_no_txn()
-          self.repo.bdb.commit_transaction()
+          committed = self.commit_changes (attempt)
           self.repo.bdb.begin_transaction()
-
-      self.state.change_pos = 0
-      self.state.phase += 1
-
-    apply_tool.save_changes_no_txn()
-    self.repo.bdb.commit_transaction()
+          if committed:
+            attempt = 0
+          else:
+            # continue at the state of the last commit
+            attempt += 1
+            break
+
+    self.apply_tool = None
     self.diff_file.close()
     return CMD_DONE
 
@@ -3,16 +3,14 @@
 
 from ServerConn import ServerConn
 from StatusLine import status_line, OutputSubsampler
-from diffutils import diff
 from utils import *
-from xzutils import xz
-from HashCache import hash_cache
 from journal import mk_journal_entry, queue_command, CMD_DONE, CMD_AGAIN
+from versionindex import prune_version_indexes, set_version_index_tag
+from versionindex import tag_commit_version, commit_index_count, update_version_indexes
 
 import os
 import pwd
 import time
-import hashlib
 import cPickle
 import subprocess
 
@@ -29,9 +27,21 @@ class NoServerConn:
   def clear_cache (self):
     pass
 
+  def bg_hashes (self, file_numbers):
+    return [ "" ] * len (file_numbers)
+
   def close (self):
     pass
 
+# number of threads used to hash new files during commit (0: one per cpu)
+def commit_hash_threads (repo):
+  value = repo.config.get ("hash-threads")
+  if len (value) == 0:
+    return 0
+  if len (value) != 1 or not value[0].isdigit():
+    raise Exception ("bad hash-threads setting")
+  return int (value[0])
+
 def launch_editor (filename):
   editor = os.getenv ("VISUAL")
   if editor is None:
@@ -280,9 +290,27 @@ class RevertCommand:
     id_list_file = open (self.state.id_list_filename, "r")
 
     OPS = 0  # to keep number of operations per transaction below a pre-defined limit
+    attempt = 0
+    chunk_start = 0   # id list position of the first id fixed in the current transaction
 
     self.repo.bdb.begin_transaction()
-    for id_str in id_list_file:
+    while True:
+      id_str = id_list_file.readline()
+      if not id_str or OPS >= 20000:
+        OPS = 0
+        if try_commit_or_backoff (self.repo, attempt):
+          if not id_str:
+            break
+          chunk_start = id_list_file.tell() - len (id_str)
+          attempt = 0
+        else:
+          # deadlock: fix the ids of the aborted transaction again
+          id_list_file.seek (chunk_start)
+          attempt += 1
+          self.repo.bdb.begin_transaction()
+          continue
+        self.repo.bdb.begin_transaction()
+
       id = bfsyncdb.ID (id_str.strip())
       if not id.valid:
         raise Exception ("found invalid id during revert")
@@ -315,13 +343,6 @@ class RevertCommand:
       if len (del_links) > 0:
         self.repo.bdb.delete_links (del_links)
 
-      if OPS >= 20000:
-        self.repo.bdb.commit_transaction()
-        self.repo.bdb.begin_transaction()
-        OPS = 0
-
-    self.repo.bdb.commit_transaction()
-
     ## clear changed inodes
     while True:
       self.repo.bdb.begin_transaction()
@@ -340,9 +361,13 @@ class RevertCommand:
         break
       if he.version > self.state.VERSION:
         self.repo.bdb.delete_history_entry (v)
+        set_version_index_tag (self.repo, v, False)
       v += 1
     self.repo.bdb.commit_transaction()
 
+    # a new commit will reuse the version numbers of the reverted versions
+    prune_version_indexes (self.repo)
+
     # we modified the db, so the fs needs to reload everything
     # in-memory cached items will not be correct
     self.server_conn.clear_cache()
@@ -384,57 +409,29 @@ class CommitCommand:
     self.outss = OutputSubsampler()
     self.DEBUG_MEM = False
 
-  # update work to do
-  def scan_inode (self, inode):
-    if inode.hash == "new":
-      filename = self.repo.make_number_filename (inode.new_file_number)
-      self.state.total_file_size += os.path.getsize (filename)
-      self.state.total_file_count += 1
-      if self.state.verbose and self.outss.need_update():
-        status_line.update ("scanning file %d (total %s)" % (
-          self.state.total_file_count, format_size1 (self.state.total_file_size)))
-
-  # create file with changed IDs
-  def make_id_list (self):
-    self.state.total_file_size = 0
-    self.state.total_file_count = 0
+  def make_commit_engine (self):
+    engine = bfsyncdb.CommitEngine (self.repo.bdb, self.repo.path, self.state.id_list_filename,
+                                    self.VERSION, commit_hash_threads (self.repo))
+    if not engine.open_ok():
+      raise BFSyncError ("commit: can't read changed id list '%s'" % self.state.id_list_filename)
+    return engine
 
+  # create file with changed IDs (binary, see bfsyncdb.IDList) and count new files
+  def make_id_list (self):
     self.repo.bdb.begin_transaction()
-    id_list_filename = self.repo.make_temp_name()
+    self.state.id_list_filename = self.repo.make_temp_name()
     self.repo.bdb.commit_transaction()
 
-    id_list_file = open (id_list_filename, "w")
-    changed_it = bfsyncdb.ChangedINodesIterator (self.repo.bdb)
-    while True:
-      id = changed_it.get_next()
-      if not id.valid:
-        break
-      id_list_file.write (id.str() + "\n")
-      inode = self.repo.bdb.load_inode (id, self.VERSION)
-      if inode.valid:
-        self.scan_inode (inode)
-    del changed_it
-    id_list_file.close()
-    return id_list_filename
-
-  # compute SHA1 hash of one file
-  def hash_one (self, filename):
-    file = open (filename, "r")
-    hash = hashlib.sha1()
-    eof = False
-    while not eof:
-      data = file.read (256 * 1024)
-      if data == "":
-        eof = True
-      else:
-        hash.update (data)
-        self.state.bytes_done += len (data)
-        if self.state.verbose and self.outss.need_update():
-          self.update_status()
-    file.close()
-    if self.state.verbose and self.outss.need_update():
-      self.update_status()
-    return hash.hexdigest()
+    if not bfsyncdb.make_changed_id_list (self.repo.bdb, self.state.id_list_filename):
+      raise BFSyncError ("commit: can't write changed id list '%s'" % self.state.id_list_filename)
+
+    if self.state.verbose:
+      status_line.update ("scanning changed files")
+
+    engine = self.make_commit_engine()
+    engine.scan()
+    self.state.total_file_count = engine.total_file_count()
+    self.state.total_file_size = engine.total_file_size()
 
   # update SHA1 hashing status
   def update_status (self):
@@ -541,12 +538,14 @@ class CommitCommand:
 
   def execute (self):
     if self.state.exec_phase == self.EXEC_PHASE_SCAN:
-      self.state.id_list_filename = self.make_id_list()
+      self.make_id_list()
+      self.state.id_list_pos = 0
       self.state.files_added = 0
       self.state.bytes_done = 0
       self.state.previous_time = 0
 
-      self.state.exec_phase += 1
+      # the fix phase is now done together with the add phase
+      self.state.exec_phase = self.EXEC_PHASE_ADD
 
       # create new journal entry
       self.repo.bdb.begin_transaction()
@@ -556,109 +555,63 @@ class CommitCommand:
       if self.DEBUG_MEM:
         print_mem_usage ("after id list scanning")
 
-    if self.state.exec_phase == self.EXEC_PHASE_FIX:
-      # in some (very rare) cases, bfsyncfs will copy-on-write the file associated with the inode
-      # without modifying the file data or inode attributes
-      #
-      # the "fix unchanged inodes" pass is designed to reset the inode to the old version in this
-      # case, before committing, which avoids problems with the actual diff created later on
-      OPS = 0
-      self.repo.bdb.begin_transaction()
-
-      id_list_file = open (self.state.id_list_filename, "r")
-      for id_str in id_list_file:
-        id = bfsyncdb.ID (id_str.strip())
-        inode_new = self.repo.bdb.load_inode (id, self.VERSION)
-        inode_old = self.repo.bdb.load_inode (id, self.VERSION - 1)
-
-        if inode_old.valid and inode_new.valid:
-          if inode_old.vmin != inode_new.vmin or inode_old.vmax != inode_new.vmax:
-            def inode_fields (inode):
-              return ( inode.id.str(),
-                      inode.uid, inode.gid,
-                      inode.mode, inode.type,
-                      inode.link, inode.size,
-                      inode.major, inode.minor,
-                      inode.nlink,
-                      inode.ctime, inode.ctime_ns,
-                      inode.mtime, inode.mtime_ns )
-
-            if inode_fields (inode_old) == inode_fields (inode_new) and inode_new.hash == "new":
-              filename = self.repo.make_number_filename (inode_new.new_file_number)
-
-              if inode_old.hash == hash_cache.compute_hash (filename):
-                self.repo.bdb.delete_inode (inode_new)
-                self.repo.bdb.delete_inode (inode_old)
-                inode_old.vmax = bfsyncdb.VERSION_INF
-                self.repo.bdb.store_inode (inode_old)
-                self.repo.bdb.add_deleted_file (inode_new.new_file_number)
-
-        OPS += 1
-        if OPS >= 20000:
-          OPS = 0
-          self.repo.bdb.commit_transaction()
-          self.repo.bdb.begin_transaction()
-
-      id_list_file.close()
-
-      self.state.exec_phase += 1
+    if self.state.exec_phase in [ self.EXEC_PHASE_FIX, self.EXEC_PHASE_ADD ] and not hasattr (self.state, "id_list_pos"):
+      # journal of an older bfsync version: the id list is a text file and there is no list
+      # position; the changed inodes table still contains all ids, so we create a new list
+      # and process it from the start (inodes that were already added are skipped)
+      self.make_id_list()
+      self.state.id_list_pos = 0
+      self.state.files_added = 0
+      self.state.bytes_done = 0
+      self.state.exec_phase = self.EXEC_PHASE_ADD
 
-      # create new journal entry
+      self.repo.bdb.begin_transaction()
       mk_journal_entry (self.repo)
       self.repo.bdb.commit_transaction()
 
+    if self.state.exec_phase == self.EXEC_PHASE_FIX:
+      # journal of an older bfsync version: fix is not a separate phase anymore
+      self.state.id_list_pos = 0
+      self.state.exec_phase = self.EXEC_PHASE_ADD
+
     if self.state.exec_phase == self.EXEC_PHASE_ADD:
       self.start_time = time.time() - self.state.previous_time
 
-      def process_inodes (inodes):
-        inodes.sort (key = lambda inode: inode.new_file_number)
-        for inode in inodes:
-          self.state.files_added += 1
-          filename = self.repo.make_number_filename (inode.new_file_number)
-          hash = self.hash_one (filename)
-          size = os.path.getsize (filename)
-          self.repo.bdb.delete_inode (inode)
-
-          if self.repo.bdb.load_hash2file (hash) == 0:
-            self.repo.bdb.store_hash2file (hash, inode.new_file_number)
-          else:
-            self.repo.bdb.add_deleted_file (inode.new_file_number)
-
-          inode.hash = hash
-          inode.size = size
-          inode.new_file_number = 0
-          self.repo.bdb.store_inode (inode)
-
-      # process files to add in small chunks
-      id_list_file = open (self.state.id_list_filename, "r")
+      # process changed inodes in batches (see bfsyncdb.CommitEngine); after a restart,
+      # continue with the first id that was not processed before the last journal entry
+      engine = self.make_commit_engine()
+      engine.seek (self.state.id_list_pos)
+      engine.set_progress (self.state.files_added, self.state.bytes_done)
 
       self.repo.bdb.begin_transaction()
-      inodes = []
-      OPS = 0
-      for id_str in id_list_file:
-        id = bfsyncdb.ID (id_str.strip())
-        if not id.valid:
-          raise Exception ("found invalid id during commit")
-        inode = self.repo.bdb.load_inode (id, self.VERSION)
-        if inode.valid and inode.hash == "new":
-          inodes.append (inode)
-
-        OPS += 1
-        if OPS >= 20000:
-          OPS = 0
-          process_inodes (inodes)
-          inodes = []
-          self.state.previous_time = time.time() - self.start_time
-          mk_journal_entry (self.repo)
-          self.repo.bdb.commit_transaction()
-          self.repo.bdb.begin_transaction()
+      while engine.load_batch (20000):
+        # files that bfsyncfs already hashed in the background need not be hashed again
+        file_numbers = engine.batch_file_numbers()
+        for file_number, bg_hash in zip (file_numbers, self.server_conn.bg_hashes (file_numbers)):
+          if bg_hash != "":
+            engine.set_hash (file_number, bg_hash)
+
+        engine.start_hashing()
+        while not engine.process (0.25):
+          if self.state.verbose and self.outss.need_update():
+            self.state.files_added = engine.files_added()
+            self.state.bytes_done = engine.bytes_done()
+            self.update_status()
+        if engine.error() != "":
+          raise BFSyncError ("commit: %s" % engine.error())
+
+        self.state.id_list_pos = engine.position()
+        self.state.files_added = engine.files_added()
+        self.state.bytes_done = engine.bytes_done()
+        self.state.previous_time = time.time() - self.start_time
+        mk_journal_entry (self.repo)
+        self.repo.bdb.commit_transaction()
+        self.repo.bdb.begin_transaction()
 
-      process_inodes (inodes)
       self.state.exec_phase += 1
       mk_journal_entry (self.repo)
       self.repo.bdb.commit_transaction()
-
-      id_list_file.close()
+      del engine
 
       if self.state.verbose:
         self.update_status()
@@ -676,19 +629,22 @@ class CommitCommand:
       diff_filename = self.repo.make_temp_name()
       self.repo.bdb.commit_transaction()
 
-      diff_file = open (diff_filename, "w")
-      diff (self.repo, diff_file)
-      diff_file.close()
+      # diff is compressed and hashed while it is generated
+      diff_start_time = time.time()
+      diff_result = bfsyncdb.write_diff_xz (self.repo.bdb, diff_filename, 0)
+      if not diff_result.ok:
+        raise BFSyncError ("commit: can't write diff: %s" % diff_result.error)
 
-      if os.path.getsize (diff_filename) != 0:
-        xz (diff_filename)
-        self.state.commit_hash = move_file_to_objects (self.repo, diff_filename + ".xz")
+      if diff_result.hash != "":
+        self.state.commit_hash = move_file_to_objects (self.repo, diff_filename, hash = diff_result.hash)
         commit_size_ok = True
       else:
         commit_size_ok = False
+      diff_time = time.time() - diff_start_time
 
       if self.state.verbose:
-        status_line.update ("computing changes: done")
+        status_line.update ("computing changes: done - %s diff, %s xz, %.2fs" % (
+                            format_size1 (diff_result.diff_size), format_size1 (diff_result.xz_size), diff_time))
         status_line.cleanup()
 
       if commit_size_ok:
@@ -716,6 +672,7 @@ class CommitCommand:
                                                        self.state.commit_author,
                                                        self.state.commit_msg,
                                                        self.state.commit_time)
+      tag_commit_version (self.repo, self.VERSION)
       self.state.exec_phase += 1
       mk_journal_entry (self.repo)
       self.repo.bdb.commit_transaction()
@@ -758,6 +715,12 @@ class CommitCommand:
 
       # this will release the lock
       self.server_conn.close()
+
+      # build the index file of the new version (tagged by tag_commit_version) and
+      # remove index files of older versions; this only reads committed versions, so
+      # it doesn't need the lock; if it is interrupted, the next commit builds it
+      if commit_index_count (self.repo) > 0:
+        update_version_indexes (self.repo)
     return CMD_DONE
 
   def get_state (self):
@@ -3,20 +3,16 @@
 
 import bfsyncdb
 
-def write1change (change_list, outfile):
-  for s in change_list:
-    outfile.write (s + "\0")
-
 def diff (repo, outfile):
   # write changes to outfile
   dg = bfsyncdb.DiffGenerator (repo.bdb)
 
   while True:
-    change = dg.get_next()
-    if len (change) == 0: # done?
+    block = dg.get_block (1024 * 1024)
+    if len (block) == 0: # done?
       return
 
-    write1change (change, outfile)
+    outfile.write (block)
 
 # parser to read changes from \0 seperated diff file
 class DiffIterator:
@@ -21,13 +21,24 @@ def strip_bfsync_commits_dir (path):
       return os.path.join (*path_parts[3:])
   return path
 
-def get_inode (inode_repo, filename, version):
-  inode = inode_repo.load_inode (bfsyncdb.id_root(), version)
-  assert (inode.valid())      # root inode should always be there
+# read-only lookup: uses the version index, if there is one
+def get_inode (repo, filename, version):
+  inode = repo.bdb.read_inode (bfsyncdb.id_root(), version)
+  assert (inode.valid)        # root inode should always be there
 
   for path_part in split_path (filename):
-    inode = inode.get_child (version, path_part)
-    if not inode.valid():
+    if inode.type != bfsyncdb.FILE_DIR:
+      return None
+
+    child_id = None
+    for link in repo.bdb.read_links (inode.id, version):
+      if link.name == path_part:
+        child_id = link.inode_id
+    if child_id is None:
+      return None
+
+    inode = repo.bdb.read_inode (child_id, version)
+    if not inode.valid:
       return None
 
   return inode
@@ -42,7 +53,6 @@ def file_log (repo, args):
   full_filename = strip_bfsync_commits_dir (os.path.join (repo.start_dir, parsed_args.file))
   VERSION = repo.first_unused_version()
   deleted_versions = repo.get_deleted_version_set()
-  inode_repo = bfsyncdb.INodeRepo (repo.bdb)
 
   print "-" * 80
 
@@ -50,18 +60,18 @@ def file_log (repo, args):
 
   for version in range (1, VERSION):
     if version not in deleted_versions or parsed_args.all:
-      inode = get_inode (inode_repo, full_filename, version)
+      inode = get_inode (repo, full_filename, version)
       if inode:
-        attrs = (inode.hash(), inode.size(), inode.mtime())
+        attrs = (inode.hash, inode.size, inode.mtime)
         if attrs != last_attrs:
           # load history entry
           hentry = repo.bdb.load_history_entry (version)
           msg = hentry.message
           msg = msg.strip()
 
-          print "%4d   Hash   %s" % (version, inode.hash())
-          print "       Size   %s" % inode.size()
-          print "       MTime  %s" % datetime.datetime.fromtimestamp (inode.mtime()).strftime ("%F %H:%M:%S")
+          print "%4d   Hash   %s" % (version, inode.hash)
+          print "       Size   %s" % inode.size
+          print "       MTime  %s" % datetime.datetime.fromtimestamp (inode.mtime).strftime ("%F %H:%M:%S")
           if repo.mount_point:
             print "       Path   %s" % os.path.join (repo.mount_point, ".bfsync", "commits", "%d" % version, full_filename)
 
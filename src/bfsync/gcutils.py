@@ -3,6 +3,7 @@
 
 import bfsyncdb
 import os
+from versionindex import prune_version_indexes
 from StatusLine import status_line, OutputSubsampler
 from utils import *
 
@@ -15,7 +16,7 @@ def gc (repo):
   need_files = bfsyncdb.SortedArray()
   object_count = 0
   outss = OutputSubsampler()
-  deleted_versions = repo.get_deleted_version_set()
+  live_versions = bfsyncdb.LiveVersions (repo.bdb)
 
   def update_status():
     status_line.update ("phase 1/4: scanning objects: %d" % object_count)
@@ -28,14 +29,7 @@ def gc (repo):
     inodes = repo.bdb.load_all_inodes (id)
     for inode in inodes:
       if len (inode.hash) == 40:
-        needed = False
-        if inode.vmax == bfsyncdb.VERSION_INF:
-          needed = True
-        else:
-          for version in range (inode.vmin, inode.vmax + 1):
-            if version not in deleted_versions:
-              needed = True
-              break
+        needed = inode.vmax == bfsyncdb.VERSION_INF or live_versions.contains_range (inode.vmin, inode.vmax)
 
         if needed:           # only keep files if versions have not been tagged deleted in history
           file_number = repo.bdb.load_hash2file (inode.hash)
@@ -75,24 +69,24 @@ def gc (repo):
   if DEBUG_MEM:
     print_mem_usage ("after history loop")
 
-  ## create file containing hashes that are no longer needed
+  ## create file containing hashes that are no longer needed (binary, 20 bytes per hash)
   repo.bdb.begin_transaction()
   h2f_delete_filename = repo.make_temp_name()
   repo.bdb.commit_transaction()
 
-  h2f_delete_file = open (h2f_delete_filename, "w")
+  h2f_delete_file = open (h2f_delete_filename, "wb")
   h2f_entries = 0
 
   def update_status_h2f():
     status_line.update ("phase 2/4: scanning hash db entries: %d" % h2f_entries)
 
-  hi = bfsyncdb.Hash2FileIterator (repo.bdb)
+  hi = bfsyncdb.Hash2FileIterator (repo.bdb, True)    # binary hashes, written as they are
   while True:
     h2f = hi.get_next()
     if not h2f.valid:
       break
     if not need_files.search (h2f.file_number):
-      h2f_delete_file.write ("%s\n" % h2f.hash)
+      h2f_delete_file.write (h2f.hash)
     if outss.need_update():
       update_status_h2f()
     h2f_entries += 1
@@ -107,23 +101,33 @@ def gc (repo):
     print_mem_usage ("after delete h2f file gen")
 
   ## delete unused hash entries in small chunks
-  h2f_delete_file = open (h2f_delete_filename, "r")
+  h2f_delete_file = open (h2f_delete_filename, "rb")
 
   status_line.update ("phase 3/4: removing unused hash db entries...")
 
   OPS = 0
+  attempt = 0
+  chunk_start = 0   # file position of first hash deleted in the current transaction
   repo.bdb.begin_transaction()
 
-  for hash in h2f_delete_file:
-    hash = hash.strip()
-    repo.bdb.delete_hash2file (hash)
-    OPS += 1
-    if OPS >= 20000:
-      repo.bdb.commit_transaction()
-      repo.bdb.begin_transaction()
+  while True:
+    bin_hash = h2f_delete_file.read (20)
+    done = len (bin_hash) != 20
+    if not done:
+      repo.bdb.delete_hash2file_bin (bin_hash)
+      OPS += 1
+    if OPS >= 20000 or done:
       OPS = 0
-
-  repo.bdb.commit_transaction()
+      if try_commit_or_backoff (repo, attempt):
+        if done:
+          break
+        chunk_start = h2f_delete_file.tell()
+        attempt = 0
+      else:
+        # deadlock: delete the hashes of the aborted transaction again
+        h2f_delete_file.seek (chunk_start)
+        attempt += 1
+      repo.bdb.begin_transaction()
 
   h2f_delete_file.close()
 
@@ -155,7 +159,14 @@ def gc (repo):
   if DEBUG_MEM:
     print_mem_usage ("after remove files loop")
 
-  # ideal cache setting: at least 100 Mb per 1.000.000 files
+  # index files of deleted versions are no longer needed
+  pruned = prune_version_indexes (repo)
+  if pruned:
+    status_line.update ("removed %d unused version index files" % pruned)
+    status_line.cleanup()
+
+  # gc has read all inodes, so the cache statistics now contain the working set
   cache_size = int (repo.config.get ("cache-size")[0])
-  status_line.update ("db cache size: %d Mb, %d objects => about %.2f%% cache is currently in use" % (cache_size, object_count, (object_count * 100 / 1000000.0) / cache_size * 100))
+  recommended_cache_size = repo.bdb.recommended_cache_size()
+  status_line.update ("db cache size: %d Mb, recommended cache size: %d Mb (see bfsync cache-stats)" % (cache_size, recommended_cache_size))
   status_line.cleanup()
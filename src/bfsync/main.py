@@ -41,6 +41,7 @@ from transferbench import transfer_bench
 from sqlexport import sql_export
 from integrity import check_integrity
 from filelog import file_log
+from versionindex import update_version_indexes, set_version_index_tag
 
 def find_bfsync_dir():
   old_cwd = os.getcwd()
@@ -118,6 +119,83 @@ def cmd_debug_perf_getattr_list():
   server_conn = ServerConn (repo_path)
   print server_conn.process_call (["perf-getattr-list", args[0]])[0]
 
+def cmd_debug_perf_query():
+  bfsync_dir = find_bfsync_dir()
+  mount_dir = os.path.dirname (bfsync_dir)
+
+  bfsync_info = parse_config (bfsync_dir + "/info")
+
+  repo_path = bfsync_info.get ("repo-path")
+  if len (repo_path) != 1:
+    raise Exception ("bad repo path")
+  repo_path = repo_path[0]
+
+  names = []
+  f = open (args[0], "r")
+  for line in f:
+    line = line.rstrip ("\n")
+    if line and line[0] != "#":
+      names.append (line)
+  f.close()
+  if not names:
+    raise BFSyncError ("debug-perf-query: no files in %s" % args[0])
+
+  server_conn = ServerConn (repo_path)
+
+  # stat() through FUSE
+  start_time = time.time()
+  stat_ok = 0
+  for name in names:
+    try:
+      os.lstat (mount_dir + name)
+      stat_ok += 1
+    except OSError:
+      pass
+  stat_time = time.time() - start_time
+
+  # batched query via server socket
+  start_time = time.time()
+  query_ok = 0
+  for r in server_conn.query_paths (names):
+    if r:
+      query_ok += 1
+  query_time = time.time() - start_time
+
+  print "files:   %d" % len (names)
+  print "lstat:   %.2f ms <=> %.f files/s (%d found)" % (stat_time * 1000, len (names) / stat_time, stat_ok)
+  print "query:   %.2f ms <=> %.f files/s (%d found)" % (query_time * 1000, len (names) / query_time, query_ok)
+  print "speedup: %.2f" % (stat_time / query_time)
+
+def cmd_debug_perf_diff():
+  repo = cd_repo_connect_db()
+
+  # diff of uncommitted changes, as computed by commit (without compression)
+  start_time = time.time()
+  dg = bfsyncdb.DiffGenerator (repo.bdb)
+  id_count = dg.id_count()
+  diff_size = 0
+  while True:
+    block = dg.get_block (1024 * 1024)
+    if len (block) == 0:
+      break
+    diff_size += len (block)
+  del dg
+  block_time = time.time() - start_time
+
+  # same diff, one change at a time
+  start_time = time.time()
+  dg = bfsyncdb.DiffGenerator (repo.bdb)
+  changes = 0
+  while len (dg.get_next()) != 0:
+    changes += 1
+  del dg
+  next_time = time.time() - start_time
+
+  print "changed ids: %d" % id_count
+  print "changes:     %d (%s)" % (changes, format_size1 (diff_size))
+  print "get_block:   %.2f ms <=> %.f ids/s" % (block_time * 1000, id_count / max (block_time, 1e-6))
+  print "get_next:    %.2f ms <=> %.f ids/s" % (next_time * 1000, id_count / max (next_time, 1e-6))
+
 def cmd_debug_get_prof():
   bfsync_dir = find_bfsync_dir()
 
@@ -636,6 +714,7 @@ def cmd_clone():
   parser.add_argument ("-u", action="store_true", dest="use_uid_gid", default=False)
   parser.add_argument ('-c', help='set cache size')
   parser.add_argument ('--rsh', help='set remote shell')
+  parser.add_argument ('--bulk-mode', help='set bulk mode (off, write-nosync, nosync)')
   parser.add_argument ("repo")
   parser.add_argument ("dest_dir", nargs = "?")
   parsed_args = parser.parse_args (args)
@@ -658,6 +737,10 @@ def cmd_clone():
   if parsed_args.c:
     cache_size = int (parsed_args.c)
 
+  if parsed_args.bulk_mode and parsed_args.bulk_mode not in [ "off", "write-nosync", "nosync" ]:
+    print "fatal: bad bulk mode '" + parsed_args.bulk_mode + "'"
+    sys.exit (1)
+
   status_line.set_op ("CLONE")
 
   url_list = url.split (":")
@@ -694,6 +777,11 @@ def cmd_clone():
   print " - cache size: %d Mb" % cache_size
   f.write ("cache-size %d;\n" % cache_size)
 
+  ## bulk mode
+  if parsed_args.bulk_mode:
+    print " - bulk mode: %s" % parsed_args.bulk_mode
+    f.write ("bulk-mode %s;\n" % parsed_args.bulk_mode)
+
   ## default push/pull
   f.write ("default {\n")
   f.write ("""  pull "%s";\n""" % url)
@@ -897,6 +985,79 @@ def cmd_config_set():
   f.write (repo_config.to_string())
   f.close()
 
+def cmd_cache_stats():
+  parser = argparse.ArgumentParser (prog='bfsync cache-stats')
+  parser.add_argument ("--apply", action="store_true", dest="apply", default=False)
+  parsed_args = parser.parse_args (args)
+
+  repo = cd_repo_connect_db()
+  print repo.bdb.cache_stats(),
+
+  if parsed_args.apply:
+    cache_size = repo.bdb.recommended_cache_size()
+
+    repo_config_filename = os.path.join (repo.path, "config")
+    repo_config = parse_config (repo_config_filename)
+    repo_config.set ("cache-size", [ "%d" % cache_size ])
+
+    # write new config file
+    f = open (repo_config_filename, "w")
+    f.write (repo_config.to_string())
+    f.close()
+
+    print "cache-size set to %d Mb" % cache_size
+
+def cmd_stats():
+  bfsync_dir = find_bfsync_dir()
+
+  bfsync_info = parse_config (bfsync_dir + "/info")
+
+  repo_path = bfsync_info.get ("repo-path")
+  if len (repo_path) != 1:
+    raise Exception ("bad repo path")
+  repo_path = repo_path[0]
+
+  os.chdir (repo_path)
+  server_conn = ServerConn (repo_path)
+  print server_conn.process_call (["stats"])[0]
+
+def cmd_compact():
+  parser = argparse.ArgumentParser (prog='bfsync compact')
+  parser.add_argument ('--time', type=float, default=0, help='stop after this number of seconds')
+  parsed_args = parser.parse_args (args)
+
+  repo = cd_repo_connect_db()
+  print repo.bdb.compact (parsed_args.time),
+
+def cmd_version_index():
+  parser = argparse.ArgumentParser (prog='bfsync version-index')
+  parser.add_argument ("--rebuild", action="store_true", dest="rebuild", default=False)
+  parser.add_argument ("--verify", action="store_true", dest="verify", default=False)
+  parser.add_argument ("--add", type=int, action="append", dest="add", default=[], metavar="VERSION")
+  parser.add_argument ("--remove", type=int, action="append", dest="remove", default=[], metavar="VERSION")
+  parsed_args = parser.parse_args (args)
+
+  repo = cd_repo_connect_db()
+
+  if parsed_args.add or parsed_args.remove:
+    lock = repo.try_lock()
+
+    current_version = repo.first_unused_version()
+    for version in parsed_args.add:
+      if version < 1 or version >= current_version:
+        raise BFSyncError ("version-index: version %d is not a committed version" % version)
+
+    repo.bdb.begin_transaction()
+    for version in parsed_args.add:
+      set_version_index_tag (repo, version, True)
+    for version in parsed_args.remove:
+      set_version_index_tag (repo, version, False)
+    repo.bdb.commit_transaction()
+
+  bad_indexes = update_version_indexes (repo, parsed_args.rebuild, parsed_args.verify)
+  if bad_indexes:
+    print "rebuilt %d corrupt version index files" % bad_indexes
+
 def cmd_config_unset():
   repo_path = find_repo_dir()
   repo_config_filename = os.path.join (repo_path, "config")
@@ -1155,7 +1316,7 @@ def cmd_new_files():
   size_sort_list = []
 
   def walk (id, prefix):
-    inode = repo.bdb.load_inode (id, VERSION)
+    inode = repo.bdb.read_inode (id, VERSION)
     if inode.valid:
       # print filename if hash was not known in previous version
       if len (inode.hash) == 40 and not inode.hash in hset:
@@ -1168,7 +1329,7 @@ def cmd_new_files():
 
       # recurse into subdirs
       if inode.type == bfsyncdb.FILE_DIR:
-        links = repo.bdb.load_links (id, VERSION)
+        links = repo.bdb.read_links (id, VERSION)
         for link in links:
           inode_name = prefix + "/" + link.name
           walk (link.inode_id, inode_name)
@@ -1290,10 +1451,24 @@ def cmd_upgrade():
 
   new_version = bfsyncdb.repo_version()
 
+  # old repositories store all tables in one database, which need to be split
+  need_split_tables = os.path.exists (os.path.join (repo_path, "bdb", "db"))
+
   if (version != "0.3.1" and version != "0.3.2" and version != "0.3.3" and version != "0.3.4"
-                         and version != "0.3.5" and version != "0.3.6"):
+                         and version != "0.3.5" and version != "0.3.6"
+                         and not (version == new_version and need_split_tables)):
     raise BFSyncError ("can't upgrade from version %s to %s" % (version, new_version))
 
+  if need_split_tables:
+    bfsync_config = parse_config (repo_path + "/config")
+    cache_size = bfsync_config.get ("cache-size")
+    if len (cache_size) != 1:
+      raise Exception ("bad cache-size setting")
+    cache_size = int (cache_size[0])
+
+    if not bfsyncdb.upgrade_tables (repo_path, cache_size):
+      raise BFSyncError ("upgrade: splitting database tables of %s failed" % repo_path)
+
   status_line.set_op ("UPGRADE")
   status_line.update ("upgraded %s (old version = %s, new_version = %s)" % (repo_path, version, new_version))
 
@@ -1329,7 +1504,7 @@ def cmd_need_upgrade():
 
   print "upgrade for " + repo_path + ":",
 
-  if version != new_version:
+  if version != new_version or os.path.exists (os.path.join (repo_path, "bdb", "db")):
     print "required"
     sys.exit (0)
   else:
@@ -1431,6 +1606,10 @@ def main():
       ( "need-upgrade",           cmd_need_upgrade, 1),
       ( "disk-usage",             cmd_disk_usage, 1),
       ( "config-set",             cmd_config_set, 1),
+      ( "cache-stats",            cmd_cache_stats, 1),
+      ( "stats",                  cmd_stats, 0),
+      ( "version-index",          cmd_version_index, 1),
+      ( "compact",                cmd_compact, 1),
       ( "config-unset",           cmd_config_unset, 1),
       ( "show-tags",              cmd_show_tags, 1),
       ( "delete-version",         cmd_delete_version, 1),
@@ -1450,6 +1629,8 @@ def main():
       ( "debug-load-all-inodes",  cmd_debug_load_all_inodes, 0),
       ( "debug-perf-getattr",     cmd_debug_perf_getattr, 1),
       ( "debug-perf-getattr-list",cmd_debug_perf_getattr_list, 1),
+      ( "debug-perf-query",       cmd_debug_perf_query, 1),
+      ( "debug-perf-diff",        cmd_debug_perf_diff, 0),
       ( "debug-clear-cache",      cmd_debug_clear_cache, 1),
       ( "debug-get-prof",         cmd_debug_get_prof, 0),
       ( "debug-reset-prof",       cmd_debug_reset_prof, 0),
@@ -1261,9 +1261,8 @@ def collect (repo, args, old_cwd):
   def update_status():
     status_line.update ("%d local files (%s) / found %d/%d files (%s)" % (fcount, format_size1 (fsize), found, ftotal, format_size1 (found_size)))
 
-  repo.bdb.begin_transaction()
-
-  OPS = 0  # to keep number of operations per transaction below a pre-defined limit
+  # keep number of operations per transaction below a pre-defined limit
+  tsplitter = TransactionSplitter (repo, 20000)
 
   # walk dirs to find objects
   ftotal = len (need_hash)
@@ -1283,27 +1282,20 @@ def collect (repo, args, old_cwd):
 
           if need_hash.has_key (hash):
             shutil.copyfile (full_name, dest_path)
-            move_file_to_objects (repo, dest_path, need_transaction = False)
+            move_file_to_objects (repo, dest_path, False, tsplitter)
             found += 1
             found_size += size
             # copy each file content only once, after that we don't need to do it again
             del need_hash[hash]
 
-            OPS += 1 # only move_file_to_objects actually causes BDB access
-
           fcount += 1
           fsize += size
           if outss.need_update():
             update_status()
 
-          if OPS >= 20000:
-            repo.bdb.commit_transaction()
-            repo.bdb.begin_transaction()
-            OPS = 0
-
         except IOError:
           pass  # usually: insufficient permissions to read file
         except OSError:
           pass  # usually: file not found
-  repo.bdb.commit_transaction()
+  tsplitter.commit()
   update_status()
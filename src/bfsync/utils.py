@@ -160,6 +160,9 @@ class Repo:
     return version
 
   # foreach_crawl / foreach_inode_link recursively walk the filesystem tree for a one version
+  #
+  # the callbacks must not modify the database: inodes and links of historical versions
+  # are read from the version index, if there is one
   def foreach_crawl (self, inode, version, inode_callback, link_callback):
     if not inode.valid:
       raise Exception ("missing inode in Repo.foreach_crawl")
@@ -170,16 +173,16 @@ class Repo:
     if inode.type != bfsyncdb.FILE_DIR:
       return # not a directory, no links
 
-    links = self.bdb.load_links (inode.id, version)
+    links = self.bdb.read_links (inode.id, version)
     for link in links:
       if link_callback:
         link_callback (link)
 
-      child = self.bdb.load_inode (link.inode_id, version)
+      child = self.bdb.read_inode (link.inode_id, version)
       self.foreach_crawl (child, version, inode_callback, link_callback)
 
   def foreach_inode_link (self, version, inode_callback, link_callback):
-    root = self.bdb.load_inode (bfsyncdb.id_root(), version)
+    root = self.bdb.read_inode (bfsyncdb.id_root(), version)
     self.foreach_crawl (root, version, inode_callback, link_callback)
 
   def foreach_changed_inode (self, version, inode_callback):
@@ -219,20 +222,8 @@ class Repo:
 
   # return all versions which have been deleted (have a deleted tag)
   def get_deleted_version_set (self):
-    # read log, scan for deleted versions
-    deleted_versions = set()
-    VERSION = 1
-    while True:
-      hentry = self.bdb.load_history_entry (VERSION)
-      VERSION += 1
-
-      if not hentry.valid:
-        break
-
-      tags = self.bdb.list_tags (hentry.version)
-      if "deleted" in tags:
-        deleted_versions.add (hentry.version)
-    return deleted_versions
+    live_versions = bfsyncdb.LiveVersions (self.bdb)
+    return set (live_versions.deleted_versions())
 
   # returns an instance of ServerConn with active lock, or
   #         None if server could not be connected
@@ -268,6 +259,13 @@ def cd_repo_connect_db (cont = False):
   if not repo.bdb.open_ok():
     raise BFSyncError ("database of repository %s can't be opened" % repo_path)
 
+  # bulk mode: commit without flushing the log (only at journal boundaries)
+  bulk_mode = bfsync_config.get ("bulk-mode")
+  if len (bulk_mode) > 0:
+    if len (bulk_mode) != 1 or bulk_mode[0] not in [ "off", "write-nosync", "nosync" ]:
+      raise Exception ("bad bulk-mode setting")
+    repo.bdb.set_bulk_mode (bulk_mode[0])
+
   jentries = repo.bdb.load_journal_entries()
   if len (jentries) != 0 and not cont:
     op = cPickle.loads (jentries[0].operation)
@@ -362,14 +360,19 @@ def parse_config (filename):
     "put-rate-limit",
     "use-uid-gid",
     "cache-size",
+    "bulk-mode",
+    "online-compact",
+    "version-index",
+    "hash-threads",
     "repo-id",
     "version"
   ])
   return bfsync_info
 
-def move_file_to_objects (repo, filename, need_transaction = True):
-  import HashCache
-  hash = HashCache.hash_cache.compute_hash (filename)
+def move_file_to_objects (repo, filename, need_transaction = True, tsplitter = None, hash = None):
+  if hash is None:
+    import HashCache
+    hash = HashCache.hash_cache.compute_hash (filename)
 
   if need_transaction:
     repo.bdb.begin_transaction()
@@ -379,7 +382,10 @@ def move_file_to_objects (repo, filename, need_transaction = True):
     objectname = repo.make_number_filename (new_file_number, True)
     os.rename (filename, repo.make_number_filename (new_file_number))
     os.chmod (objectname, 0400)
-    repo.bdb.store_hash2file (hash, new_file_number)
+    if tsplitter:
+      tsplitter.run (lambda: repo.bdb.store_hash2file (hash, new_file_number))
+    else:
+      repo.bdb.store_hash2file (hash, new_file_number)
   else:
     # already known
     os.unlink (filename)
@@ -446,23 +452,53 @@ def print_mem_usage (comment):
   print "** %.2f ** %s ** memory smaps: %d K" % (time.time() - mem_usage_time.start, comment, mem_smaps)
   print
 
+# splits a long sequence of database operations into transactions of max_count operations
+#
+# operations passed to run() are remembered until the transaction is committed; if the
+# transaction is aborted due to a deadlock, they are executed again in a new transaction
 class TransactionSplitter:
   def __init__ (self, repo, max_count):
     self.repo = repo
     self.count = 0
     self.max_count = max_count
+    self.redo_ops = []
     self.repo.bdb.begin_transaction()
 
   def __del__ (self):
     assert self.count == 0
 
+  def run (self, op):
+    op()
+    self.redo_ops.append (op)
+    self.split()
+
   def split (self):
     self.count += 1
     if self.count >= self.max_count:
-      self.repo.bdb.commit_transaction()
+      self.commit()
       self.repo.bdb.begin_transaction()
-      self.count = 0
 
   def commit (self):
-    self.repo.bdb.commit_transaction()
+    attempt = 0
+    while not self.repo.bdb.try_commit_transaction():
+      if not self.repo.bdb.retry_backoff (attempt):
+        raise Exception ("transaction failed: deadlock persists after %d retries" % attempt)
+      attempt += 1
+
+      self.repo.bdb.begin_transaction()
+      for op in self.redo_ops:
+        op()
+    self.redo_ops = []
     self.count = 0
+
+# commit one transaction of a long sequence of operations that the caller can redo
+#
+# returns True if the transaction was committed; if it was aborted due to a deadlock,
+# waits (with backoff) and returns False: the caller starts a new transaction and redoes
+# the operations since the last successful commit
+def try_commit_or_backoff (repo, attempt):
+  if repo.bdb.try_commit_transaction():
+    return True
+  if not repo.bdb.retry_backoff (attempt):
+    raise BFSyncError ("transaction failed: deadlock persists after %d retries" % attempt)
+  return False
@@ -0,0 +1,107 @@
+# bfsync: Big File synchronization tool
+# Licensed GNU GPL v3 or later: http://www.gnu.org/licenses/gpl.html
+
+import bfsyncdb
+import os
+from utils import *
+
+# version index files: <repo>/version-index/<version>, see fs/bfversionindex.hh
+#
+# each index file contains all inodes and links of one version, so only versions
+# that are tagged with INDEX_TAG get an index file; the tag value is INDEX_TAG_USER
+# for versions tagged with "bfsync version-index --add" and INDEX_TAG_COMMIT for
+# versions tagged by commit (see tag_commit_version)
+
+INDEX_TAG = "version-index"
+INDEX_TAG_USER = "1"
+INDEX_TAG_COMMIT = "commit"
+
+def version_index_dir (repo):
+  return os.path.join (repo.path, "version-index")
+
+def list_version_indexes (repo):
+  result = []
+  index_dir = version_index_dir (repo)
+  if os.path.exists (index_dir):
+    for filename in os.listdir (index_dir):
+      if filename.isdigit():
+        result.append (int (filename))
+  return sorted (result)
+
+# committed versions that should have an index file
+def indexed_versions (repo):
+  current_version = repo.first_unused_version()
+  deleted_versions = repo.get_deleted_version_set()
+
+  result = []
+  for version in range (1, current_version):
+    if version not in deleted_versions and INDEX_TAG in repo.bdb.list_tags (version):
+      result.append (version)
+  return result
+
+# add/remove version index tag (needs a transaction)
+def set_version_index_tag (repo, version, enable):
+  values = repo.bdb.load_tag (version, INDEX_TAG)
+  if enable and INDEX_TAG_USER not in values:
+    repo.bdb.add_tag (version, INDEX_TAG, INDEX_TAG_USER)
+  if not enable:
+    for value in values:
+      repo.bdb.del_tag (version, INDEX_TAG, value)
+
+# number of most recent versions that commit tags for indexing ("version-index"
+# config setting); 0 (default) means that only user tagged versions are indexed
+def commit_index_count (repo):
+  value = repo.config.get ("version-index")
+  if len (value) == 0:
+    return 0
+  if len (value) != 1 or not value[0].isdigit():
+    raise BFSyncError ("bad version-index setting")
+  return int (value[0])
+
+# called by commit for the new version (needs a transaction): tags it for indexing
+# and removes the commit tags of versions that are no longer among the most recent
+def tag_commit_version (repo, version):
+  count = commit_index_count (repo)
+  if count == 0:
+    return
+
+  repo.bdb.add_tag (version, INDEX_TAG, INDEX_TAG_COMMIT)
+
+  for old_version in range (1, version - count + 1):
+    if INDEX_TAG_COMMIT in repo.bdb.load_tag (old_version, INDEX_TAG):
+      repo.bdb.del_tag (old_version, INDEX_TAG, INDEX_TAG_COMMIT)
+
+# remove index files of versions that no longer exist (deleted/expired versions
+# are removed by gc, reverted versions by revert) or are no longer tagged, and
+# leftovers of interrupted builds
+def prune_version_indexes (repo):
+  index_dir = version_index_dir (repo)
+  if not os.path.exists (index_dir):
+    return 0
+
+  keep_versions = set (indexed_versions (repo))
+
+  pruned = 0
+  for filename in os.listdir (index_dir):
+    if filename.isdigit() and int (filename) in keep_versions:
+      continue
+    os.remove (os.path.join (index_dir, filename))
+    pruned += 1
+  return pruned
+
+# build index files for all tagged versions that have none; the current version
+# (first unused version) still changes and is always read from the db
+def update_version_indexes (repo, rebuild = False, verify = False):
+  have_indexes = set (list_version_indexes (repo))
+
+  bad_indexes = 0
+  for version in indexed_versions (repo):
+    if version in have_indexes and verify and not repo.bdb.verify_version_index (version):
+      print "version index %d: checksum mismatch" % version
+      bad_indexes += 1
+      have_indexes.remove (version)
+    if rebuild or version not in have_indexes:
+      if not repo.bdb.build_version_index (version):
+        raise BFSyncError ("building version index %d failed" % version)
+  prune_version_indexes (repo)
+  return bad_indexes
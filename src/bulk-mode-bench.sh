@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# measures clone time (pull + apply) with and without bulk mode; for a local
+# master repository, most of the clone time is spent applying the history
+#
+# usage: bulk-mode-bench.sh <master-repo> [<cache_size_mb>]
+#
+# the clones are created in the current directory and deleted afterwards
+
+usage()
+{
+  echo "bulk-mode-bench.sh <master-repo> [<cache_size_mb>]"
+  exit 1
+}
+
+[ -d "$1" ] || usage;
+
+MASTER=$(readlink -f $1)
+CACHE_SIZE=${2:-256}
+BFSYNC=$(dirname $(readlink -f $0))/bfsync.py
+
+for run in 1 2
+do
+  for mode in off write-nosync nosync
+  do
+    rm -rf bench-clone-$mode
+    sync
+    /usr/bin/time -f "run $run bulk-mode $mode clone-time %e" $BFSYNC clone -c $CACHE_SIZE --bulk-mode $mode $MASTER bench-clone-$mode > /dev/null
+    rm -rf bench-clone-$mode
+  done
+done
@@ -0,0 +1,77 @@
+#!/usr/bin/python
+
+# measures hash2file operations as done by commit (load + store) and gc phase 3
+# (delete, with hex and with binary hashes), lookups of absent hashes (answered
+# by the hash2file filter), and the INodeHashIterator scan
+#
+# usage: h2f_bench.py <repo>/bdb
+#
+# the hashes stored by each round are deleted again at the end of the round,
+# so the repository is not modified
+
+import bfsyncdb
+import sys
+import hashlib
+import time
+
+COUNT = 20000
+
+def rate (start):
+  return COUNT / (time.time() - start)
+
+bdb = bfsyncdb.open_db (sys.argv[1], 256, False)
+
+hashes = [ hashlib.sha1 ("h2f_bench:%d" % n).hexdigest() for n in range (COUNT) ]
+bin_hashes = [ h.decode ("hex") for h in hashes ]
+
+for j in range (5):
+  bdb.begin_transaction()
+
+  # commit: lookup and store new hashes
+  start = time.time()
+  for n in range (COUNT):
+    if bdb.load_hash2file (hashes[n]) == 0:
+      bdb.store_hash2file (hashes[n], n + 1)
+  commit_rate = rate (start)
+
+  bdb.commit_transaction()
+
+  # gc phase 3: delete hashes in hex form
+  bdb.begin_transaction()
+  start = time.time()
+  for h in hashes:
+    bdb.delete_hash2file (h)
+  delete_hex_rate = rate (start)
+  bdb.abort_transaction()
+
+  # gc phase 3: delete hashes in binary form
+  bdb.begin_transaction()
+  start = time.time()
+  for h in bin_hashes:
+    bdb.delete_hash2file_bin (h)
+  delete_bin_rate = rate (start)
+  bdb.commit_transaction()
+
+  print "commit: %.2f hashes/s   gc delete hex: %.2f hashes/s   gc delete binary: %.2f hashes/s" % (
+    commit_rate, delete_hex_rate, delete_bin_rate)
+  sys.stdout.flush()
+
+# lookups of hashes that are not in the db, like during a first commit or clone
+absent = [ hashlib.sha1 ("h2f_bench:absent:%d" % n).hexdigest() for n in range (COUNT) ]
+for j in range (3):
+  start = time.time()
+  for h in absent:
+    bdb.load_hash2file (h)
+  print "lookup absent: %.2f hashes/s" % rate (start)
+
+print
+print bdb.hash2file_stats(),
+print
+
+start = time.time()
+count = 0
+hi = bfsyncdb.INodeHashIterator (bdb)
+while hi.get_next() != "":
+  count += 1
+del hi
+print "INodeHashIterator: %d hashes in %.2f s" % (count, time.time() - start)
@@ -0,0 +1,51 @@
+#!/usr/bin/python
+
+# compares storing inodes one by one with bulk storing via store_inodes
+#
+# usage: inode_store_bench.py <repo>/bdb
+#
+# all changes are done in a transaction that is aborted afterwards, so the
+# repository is not modified
+
+import bfsyncdb
+import sys
+import time
+
+COUNT = 20000
+
+def make_inodes (j):
+  inodes = bfsyncdb.INodeVector()
+  for n in range (COUNT):
+    inode = bfsyncdb.INode()
+    inode.vmin = 1
+    inode.vmax = bfsyncdb.VERSION_INF
+    inode.id = bfsyncdb.ID ("/%08x%032x" % (j, n))
+    inode.uid = 1000
+    inode.gid = 1000
+    inode.mode = 0644
+    inode.type = bfsyncdb.FILE_REGULAR
+    inode.hash = "%040x" % n
+    inode.size = n
+    inodes.push_back (inode)
+  return inodes
+
+bdb = bfsyncdb.open_db (sys.argv[1], 256, False)
+
+for j in range (1, 6):
+  inodes = make_inodes (j)
+
+  bdb.begin_transaction()
+  start = time.time()
+  for inode in inodes:
+    bdb.store_inode (inode)
+  single_time = time.time() - start
+  bdb.abort_transaction()
+
+  bdb.begin_transaction()
+  start = time.time()
+  bdb.store_inodes (inodes)
+  bulk_time = time.time() - start
+  bdb.abort_transaction()
+
+  print "single: %.2f records/s   bulk: %.2f records/s" % (COUNT / single_time, COUNT / bulk_time)
+  sys.stdout.flush()
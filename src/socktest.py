@@ -15,3 +15,8 @@ while i < 10:
   msg += [ "Hello world %d!\n" % i ]
   result = server_conn.process_call (msg)
   print 'Received result ', result
+
+# pipelined requests: send all, then read all results
+msgs = [ [ "print", "Pipelined request %d\n" % i ] for i in range (10) ] + [ [ "cache-stats" ] ]
+for result in server_conn.process_calls (msgs):
+  print 'Received result ', result